@@ -7,9 +7,6 @@
 // Note: commented out means not currently used/supported
 //////////////////////////////////////////////////////////////////////////
 
-// Maximum number of threads supported
-#define RT_MAX_THREAD_COUNT 4
-
 // Ray packet dimension (2x2, 4x4, etc)
 #define RT_PACKET_DIM 4
 
@@ -19,6 +16,9 @@
 // Number of rays packed in SIMD style
 #define RT_PACKET_SIMD_SIZE ( RT_PACKET_SIZE / 4 )
 
+// Maximum number of rays waiting in a ray stream (see rtsEnqueueRay)
+#define RT_STREAM_SIZE ( RT_PACKET_SIZE * 4 )
+
 // Primitive types
 #define RT_TRIANGLES				0x0001
 #define RT_TRIANGLE_STRIP			0x0002
@@ -46,6 +46,29 @@
 #define RT_DOUBLE					0x1107
 */
 
+// Geometry build modes
+#define RT_BUILD_SAH_SWEEP			0x4000
+#define RT_BUILD_SAH_PRESORTED		0x4001
+#define RT_BUILD_SAH_BINNED			0x4002
+
+// Instance build modes (RT_BUILD_SAH_BINNED is also supported)
+#define RT_BUILD_CLOSEST_BORDER		0x4010
+
+// Geometry acceleration structures
+#define RT_ACCEL_KDTREE				0x4020
+#define RT_ACCEL_BVH4				0x4021
+
+// Statistics (see rtGetStatistic)
+#define RT_STAT_SINGLE_TRIANGLE_TESTS	0x4030
+#define RT_STAT_SINGLE_MAILBOX_SKIPS	0x4031
+#define RT_STAT_PACKET_TRIANGLE_TESTS	0x4032
+#define RT_STAT_PACKET_MAILBOX_SKIPS	0x4033
+#define RT_STAT_PACKET_TRAVERSALS		0x4034
+#define RT_STAT_PACKET_FALLBACKS		0x4035
+#define RT_STAT_FALLBACK_RAYS			0x4036
+#define RT_STAT_STREAM_RAYS				0x4037
+#define RT_STAT_STREAM_PACKETS			0x4038
+
 // Plug-in parameters
 #define RT_TRANSLATE				0x1000
 #define RT_ROTATE_X					0x1001
@@ -17,6 +17,7 @@ namespace rts
 	class IMaterial;
 	class ITexture;
 	class ILight;
+	class ISampler;
 }
 
 // Initializes a valid ray tracing context
@@ -34,6 +35,10 @@ void rtCameraParameter( unsigned int paramId, void* paramValue );
 void rtEnvironmentClass( rts::IEnvironment* obj );
 void rtEnvironmentParameter( unsigned int paramId, void* paramValue );
 
+// Overwrite default sampler (Sobol sequence)
+void rtSamplerClass( rts::ISampler* obj );
+void rtSamplerParameter( unsigned int paramId, void* paramValue );
+
 // Create and setup material shaders
 unsigned int rtGenMaterials( unsigned int count );
 void rtBindMaterial( unsigned int materialId );
@@ -97,10 +102,57 @@ void rtEnd();
 // End new geometry
 void rtEndGeometry();
 
+// Algorithm used by rtEndGeometry to build the geometry's kd-tree.
+// Applies to geometries ended afterwards, so it may be changed from one geometry to the next.
+// RT_BUILD_SAH_SWEEP: exact SAH, sorts split candidates at every node, O(N log^2 N).
+// RT_BUILD_SAH_PRESORTED: exact SAH, sorts split candidates only once, O(N log N).
+// RT_BUILD_SAH_BINNED: approximate SAH, evaluated at bin borders only, O(N) per tree level.
+//   Much faster, at the expense of a slightly worse tree. Meant for geometries edited interactively.
+// Default is RT_BUILD_SAH_SWEEP.
+void rtSetGeometryBuildMode( unsigned int mode );
+unsigned int rtGetGeometryBuildMode();
+
+// Number of bins per axis used by RT_BUILD_SAH_BINNED.
+// Applies to geometries ended afterwards.
+// Default is 32.
+void rtSetGeometryBinCount( unsigned int count );
+unsigned int rtGetGeometryBinCount();
+
+// Acceleration structure built by rtEndGeometry, applies to geometries ended afterwards.
+// RT_ACCEL_KDTREE: SAH kd-tree, built with the mode set in rtSetGeometryBuildMode. Best trace speed.
+// RT_ACCEL_BVH4: bounding volume hierarchy with 4 children per node, tested at once with SSE.
+//   Built with binned SAH, much faster than a kd-tree (build mode and bin count are ignored).
+//   Meant for geometries rebuilt often. Ray packets are traced one ray at a time in these geometries.
+// Default is RT_ACCEL_KDTREE.
+void rtSetGeometryAccelStructure( unsigned int accel );
+unsigned int rtGetGeometryAccelStructure();
+
+// Whether rtEndGeometry copies the triangles of each leaf next to each other, applies to geometries ended afterwards.
+// Ray packets then read the triangles of a leaf from consecutive memory instead of looking them up by id.
+// Triangles in several leaves are copied once per leaf, which takes about as much memory again as the triangles.
+// Single rays always read leaf ordered triangle blocks.
+// Default is true.
+void rtSetGeometryLeafOrdered( bool enabled );
+bool rtGetGeometryLeafOrdered();
+
+// Algorithm used to build the instance kd-tree, which is rebuilt in next frame if mode changes.
+// RT_BUILD_CLOSEST_BORDER: splits at the object border closest to the center of each node. Fast, but may build
+//   deep, unbalanced trees for unevenly distributed instances.
+// RT_BUILD_SAH_BINNED: approximate SAH with a fixed number of bins. Better trees, in about the same time for
+//   thousands of instances.
+// Default is RT_BUILD_CLOSEST_BORDER.
+void rtSetInstanceBuildMode( unsigned int mode );
+unsigned int rtGetInstanceBuildMode();
+
 // Instantiate geometries using current matrix
 unsigned int rtGenInstances( unsigned int count );
 void rtInstantiate( unsigned int instanceId, unsigned int geometryId );
 
+// Move an already instantiated geometry, e.g. for animations.
+// Only the affected parts of the instance tree are updated in next frame (it is rebuilt if quality degrades too much).
+// Matrix has the same layout as in rtLoadMatrixfv. Ignored for instances not instantiated yet (see rtInstantiate).
+void rtUpdateInstanceTransform( unsigned int instanceId, const float* const matrix );
+
 // Do not change transform, or it will cause undefined side-effects
 const float* rtGetInstanceTransform( unsigned int instanceId );
 
@@ -129,7 +181,56 @@ float rtGetRayEpsilon();
 void rtSetMediumRefractionIndex( float index );
 float rtGetMediumRefractionIndex();
 
+// Seed of random numbers drawn by renderers and shaders (see rtsRandom).
+// A given seed renders the same image whatever the number of threads. Change it every frame to get different noise.
+// Default is 0.
+void rtSetRandomSeed( unsigned int seed );
+unsigned int rtGetRandomSeed();
+
+// Rays traversed at once by packet renderers: 4 (SSE2), 8 (AVX2) or 16 (AVX-512F).
+// Widths not supported by the host CPU, or not built by the compiler (see README.md), fall back to the widest
+// supported one, see rtGetSimdWidth.
+// Default is the widest width supported by the host CPU.
+void rtSetSimdWidth( unsigned int width );
+unsigned int rtGetSimdWidth();
+
+// Ray packets entering a geometry with fewer active rays are traced there one ray at a time, which is faster than
+// carrying mostly empty packets down the tree (incoherent packets, silhouettes, secondary rays).
+// Also applies to shadow packets and to the packets regrouped from ray streams (see rtsTraceRayStream).
+// Bvh geometries are always traced one ray at a time. 0 always traces packets.
+// Default is 2, i.e. only packets left with a single active ray.
+void rtSetPacketMinActiveRays( unsigned int count );
+unsigned int rtGetPacketMinActiveRays();
+
+// Intensity below which lights are not computed: each light only reaches the points it illuminates by more
+// than cutoff, given its attenuation (see rts::ILight::influence), and shaders skip the others (see rtsQueryLights).
+// Lights are kept in a tree of their spheres of influence rebuilt every frame, for scenes with many lights.
+// Default is 0, i.e. all lights reach all points.
+void rtSetLightCutoff( float cutoff );
+float rtGetLightCutoff();
+
+// Number of lights picked at random at each shading point (see rtsQueryLights), in proportion to their estimated
+// intensity there, instead of computing all lights that reach it. Much faster for hundreds of lights, at the expense
+// of noise, which averages out over pixel samples. Shaders may pick fewer lights (at most 16 with the rtl materials).
+// Default is 0, i.e. all lights are computed.
+void rtSetLightSampleCount( unsigned int count );
+unsigned int rtGetLightSampleCount();
+
 // Ray trace scene
 void rtRenderFrame();
 
+// Counters summed over all threads since rtInit or the last rtResetStatistics. Only exact between frames.
+// RT_STAT_SINGLE_TRIANGLE_TESTS: triangles tested against single rays.
+// RT_STAT_SINGLE_MAILBOX_SKIPS: triangles not tested again by a single ray, already tested in another kd-tree leaf.
+//   Only whole blocks of 4 triangles are skipped (see rtSetGeometryLeafOrdered).
+// RT_STAT_PACKET_TRIANGLE_TESTS: triangles tested against ray packets.
+// RT_STAT_PACKET_MAILBOX_SKIPS: triangles not tested again by a ray packet, already tested by all its active rays.
+// RT_STAT_PACKET_TRAVERSALS: geometries traversed by ray packets.
+// RT_STAT_PACKET_FALLBACKS: geometries traversed by the rays of a packet one at a time instead (see rtSetPacketMinActiveRays).
+// RT_STAT_FALLBACK_RAYS: rays traced one at a time by these fallbacks.
+// RT_STAT_STREAM_RAYS: secondary rays traced from ray streams (see rtsTraceRayStream).
+// RT_STAT_STREAM_PACKETS: packets these rays were regrouped into, the others were traced one at a time.
+double rtGetStatistic( unsigned int stat );
+void rtResetStatistics();
+
 #endif // _RT_H_
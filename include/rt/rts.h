@@ -4,8 +4,10 @@
 
 #include <rt/definitions.h>
 #include <rts/RTstate.h>
+#include <rts/RTstream.h>
 #include <rtu/float3.h>
 #include <rtu/float4x4.h>
+#include <rtu/random.h>
 
 /************************************************************************/
 /* Shader Programming Interface                                         */
@@ -17,7 +19,9 @@
 // Use camera to setup primary ray state.
 // Initializes ray origin and direction.
 // Resets ray recursion depth.
-void rtsInitPrimaryRayState( rts::RTstate& state, float x, float y );
+// Seeds state random numbers (see rtsRandom) from the pixel nearest to (x,y) and given sample index,
+// which should be different for each ray traced through the same pixel.
+void rtsInitPrimaryRayState( rts::RTstate& state, float x, float y, unsigned int sample = 0 );
 
 // Initialize state information for querying light radiance samples.
 // Hit-position and shading normal must have been previously computed in state.
@@ -53,6 +57,31 @@ bool rtsInitRefractionRayState( const rts::RTstate& state, float refractionIndex
 // Number of packet rays is given by RT_PACKET_SIZE
 void rtsInitPrimaryRayStatePacket( rts::RTstate& state, float* packetRays );
 
+// Initialize state for a bundle of shadow rays, with all rays disabled.
+// Enable rays with rtsSetShadowRayPacket, then trace them with rtsTraceHitPacket.
+void rtsInitShadowRayStatePacket( rts::RTstate& shadow );
+
+// Setup and enable a shadow ray in the bundle.
+// Same as rtsInitShadowRayState: ray goes from origin up to origin + directionTowardsLight * rayMaxDistance.
+// Rays with the same direction signs (e.g. from neighbor primary rays towards the same light) are traced together.
+void rtsSetShadowRayPacket( rts::RTstate& shadow, unsigned int ray, const rtu::float3& origin, 
+						    const rtu::float3& directionTowardsLight, float rayMaxDistance );
+
+// Initialize single ray state from given ray of a packet state, e.g. to shade it with scalar code.
+// Copies ray, hit, result color, recursion depth and previously computed hit-position and shading normal.
+void rtsInitRayStateFromPacket( const rts::RTstate& packet, unsigned int ray, rts::RTstate& state );
+
+// Initialize packet state information for querying light radiance samples of all rays.
+// Hit-positions and shading normals must have been previously computed in state.
+void rtsInitLightStatePacket( const rts::RTstate& state, rts::RTstate& light );
+
+// Initialize shadow rays of a packet light state, same as rtsInitShadowRayState.
+// Directions are given as x of all rays, then y, then z.
+// Rays of mask whose surface points away from light are disabled, returns false if all of them are disabled.
+// Remaining rays are enabled for rtsTraceHitPacket.
+bool rtsInitShadowRayStatePacket( const __m128 directionTowardsLight4[RT_PACKET_SIMD_SIZE*3], float rayMaxDistance,
+								  __m128 mask4[RT_PACKET_SIMD_SIZE], rts::RTstate& light );
+
 //////////////////////////////////////////////////////////////////////////
 // Main ray-tracing functions
 
@@ -62,6 +91,12 @@ void rtsTraceRay( rts::RTstate& state );
 // Trace single ray and only test for occlusion
 bool rtsTraceHit( rts::RTstate& state );
 
+// Trace count single ray states, e.g. all primary rays of a tile: first find the closest hits of all of them,
+// then shade them grouped by material, with one call to rts::IMaterial::shadeBatch per material hit.
+// Same results as rtsTraceRay on each state, for scenes with many materials. Shaders may call it too, e.g. from
+// rts::IMaterial::shadeBatch to trace the secondary rays of their batch.
+void rtsTraceRayBatch( rts::RTstate* const states[], unsigned int count );
+
 /************************************************************************/
 /* Packet versions                                                      */
 /************************************************************************/
@@ -69,6 +104,62 @@ bool rtsTraceHit( rts::RTstate& state );
 // Trace a ray packet using SIMD
 void rtsTraceRayPacket( rts::RTstate& state );
 
+// Same as rtsTraceRayPacket, in two steps: find closest hits of all rays, then shade them.
+// Lets renderers trace many packets before shading any of them.
+void rtsIntersectRayPacket( rts::RTstate& state );
+void rtsShadeRayPacket( rts::RTstate& state );
+
+// Trace enabled rays of a shadow packet using SIMD, only testing for occlusion.
+// Each ray stops at its first hit. Returns number of occluded rays (see rtsRayHitPacket).
+unsigned int rtsTraceHitPacket( rts::RTstate& shadow );
+
+/************************************************************************/
+/* Ray streams                                                          */
+/************************************************************************/
+
+// Secondary rays of many shaded rays (e.g. reflections of all rays of a packet) can be enqueued in a stream
+// instead of being traced one by one. The stream sorts them by direction signs and origin, then traces them
+// as packets of coherent rays.
+
+// Initialize an empty stream
+void rtsInitRayStream( rts::RTstream& stream );
+
+// Empty stream owned by the calling thread, for shaders that would keep a stream on their stack while its rays recurse.
+// Each call returns another stream, until released by rtsReleaseRayStream in reverse order.
+rts::RTstream& rtsAcquireRayStream();
+void rtsReleaseRayStream();
+
+// Enqueue ray of a state initialized as a secondary ray (e.g. with rtsInitReflectionRayState).
+// Once traced, its result color times weight is added to target, which must stay valid until then.
+// If stream already holds RT_STREAM_SIZE rays, they are traced first.
+void rtsEnqueueRay( rts::RTstream& stream, const rts::RTstate& state, const rtu::float3& weight, rtu::float3& target );
+
+// Trace all rays of the stream and add their weighted result colors to their targets. Stream is empty afterwards.
+// Rays traced in the same packet share the random numbers and sample dimension of the first one (see rtsRandom).
+// While the calling thread queues rays (see rtsBeginRayQueue), they are queued instead.
+void rtsTraceRayStream( rts::RTstream& stream );
+
+/************************************************************************/
+/* Ray queues                                                           */
+/************************************************************************/
+
+// Breadth-first tracing for renderers: between rtsBeginRayQueue and rtsEndRayQueue, rays of streams traced by
+// shaders on the calling thread are not traced right away, but queued. Once traced, their results are added to
+// the target of the primary ray they descend from (see rtsSetPathTarget), times the product of the weights along
+// their path. Rays of primary rays without target are dropped. Rays traced by shaders with rtsTraceRay are not queued.
+void rtsBeginRayQueue();
+void rtsEndRayQueue();
+
+// Trace all rays queued by the calling thread, i.e. one more bounce of all paths: rays are sorted and traced
+// in packets like rays of streams, and the rays enqueued by their shaders are queued for the next call.
+// Returns number of rays traced, zero once all paths are done. Must not be called by shaders.
+unsigned int rtsTraceRayQueue();
+
+// Set target of queued rays descending from a primary ray (see rtsBeginRayQueue), e.g. its pixel color.
+// Target must stay valid until rtsTraceRayQueue returns zero.
+void rtsSetPathTarget( rts::RTstate& state, rtu::float3& target );
+void rtsSetPathTargetPacket( rts::RTstate& state, unsigned int ray, rtu::float3& target );
+
 //////////////////////////////////////////////////////////////////////////
 // Store result in state for later use by other functions and shaders
 
@@ -78,6 +169,16 @@ rtu::float3& rtsComputeHitPosition( rts::RTstate& state );
 // Compute interpolated shading normal
 rtu::float3& rtsComputeShadingNormal( rts::RTstate& state );
 
+/************************************************************************/
+/* Packet versions                                                      */
+/************************************************************************/
+
+// Compute hit positions of all rays (see rtsHitPositionPacket)
+void rtsComputeHitPositionPacket( rts::RTstate& state );
+
+// Compute interpolated shading normals of rays in mask (see rtsShadingNormalPacket)
+void rtsComputeShadingNormalPacket( rts::RTstate& state, const __m128 mask4[RT_PACKET_SIMD_SIZE] );
+
 //////////////////////////////////////////////////////////////////////////
 // Don't store results
 
@@ -102,6 +203,20 @@ void rtsComputeReflectedDirection( const rtu::float3& incident, const rtu::float
 // Shading normal must have been previously computed in state.
 bool rtsFrontFace( const rts::RTstate& state );
 
+/************************************************************************/
+/* Packet versions                                                      */
+/************************************************************************/
+
+// Compute interpolated shading colors of rays in mask, given as x of all rays, then y, then z
+void rtsComputeShadingColorPacket( const rts::RTstate& state, const __m128 mask4[RT_PACKET_SIMD_SIZE],
+								   __m128 color4[RT_PACKET_SIMD_SIZE*3] );
+
+// Compute normalized vectors for shading specular reflections of all rays (see rtsComputeSpecularVector)
+void rtsComputeSpecularVectorPacket( const rts::RTstate& state, __m128 specularVector4[RT_PACKET_SIMD_SIZE*3] );
+
+// Disable rays of mask that hit back faces (see rtsFrontFace)
+void rtsFrontFacePacket( const rts::RTstate& state, __m128 mask4[RT_PACKET_SIMD_SIZE] );
+
 // TODO: other mathematical helper functions
 
 //////////////////////////////////////////////////////////////////////////
@@ -135,14 +250,47 @@ void rtsBarycentricCoords( const rts::RTstate& state, rtu::float3& coords );
 /* Packet versions                                                      */
 /************************************************************************/
 
+// Attributes of all rays are stored as structures of arrays:
+// 3D attributes hold x of all rays, then y, then z (RT_PACKET_SIMD_SIZE values each).
+
+// Get ray origins
+__m128* rtsRayOriginPacket( rts::RTstate& state );
+
+// Get ray directions
+__m128* rtsRayDirectionPacket( rts::RTstate& state );
+
+// Get resulting colors stored in state
+__m128* rtsResultColorPacket( rts::RTstate& state );
+
+// Hit-positions must have been previously computed
+__m128* rtsHitPositionPacket( rts::RTstate& state );
+
+// Shading normals must have been previously computed
+__m128* rtsShadingNormalPacket( rts::RTstate& state );
+
+// Get mask of shadow rays occluded in last rtsTraceHitPacket
+const __m128* rtsOccludedPacket( const rts::RTstate& shadow );
+
 // Set ray origin
 void rtsSetRayOriginPacket( rts::RTstate& state, unsigned int ray, const rtu::float3& origin );
 
 // Set ray direction
 void rtsSetRayDirectionPacket( rts::RTstate& state, unsigned int ray, const rtu::float3& direction );
 
-// Get resulting color stored in state
-rtu::float3& rtsResultColorPacket( rts::RTstate& state, unsigned int ray );
+// Get resulting color of given ray
+void rtsResultColorPacket( const rts::RTstate& state, unsigned int ray, rtu::float3& color );
+
+// Set resulting color of given ray
+void rtsSetResultColorPacket( rts::RTstate& state, unsigned int ray, const rtu::float3& color );
+
+// Returns whether given shadow ray was occluded in last rtsTraceHitPacket
+bool rtsRayHitPacket( const rts::RTstate& shadow, unsigned int ray );
+
+// Returns whether given ray is enabled in mask
+bool rtsRayEnabledPacket( const __m128 mask4[RT_PACKET_SIMD_SIZE], unsigned int ray );
+
+// Disable given ray in mask
+void rtsDisableRayPacket( __m128 mask4[RT_PACKET_SIMD_SIZE], unsigned int ray );
 
 //////////////////////////////////////////////////////////////////////////
 // Accessors for current ray-tracing context
@@ -153,13 +301,51 @@ void rtsViewport( unsigned int& width, unsigned int& height );
 // Get current frame buffer from renderer
 float* rtsFrameBuffer();
 
+// Get next random number in [0,1) from state.
+// Numbers only depend on the seed set with rtSetRandomSeed, pixel, sample and ray path, not on the calling thread.
+// Secondary, light and shadow states draw numbers independent from those of the state they were initialized from.
+float rtsRandom( rts::RTstate& state );
+
+// Initialize random numbers for renderer decisions on pixel (x,y), such as sample positions.
+// Independent from the numbers of the states traced through the pixel.
+void rtsInitPixelRandom( rtu::CounterRandom& random, unsigned int x, unsigned int y );
+
+// Get count 2D samples in [0,1)^2 from the current sampler (see rtSamplerClass), e.g. for area light samples.
+// Each call draws from the next dimension of the sequence. The sequence continues from one pixel sample
+// (see rtsInitPrimaryRayState) to the next, so the samples of all of them together are well distributed.
+// Secondary, light and shadow states continue the sequence of the state they were initialized from.
+void rtsSamples2D( rts::RTstate& state, float* uv, unsigned int count );
+
+// Get 2D samples in [0,1)^2 for renderer decisions on pixel (x,y), such as sample positions on the image plane.
+// Samples first to first+count-1 of the pixel sequence.
+void rtsPixelSamples2D( unsigned int x, unsigned int y, unsigned int first, unsigned int count, float* uv );
+
 // Get array of global lights, returns light count (number of elements in array)
 // If there are no more lights, return value will be zero, and pointer will be invalid.
 int rtsGlobalLights( void**& lights );
 
+// Get lights that may illuminate the hit position of state (see rtsComputeHitPosition), at most maxCount per call.
+// Lights only reach the points they illuminate by more than the cutoff set with rtSetLightCutoff.
+// Cursor must be 0 on first call and is updated for the next one. Returns number of lights stored, zero once done.
+// Radiance of each light must be multiplied by its weight, which is 1 unless lights are picked at random
+// (see rtSetLightSampleCount). Then all of them are returned by the first call, and a light may be returned twice.
+unsigned int rtsQueryLights( rts::RTstate& state, unsigned int& cursor, void** lights, float* weights, unsigned int maxCount );
+
+// Same for the hit positions of all rays of a packet state enabled in mask (see rtsComputeHitPositionPacket).
+// Lights and weights are the same for all of them.
+unsigned int rtsQueryLightsPacket( rts::RTstate& state, const __m128 mask4[RT_PACKET_SIMD_SIZE], unsigned int& cursor,
+								   void** lights, float* weights, unsigned int maxCount );
+
 // Compute given light's radiance contribution.
 // If light does not illuminates state, returns false. Else returns true.
-bool rtsIlluminate( rts::RTstate& state, void* light );
+// Pick is the index of light in the array filled by rtsQueryLights: a light picked at random several times draws
+// different samples for each pick.
+bool rtsIlluminate( rts::RTstate& state, void* light, unsigned int pick = 0 );
+
+// Compute given light's radiance contribution for rays of a packet light state enabled in mask.
+// Rays not illuminated are disabled in mask. Returns false if all of them are disabled.
+// Light radiance of each ray is stored in result color, direction towards light in ray direction.
+bool rtsIlluminatePacket( rts::RTstate& state, void* light, __m128 mask4[RT_PACKET_SIMD_SIZE], unsigned int pick = 0 );
 
 // Compute given texture's color contribution and store it in resultColor.
 // Automatically uses defined texture wrap modes, environment mode, filters, etc.
@@ -3,20 +3,28 @@
 #define _RTL_ADAPTIVERENDERER_H_
 
 #include <rts/IRenderer.h>
+#include <rtl/TileScheduler.h>
 
 namespace rtl {
 
-class AdaptiveRenderer : public rts::IRenderer
+class AdaptiveRenderer : public rts::IRenderer, public TileScheduler::ITileJob
 {
 public:
 	virtual void init();
 	virtual void render();
+	virtual void renderTile( unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1 );
 
 private:
-	void adaptiveSupersample( float x, float y, rtu::float3& resultColor, unsigned int recursionDepth );
+	// Samples drawn so far in this pixel are counted in sampleCount
+	void adaptiveSupersample( float x, float y, rtu::float3& resultColor, unsigned int recursionDepth,
+		                      rtu::CounterRandom& random, unsigned int& sampleCount );
 
 	unsigned int _maxRecursionDepth;
 	float _epsilon;
+
+	// Current frame
+	unsigned int _width;
+	float* _frameBuffer;
 };
 
 } // namespace rtl
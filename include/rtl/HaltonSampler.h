@@ -0,0 +1,18 @@
+#pragma once
+#ifndef _RTL_HALTONSAMPLER_H_
+#define _RTL_HALTONSAMPLER_H_
+
+#include <rts/ISampler.h>
+
+namespace rtl {
+
+// Halton sequence in bases 2 and 3, randomly shifted per pixel (Cranley-Patterson rotation)
+class HaltonSampler : public rts::ISampler
+{
+public:
+	virtual void sample2D( rtu::CounterRandom& random, unsigned int first, unsigned int count, float* uv );
+};
+
+} // namespace rtl
+
+#endif // _RTL_HALTONSAMPLER_H_
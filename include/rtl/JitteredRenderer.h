@@ -3,12 +3,15 @@
 #define _RTL_JITTEREDRENDERER_H_
 
 #include <rts/IRenderer.h>
+#include <rtl/TileScheduler.h>
 
 namespace rtl {
 
-class JitteredRenderer : public rts::IRenderer
+// Supersampling with samples positioned by the current sampler (see rtSamplerClass)
+class JitteredRenderer : public rts::IRenderer, public TileScheduler::ITileJob
 {
 public:
+	// Number of samples per pixel
 	enum GridResolution
 	{
 		TWO_BY_TWO,
@@ -18,11 +21,19 @@ public:
 
 	virtual void init();
 	virtual void render();
+	virtual void renderTile( unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1 );
 
 	void setGridResolution( GridResolution res );
 
 private:
 	GridResolution _gridRes;
+
+	static const unsigned int MAX_SAMPLE_COUNT = 16;
+
+	// Current frame
+	unsigned int _sampleCount;
+	unsigned int _width;
+	float* _frameBuffer;
 };
 
 } // namespace rtl
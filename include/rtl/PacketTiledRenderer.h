@@ -3,13 +3,20 @@
 #define _RTL_PACKETTILEDRENDERER_H_
 
 #include <rts/IRenderer.h>
+#include <rtl/TileScheduler.h>
 
 namespace rtl {
 
-class PacketTiledRenderer : public rts::IRenderer
+class PacketTiledRenderer : public rts::IRenderer, public TileScheduler::ITileJob
 {
 public:
 	virtual void render();
+	virtual void renderTile( unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1 );
+
+private:
+	// Current frame
+	unsigned int _width;
+	float* _frameBuffer;
 };
 
 } // namespace rtl
@@ -2,33 +2,25 @@
 #ifndef _RTL_PHONGCOLORMATERIAL_H_
 #define _RTL_PHONGCOLORMATERIAL_H_
 
-#include <rts/IMaterial.h>
+#include <rtl/PhongMaterial.h>
 
 namespace rtl {
 
-class PhongColorMaterial : public rts::IMaterial
+// Phong material with a single diffuse color, instead of the shading color of the geometry
+class PhongColorMaterial : public PhongMaterial
 {
 public:
 	PhongColorMaterial();
 
-	virtual void receiveParameter( int paramId, void* paramValue );
-	virtual void shade( rts::RTstate& state );
-
-	void setAmbient( float r, float g, float b );
 	void setDiffuse( float r, float g, float b );
-	void setReflexCoeff( float coeff );
-	void setOpacity( float opacity );
-	void setRefractionIndex( float index );
+
+protected:
+	virtual void objectColor( const rts::RTstate& state, rtu::float3& color );
+	virtual void objectColorPacket( const rts::RTstate& state, const __m128 mask4[RT_PACKET_SIMD_SIZE],
+		                            __m128 color4[RT_PACKET_SIMD_SIZE*3] );
 
 private:
-	rtu::float3 _ambient;
 	rtu::float3 _diffuse;
-	rtu::float3 _specularColor;
-	float _specularExponent;
-	float _reflexCoeff;
-	float _refractionIndex;
-	float _opacity;
-	unsigned int _textureId;
 };
 
 } // namespace rtl
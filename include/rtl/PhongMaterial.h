@@ -13,12 +13,27 @@ public:
 
 	virtual void receiveParameter( int paramId, void* paramValue );
 	virtual void shade( rts::RTstate& state );
+	virtual void shadePacket( rts::RTstate& state, const __m128 mask4[RT_PACKET_SIMD_SIZE] );
 
+	void setAmbient( float r, float g, float b );
 	void setReflexCoeff( float coeff );
 	void setOpacity( float opacity );
 	void setRefractionIndex( float index );
 
+protected:
+	// Color of hit point of state, lit by ambient and diffuse light.
+	// Default implementation: shading color of the geometry (see rtsComputeShadingColor)
+	virtual void objectColor( const rts::RTstate& state, rtu::float3& color );
+	virtual void objectColorPacket( const rts::RTstate& state, const __m128 mask4[RT_PACKET_SIMD_SIZE],
+		                            __m128 color4[RT_PACKET_SIMD_SIZE*3] );
+
 private:
+	// Texture, reflection and refraction contributions, after direct lighting is stored in result color
+	void shadeEffects( rts::RTstate& state );
+
+	// Reflection and refraction rays of state, added to color once stream is traced
+	void enqueueSecondaryRays( const rts::RTstate& state, rtu::float3& color, rts::RTstream& stream );
+
 	rtu::float3 _ambient;
 	rtu::float3 _specularColor;
 	float _specularExponent;
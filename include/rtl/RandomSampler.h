@@ -0,0 +1,18 @@
+#pragma once
+#ifndef _RTL_RANDOMSAMPLER_H_
+#define _RTL_RANDOMSAMPLER_H_
+
+#include <rts/ISampler.h>
+
+namespace rtl {
+
+// Independent uniform samples
+class RandomSampler : public rts::ISampler
+{
+public:
+	virtual void sample2D( rtu::CounterRandom& random, unsigned int first, unsigned int count, float* uv );
+};
+
+} // namespace rtl
+
+#endif // _RTL_RANDOMSAMPLER_H_
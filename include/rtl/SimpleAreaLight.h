@@ -11,11 +11,22 @@ class SimpleAreaLight : public SimplePointLight
 public:
 	SimpleAreaLight();
 
-	virtual void init();
+	static const unsigned int MAX_SAMPLE_COUNT = 64;
+
 	virtual bool illuminate( rts::RTstate& state );
+	// Not the point light one: illuminate each ray with its own samples
+	virtual bool illuminatePacket( rts::RTstate& state, __m128 mask4[RT_PACKET_SIMD_SIZE] );
+
+	// Point light influence, grown by the disk radius
+	virtual bool influence( float cutoff, rtu::float3& center, float& radius );
+
+	void setRadius( float radius );
+	// Shadow rays per illuminated point, at most MAX_SAMPLE_COUNT
+	void setSampleCount( unsigned int count );
 
 private:
-	void randomDisk( float& x, float& y );
+	// Map sample in unit square to unit disk
+	void concentricDisk( float u, float v, float& x, float& y );
 
 	float _radius;
 	float _area;
@@ -12,6 +12,11 @@ public:
 	SimplePointLight();
 
 	virtual bool illuminate( rts::RTstate& state );
+	virtual bool illuminatePacket( rts::RTstate& state, __m128 mask4[RT_PACKET_SIMD_SIZE] );
+
+	// Distance at which the attenuated intensity falls to cutoff
+	virtual bool influence( float cutoff, rtu::float3& center, float& radius );
+	virtual float intensityAt( const rtu::float3& position );
 
 	void setCastShadows( bool enabled );
 	void setIntensity( float x, float y, float z );
@@ -21,6 +26,9 @@ public:
 	void setQuadraticAttenuation( float atten );
 
 protected:
+	// Attenuation factor at distance
+	inline float attenuation( float distance ) const;
+
 	bool _castShadows;
 	rtu::float3 _intensity;
 	rtu::float3 _position;
@@ -29,6 +37,11 @@ protected:
 	float _quadAtten;
 };
 
+inline float SimplePointLight::attenuation( float distance ) const
+{
+	return 1.0f / ( _constAtten + _linearAtten * distance + _quadAtten * distance * distance );
+}
+
 } // namespace rtl
 
 #endif // _RTL_SIMPLEPOINTLIGHT_H_
@@ -0,0 +1,18 @@
+#pragma once
+#ifndef _RTL_SOBOLSAMPLER_H_
+#define _RTL_SOBOLSAMPLER_H_
+
+#include <rts/ISampler.h>
+
+namespace rtl {
+
+// First two dimensions of the Sobol sequence, scrambled per pixel with random digit flips (stays a (0,2)-sequence)
+class SobolSampler : public rts::ISampler
+{
+public:
+	virtual void sample2D( rtu::CounterRandom& random, unsigned int first, unsigned int count, float* uv );
+};
+
+} // namespace rtl
+
+#endif // _RTL_SOBOLSAMPLER_H_
@@ -0,0 +1,67 @@
+#pragma once
+#ifndef _RTL_TILESCHEDULER_H_
+#define _RTL_TILESCHEDULER_H_
+
+#include <rtu/common.h>
+#include <omp.h>
+#include <vector>
+
+namespace rtl {
+
+/*
+ *	Splits the image in tiles and runs a job on each of them, using all threads of a single OpenMP parallel region.
+ *	Tiles are sorted in Morton order and each thread gets a contiguous range of them, so that neighboring tiles
+ *	are traced by the same thread. Threads that finish their range steal tiles from the end of the others'.
+ */
+class TileScheduler
+{
+public:
+	// Work done for each tile, called concurrently from all threads
+	class ITileJob
+	{
+	public:
+		// Pixels in [x0,x1) x [y0,y1)
+		virtual void renderTile( unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1 ) = 0;
+
+	protected:
+		virtual ~ITileJob() {;}
+	};
+
+	static const unsigned int DEFAULT_TILE_SIZE = 16;
+
+	// Scheduler shared by all renderers
+	static TileScheduler& instance();
+
+	TileScheduler();
+	~TileScheduler();
+
+	// Runs job on all tiles of a width x height image, returning when all of them are done
+	void run( ITileJob& job, unsigned int width, unsigned int height, unsigned int tileSize = DEFAULT_TILE_SIZE );
+
+private:
+	// Tiles _tiles[begin..end) not yet taken. Owner thread takes them from the front, thieves from the back.
+	struct WorkQueue
+	{
+		omp_lock_t lock;
+		unsigned int begin;
+		unsigned int end;
+	};
+
+	void sortTiles( unsigned int tileCountX, unsigned int tileCountY );
+	void resizeQueues( unsigned int threadCount );
+
+	bool popTile( unsigned int thread, unsigned int& tile );
+	bool stealTile( unsigned int thread, unsigned int& tile );
+
+	// Morton codes of tile coordinates, sorted
+	std::vector<unsigned int> _tiles;
+	unsigned int _tileCountX;
+	unsigned int _tileCountY;
+
+	WorkQueue* _queues;
+	unsigned int _queueCount;
+};
+
+} // namespace rtl
+
+#endif // _RTL_TILESCHEDULER_H_
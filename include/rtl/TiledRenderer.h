@@ -3,13 +3,37 @@
 #define _RTL_TILEDRENDERER_H_
 
 #include <rts/IRenderer.h>
+#include <rtl/TileScheduler.h>
+#include <vector>
 
 namespace rtl {
 
-class TiledRenderer : public rts::IRenderer
+class TiledRenderer : public rts::IRenderer, public TileScheduler::ITileJob
 {
 public:
+	virtual void init();
 	virtual void render();
+	virtual void renderTile( unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1 );
+
+	// Trace all primary rays of a tile before shading any of them, grouped by material (see rtsTraceRayBatch).
+	// Faster for scenes with many materials, slower for scenes with few of them. Default is false.
+	void setSortShading( bool enabled );
+
+protected:
+	virtual ~TiledRenderer();
+
+private:
+	void renderTileSorted( unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1 );
+
+	bool _sortShading;
+
+	// Primary states of the tile rendered by each thread with sorted shading, too large for thread stacks.
+	// Allocated by render() the first time it runs with that many threads.
+	std::vector<rts::RTstate*> _tileSamples;
+
+	// Current frame
+	unsigned int _width;
+	float* _frameBuffer;
 };
 
 } // namespace rtl
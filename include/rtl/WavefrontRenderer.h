@@ -0,0 +1,32 @@
+#pragma once
+#ifndef _RTL_WAVEFRONTRENDERER_H_
+#define _RTL_WAVEFRONTRENDERER_H_
+
+#include <rts/IRenderer.h>
+#include <rtl/TileScheduler.h>
+
+namespace rtl {
+
+/*
+ *	Breadth-first packet renderer: each tile is rendered in stages over all of its packets at once.
+ *	Primary packets are generated, traced, then shaded (see rtsIntersectRayPacket). Secondary rays enqueued by
+ *	shaders are queued instead of traced recursively (see rtsBeginRayQueue), and traced one bounce at a time
+ *	for the whole tile. Stack usage does not depend on the maximum ray recursion depth if shaders enqueue their
+ *	secondary rays in ray streams from shadePacket (e.g. PhongMaterial, PhongColorMaterial); other shaders trace them
+ *	recursively. Shadow rays are still traced during shading, by lights, but do not recurse.
+ */
+class WavefrontRenderer : public rts::IRenderer, public TileScheduler::ITileJob
+{
+public:
+	virtual void render();
+	virtual void renderTile( unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1 );
+
+private:
+	// Current frame
+	unsigned int _width;
+	float* _frameBuffer;
+};
+
+} // namespace rtl
+
+#endif // _RTL_WAVEFRONTRENDERER_H_
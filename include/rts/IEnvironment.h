@@ -10,6 +10,10 @@ class IEnvironment : public IPlugin
 {
 public:
 	virtual void shade( rts::RTstate& state ) = 0;
+
+	// Shade rays of a packet state enabled in mask, all of them missing the scene.
+	// Default implementation: shade each ray with shade()
+	virtual void shadePacket( rts::RTstate& state, const __m128 mask4[RT_PACKET_SIMD_SIZE] );
 };
 
 } // namespace rts
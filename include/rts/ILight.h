@@ -9,10 +9,45 @@ namespace rts {
 class ILight : public IPlugin
 {
 public:
+	ILight();
+
+	// Id of this light (see rtGenLights), set by rtLightClass. Lights draw random numbers and samples from it.
+	unsigned int lightId() const;
+	void setLightId( unsigned int lightId );
+
 	// Default implementation: do nothing
 	virtual bool illuminate( rts::RTstate& state );
+
+	// Illuminate rays of a packet light state enabled in mask (see rtsInitLightStatePacket).
+	// Rays that are not illuminated are disabled in mask. Returns false if all of them are disabled.
+	// Default implementation: illuminate each ray with illuminate()
+	virtual bool illuminatePacket( rts::RTstate& state, __m128 mask4[RT_PACKET_SIMD_SIZE] );
+
+	// Bounding sphere of the points this light illuminates by more than cutoff (see rtSetLightCutoff), e.g. given
+	// its distance attenuation. Lights outside of it are skipped by rtsQueryLights. Radius 0 if it illuminates none.
+	// Returns false if light may illuminate any point.
+	// Default implementation: return false
+	virtual bool influence( float cutoff, rtu::float3& center, float& radius );
+
+	// Estimated intensity reaching position, ignoring occlusion and surface orientation.
+	// Lights are picked in proportion to it when sampled at random (see rtSetLightSampleCount).
+	// Default implementation: return 1
+	virtual float intensityAt( const rtu::float3& position );
+
+private:
+	unsigned int _lightId;
 };
 
+inline unsigned int ILight::lightId() const
+{
+	return _lightId;
+}
+
+inline void ILight::setLightId( unsigned int lightId )
+{
+	_lightId = lightId;
+}
+
 } // namespace rts
 
 #endif // _RTS_ILIGHT_H_
@@ -11,6 +11,14 @@ class IMaterial : public IPlugin
 public:
 	// Default implementation: do nothing
 	virtual void shade( rts::RTstate& state );
+
+	// Shade rays of a packet state enabled in mask, all of them hitting this material.
+	// Default implementation: shade each ray with shade()
+	virtual void shadePacket( rts::RTstate& state, const __m128 mask4[RT_PACKET_SIMD_SIZE] );
+
+	// Shade count traced single ray states, all of them hitting this material (see rtsTraceRayBatch).
+	// Default implementation: shade each state with shade()
+	virtual void shadeBatch( rts::RTstate* const states[], unsigned int count );
 };
 
 } // namespace rts
@@ -0,0 +1,22 @@
+#pragma once
+#ifndef _RTS_ISAMPLER_H_
+#define _RTS_ISAMPLER_H_
+
+#include <rts/IPlugin.h>
+
+namespace rts {
+
+// Sample sequences used by renderers and shaders (see rtsSamples2D)
+class ISampler : public IPlugin
+{
+public:
+	// Fill uv with count 2D samples in [0,1)^2, numbers first to first+count-1 of the sequence.
+	// Given random numbers are the same for all samples of a pixel in a given dimension, and differ from pixel to
+	// pixel and dimension to dimension, to decorrelate sequences (e.g. with random shifts or scrambling).
+	// Called concurrently from all render threads.
+	virtual void sample2D( rtu::CounterRandom& random, unsigned int first, unsigned int count, float* uv ) = 0;
+};
+
+} // namespace rts
+
+#endif // _RTS_ISAMPLER_H_
@@ -6,16 +6,14 @@
 
 namespace rts {
 
-// TODO: check size with RayPacketState!
-
 // Dummy ray state container
 // Hides actual implementation from plugins
-// Size must be greater than or equal to actual RayState/RayPacketState sizes
+// Size must be greater than or equal to actual RayState/RayPacketState sizes (checked when initializing primary states)
 RTU_CACHE_ALIGN( 16 )
 struct RTstate
 {
 private:
-	char filler[2048];
+	char filler[2560];
 };
 
 } // namespace rts
@@ -0,0 +1,21 @@
+#pragma once
+#ifndef _RTS_RTSTREAM_H_
+#define _RTS_RTSTREAM_H_
+
+#include <rtu/common.h>
+
+namespace rts {
+
+// Dummy ray stream container (see rtsInitRayStream)
+// Hides actual implementation from plugins
+// Size must be greater than or equal to actual RayStream size (checked when initializing streams)
+RTU_CACHE_ALIGN( 16 )
+struct RTstream
+{
+private:
+	char filler[10240];
+};
+
+} // namespace rts
+
+#endif // _RTS_RTSTREAM_H_
@@ -0,0 +1,28 @@
+#pragma once
+#ifndef _RTU_CPU_H_
+#define _RTU_CPU_H_
+
+#include <rtu/common.h>
+
+namespace rtu {
+
+/**
+ *	Instruction sets of the host CPU, detected once with cpuid.
+ *	An instruction set is only reported if the operating system also saves its registers on context switches.
+ */
+class Cpu
+{
+public:
+	//! True if AVX2 instructions can be used.
+	static bool hasAvx2();
+
+	//! True if AVX-512F instructions can be used.
+	static bool hasAvx512();
+
+	//! Floats in the widest usable SIMD register: 4 (SSE2), 8 (AVX2) or 16 (AVX-512F).
+	static unsigned int simdWidth();
+};
+
+} // namespace rtu
+
+#endif // _RTU_CPU_H_
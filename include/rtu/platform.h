@@ -40,6 +40,36 @@
 	#error Oops! The RTU_CACHE_ALIGN macro was not defined for this compiler!
 #endif
 
+// Portable macro to declare thread local storage (for POD data only)
+#if defined(_MSC_VER)
+	#define RTU_THREAD_LOCAL	__declspec(thread)
+#elif defined(__GNUG__)
+	#define RTU_THREAD_LOCAL	__thread
+#else
+	#error Oops! The RTU_THREAD_LOCAL macro was not defined for this compiler!
+#endif
+
+// Portable macros to check if the compiler can generate AVX2 and AVX-512F code (see rtu/simd.h).
+// Visual C++ accepts their intrinsics anywhere, gcc only in files compiled with -mavx2 or -mavx512f.
+// Code using them must only run after checking host support at run time (see rtu/cpu.h).
+#if defined(_MSC_VER)
+	#if _MSC_VER >= 1700
+		#define RTU_HAS_AVX2
+	#endif
+	#if _MSC_VER >= 1911
+		#define RTU_HAS_AVX512
+	#endif
+#elif defined(__GNUG__)
+	#if defined(__AVX2__)
+		#define RTU_HAS_AVX2
+	#endif
+	#if defined(__AVX512F__)
+		#define RTU_HAS_AVX512
+	#endif
+#else
+	#error Oops! The RTU_HAS_AVX2 and RTU_HAS_AVX512 macros were not defined for this compiler!
+#endif
+
 #if defined(__GNUG__)
 	#include <sys/types.h>
 #endif
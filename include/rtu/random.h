@@ -3,6 +3,7 @@
 #define _RTU_RANDOM_H_
 
 #include <rtu/common.h>
+#include <rtu/sse.h>
 
 namespace rtu {
 
@@ -82,6 +83,78 @@ private:
 	static int32 mti;
 };
 
+/**
+ *	Counter-based Pseudo-Random Number Generator (Philox4x32-10, see [Salmon et al. 2011]).
+ *	Each number is a pure function of (seed, stream, substream, position in stream), so there is no shared state:
+ *	a generator per pixel and sample gives the same numbers whatever thread (or how many threads) uses it.
+ */
+class CounterRandom
+{
+public:
+	//! Seed and streams are all zero.
+	CounterRandom();
+	CounterRandom( uint32 seed, uint32 stream, uint32 substream = 0 );
+
+	//! Restarts the generator at the beginning of given stream.
+	void reset( uint32 seed, uint32 stream, uint32 substream = 0 );
+
+	/**
+	 *	Returns a generator independent from this one (e.g. for a secondary ray), which starts at the beginning of its
+	 *	own stream. The same id always gives the same generator, whatever numbers have been drawn from this one.
+	 */
+	CounterRandom branch( uint32 id ) const;
+
+	//! Moves to given position in stream: next number is the one integer32() would draw after position others since reset.
+	void seek( uint32 position );
+
+	//! Generates a random uint32 on the [0,0xFFFFFFFF] interval.
+	inline uint32 integer32();
+
+	//! Generates a random real number on the [0,1) interval (24 bits resolution).
+	inline float real();
+
+	inline float real( float min, float max );
+
+	//! Generates 4 random real numbers on the [0,1) interval at once, from a single Philox block.
+	__m128 real4();
+
+	//! Fills result with count random real numbers on the [0,1) interval, 4 at a time.
+	void reals( float* result, uint32 count );
+
+	//! Philox4x32-10 bijection: scrambles counter using key.
+	static void philox( const uint32 counter[4], const uint32 key[2], uint32 result[4] );
+
+private:
+	// Generates next block of 4 numbers
+	void nextBlock();
+
+	// key: scrambled seed, counter: (block, stream, substream, branch path)
+	uint32 _key[2];
+	uint32 _counter[4];
+
+	// Last generated block, _used numbers already returned
+	uint32 _block[4];
+	uint32 _used;
+};
+
+inline uint32 CounterRandom::integer32()
+{
+	if( _used == 4 )
+		nextBlock();
+
+	return _block[_used++];
+}
+
+inline float CounterRandom::real()
+{
+	return ( integer32() >> 8 ) * ( 1.0f / 16777216.0f );
+}
+
+inline float CounterRandom::real( float min, float max )
+{
+	return ( min + ( max - min ) * real() );
+}
+
 } // namespace rtu
 
 #endif
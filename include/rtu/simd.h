@@ -0,0 +1,182 @@
+#pragma once
+#ifndef _RTU_SIMD_H_
+#define _RTU_SIMD_H_
+
+#include <rtu/common.h>
+#include <rtu/sse.h>
+
+#if defined(RTU_HAS_AVX2) || defined(RTU_HAS_AVX512)
+	#include <immintrin.h> // AVX, AVX2 & AVX-512 intrinsics
+#endif
+
+namespace rtu {
+
+/*
+ *	SIMD instruction sets wrapped behind the same interface, so that kernels can be written once as templates
+ *	and instantiated for each width. Data is loaded from arrays of WIDTH consecutive floats.
+ *	Masks are stored in memory as one 0 or 0xFFFFFFFF float per lane, same as SSE compare results.
+ *	Wider sets are only defined if the compiler can generate them (see RTU_HAS_AVX2 and RTU_HAS_AVX512),
+ *	and must only run if the host supports them (see rtu::Cpu).
+ */
+
+// SSE2, 4 lanes. Data must be 16-byte aligned.
+struct Simd4
+{
+	static const unsigned int WIDTH = 4;
+
+	typedef __m128 Float;
+	typedef __m128 Mask;
+
+	static RTU_FORCEINLINE Float load( const float* p ) { return _mm_load_ps( p ); }
+	static RTU_FORCEINLINE void store( float* p, Float v ) { _mm_store_ps( p, v ); }
+	static RTU_FORCEINLINE Float set1( float f ) { return _mm_set_ps1( f ); }
+	static RTU_FORCEINLINE Float zero() { return _mm_setzero_ps(); }
+
+	static RTU_FORCEINLINE Float add( Float a, Float b ) { return _mm_add_ps( a, b ); }
+	static RTU_FORCEINLINE Float sub( Float a, Float b ) { return _mm_sub_ps( a, b ); }
+	static RTU_FORCEINLINE Float mul( Float a, Float b ) { return _mm_mul_ps( a, b ); }
+	// Returns b if any of them is NaN
+	static RTU_FORCEINLINE Float min( Float a, Float b ) { return _mm_min_ps( a, b ); }
+	static RTU_FORCEINLINE Float max( Float a, Float b ) { return _mm_max_ps( a, b ); }
+	// Same as sseFastRcp
+	static RTU_FORCEINLINE Float rcp( Float v ) { return sseFastRcp( v ); }
+
+	// Comparisons are false if any of them is NaN
+	static RTU_FORCEINLINE Mask cmplt( Float a, Float b ) { return _mm_cmplt_ps( a, b ); }
+	static RTU_FORCEINLINE Mask cmple( Float a, Float b ) { return _mm_cmple_ps( a, b ); }
+	static RTU_FORCEINLINE Mask cmpge( Float a, Float b ) { return _mm_cmpge_ps( a, b ); }
+
+	static RTU_FORCEINLINE Mask andMask( Mask a, Mask b ) { return _mm_and_ps( a, b ); }
+	static RTU_FORCEINLINE Mask loadMask( const float* p ) { return _mm_load_ps( p ); }
+	static RTU_FORCEINLINE void storeMask( float* p, Mask m ) { _mm_store_ps( p, m ); }
+	// One bit per lane
+	static RTU_FORCEINLINE unsigned int maskBits( Mask m ) { return _mm_movemask_ps( m ); }
+
+	// Overwrite lanes of mask only
+	static RTU_FORCEINLINE void maskStore( float* p, Mask m, Float v )
+	{
+		_mm_store_ps( p, _mm_or_ps( _mm_andnot_ps( m, _mm_load_ps( p ) ), _mm_and_ps( m, v ) ) );
+	}
+
+	static RTU_FORCEINLINE void maskStore( unsigned int* p, Mask m, unsigned int v )
+	{
+		__m128i* const ip = reinterpret_cast<__m128i*>( p );
+		const __m128i im = _mm_castps_si128( m );
+		_mm_store_si128( ip, _mm_or_si128( _mm_andnot_si128( im, _mm_load_si128( ip ) ), _mm_and_si128( im, _mm_set1_epi32( v ) ) ) );
+	}
+};
+
+#if defined(RTU_HAS_AVX2)
+
+// AVX2, 8 lanes. Data needs no alignment.
+struct Simd8
+{
+	static const unsigned int WIDTH = 8;
+
+	typedef __m256 Float;
+	typedef __m256 Mask;
+
+	static RTU_FORCEINLINE Float load( const float* p ) { return _mm256_loadu_ps( p ); }
+	static RTU_FORCEINLINE void store( float* p, Float v ) { _mm256_storeu_ps( p, v ); }
+	static RTU_FORCEINLINE Float set1( float f ) { return _mm256_set1_ps( f ); }
+	static RTU_FORCEINLINE Float zero() { return _mm256_setzero_ps(); }
+
+	static RTU_FORCEINLINE Float add( Float a, Float b ) { return _mm256_add_ps( a, b ); }
+	static RTU_FORCEINLINE Float sub( Float a, Float b ) { return _mm256_sub_ps( a, b ); }
+	static RTU_FORCEINLINE Float mul( Float a, Float b ) { return _mm256_mul_ps( a, b ); }
+	static RTU_FORCEINLINE Float min( Float a, Float b ) { return _mm256_min_ps( a, b ); }
+	static RTU_FORCEINLINE Float max( Float a, Float b ) { return _mm256_max_ps( a, b ); }
+
+	// Same approximation and Newton-Raphson iteration as sseFastRcp
+	static RTU_FORCEINLINE Float rcp( Float v )
+	{
+		const __m256 n = _mm256_rcp_ps( v );
+		const __m256 inf = _mm256_castsi256_ps( _mm256_set1_epi32( 0x7F800000 ) );
+		return _mm256_min_ps( _mm256_sub_ps( _mm256_add_ps( n, n ), _mm256_mul_ps( _mm256_mul_ps( v, n ), n ) ), inf );
+	}
+
+	static RTU_FORCEINLINE Mask cmplt( Float a, Float b ) { return _mm256_cmp_ps( a, b, _CMP_LT_OQ ); }
+	static RTU_FORCEINLINE Mask cmple( Float a, Float b ) { return _mm256_cmp_ps( a, b, _CMP_LE_OQ ); }
+	static RTU_FORCEINLINE Mask cmpge( Float a, Float b ) { return _mm256_cmp_ps( a, b, _CMP_GE_OQ ); }
+
+	static RTU_FORCEINLINE Mask andMask( Mask a, Mask b ) { return _mm256_and_ps( a, b ); }
+	static RTU_FORCEINLINE Mask loadMask( const float* p ) { return _mm256_loadu_ps( p ); }
+	static RTU_FORCEINLINE void storeMask( float* p, Mask m ) { _mm256_storeu_ps( p, m ); }
+	static RTU_FORCEINLINE unsigned int maskBits( Mask m ) { return _mm256_movemask_ps( m ); }
+
+	static RTU_FORCEINLINE void maskStore( float* p, Mask m, Float v )
+	{
+		_mm256_maskstore_ps( p, _mm256_castps_si256( m ), v );
+	}
+
+	static RTU_FORCEINLINE void maskStore( unsigned int* p, Mask m, unsigned int v )
+	{
+		_mm256_maskstore_epi32( reinterpret_cast<int*>( p ), _mm256_castps_si256( m ), _mm256_set1_epi32( v ) );
+	}
+};
+
+#endif // RTU_HAS_AVX2
+
+#if defined(RTU_HAS_AVX512)
+
+// AVX-512F, 16 lanes. Data needs no alignment. Masks live in mask registers, one bit per lane.
+struct Simd16
+{
+	static const unsigned int WIDTH = 16;
+
+	typedef __m512 Float;
+	typedef __mmask16 Mask;
+
+	static RTU_FORCEINLINE Float load( const float* p ) { return _mm512_loadu_ps( p ); }
+	static RTU_FORCEINLINE void store( float* p, Float v ) { _mm512_storeu_ps( p, v ); }
+	static RTU_FORCEINLINE Float set1( float f ) { return _mm512_set1_ps( f ); }
+	static RTU_FORCEINLINE Float zero() { return _mm512_setzero_ps(); }
+
+	static RTU_FORCEINLINE Float add( Float a, Float b ) { return _mm512_add_ps( a, b ); }
+	static RTU_FORCEINLINE Float sub( Float a, Float b ) { return _mm512_sub_ps( a, b ); }
+	static RTU_FORCEINLINE Float mul( Float a, Float b ) { return _mm512_mul_ps( a, b ); }
+	static RTU_FORCEINLINE Float min( Float a, Float b ) { return _mm512_min_ps( a, b ); }
+	static RTU_FORCEINLINE Float max( Float a, Float b ) { return _mm512_max_ps( a, b ); }
+
+	// Better initial approximation than SSE and AVX2 (14 bits instead of 12), same Newton-Raphson iteration
+	static RTU_FORCEINLINE Float rcp( Float v )
+	{
+		const __m512 n = _mm512_rcp14_ps( v );
+		const __m512 inf = _mm512_castsi512_ps( _mm512_set1_epi32( 0x7F800000 ) );
+		return _mm512_min_ps( _mm512_sub_ps( _mm512_add_ps( n, n ), _mm512_mul_ps( _mm512_mul_ps( v, n ), n ) ), inf );
+	}
+
+	static RTU_FORCEINLINE Mask cmplt( Float a, Float b ) { return _mm512_cmp_ps_mask( a, b, _CMP_LT_OQ ); }
+	static RTU_FORCEINLINE Mask cmple( Float a, Float b ) { return _mm512_cmp_ps_mask( a, b, _CMP_LE_OQ ); }
+	static RTU_FORCEINLINE Mask cmpge( Float a, Float b ) { return _mm512_cmp_ps_mask( a, b, _CMP_GE_OQ ); }
+
+	static RTU_FORCEINLINE Mask andMask( Mask a, Mask b ) { return static_cast<Mask>( a & b ); }
+
+	static RTU_FORCEINLINE Mask loadMask( const float* p )
+	{
+		return _mm512_cmpneq_epi32_mask( _mm512_loadu_si512( p ), _mm512_setzero_si512() );
+	}
+
+	static RTU_FORCEINLINE void storeMask( float* p, Mask m )
+	{
+		_mm512_storeu_si512( p, _mm512_maskz_mov_epi32( m, _mm512_set1_epi32( -1 ) ) );
+	}
+
+	static RTU_FORCEINLINE unsigned int maskBits( Mask m ) { return m; }
+
+	static RTU_FORCEINLINE void maskStore( float* p, Mask m, Float v )
+	{
+		_mm512_mask_storeu_ps( p, m, v );
+	}
+
+	static RTU_FORCEINLINE void maskStore( unsigned int* p, Mask m, unsigned int v )
+	{
+		_mm512_mask_storeu_epi32( p, m, _mm512_set1_epi32( v ) );
+	}
+};
+
+#endif // RTU_HAS_AVX512
+
+} // namespace rtu
+
+#endif // _RTU_SIMD_H_
@@ -24,4 +24,42 @@ bool rtutLoadRa2( char* filename, unsigned int& geometryId );
 // Accepts any file format supported by OpenSceneGraph
 bool rtutLoadOpenSceneGraph( char* filename, unsigned int& geometryId );
 
+// Benchmarks
+
+// Builds the teapot and the given .ra2 scene (may be NULL) with every geometry build mode.
+// Prints build time and average frame time of the resulting kd-trees to stdout.
+// Should be called in an empty scene, after setting up viewport, frame buffer and renderer.
+void rtutBenchmarkGeometryBuild( char* ra2Filename, unsigned int frameCount );
+
+// Instantiates the teapot instanceCount times, spread uniformly and then grouped in a few dense clusters.
+// Compares every instance build mode, printing build time (first frame minus average frame time),
+// average frame time and primary rays per second to stdout.
+// Should be called in an empty scene, after setting up a frame buffer of at least width*height pixels and renderer.
+void rtutBenchmarkInstanceBuild( unsigned int instanceCount, unsigned int width, unsigned int height, unsigned int frameCount );
+
+// Renders the teapot with the packet kernels of every SIMD width supported by the host (see rtSetSimdWidth),
+// printing average frame time and primary rays per second to stdout.
+// Should be called in an empty scene, after setting up a frame buffer of at least width*height pixels and a packet renderer.
+void rtutBenchmarkSimdWidth( unsigned int width, unsigned int height, unsigned int frameCount );
+
+// Tests
+
+// Renders the teapot with every tiled renderer on a viewport that is not a multiple of the packet size,
+// into a frame buffer followed by guard pixels. Prints results to stdout.
+// Returns false if any renderer leaves a pixel unwritten or writes past the end of the frame buffer.
+// Should be called in an empty scene. Renderer, viewport and frame buffer must be set up again afterwards.
+bool rtutTestTileBorders();
+
+// Renders the teapot as a mirror shading its reflections on itself with nested batches (see rtsTraceRayBatch),
+// with the tiled renderer both sorting and not sorting shading by material. Prints results to stdout.
+// Returns false if both images differ.
+// Should be called in an empty scene. Renderer, viewport and frame buffer must be set up again afterwards.
+bool rtutTestRecursiveBatchShading();
+
+// Moves clustered teapot instances over several frames with rtUpdateInstanceTransform, for every instance build mode,
+// then renders them again with the instance tree rebuilt from scratch. Prints results to stdout.
+// Returns false if the updated and rebuilt trees render different images.
+// Should be called in an empty scene. Renderer, viewport and frame buffer must be set up again afterwards.
+bool rtutTestInstanceUpdate();
+
 #endif // _RTUT_H_
@@ -6,10 +6,12 @@
 #include <rtc/MatrixStack.h>
 #include <rtc/PrimitiveAssembler.h>
 #include <rtc/KdTreeBuilder.h>
+#include <rtc/RayTracer.h>
 
 #include <rtl/PerspectiveCamera.h>
 #include <rtl/SingleColorEnvironment.h>
 #include <rtl/SingleRenderer.h>
+#include <rtl/SobolSampler.h>
 
 #include <rtu/stl.h>
 
@@ -30,6 +32,7 @@ static unsigned int s_currentLight;
 
 // Instance managing
 static bool s_instancesDirty = true;
+static std::vector<unsigned int> s_movedInstances; // updated without rebuilding the instance tree
 
 /************************************************************************/
 /* Core Programming Interface                                           */
@@ -42,6 +45,7 @@ bool rtInit()
 	rtCameraClass( new rtl::PerspectiveCamera() );
 	rtEnvironmentClass( new rtl::SingleColorEnvironment() );
 	rtRendererClass( new rtl::SingleRenderer() );
+	rtSamplerClass( new rtl::SobolSampler() );
 
 	// Invalid light id == 0
 	rtGenLights( 1 );
@@ -65,6 +69,17 @@ bool rtInit()
 	rtSetRayEpsilon( 2e-4f );
 	// Approximation for air index
 	rtSetMediumRefractionIndex( 1.0f );
+	rtSetGeometryBuildMode( RT_BUILD_SAH_SWEEP );
+	rtSetGeometryBinCount( 32 );
+	rtSetGeometryAccelStructure( RT_ACCEL_KDTREE );
+	rtSetGeometryLeafOrdered( true );
+	rtSetInstanceBuildMode( RT_BUILD_CLOSEST_BORDER );
+	rtSetRandomSeed( 0 );
+	rtSetSimdWidth( rtc::RayTracer::maxSimdWidth() );
+	rtSetPacketMinActiveRays( 2 );
+	rtSetLightCutoff( 0.0f );
+	rtSetLightSampleCount( 0 );
+	rtResetStatistics();
 
 	// Default attribute bindings
 	rtc::AttributeBinding ab;
@@ -111,6 +126,18 @@ void rtEnvironmentParameter( unsigned int paramId, void* paramValue )
 	rtc::Plugins::environment->receiveParameter( paramId, paramValue );
 }
 
+// Overwrite default sampler
+void rtSamplerClass( rts::ISampler* obj )
+{
+	rtc::Plugins::sampler = obj;
+	obj->init();
+}
+
+void rtSamplerParameter( unsigned int paramId, void* paramValue )
+{
+	rtc::Plugins::sampler->receiveParameter( paramId, paramValue );
+}
+
 // Create and setup material shaders
 unsigned int rtGenMaterials( unsigned int count )
 {
@@ -217,6 +244,7 @@ unsigned int rtGenLights( unsigned int count )
 	for( unsigned int i = previousSize; i < newSize; ++i )
 	{
 		rtc::Plugins::lights[i] = new rts::ILight();
+		rtc::Plugins::lights[i]->setLightId( i );
 	}
 
 	return previousSize;
@@ -236,6 +264,7 @@ void rtLightClass( rts::ILight* obj )
 		return;
 
 	rtc::Plugins::lights.at( s_currentLight ) = obj;
+	obj->setLightId( s_currentLight );
 	obj->init();
 }
 
@@ -305,6 +334,8 @@ void rtNewGeometry( unsigned int geometryId )
 
 	rtc::Geometry& geometry = rtc::Scene::geometries.at( geometryId );
 	geometry.kdTree.erase();
+	geometry.bvh.erase();
+	geometry.leafTriangles.erase();
 	rtu::vectorFreeMemory( geometry.triAccel );
 	rtu::vectorFreeMemory( geometry.triDesc );
 	rtu::vectorFreeMemory( geometry.vertices );
@@ -424,8 +455,68 @@ void rtEnd()
 // End new geometry
 void rtEndGeometry()
 {
-	// Build and store the optimized kdtree
-	rtc::KdTreeBuilder::buildTree( &rtc::Scene::geometries.at( s_currentGeometry ) );
+	rtc::Geometry& geometry = rtc::Scene::geometries.at( s_currentGeometry );
+	geometry.accelStructure = rtc::Scene::geometryAccelStructure;
+	geometry.leafOrdered = rtc::Scene::geometryLeafOrdered;
+
+	// Build and store the optimized kdtree (or bvh)
+	rtc::KdTreeBuilder::buildTree( &geometry, rtc::Scene::geometryBuildMode, rtc::Scene::geometryBinCount );
+}
+
+// Algorithm used by rtEndGeometry to build the geometry's kd-tree
+void rtSetGeometryBuildMode( unsigned int mode )
+{
+	rtc::Scene::geometryBuildMode = mode;
+}
+
+unsigned int rtGetGeometryBuildMode()
+{
+	return rtc::Scene::geometryBuildMode;
+}
+
+// Number of bins per axis used by RT_BUILD_SAH_BINNED
+void rtSetGeometryBinCount( unsigned int count )
+{
+	rtc::Scene::geometryBinCount = count;
+}
+
+unsigned int rtGetGeometryBinCount()
+{
+	return rtc::Scene::geometryBinCount;
+}
+
+// Acceleration structure built by rtEndGeometry
+void rtSetGeometryAccelStructure( unsigned int accel )
+{
+	rtc::Scene::geometryAccelStructure = accel;
+}
+
+unsigned int rtGetGeometryAccelStructure()
+{
+	return rtc::Scene::geometryAccelStructure;
+}
+
+// Whether rtEndGeometry copies triangles in leaf order for ray packets
+void rtSetGeometryLeafOrdered( bool enabled )
+{
+	rtc::Scene::geometryLeafOrdered = enabled;
+}
+
+bool rtGetGeometryLeafOrdered()
+{
+	return rtc::Scene::geometryLeafOrdered;
+}
+
+// Algorithm used to build the instance kd-tree
+void rtSetInstanceBuildMode( unsigned int mode )
+{
+	rtc::Scene::instanceBuildMode = mode;
+	s_instancesDirty = true;
+}
+
+unsigned int rtGetInstanceBuildMode()
+{
+	return rtc::Scene::instanceBuildMode;
 }
 
 // Instantiate geometries using current matrix
@@ -436,18 +527,11 @@ unsigned int rtGenInstances( unsigned int count )
 	return previousSize;
 }
 
-void rtInstantiate( unsigned int instanceId, unsigned int geometryId )
+// Update instance bounding box according to its matrix and geometry's original bounding box
+static void updateInstanceBox( rtc::Instance& instance )
 {
-	if( ( instanceId >= rtc::Scene::instances.size() ) || ( geometryId >= rtc::Scene::geometries.size() ) )
-		return;
-
-	rtc::Instance& instance = rtc::Scene::instances.at( instanceId );
-	instance.transform.setMatrix( s_matrixStack.top() );
-	instance.geometryId = geometryId;
-
-	// Update instance bounding box according to current matrix and geometry's original bounding box
 	rtu::float3 boxVertices[8];
-	rtc::Scene::geometries.at( geometryId ).kdTree.bbox.computeVertices( boxVertices );
+	rtc::Scene::geometries.at( instance.geometryId ).bbox().computeVertices( boxVertices );
 
 	for( unsigned int v = 0; v < 8; ++v )
 	{
@@ -467,10 +551,39 @@ void rtInstantiate( unsigned int instanceId, unsigned int geometryId )
 	maxv.x *= ( maxv.x < 0.0f )? 0.999f : 1.111f;
 	maxv.y *= ( maxv.y < 0.0f )? 0.999f : 1.111f;
 	maxv.z *= ( maxv.z < 0.0f )? 0.999f : 1.111f;
+}
+
+void rtInstantiate( unsigned int instanceId, unsigned int geometryId )
+{
+	if( ( instanceId >= rtc::Scene::instances.size() ) || ( geometryId >= rtc::Scene::geometries.size() ) )
+		return;
+
+	rtc::Instance& instance = rtc::Scene::instances.at( instanceId );
+	instance.transform.setMatrix( s_matrixStack.top() );
+	instance.geometryId = geometryId;
+	updateInstanceBox( instance );
 
 	s_instancesDirty = true;
 }
 
+// Move an instance, without rebuilding the entire instance tree in next frame
+// Matrix has the same layout as in rtLoadMatrixfv
+void rtUpdateInstanceTransform( unsigned int instanceId, const float* const matrix )
+{
+	if( instanceId >= rtc::Scene::instances.size() )
+		return;
+
+	// No geometry box to transform until instantiated
+	rtc::Instance& instance = rtc::Scene::instances.at( instanceId );
+	if( instance.geometryId == rtc::Instance::INVALID_GEOMETRY )
+		return;
+
+	instance.transform.setMatrix( rtu::float4x4( matrix ) );
+	updateInstanceBox( instance );
+
+	s_movedInstances.push_back( instanceId );
+}
+
 // Do not change transform, or it will cause undefined side-effects
 const float* rtGetInstanceTransform( unsigned int instanceId )
 {
@@ -536,6 +649,60 @@ float rtGetMediumRefractionIndex()
 	return rtc::Scene::mediumRefractionIndex;
 }
 
+void rtSetRandomSeed( unsigned int seed )
+{
+	rtc::Scene::randomSeed = seed;
+}
+
+unsigned int rtGetRandomSeed()
+{
+	return rtc::Scene::randomSeed;
+}
+
+// Width of packet traversal kernels
+void rtSetSimdWidth( unsigned int width )
+{
+	rtc::RayTracer::setSimdWidth( width );
+}
+
+unsigned int rtGetSimdWidth()
+{
+	return rtc::RayTracer::simdWidth();
+}
+
+// Packets with fewer active rays are traced one ray at a time in each geometry
+void rtSetPacketMinActiveRays( unsigned int count )
+{
+	rtc::Scene::packetMinActiveRays = count;
+}
+
+unsigned int rtGetPacketMinActiveRays()
+{
+	return rtc::Scene::packetMinActiveRays;
+}
+
+// Lights only reach the points they illuminate by more than cutoff
+void rtSetLightCutoff( float cutoff )
+{
+	rtc::Scene::lightCutoff = cutoff;
+}
+
+float rtGetLightCutoff()
+{
+	return rtc::Scene::lightCutoff;
+}
+
+// Lights picked at random per shading point, 0 for all of them
+void rtSetLightSampleCount( unsigned int count )
+{
+	rtc::Scene::lightSampleCount = count;
+}
+
+unsigned int rtGetLightSampleCount()
+{
+	return rtc::Scene::lightSampleCount;
+}
+
 // Ray trace scene
 void rtRenderFrame()
 {
@@ -560,10 +727,55 @@ void rtRenderFrame()
 	// Update instances, if needed
 	if( s_instancesDirty )
 	{
-		rtc::KdTreeBuilder::buildTree( rtc::Scene::instanceTree, rtc::Scene::instances );
+		rtc::KdTreeBuilder::buildTree( rtc::Scene::instanceTree, rtc::Scene::instances, rtc::Scene::instanceBuildMode );
 		s_instancesDirty = false;
 	}
+	else if( !s_movedInstances.empty() )
+	{
+		rtc::KdTreeBuilder::updateTree( rtc::Scene::instanceTree, rtc::Scene::instances, s_movedInstances, 
+			                            rtc::Scene::instanceBuildMode );
+	}
+	s_movedInstances.clear();
+
+	// Lights may have moved in newFrame
+	rtc::Scene::lightTree.build( rtc::Scene::lightCutoff );
 
 	// Render current frame
 	rtc::Plugins::renderer->render();
 }
+
+// Counters summed over all threads
+double rtGetStatistic( unsigned int stat )
+{
+	rtc::RayTracer::Statistics stats;
+	rtc::RayTracer::statistics( stats );
+
+	switch( stat )
+	{
+	case RT_STAT_SINGLE_TRIANGLE_TESTS:
+		return static_cast<double>( stats.singleTests );
+	case RT_STAT_SINGLE_MAILBOX_SKIPS:
+		return static_cast<double>( stats.singleSkips );
+	case RT_STAT_PACKET_TRIANGLE_TESTS:
+		return static_cast<double>( stats.packetTests );
+	case RT_STAT_PACKET_MAILBOX_SKIPS:
+		return static_cast<double>( stats.packetSkips );
+	case RT_STAT_PACKET_TRAVERSALS:
+		return static_cast<double>( stats.packetTraversals );
+	case RT_STAT_PACKET_FALLBACKS:
+		return static_cast<double>( stats.packetFallbacks );
+	case RT_STAT_FALLBACK_RAYS:
+		return static_cast<double>( stats.fallbackRays );
+	case RT_STAT_STREAM_RAYS:
+		return static_cast<double>( stats.streamRays );
+	case RT_STAT_STREAM_PACKETS:
+		return static_cast<double>( stats.streamPackets );
+	default:
+		return 0.0;
+	}
+}
+
+void rtResetStatistics()
+{
+	rtc::RayTracer::resetStatistics();
+}
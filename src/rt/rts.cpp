@@ -6,8 +6,7 @@
 #include <rtc/RayTracer.h>
 #include <rtc/RayState.h>
 
-// TODO: remove
-#include <rtu/random.h>
+#include <algorithm>
 
 /************************************************************************/
 /* Macros                                                               */
@@ -20,6 +19,8 @@
 #define _TO_RAY_PACKET_STATE(s)       reinterpret_cast<rtc::RayPacketState&>( (s) )
 #define _TO_CONST_RAY_PACKET_STATE(s) reinterpret_cast<const rtc::RayPacketState&>( (s) )
 
+#define _TO_RAY_STREAM(s) reinterpret_cast<rtc::RayStream&>( (s) )
+
 /************************************************************************/
 /* Global objects                                                       */
 /************************************************************************/
@@ -27,6 +28,85 @@
 // Core ray tracing
 static rtc::RayTracer s_rayTracer;
 
+// Branches of state random numbers (see rtu::CounterRandom::branch)
+static const unsigned int LIGHT_BRANCH      = 0;
+static const unsigned int REFLECTION_BRANCH = 1;
+static const unsigned int REFRACTION_BRANCH = 2;
+// Ray r of a packet shaded on its own uses branch PACKET_RAY_BRANCH + r
+static const unsigned int PACKET_RAY_BRANCH = 3;
+
+// Substreams of pixel random numbers and sampler decorrelation, never used as sample indices
+static const unsigned int PIXEL_SUBSTREAM   = 0xFFFFFFFF;
+static const unsigned int SAMPLER_SUBSTREAM = 0xFFFFFFFE;
+
+// Sample dimension drawn by renderers on the image plane, shaders start at the next one
+static const unsigned int PIXEL_DIMENSION = 0;
+
+// Random stream of the pixel nearest to (x,y)
+static unsigned int pixelStream( float x, float y )
+{
+	unsigned int width;
+	unsigned int height;
+	rtc::Plugins::camera->getViewport( width, height );
+
+	const unsigned int px = ( x > 0.0f ) ? (unsigned int)( x + 0.5f ) : 0;
+	const unsigned int py = ( y > 0.0f ) ? (unsigned int)( y + 0.5f ) : 0;
+	return px + py * width;
+}
+
+// First sample dimension of a branch of a state. Samplers only use dimensions to decorrelate their sample sets
+// (see drawSamples): hashing them keeps the dimensions of each branch apart from its parent's and its siblings'.
+static unsigned int branchDimension( unsigned int dimension, unsigned int branch )
+{
+	unsigned int h = ( dimension * 0x9E3779B9 ) ^ ( ( branch + 1 ) * 0x85EBCA6B );
+	h ^= h >> 16;
+	h *= 0x7FEB352D;
+	h ^= h >> 15;
+	h *= 0x846CA68B;
+	h ^= h >> 16;
+	return h;
+}
+
+// Secondary states draw random numbers and samples independent from their parent's, for the same pixel sample
+static void inheritSampling( const rtc::RayState& parent, rtc::RayState& child, unsigned int branch )
+{
+	child.random = parent.random.branch( branch );
+	child.pixel = parent.pixel;
+	child.sample = parent.sample;
+	child.sampleDimension = branchDimension( parent.sampleDimension, branch );
+}
+
+// Secondary states contribute to the same pixel as their parent, through its path (see rtsBeginRayQueue)
+static void inheritPath( const rtc::RayState& parent, rtc::RayState& child )
+{
+	child.pathWeight = parent.pathWeight;
+	child.pathTarget = parent.pathTarget;
+}
+
+// Same as inheritSampling, for packet light states
+static void inheritSamplingPacket( const rtc::RayPacketState& parent, rtc::RayPacketState& child, unsigned int branch )
+{
+	child.random = parent.random.branch( branch );
+	std::copy( parent.pixel, parent.pixel + RT_PACKET_SIZE, child.pixel );
+	std::copy( parent.sample, parent.sample + RT_PACKET_SIZE, child.sample );
+	child.sampleDimension = branchDimension( parent.sampleDimension, branch );
+}
+
+// Inverse lengths of 4 vectors, same precision as rtu::float3::normalize
+static inline __m128 sseInvLength( __m128 x, __m128 y, __m128 z )
+{
+	return _mm_div_ps( rtu::SSE_ONE, _mm_sqrt_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( x, x ), _mm_mul_ps( y, y ) ), _mm_mul_ps( z, z ) ) ) );
+}
+
+// Samples [first,first+count) of a pixel's sequence in given dimension
+static void drawSamples( unsigned int pixel, unsigned int dimension, unsigned int first, unsigned int count, float* uv )
+{
+	rtu::CounterRandom random( rtc::Scene::randomSeed, pixel, SAMPLER_SUBSTREAM );
+	random = random.branch( dimension );
+
+	rtc::Plugins::sampler->sample2D( random, first, count, uv );
+}
+
 /************************************************************************/
 /* Shader Programming Interface                                         */
 /************************************************************************/
@@ -37,13 +117,21 @@ static rtc::RayTracer s_rayTracer;
 // Use camera to setup primary ray state.
 // Initializes ray origin and direction.
 // Resets ray recursion depth.
-void rtsInitPrimaryRayState( rts::RTstate& state, float x, float y )
+void rtsInitPrimaryRayState( rts::RTstate& state, float x, float y, unsigned int sample )
 {
+	RTU_STATIC_CHECK( sizeof( rtc::RayState ) <= sizeof( rts::RTstate ), rtstate_must_hold_ray_state );
+
 	rtc::Plugins::camera->getRay( state, x, y );
 
 	// Reset ray state parameters
 	rtc::RayState& rs = _TO_RAY_STATE( state );
 	rs.recursionDepth = 0;
+	rs.pixel = pixelStream( x, y );
+	rs.sample = sample;
+	rs.sampleDimension = PIXEL_DIMENSION + 1;
+	rs.random.reset( rtc::Scene::randomSeed, rs.pixel, sample );
+	rs.pathWeight.set( 1.0f, 1.0f, 1.0f );
+	rs.pathTarget = NULL;
 }
 
 // Initialize state information for querying light radiance samples.
@@ -58,6 +146,7 @@ void rtsInitLightState( const rts::RTstate& state, rts::RTstate& light )
 	// TODO: shoudn't need an epsilon here...
 	lig.hitPosition = rs.hitPosition + rs.shadingNormal * rtc::Scene::rayEpsilon;
 	lig.shadingNormal = rs.shadingNormal;
+	inheritSampling( rs, lig, LIGHT_BRANCH );
 }
 
 // Initialize state information for shadow rays.
@@ -94,6 +183,8 @@ void rtsInitReflectionRayState( const rts::RTstate& state, rts::RTstate& reflect
 
 	// Increment recursion depth
 	ref.recursionDepth = rs.recursionDepth + 1;
+	inheritSampling( rs, ref, REFLECTION_BRANCH );
+	inheritPath( rs, ref );
 }
 
 // Initialize state information for refraction rays.
@@ -145,6 +236,8 @@ bool rtsInitRefractionRayState( const rts::RTstate& state, float refractionIndex
 
 	ref.ray.origin = rs.hitPosition;
 	ref.recursionDepth = rs.recursionDepth + 1;
+	inheritSampling( rs, ref, REFRACTION_BRANCH );
+	inheritPath( rs, ref );
 	return true;
 }
 
@@ -158,10 +251,132 @@ bool rtsInitRefractionRayState( const rts::RTstate& state, float refractionIndex
 // Number of packet rays is given by RT_PACKET_SIZE
 void rtsInitPrimaryRayStatePacket( rts::RTstate& state, float* rayXYCoords )
 {
+	RTU_STATIC_CHECK( sizeof( rtc::RayPacketState ) <= sizeof( rts::RTstate ), rtstate_must_hold_ray_packet_state );
+
 	rtc::Plugins::camera->getRayPacket( state, rayXYCoords );
 
 	// Reset ray state parameters
-	std::fill_n( _TO_RAY_PACKET_STATE( state ).recursionDepth, RT_PACKET_SIZE, 0 );
+	rtc::RayPacketState& rps = _TO_RAY_PACKET_STATE( state );
+	std::fill_n( rps.recursionDepth, RT_PACKET_SIZE, 0 );
+	rps.random.reset( rtc::Scene::randomSeed, pixelStream( rayXYCoords[0], rayXYCoords[1] ), 0 );
+
+	for( unsigned int r = 0; r < RT_PACKET_SIZE; ++r )
+	{
+		rps.pixel[r] = pixelStream( rayXYCoords[r*2], rayXYCoords[r*2+1] );
+	}
+	std::fill_n( rps.sample, RT_PACKET_SIZE, 0 );
+	rps.sampleDimension = PIXEL_DIMENSION + 1;
+	std::fill_n( rps.pathWeight, RT_PACKET_SIZE*3, 1.0f );
+	std::fill_n( rps.pathTarget, RT_PACKET_SIZE, static_cast<rtu::float3*>( NULL ) );
+}
+
+// Initialize state for a bundle of shadow rays, with all rays disabled.
+void rtsInitShadowRayStatePacket( rts::RTstate& shadow )
+{
+	rtc::RayPacketState& rps = _TO_RAY_PACKET_STATE( shadow );
+	std::fill_n( rps.packet.mask, RT_PACKET_SIZE, 0 );
+	std::fill_n( rps.occluded, RT_PACKET_SIZE, 0 );
+}
+
+// Setup and enable a shadow ray in the bundle.
+void rtsSetShadowRayPacket( rts::RTstate& shadow, unsigned int ray, const rtu::float3& origin, 
+						    const rtu::float3& directionTowardsLight, float rayMaxDistance )
+{
+	rtc::RayPacketState& rps = _TO_RAY_PACKET_STATE( shadow );
+	rtsSetRayOriginPacket( shadow, ray, origin );
+	rtsSetRayDirectionPacket( shadow, ray, directionTowardsLight );
+	rps.packet.tfar[ray] = rayMaxDistance;
+	rps.packet.mask[ray] = 0xFFFFFFFF;
+}
+
+// Initialize single ray state from given ray of a packet state, e.g. to shade it with scalar code.
+void rtsInitRayStateFromPacket( const rts::RTstate& packet, unsigned int ray, rts::RTstate& state )
+{
+	const rtc::RayPacketState& rps = _TO_CONST_RAY_PACKET_STATE( packet );
+	rtc::RayState& rs = _TO_RAY_STATE( state );
+
+	rs.ray.origin.set( rps.packet.ox[ray], rps.packet.oy[ray], rps.packet.oz[ray] );
+	rs.ray.direction.set( rps.packet.dx[ray], rps.packet.dy[ray], rps.packet.dz[ray] );
+	rs.ray.tnear = rps.packet.tnear[ray];
+	rs.ray.tfar = rps.packet.tfar[ray];
+
+	rs.hit.triangleId = rps.hit.tId[ray];
+	rs.hit.v0Coord = rps.hit.v0c[ray];
+	rs.hit.v1Coord = rps.hit.v1c[ray];
+	rs.hit.v2Coord = rps.hit.v2c[ray];
+	rs.hit.distance = rps.hit.dist[ray];
+	rs.hit.instance = rps.hit.inst[ray];
+	rs.hit.geometry = rps.hit.geom[ray];
+
+	rs.resultColor.set( rps.resultColor[ray], rps.resultColor[RT_PACKET_SIZE+ray], rps.resultColor[RT_PACKET_SIZE*2+ray] );
+	rs.recursionDepth = rps.recursionDepth[ray];
+	rs.random = rps.random.branch( PACKET_RAY_BRANCH + ray );
+	rs.pixel = rps.pixel[ray];
+	rs.sample = rps.sample[ray];
+	rs.sampleDimension = rps.sampleDimension;
+	rs.pathWeight.set( rps.pathWeight[ray], rps.pathWeight[RT_PACKET_SIZE+ray], rps.pathWeight[RT_PACKET_SIZE*2+ray] );
+	rs.pathTarget = rps.pathTarget[ray];
+
+	rs.hitPosition.set( rps.hitPosition[ray], rps.hitPosition[RT_PACKET_SIZE+ray], rps.hitPosition[RT_PACKET_SIZE*2+ray] );
+	rs.shadingNormal.set( rps.shadingNormal[ray], rps.shadingNormal[RT_PACKET_SIZE+ray], rps.shadingNormal[RT_PACKET_SIZE*2+ray] );
+}
+
+// Initialize packet state information for querying light radiance samples of all rays.
+// Hit-positions and shading normals must have been previously computed in state.
+void rtsInitLightStatePacket( const rts::RTstate& state, rts::RTstate& light )
+{
+	const rtc::RayPacketState& rps = _TO_CONST_RAY_PACKET_STATE( state );
+	rtc::RayPacketState& lig = _TO_RAY_PACKET_STATE( light );
+
+	// Same displacement as rtsInitLightState
+	const __m128 epsilon4 = _mm_set_ps1( rtc::Scene::rayEpsilon );
+	for( unsigned int i = 0; i < RT_PACKET_SIMD_SIZE*3; ++i )
+	{
+		lig.packet.da4[i] = rps.packet.da4[i];
+		lig.hitPosition4[i] = _mm_add_ps( rps.hitPosition4[i], _mm_mul_ps( rps.shadingNormal4[i], epsilon4 ) );
+		lig.shadingNormal4[i] = rps.shadingNormal4[i];
+	}
+
+	std::copy( rps.recursionDepth, rps.recursionDepth + RT_PACKET_SIZE, lig.recursionDepth );
+	inheritSamplingPacket( rps, lig, LIGHT_BRANCH );
+}
+
+// Initialize shadow rays of a packet light state, same as rtsInitShadowRayState.
+bool rtsInitShadowRayStatePacket( const __m128 directionTowardsLight4[RT_PACKET_SIMD_SIZE*3], float rayMaxDistance,
+								  __m128 mask4[RT_PACKET_SIMD_SIZE], rts::RTstate& light )
+{
+	rtc::RayPacketState& rps = _TO_RAY_PACKET_STATE( light );
+	rtc::RayPacket& packet = rps.packet;
+
+	const __m128 tfar4 = _mm_set_ps1( rayMaxDistance );
+	int enabledBits = 0;
+
+	for( unsigned int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+	{
+		const __m128 lx = directionTowardsLight4[p];
+		const __m128 ly = directionTowardsLight4[p+RT_PACKET_SIMD_SIZE];
+		const __m128 lz = directionTowardsLight4[p+RT_PACKET_SIMD_SIZE*2];
+
+		// Check if surface does not point away from light
+		const __m128 nDotL = _mm_add_ps( _mm_add_ps( _mm_mul_ps( rps.shadingNormal4[p], lx ), 
+			                                         _mm_mul_ps( rps.shadingNormal4[p+RT_PACKET_SIMD_SIZE], ly ) ),
+			                             _mm_mul_ps( rps.shadingNormal4[p+RT_PACKET_SIMD_SIZE*2], lz ) );
+		mask4[p] = _mm_and_ps( mask4[p], _mm_cmpgt_ps( nDotL, rtu::SSE_ZERO ) );
+		enabledBits |= _mm_movemask_ps( mask4[p] );
+
+		// Set new ray parameters
+		packet.ox4[p] = rps.hitPosition4[p];
+		packet.oy4[p] = rps.hitPosition4[p+RT_PACKET_SIMD_SIZE];
+		packet.oz4[p] = rps.hitPosition4[p+RT_PACKET_SIMD_SIZE*2];
+		packet.dx4[p] = lx;
+		packet.dy4[p] = ly;
+		packet.dz4[p] = lz;
+		packet.tfar4[p] = tfar4;
+		packet.mask4[p] = mask4[p];
+		rps.occluded4[p] = rtu::SSE_ZERO;
+	}
+
+	return ( enabledBits != 0 );
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -174,6 +389,17 @@ void rtsTraceRay( rts::RTstate& state )
 	//s_rayTracer.bruteFroce( state );
 }
 
+// Trace single rays, then shade them sorted by material
+void rtsTraceRayBatch( rts::RTstate* const states[], unsigned int count )
+{
+	for( unsigned int i = 0; i < count; ++i )
+	{
+		s_rayTracer.findHitSingle( *states[i] );
+	}
+
+	s_rayTracer.shadeBatch( states, count );
+}
+
 // Trace single ray and only test for occlusion
 bool rtsTraceHit( rts::RTstate& state )
 {
@@ -187,6 +413,13 @@ bool rtsTraceHit( rts::RTstate& state )
 
 // Trace a ray packet using SIMD
 void rtsTraceRayPacket( rts::RTstate& state )
+{
+	rtsIntersectRayPacket( state );
+	rtsShadeRayPacket( state );
+}
+
+// Find closest hits of a ray packet, without shading them
+void rtsIntersectRayPacket( rts::RTstate& state )
 {
 	rtc::RayPacketState& rps = _TO_RAY_PACKET_STATE( state );
 	rtc::RayPacket& packet = rps.packet;
@@ -219,11 +452,166 @@ void rtsTraceRayPacket( rts::RTstate& state )
 				s_rayTracer.tracePacket( state, q );
 			}
 		}
-		// TODO: why we need this?
-		//std::fill_n( packet.mask, RT_PACKET_SIZE, 0xFFFFFFFF );
+		// All rays are shaded together
+		std::fill_n( packet.mask, RT_PACKET_SIZE, 0xFFFFFFFF );
 	}
 }
 
+// Shade the hits found by rtsIntersectRayPacket
+void rtsShadeRayPacket( rts::RTstate& state )
+{
+	s_rayTracer.shadePacket( state );
+}
+
+// Trace enabled rays of a shadow packet using SIMD, only testing for occlusion.
+unsigned int rtsTraceHitPacket( rts::RTstate& shadow )
+{
+	rtc::RayPacketState& rps = _TO_RAY_PACKET_STATE( shadow );
+	rtc::RayPacket& packet = rps.packet;
+	std::fill_n( rps.occluded, RT_PACKET_SIZE, 0 );
+
+	// Disabled rays copy an enabled one, so that they don't break packet coherence
+	const unsigned int* first = std::find( packet.mask, packet.mask + RT_PACKET_SIZE, 0xFFFFFFFF );
+	if( first == packet.mask + RT_PACKET_SIZE )
+		return 0;
+
+	const unsigned int f = first - packet.mask;
+	for( unsigned int r = 0; r < RT_PACKET_SIZE; ++r )
+	{
+		if( packet.mask[r] != 0 )
+			continue;
+
+		packet.ox[r] = packet.ox[f]; packet.oy[r] = packet.oy[f]; packet.oz[r] = packet.oz[f];
+		packet.dx[r] = packet.dx[f]; packet.dy[r] = packet.dy[f]; packet.dz[r] = packet.dz[f];
+		packet.tfar[r] = packet.tfar[f];
+	}
+
+	packet.preCompute();
+	if( packet.isCoherent )
+		return s_rayTracer.traceHitPacket( shadow, (packet.xmask & 1) + (packet.ymask & 2) + (packet.zmask & 4) );
+
+	// Trace rays with the same direction signs together, same as rtsTraceRayPacket.
+	// Traversal changes ray distances, so restore them for each group.
+	unsigned int enabled[RT_PACKET_SIZE];
+	float tfar[RT_PACKET_SIZE];
+	std::copy( packet.mask, packet.mask + RT_PACKET_SIZE, enabled );
+	std::copy( packet.tfar, packet.tfar + RT_PACKET_SIZE, tfar );
+
+	unsigned int hitCount = 0;
+	unsigned int qmask = 0;
+	for( unsigned int b = 1, i = 0; i < 16; i++, b <<= 1 )
+	{
+		if( enabled[i] == 0 )
+			continue;
+
+		const int q = ((packet.xmask & b)?1:0) + ((packet.ymask & b)?2:0) + ((packet.zmask & b)?4:0);
+		if( !( qmask & (1 << q) ) )
+		{
+			qmask |= 1 << q;
+			std::fill_n( packet.mask, RT_PACKET_SIZE, 0 );
+			for( unsigned int b1 = b, i1 = i; i1 < 16; i1++, b1 <<= 1 )
+			{
+				const int cq = ((packet.xmask & b1)?1:0) + ((packet.ymask & b1)?2:0) + ((packet.zmask & b1)?4:0);
+				if( ( q == cq ) && ( enabled[i1] != 0 ) )
+					packet.mask[i1] = 0xFFFFFFFF;
+			}
+			packet.isCoherent = false;
+			std::copy( tfar, tfar + RT_PACKET_SIZE, packet.tfar );
+			hitCount += s_rayTracer.traceHitPacket( shadow, q );
+		}
+	}
+
+	std::copy( enabled, enabled + RT_PACKET_SIZE, packet.mask );
+	return hitCount;
+}
+
+/************************************************************************/
+/* Ray streams                                                          */
+/************************************************************************/
+
+// Initialize an empty stream
+void rtsInitRayStream( rts::RTstream& stream )
+{
+	RTU_STATIC_CHECK( sizeof( rtc::RayStream ) <= sizeof( rts::RTstream ), rtstream_must_hold_ray_stream );
+
+	_TO_RAY_STREAM( stream ).clear();
+}
+
+// Empty stream owned by the calling thread
+rts::RTstream& rtsAcquireRayStream()
+{
+	rts::RTstream& stream = rtc::RayTracer::context().shaderStreams.push();
+	rtsInitRayStream( stream );
+	return stream;
+}
+
+void rtsReleaseRayStream()
+{
+	rtc::RayTracer::context().shaderStreams.pop();
+}
+
+// Enqueue ray of a state initialized as a secondary ray
+void rtsEnqueueRay( rts::RTstream& stream, const rts::RTstate& state, const rtu::float3& weight, rtu::float3& target )
+{
+	rtc::RayStream& rays = _TO_RAY_STREAM( stream );
+	if( rays.full() )
+		s_rayTracer.traceStream( rays );
+
+	const rtc::RayState& rs = _TO_CONST_RAY_STATE( state );
+	rtc::RayStream::Entry& ray = rays.rays[rays.count++];
+	ray.origin = rs.ray.origin;
+	ray.direction = rs.ray.direction;
+	ray.recursionDepth = rs.recursionDepth;
+	ray.random = rs.random;
+	ray.pixel = rs.pixel;
+	ray.sample = rs.sample;
+	ray.sampleDimension = rs.sampleDimension;
+	ray.weight = weight;
+	ray.target = &target;
+	ray.pathWeight = rs.pathWeight;
+	ray.pathTarget = rs.pathTarget;
+}
+
+// Trace all rays of the stream and add their weighted result colors to their targets
+void rtsTraceRayStream( rts::RTstream& stream )
+{
+	rtc::RayStream& rays = _TO_RAY_STREAM( stream );
+	if( rays.count > 0 )
+		s_rayTracer.traceStream( rays );
+}
+
+/************************************************************************/
+/* Ray queues                                                           */
+/************************************************************************/
+
+// Queue rays of streams traced by the calling thread until rtsEndRayQueue
+void rtsBeginRayQueue()
+{
+	s_rayTracer.beginQueue();
+}
+
+void rtsEndRayQueue()
+{
+	s_rayTracer.endQueue();
+}
+
+// Trace all rays queued by the calling thread
+unsigned int rtsTraceRayQueue()
+{
+	return s_rayTracer.traceQueue();
+}
+
+// Set target of queued rays descending from a primary ray
+void rtsSetPathTarget( rts::RTstate& state, rtu::float3& target )
+{
+	_TO_RAY_STATE( state ).pathTarget = &target;
+}
+
+void rtsSetPathTargetPacket( rts::RTstate& state, unsigned int ray, rtu::float3& target )
+{
+	_TO_RAY_PACKET_STATE( state ).pathTarget[ray] = &target;
+}
+
 //////////////////////////////////////////////////////////////////////////
 // Store result in state for later use by rtsInit...State functions and other shaders
 
@@ -266,6 +654,68 @@ rtu::float3& rtsComputeShadingNormal( rts::RTstate& state )
 	return rs.shadingNormal;
 }
 
+/************************************************************************/
+/* Packet versions                                                      */
+/************************************************************************/
+
+// Compute hit positions of all rays
+void rtsComputeHitPositionPacket( rts::RTstate& state )
+{
+	rtc::RayPacketState& rps = _TO_RAY_PACKET_STATE( state );
+	const rtc::RayPacket& packet = rps.packet;
+
+	for( unsigned int i = 0; i < RT_PACKET_SIMD_SIZE*3; ++i )
+	{
+		rps.hitPosition4[i] = _mm_add_ps( packet.oa4[i], _mm_mul_ps( packet.da4[i], rps.hit.dist4[i%RT_PACKET_SIMD_SIZE] ) );
+	}
+}
+
+// Compute interpolated shading normals of rays in mask
+void rtsComputeShadingNormalPacket( rts::RTstate& state, const __m128 mask4[RT_PACKET_SIMD_SIZE] )
+{
+	rtc::RayPacketState& rps = _TO_RAY_PACKET_STATE( state );
+	const rtc::HitPacket& hit = rps.hit;
+	float* nx = rps.shadingNormal;
+	float* ny = rps.shadingNormal + RT_PACKET_SIZE;
+	float* nz = rps.shadingNormal + RT_PACKET_SIZE*2;
+
+	// Vertex normals are gathered ray by ray, each from its own geometry and instance
+	for( unsigned int r = 0; r < RT_PACKET_SIZE; ++r )
+	{
+		if( !rtsRayEnabledPacket( mask4, r ) )
+			continue;
+
+		const rtc::Geometry& geometry = *hit.geom[r];
+		const rtc::TriDesc& triangle = geometry.triDesc[hit.tId[r]];
+		const rtu::float3& v0Normal = geometry.normals[triangle.v0];
+		const rtu::float3& v1Normal = geometry.normals[triangle.v1];
+		const rtu::float3& v2Normal = geometry.normals[triangle.v2];
+
+		rtu::float3 normal;
+		normal.x = v0Normal.x*hit.v0c[r] + v1Normal.x*hit.v1c[r] + v2Normal.x*hit.v2c[r];
+		normal.y = v0Normal.y*hit.v0c[r] + v1Normal.y*hit.v1c[r] + v2Normal.y*hit.v2c[r];
+		normal.z = v0Normal.z*hit.v0c[r] + v1Normal.z*hit.v1c[r] + v2Normal.z*hit.v2c[r];
+
+		hit.inst[r]->transform.transformNormal( normal );
+		nx[r] = normal.x;
+		ny[r] = normal.y;
+		nz[r] = normal.z;
+	}
+
+	// Normalize 4 rays at once, keeping rays out of mask
+	for( unsigned int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+	{
+		__m128& x = rps.shadingNormal4[p];
+		__m128& y = rps.shadingNormal4[p+RT_PACKET_SIMD_SIZE];
+		__m128& z = rps.shadingNormal4[p+RT_PACKET_SIMD_SIZE*2];
+
+		const __m128 invLength = sseInvLength( x, y, z );
+		x = _mm_or_ps( _mm_and_ps( mask4[p], _mm_mul_ps( x, invLength ) ), _mm_andnot_ps( mask4[p], x ) );
+		y = _mm_or_ps( _mm_and_ps( mask4[p], _mm_mul_ps( y, invLength ) ), _mm_andnot_ps( mask4[p], y ) );
+		z = _mm_or_ps( _mm_and_ps( mask4[p], _mm_mul_ps( z, invLength ) ), _mm_andnot_ps( mask4[p], z ) );
+	}
+}
+
 //////////////////////////////////////////////////////////////////////////
 // Don't store results
 
@@ -359,6 +809,83 @@ bool rtsFrontFace( const rts::RTstate& state )
 	return ( rs.shadingNormal.dot( rs.ray.direction ) <= 0.0f );
 }
 
+/************************************************************************/
+/* Packet versions                                                      */
+/************************************************************************/
+
+// Compute interpolated shading colors of rays in mask
+void rtsComputeShadingColorPacket( const rts::RTstate& state, const __m128 mask4[RT_PACKET_SIMD_SIZE],
+								   __m128 color4[RT_PACKET_SIMD_SIZE*3] )
+{
+	const rtc::RayPacketState& rps = _TO_CONST_RAY_PACKET_STATE( state );
+	const rtc::HitPacket& hit = rps.hit;
+	float* cx = reinterpret_cast<float*>( color4 );
+	float* cy = cx + RT_PACKET_SIZE;
+	float* cz = cx + RT_PACKET_SIZE*2;
+
+	for( unsigned int r = 0; r < RT_PACKET_SIZE; ++r )
+	{
+		if( !rtsRayEnabledPacket( mask4, r ) )
+		{
+			cx[r] = cy[r] = cz[r] = 0.0f;
+			continue;
+		}
+
+		const rtc::Geometry& geometry = *hit.geom[r];
+		const rtc::TriDesc& triangle = geometry.triDesc[hit.tId[r]];
+		const rtu::float3& v0Color = geometry.colors[triangle.v0];
+		const rtu::float3& v1Color = geometry.colors[triangle.v1];
+		const rtu::float3& v2Color = geometry.colors[triangle.v2];
+
+		cx[r] = v0Color.x*hit.v0c[r] + v1Color.x*hit.v1c[r] + v2Color.x*hit.v2c[r];
+		cy[r] = v0Color.y*hit.v0c[r] + v1Color.y*hit.v1c[r] + v2Color.y*hit.v2c[r];
+		cz[r] = v0Color.z*hit.v0c[r] + v1Color.z*hit.v1c[r] + v2Color.z*hit.v2c[r];
+	}
+}
+
+// Compute normalized vectors for shading specular reflections of all rays
+void rtsComputeSpecularVectorPacket( const rts::RTstate& state, __m128 specularVector4[RT_PACKET_SIMD_SIZE*3] )
+{
+	const rtc::RayPacketState& rps = _TO_CONST_RAY_PACKET_STATE( state );
+	const rtc::RayPacket& packet = rps.packet;
+	const __m128 two4 = _mm_set_ps1( 2.0f );
+
+	for( unsigned int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+	{
+		const __m128 nx = rps.shadingNormal4[p];
+		const __m128 ny = rps.shadingNormal4[p+RT_PACKET_SIMD_SIZE];
+		const __m128 nz = rps.shadingNormal4[p+RT_PACKET_SIMD_SIZE*2];
+
+		// Same as rtsComputeReflectedDirection
+		const __m128 proj = _mm_mul_ps( two4, _mm_add_ps( _mm_add_ps( _mm_mul_ps( packet.dx4[p], nx ), 
+			                                                          _mm_mul_ps( packet.dy4[p], ny ) ),
+			                                              _mm_mul_ps( packet.dz4[p], nz ) ) );
+		const __m128 rx = _mm_sub_ps( packet.dx4[p], _mm_mul_ps( nx, proj ) );
+		const __m128 ry = _mm_sub_ps( packet.dy4[p], _mm_mul_ps( ny, proj ) );
+		const __m128 rz = _mm_sub_ps( packet.dz4[p], _mm_mul_ps( nz, proj ) );
+
+		const __m128 invLength = sseInvLength( rx, ry, rz );
+		specularVector4[p] = _mm_mul_ps( rx, invLength );
+		specularVector4[p+RT_PACKET_SIMD_SIZE] = _mm_mul_ps( ry, invLength );
+		specularVector4[p+RT_PACKET_SIMD_SIZE*2] = _mm_mul_ps( rz, invLength );
+	}
+}
+
+// Disable rays of mask that hit back faces
+void rtsFrontFacePacket( const rts::RTstate& state, __m128 mask4[RT_PACKET_SIMD_SIZE] )
+{
+	const rtc::RayPacketState& rps = _TO_CONST_RAY_PACKET_STATE( state );
+	const rtc::RayPacket& packet = rps.packet;
+
+	for( unsigned int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+	{
+		const __m128 nDotD = _mm_add_ps( _mm_add_ps( _mm_mul_ps( rps.shadingNormal4[p], packet.dx4[p] ), 
+			                                         _mm_mul_ps( rps.shadingNormal4[p+RT_PACKET_SIMD_SIZE], packet.dy4[p] ) ),
+			                             _mm_mul_ps( rps.shadingNormal4[p+RT_PACKET_SIMD_SIZE*2], packet.dz4[p] ) );
+		mask4[p] = _mm_and_ps( mask4[p], _mm_cmple_ps( nDotD, rtu::SSE_ZERO ) );
+	}
+}
+
 //////////////////////////////////////////////////////////////////////////
 // Accessors for state attributes
 
@@ -415,6 +942,42 @@ void rtsBarycentricCoords( const rts::RTstate& state, rtu::float3& coords )
 /* Packet versions                                                      */
 /************************************************************************/
 
+// Get ray origins
+__m128* rtsRayOriginPacket( rts::RTstate& state )
+{
+	return _TO_RAY_PACKET_STATE( state ).packet.oa4;
+}
+
+// Get ray directions
+__m128* rtsRayDirectionPacket( rts::RTstate& state )
+{
+	return _TO_RAY_PACKET_STATE( state ).packet.da4;
+}
+
+// Get resulting colors stored in state
+__m128* rtsResultColorPacket( rts::RTstate& state )
+{
+	return _TO_RAY_PACKET_STATE( state ).resultColor4;
+}
+
+// Hit-positions must have been previously computed
+__m128* rtsHitPositionPacket( rts::RTstate& state )
+{
+	return _TO_RAY_PACKET_STATE( state ).hitPosition4;
+}
+
+// Shading normals must have been previously computed
+__m128* rtsShadingNormalPacket( rts::RTstate& state )
+{
+	return _TO_RAY_PACKET_STATE( state ).shadingNormal4;
+}
+
+// Get mask of shadow rays occluded in last rtsTraceHitPacket
+const __m128* rtsOccludedPacket( const rts::RTstate& shadow )
+{
+	return _TO_CONST_RAY_PACKET_STATE( shadow ).occluded4;
+}
+
 // Set ray origin
 void rtsSetRayOriginPacket( rts::RTstate& state, unsigned int ray, const rtu::float3& origin )
 {
@@ -433,11 +996,38 @@ void rtsSetRayDirectionPacket( rts::RTstate& state, unsigned int ray, const rtu:
 	rps.packet.dz[ray] = direction.z;
 }
 
-// Get resulting color stored in state
-rtu::float3& rtsResultColorPacket( rts::RTstate& state, unsigned int ray )
+// Get resulting color of given ray
+void rtsResultColorPacket( const rts::RTstate& state, unsigned int ray, rtu::float3& color )
+{
+	const rtc::RayPacketState& rps = _TO_CONST_RAY_PACKET_STATE( state );
+	color.set( rps.resultColor[ray], rps.resultColor[RT_PACKET_SIZE+ray], rps.resultColor[RT_PACKET_SIZE*2+ray] );
+}
+
+// Set resulting color of given ray
+void rtsSetResultColorPacket( rts::RTstate& state, unsigned int ray, const rtu::float3& color )
+{
+	rtc::RayPacketState& rps = _TO_RAY_PACKET_STATE( state );
+	rps.resultColor[ray] = color.x;
+	rps.resultColor[RT_PACKET_SIZE+ray] = color.y;
+	rps.resultColor[RT_PACKET_SIZE*2+ray] = color.z;
+}
+
+// Returns whether given shadow ray was occluded in last rtsTraceHitPacket
+bool rtsRayHitPacket( const rts::RTstate& shadow, unsigned int ray )
+{
+	return ( _TO_CONST_RAY_PACKET_STATE( shadow ).occluded[ray] != 0 );
+}
+
+// Returns whether given ray is enabled in mask
+bool rtsRayEnabledPacket( const __m128 mask4[RT_PACKET_SIMD_SIZE], unsigned int ray )
 {
-	// TODO: use parallel code
-	return _TO_RAY_PACKET_STATE( state ).resultColor[ray];
+	return ( ( _mm_movemask_ps( mask4[ray/4] ) & ( 1 << ( ray%4 ) ) ) != 0 );
+}
+
+// Disable given ray in mask
+void rtsDisableRayPacket( __m128 mask4[RT_PACKET_SIMD_SIZE], unsigned int ray )
+{
+	reinterpret_cast<unsigned int*>( mask4 )[ray] = 0;
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -455,6 +1045,41 @@ float* rtsFrameBuffer()
 	return rtc::Scene::frameBuffer;
 }
 
+// Get next random number in [0,1) from state.
+float rtsRandom( rts::RTstate& state )
+{
+	return _TO_RAY_STATE( state ).random.real();
+}
+
+// Initialize random numbers for renderer decisions on pixel (x,y), such as sample positions.
+void rtsInitPixelRandom( rtu::CounterRandom& random, unsigned int x, unsigned int y )
+{
+	unsigned int width;
+	unsigned int height;
+	rtc::Plugins::camera->getViewport( width, height );
+
+	random.reset( rtc::Scene::randomSeed, x + y * width, PIXEL_SUBSTREAM );
+}
+
+// Get count 2D samples in [0,1)^2 for state, from next dimension of the sampler sequence.
+void rtsSamples2D( rts::RTstate& state, float* uv, unsigned int count )
+{
+	rtc::RayState& rs = _TO_RAY_STATE( state );
+
+	// Samples of all pixel samples together are well distributed
+	drawSamples( rs.pixel, rs.sampleDimension++, rs.sample * count, count, uv );
+}
+
+// Get 2D samples in [0,1)^2 for renderer decisions on pixel (x,y), such as sample positions on the image plane.
+void rtsPixelSamples2D( unsigned int x, unsigned int y, unsigned int first, unsigned int count, float* uv )
+{
+	unsigned int width;
+	unsigned int height;
+	rtc::Plugins::camera->getViewport( width, height );
+
+	drawSamples( x + y * width, PIXEL_DIMENSION, first, count, uv );
+}
+
 // Get array of global lights, returns light count (number of elements in array)
 // If there are no more lights, return value will be zero, and pointer will be invalid.
 int rtsGlobalLights( void**& lights )
@@ -464,13 +1089,129 @@ int rtsGlobalLights( void**& lights )
 	return rtc::Plugins::lights.size() - 1;
 }
 
+// Lights overlapping box, or lights picked at random at position
+static unsigned int queryLights( const rtc::AABB& box, const rtu::float3& position, rtu::CounterRandom& random,
+								 unsigned int& cursor, void** lights, float* weights, unsigned int maxCount )
+{
+	static const unsigned int CHUNK_SIZE = 16;
+	static const unsigned int MAX_SAMPLE_COUNT = 64;
+
+	const rtc::LightTree& tree = rtc::Scene::lightTree;
+	unsigned int count = 0;
+
+	if( rtc::Scene::lightSampleCount > 0 )
+	{
+		// All samples are returned by the first call
+		if( cursor != 0 )
+			return 0;
+		cursor = 1;
+
+		unsigned int ids[MAX_SAMPLE_COUNT];
+		const unsigned int sampleCount = std::min( std::min( rtc::Scene::lightSampleCount, maxCount ), MAX_SAMPLE_COUNT );
+		count = tree.sample( box, position, random.real(), sampleCount, ids, weights,
+			                 rtc::RayTracer::context().lightCandidates );
+
+		for( unsigned int i = 0; i < count; ++i )
+		{
+			lights[i] = rtc::Plugins::lights[ids[i]].get();
+		}
+		return count;
+	}
+
+	unsigned int ids[CHUNK_SIZE];
+	while( count < maxCount )
+	{
+		const unsigned int found = tree.query( box, cursor, ids, std::min( maxCount - count, CHUNK_SIZE ) );
+		if( found == 0 )
+			break;
+
+		for( unsigned int i = 0; i < found; ++i, ++count )
+		{
+			lights[count] = rtc::Plugins::lights[ids[i]].get();
+			weights[count] = 1.0f;
+		}
+	}
+	return count;
+}
+
+// Get lights that may illuminate hit position of state, at most maxCount per call
+unsigned int rtsQueryLights( rts::RTstate& state, unsigned int& cursor, void** lights, float* weights, unsigned int maxCount )
+{
+	rtc::RayState& rs = _TO_RAY_STATE( state );
+
+	rtc::AABB point;
+	point.minv = rs.hitPosition;
+	point.maxv = rs.hitPosition;
+	return queryLights( point, rs.hitPosition, rs.random, cursor, lights, weights, maxCount );
+}
+
+// Get lights that may illuminate hit positions of rays of a packet state enabled in mask, at most maxCount per call
+unsigned int rtsQueryLightsPacket( rts::RTstate& state, const __m128 mask4[RT_PACKET_SIMD_SIZE], unsigned int& cursor,
+								   void** lights, float* weights, unsigned int maxCount )
+{
+	rtc::RayPacketState& rps = _TO_RAY_PACKET_STATE( state );
+
+	// Bounds of enabled hit positions
+	const float inf = rtu::mathf::MAX_VALUE;
+	rtc::AABB box;
+	box.minv.set( inf, inf, inf );
+	box.maxv.set( -inf, -inf, -inf );
+
+	for( unsigned int r = 0; r < RT_PACKET_SIZE; ++r )
+	{
+		if( !rtsRayEnabledPacket( mask4, r ) )
+			continue;
+
+		for( unsigned int c = 0; c < 3; ++c )
+		{
+			const float x = rps.hitPosition[r+c*RT_PACKET_SIZE];
+			box.minv[c] = std::min( box.minv[c], x );
+			box.maxv[c] = std::max( box.maxv[c], x );
+		}
+	}
+
+	if( box.minv.x > box.maxv.x )
+		return 0;
+
+	const rtu::float3 center = ( box.minv + box.maxv ) * 0.5f;
+	return queryLights( box, center, rps.random, cursor, lights, weights, maxCount );
+}
+
+// Each light draws its own random numbers and samples, and so does each pick of a light picked at random
+static void branchLight( rtu::CounterRandom& random, unsigned int& dimension, void* light, unsigned int pick )
+{
+	const unsigned int lightId = _TO_LIGHT_REF_PTR( light )->lightId();
+	random = random.branch( lightId );
+	dimension = branchDimension( dimension, lightId );
+
+	// Picks are stratified (see rtc::LightTree::sample), a light is returned once otherwise
+	if( rtc::Scene::lightSampleCount > 0 )
+	{
+		random = random.branch( pick );
+		dimension = branchDimension( dimension, pick );
+	}
+}
+
 // Compute given light's radiance contribution.
 // If light does not illuminates state, returns false. Else returns true.
-bool rtsIlluminate( rts::RTstate& state, void* light )
+bool rtsIlluminate( rts::RTstate& state, void* light, unsigned int pick )
 {
+	rtc::RayState& rs = _TO_RAY_STATE( state );
+	branchLight( rs.random, rs.sampleDimension, light, pick );
+
 	return _TO_LIGHT_REF_PTR( light )->illuminate( state );
 }
 
+// Compute given light's radiance contribution for rays of a packet light state enabled in mask.
+bool rtsIlluminatePacket( rts::RTstate& state, void* light, __m128 mask4[RT_PACKET_SIMD_SIZE], unsigned int pick )
+{
+	// Same random numbers and samples branch as rtsIlluminate
+	rtc::RayPacketState& rps = _TO_RAY_PACKET_STATE( state );
+	branchLight( rps.random, rps.sampleDimension, light, pick );
+
+	return _TO_LIGHT_REF_PTR( light )->illuminatePacket( state, mask4 );
+}
+
 // Compute given texture's color contribution.
 // Automatically uses pre-defined texture wrap modes, environment modes, filters, etc.
 void rtsApplyTexture( rts::RTstate& state, unsigned int textureId )
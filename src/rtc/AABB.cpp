@@ -3,10 +3,6 @@
 
 namespace rtc {
 
-// Reusable memory for triangle clipping
-static rtu::float3 s_vertexBuffer[8];
-static rtu::float3 s_tempBuffer[8];
-
 void AABB::buildFrom( const rtu::float3* vertices, unsigned int vertexCount )
 {
 	// Check degenerate box
@@ -75,21 +71,25 @@ void AABB::clipTriangle( AABB& result, const rtu::float3& v0, const rtu::float3&
 {
 	// TODO: Sutherland-Hodgman Clipping
 	// may optimize by reusing triangle aabb and checking if it needs to be updated (see arauna src)
-	// TODO: global variables will cause problems when code becomes multi-threaded / parallelized!!!
-	s_vertexBuffer[0] = v0;
-	s_vertexBuffer[1] = v1;
-	s_vertexBuffer[2] = v2;
+	// Clipping memory lives on the stack, so that several threads may clip triangles at the same time.
+	// Each of the 6 planes may add one vertex to the triangle (plus one temporary intersection point).
+	rtu::float3 vertexBuffer[16];
+	rtu::float3 tempBuffer[16];
+
+	vertexBuffer[0] = v0;
+	vertexBuffer[1] = v1;
+	vertexBuffer[2] = v2;
 
 	unsigned int vertexCount = 3;
 
-	clip( vertexCount, minv.x, 1.0f, 0 );
-	clip( vertexCount, minv.y, 1.0f, 1 );
-	clip( vertexCount, minv.z, 1.0f, 2 );
-	clip( vertexCount, maxv.x, -1.0f, 0 );
-	clip( vertexCount, maxv.y, -1.0f, 1 );
-	clip( vertexCount, maxv.z, -1.0f, 2 );
+	clip( vertexBuffer, tempBuffer, vertexCount, minv.x, 1.0f, 0 );
+	clip( vertexBuffer, tempBuffer, vertexCount, minv.y, 1.0f, 1 );
+	clip( vertexBuffer, tempBuffer, vertexCount, minv.z, 1.0f, 2 );
+	clip( vertexBuffer, tempBuffer, vertexCount, maxv.x, -1.0f, 0 );
+	clip( vertexBuffer, tempBuffer, vertexCount, maxv.y, -1.0f, 1 );
+	clip( vertexBuffer, tempBuffer, vertexCount, maxv.z, -1.0f, 2 );
 
-	result.buildFrom( s_vertexBuffer, vertexCount );
+	result.buildFrom( vertexBuffer, vertexCount );
 }
 
 void AABB::split( AABB& left, AABB& right, const SplitPlane& plane ) const
@@ -279,7 +279,7 @@ void AABB::computeVertices( rtu::float3* vertices ) const
 }
 
 // Private methods
-void AABB::clip( unsigned int& vertexCount, float pos, float dir, unsigned int dim ) const
+void AABB::clip( rtu::float3* vertices, rtu::float3* temp, unsigned int& vertexCount, float pos, float dir, unsigned int dim ) const
 {
 	bool allin = true;
 	bool allout = true;
@@ -287,7 +287,7 @@ void AABB::clip( unsigned int& vertexCount, float pos, float dir, unsigned int d
 	// Try to accept or reject all vertices
 	for( unsigned int i = 0; i < vertexCount; ++i )
 	{
-		float dist = dir * ( s_vertexBuffer[i][dim] - pos );
+		float dist = dir * ( vertices[i][dim] - pos );
 		if( dist < 0 )
 			allin = false;
 		else
@@ -305,20 +305,20 @@ void AABB::clip( unsigned int& vertexCount, float pos, float dir, unsigned int d
 	}
 
 	// Need to add each vertex and potential intersection points
-	rtu::float3 v1 = s_vertexBuffer[0];
+	rtu::float3 v1 = vertices[0];
 	float d1 = dir * ( v1[dim] - pos );
 	bool inside = ( d1 >= 0 );
 	unsigned int count = 0;
 
 	for( unsigned int i = 0; i < vertexCount; ++i )
 	{
-		const rtu::float3& v2 = s_vertexBuffer[(i + 1) % vertexCount];
+		const rtu::float3& v2 = vertices[(i + 1) % vertexCount];
 		float d2 = dir * ( v2[dim] - pos );
 
 		if( inside && ( d2 >= 0 ) ) 
 		{
 			// Previous and current are inside, add current (assume first has been added)
-			s_tempBuffer[count++] = v2;
+			temp[count++] = v2;
 		}
 		else if( !inside && ( d2 >= 0 ) )
 		{
@@ -326,8 +326,8 @@ void AABB::clip( unsigned int& vertexCount, float pos, float dir, unsigned int d
 			float d = d1 / (d1 - d2);
 			rtu::float3& vc = v1 + ( (v2 - v1) * d );
 			vc[dim] = pos;
-			s_tempBuffer[count++] = vc;
-			s_tempBuffer[count++] = v2;
+			temp[count++] = vc;
+			temp[count++] = v2;
 			inside = true;
 		}
 		else if( inside && ( d2 < 0 ) )
@@ -336,7 +336,7 @@ void AABB::clip( unsigned int& vertexCount, float pos, float dir, unsigned int d
 			float d = d2 / (d2 - d1);
 			rtu::float3& vc = v2 + ( (v1 - v2) * d );
 			vc[dim] = pos;
-			s_tempBuffer[count++] = vc;
+			temp[count++] = vc;
 			inside = false;
 		}
 		// Update previous vertex info
@@ -349,9 +349,9 @@ void AABB::clip( unsigned int& vertexCount, float pos, float dir, unsigned int d
 
 	for( unsigned int i = 0; i < count; i++ )
 	{
-		const rtu::float3& dist = s_tempBuffer[i] - s_tempBuffer[(i + count - 1) % count];
+		const rtu::float3& dist = temp[i] - temp[(i + count - 1) % count];
 		if( dist.length() > rtu::mathf::ZERO_TOLERANCE )
-			s_vertexBuffer[vertexCount++] = s_tempBuffer[i];
+			vertices[vertexCount++] = temp[i];
 	}
 }
 
@@ -56,7 +56,8 @@ struct AABB
 	rtu::float3 maxv;
 
 private:
-	void clip( unsigned int& vertexCount, float pos, float dir, unsigned int dim ) const;
+	// Clips polygon in vertices against one plane, using temp as scratch memory
+	void clip( rtu::float3* vertices, rtu::float3* temp, unsigned int& vertexCount, float pos, float dir, unsigned int dim ) const;
 };
 
 } // namespace rtc
@@ -0,0 +1,115 @@
+#include <rtc/Arena.h>
+#include <xmmintrin.h>
+
+namespace rtc {
+
+Arena::Arena( size_t blockSize )
+: _current( 0 ), _blockSize( blockSize )
+{
+	// empty
+}
+
+Arena::~Arena()
+{
+	release();
+}
+
+void* Arena::allocate( size_t bytes )
+{
+	bytes = ( bytes + ALIGNMENT - 1 ) & ~( (size_t)ALIGNMENT - 1 );
+
+	if( !_blocks.empty() )
+	{
+		// Fits in current block
+		Block& current = _blocks[_current];
+		if( current.used + bytes <= current.size )
+		{
+			void* memory = current.data + current.used;
+			current.used += bytes;
+			return memory;
+		}
+
+		// Reuse next block, previously freed by a rewind
+		if( ( _current + 1 < _blocks.size() ) && ( _blocks[_current + 1].size >= bytes ) )
+		{
+			Block& next = _blocks[++_current];
+			next.used = bytes;
+			return next.data;
+		}
+
+		// New block goes right after current one
+		++_current;
+	}
+
+	Block block;
+	block.size = ( bytes > _blockSize ) ? bytes : _blockSize;
+	block.data = static_cast<char*>( _mm_malloc( block.size, ALIGNMENT ) );
+	block.used = bytes;
+	_blocks.insert( _blocks.begin() + _current, block );
+
+	return block.data;
+}
+
+Arena::Mark Arena::mark() const
+{
+	Mark position;
+	position.block = _current;
+	position.used = _blocks.empty() ? 0 : _blocks[_current].used;
+	return position;
+}
+
+void Arena::rewind( const Mark& position )
+{
+	if( _blocks.empty() )
+		return;
+
+	// Keep blocks for reuse
+	for( unsigned int i = position.block + 1; i <= _current; ++i )
+	{
+		_blocks[i].used = 0;
+	}
+
+	_current = position.block;
+	_blocks[_current].used = position.used;
+}
+
+void Arena::merge( Arena& other )
+{
+	if( other._blocks.empty() )
+		return;
+
+	// Free unused blocks of other arena
+	const unsigned int usedCount = other._current + 1;
+	for( unsigned int i = usedCount; i < other._blocks.size(); ++i )
+	{
+		_mm_free( other._blocks[i].data );
+	}
+
+	// Used blocks go before our current block, so that free blocks remain after it
+	if( _blocks.empty() )
+	{
+		_blocks.assign( other._blocks.begin(), other._blocks.begin() + usedCount );
+		_current = usedCount - 1;
+	}
+	else
+	{
+		_blocks.insert( _blocks.begin() + _current, other._blocks.begin(), other._blocks.begin() + usedCount );
+		_current += usedCount;
+	}
+
+	other._blocks.clear();
+	other._current = 0;
+}
+
+void Arena::release()
+{
+	for( unsigned int i = 0; i < _blocks.size(); ++i )
+	{
+		_mm_free( _blocks[i].data );
+	}
+
+	_blocks.clear();
+	_current = 0;
+}
+
+} // namespace rtc
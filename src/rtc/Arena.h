@@ -0,0 +1,72 @@
+#pragma once
+#ifndef _RTC_ARENA_H_
+#define _RTC_ARENA_H_
+
+#include <rtu/common.h>
+#include <vector>
+
+namespace rtc {
+
+/*
+ *	Linear allocator: memory is taken from large blocks and is only released all at once.
+ *	Also supports stack-like usage for temporary data (see mark/rewind).
+ *	Blocks before and including the current one are in use, blocks after it are free for reuse.
+ *	Not thread-safe: use one arena per thread and merge them afterwards.
+ */
+class Arena
+{
+public:
+	static const unsigned int ALIGNMENT = 16;
+	static const unsigned int DEFAULT_BLOCK_SIZE = 1 << 20;
+
+	struct Mark
+	{
+		unsigned int block;
+		size_t used;
+	};
+
+	Arena( size_t blockSize = DEFAULT_BLOCK_SIZE );
+	~Arena();
+
+	// Returns ALIGNMENT-aligned memory, valid until released or rewound
+	void* allocate( size_t bytes );
+
+	template<typename T>
+	inline T* allocate( size_t count );
+
+	// Save current position, and later release everything allocated after it
+	Mark mark() const;
+	void rewind( const Mark& position );
+
+	// Take ownership of all memory allocated in other arena (which becomes empty)
+	void merge( Arena& other );
+
+	// Free all memory
+	void release();
+
+private:
+	// forbid copies
+	Arena( const Arena& );
+	Arena& operator=( const Arena& );
+
+	struct Block
+	{
+		char* data;
+		size_t size;
+		size_t used;
+	};
+
+	std::vector<Block> _blocks;
+	unsigned int _current;
+	size_t _blockSize;
+};
+
+template<typename T>
+inline T* Arena::allocate( size_t count )
+{
+	return static_cast<T*>( allocate( count * sizeof( T ) ) );
+}
+
+} // namespace rtc
+
+#endif // _RTC_ARENA_H_
@@ -0,0 +1,158 @@
+#pragma once
+#ifndef _RTC_ARRAY_H_
+#define _RTC_ARRAY_H_
+
+#include <rtu/common.h>
+#include <algorithm>
+
+namespace rtc {
+
+// Growing array, like std::vector, allocated with new [] so that its data can be taken over
+// by structures freed with delete [] (see KdTree) instead of being copied
+template<typename T>
+class Array
+{
+public:
+	inline Array();
+	inline Array( const Array<T>& other );
+	inline ~Array();
+
+	inline Array<T>& operator=( const Array<T>& other );
+
+	inline unsigned int size() const;
+	inline T& operator[]( unsigned int i );
+	inline const T& operator[]( unsigned int i ) const;
+
+	// Capacity grows by half when needed
+	inline void resize( unsigned int size );
+	inline void append( const T* values, unsigned int count );
+
+	// Exact capacity, no further growth until size exceeds it
+	inline void reserve( unsigned int capacity );
+
+	inline void swap( Array<T>& other );
+	inline void freeMemory();
+
+	// Caller owns returned data (allocated with new []), array is left empty
+	inline T* release();
+
+private:
+	inline void grow( unsigned int size );
+
+	T* _data;
+	unsigned int _size;
+	unsigned int _capacity;
+};
+
+template<typename T>
+Array<T>::Array()
+: _data( NULL ), _size( 0 ), _capacity( 0 )
+{
+}
+
+template<typename T>
+Array<T>::Array( const Array<T>& other )
+: _data( NULL ), _size( 0 ), _capacity( 0 )
+{
+	append( other._data, other._size );
+}
+
+template<typename T>
+Array<T>::~Array()
+{
+	freeMemory();
+}
+
+template<typename T>
+Array<T>& Array<T>::operator=( const Array<T>& other )
+{
+	Array<T> copy( other );
+	swap( copy );
+	return *this;
+}
+
+template<typename T>
+unsigned int Array<T>::size() const
+{
+	return _size;
+}
+
+template<typename T>
+T& Array<T>::operator[]( unsigned int i )
+{
+	return _data[i];
+}
+
+template<typename T>
+const T& Array<T>::operator[]( unsigned int i ) const
+{
+	return _data[i];
+}
+
+template<typename T>
+void Array<T>::resize( unsigned int size )
+{
+	grow( size );
+	_size = size;
+}
+
+template<typename T>
+void Array<T>::append( const T* values, unsigned int count )
+{
+	grow( _size + count );
+	std::copy( values, values + count, _data + _size );
+	_size += count;
+}
+
+template<typename T>
+void Array<T>::reserve( unsigned int capacity )
+{
+	if( capacity <= _capacity )
+		return;
+
+	T* data = new T[capacity];
+	std::copy( _data, _data + _size, data );
+	if( _data != NULL )
+		delete [] _data;
+	_data = data;
+	_capacity = capacity;
+}
+
+template<typename T>
+void Array<T>::swap( Array<T>& other )
+{
+	std::swap( _data, other._data );
+	std::swap( _size, other._size );
+	std::swap( _capacity, other._capacity );
+}
+
+template<typename T>
+void Array<T>::freeMemory()
+{
+	if( _data != NULL )
+		delete [] _data;
+	_data = NULL;
+	_size = 0;
+	_capacity = 0;
+}
+
+template<typename T>
+T* Array<T>::release()
+{
+	T* data = _data;
+	_data = NULL;
+	_size = 0;
+	_capacity = 0;
+	return data;
+}
+
+template<typename T>
+void Array<T>::grow( unsigned int size )
+{
+	if( size > _capacity )
+		reserve( std::max( size, _capacity + _capacity / 2 ) );
+}
+
+} // namespace rtc
+
+#endif // _RTC_ARRAY_H_
@@ -0,0 +1,64 @@
+#include <rtc/Bvh4.h>
+#include <xmmintrin.h>
+
+namespace rtc {
+
+void Bvh4Node::setEmptyChild( unsigned int c )
+{
+	// Inverted box, never hit by any ray
+	for( unsigned int a = 0; a < 3; ++a )
+	{
+		bounds[a*2][c] = rtu::mathf::MAX_VALUE;
+		bounds[a*2+1][c] = -rtu::mathf::MAX_VALUE;
+	}
+
+	// Empty leaf
+	children[c] = 0x80000000;
+}
+
+void Bvh4Node::setChild( unsigned int c, const AABB& box, unsigned int nodeIndex )
+{
+	for( unsigned int a = 0; a < 3; ++a )
+	{
+		bounds[a*2][c] = box.minv[a];
+		bounds[a*2+1][c] = box.maxv[a];
+	}
+
+	children[c] = nodeIndex & 0x7FFFFFFF;
+}
+
+void Bvh4Node::setLeafChild( unsigned int c, const AABB& box, unsigned int elementStart, unsigned int elementCount )
+{
+	for( unsigned int a = 0; a < 3; ++a )
+	{
+		bounds[a*2][c] = box.minv[a];
+		bounds[a*2+1][c] = box.maxv[a];
+	}
+
+	children[c] = 0x80000000 | ( elementCount << 27 ) | ( elementStart & 0x07FFFFFF );
+}
+
+void Bvh4Node::setLeafStart( unsigned int c, unsigned int elementStart )
+{
+	children[c] = ( children[c] & 0xF8000000 ) | ( elementStart & 0x07FFFFFF );
+}
+
+Bvh4::Bvh4()
+: nodes( NULL ), nodeCount( 0 ), elements( NULL )
+{
+}
+
+void Bvh4::erase()
+{
+	if( nodes != NULL )
+		_mm_free( nodes );
+	if( elements != NULL )
+		delete [] elements;
+
+	// Tree may be rebuilt later (see rtNewGeometry)
+	nodes = NULL;
+	nodeCount = 0;
+	elements = NULL;
+}
+
+} // namespace rtc
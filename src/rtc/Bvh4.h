@@ -0,0 +1,85 @@
+#pragma once
+#ifndef _RTC_BVH4_H_
+#define _RTC_BVH4_H_
+
+#include <rtu/common.h>
+#include <rtu/sse.h>
+#include <rtc/AABB.h>
+
+namespace rtc {
+
+/*
+ *	Bounding volume hierarchy with 4 children per node (QBVH).
+ *	The 4 child boxes are stored as a structure of arrays, so that a ray is tested against all of them at once with SSE.
+ */
+struct Bvh4Node
+{
+	static const unsigned int MAX_LEAF_SIZE = 15;
+
+	void setEmptyChild( unsigned int c );
+	void setChild( unsigned int c, const AABB& box, unsigned int nodeIndex );
+	void setLeafChild( unsigned int c, const AABB& box, unsigned int elementStart, unsigned int elementCount );
+	// Moves elements of leaf child c, keeping its box and element count
+	void setLeafStart( unsigned int c, unsigned int elementStart );
+
+	// Decode child references stored in children array
+	static inline unsigned int isLeaf( unsigned int child );
+	static inline unsigned int nodeIndex( unsigned int child );
+	static inline unsigned int elemStart( unsigned int child );
+	static inline unsigned int elemCount( unsigned int child );
+
+	// Child boxes: xmin, xmax, ymin, ymax, zmin, zmax (same layout used to clip ray packets)
+	union { float bounds[6][4]; __m128 bounds4[6]; };
+
+	//--- If internal child ---
+	// bits 0..30 : index of child node
+	// bit 31 : 0
+	//--- If leaf child ---
+	// bits 0..26 : offset to start of elements
+	// bits 27..30 : number of elements stored in leaf
+	// bit 31 : 1
+	unsigned int children[4];
+};
+
+inline unsigned int Bvh4Node::isLeaf( unsigned int child )
+{
+	return ( child & 0x80000000 );
+}
+
+inline unsigned int Bvh4Node::nodeIndex( unsigned int child )
+{
+	return child;
+}
+
+inline unsigned int Bvh4Node::elemStart( unsigned int child )
+{
+	return ( child & 0x07FFFFFF );
+}
+
+inline unsigned int Bvh4Node::elemCount( unsigned int child )
+{
+	return ( ( child >> 27 ) & 0xF );
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+struct Bvh4
+{
+	// Maximum depth of trees built by Bvh4Builder
+	static const unsigned int MAX_DEPTH = 64;
+
+	Bvh4();
+	// No destructor, same as KdTree (geometries are shallow copied when their vector is resized)
+
+	void erase();
+
+	AABB bbox;
+	// Root is nodes[0]. Nodes are 16-byte aligned.
+	Bvh4Node* nodes;
+	unsigned int nodeCount;
+	unsigned int* elements;
+};
+
+} // namespace rtc
+
+#endif // _RTC_BVH4_H_
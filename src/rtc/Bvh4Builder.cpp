@@ -0,0 +1,267 @@
+#include <rtc/Bvh4Builder.h>
+#include <rtu/stl.h>
+#include <xmmintrin.h>
+#include <algorithm>
+#include <cstring>
+
+namespace rtc {
+
+Bvh4Builder::Bvh4Builder()
+: _geometry( NULL ), _result( NULL )
+{
+}
+
+void Bvh4Builder::buildTree( Bvh4& result, const Geometry* geometry )
+{
+	RTU_STATIC_CHECK( LEAF_SIZE <= Bvh4Node::MAX_LEAF_SIZE, leaf_size_must_fit_in_child_reference );
+
+	_geometry = geometry;
+	_result = &result;
+
+	const unsigned int triangleCount = _geometry->triDesc.size();
+	const std::vector<rtu::float3>& vertices = _geometry->vertices;
+
+	// Free previous tree before building the new one
+	result.erase();
+
+	// Triangle boxes and centroids
+	_boxes.resize( triangleCount );
+	_centroids.resize( triangleCount );
+	_ids.resize( triangleCount );
+
+	Range root;
+	root.begin = 0;
+	root.end = triangleCount;
+
+	for( unsigned int t = 0; t < triangleCount; ++t )
+	{
+		const TriDesc& triDesc = _geometry->triDesc[t];
+		AABB& box = _boxes[t];
+		box.buildFrom( &vertices[triDesc.v0], 1 );
+		box.expandBy( &vertices[triDesc.v1], 1 );
+		box.expandBy( &vertices[triDesc.v2], 1 );
+
+		_centroids[t] = ( box.minv + box.maxv ) * 0.5f;
+		_ids[t] = t;
+	}
+
+	// Internal nodes have at least two children, so there are fewer of them than triangles
+	result.nodes = static_cast<Bvh4Node*>( _mm_malloc( ( triangleCount + 1 ) * sizeof( Bvh4Node ), 16 ) );
+	result.nodeCount = 1;
+
+	if( triangleCount == 0 )
+	{
+		result.bbox.minv.set( 0.0f, 0.0f, 0.0f );
+		result.bbox.maxv.set( 0.0f, 0.0f, 0.0f );
+		for( unsigned int c = 0; c < 4; ++c )
+		{
+			result.nodes[0].setEmptyChild( c );
+		}
+	}
+	else
+	{
+		computeBoxes( root );
+		result.bbox = root.box;
+		buildNode( 0, root, 1 );
+	}
+
+	// Shrink node array to its actual size
+	Bvh4Node* nodes = static_cast<Bvh4Node*>( _mm_malloc( result.nodeCount * sizeof( Bvh4Node ), 16 ) );
+	memcpy( nodes, result.nodes, result.nodeCount * sizeof( Bvh4Node ) );
+	_mm_free( result.nodes );
+	result.nodes = nodes;
+
+	// Leaves point to ranges of the sorted id list
+	result.elements = new unsigned int[triangleCount];
+	std::copy( _ids.begin(), _ids.end(), result.elements );
+
+	rtu::vectorFreeMemory( _boxes );
+	rtu::vectorFreeMemory( _centroids );
+	rtu::vectorFreeMemory( _ids );
+}
+
+void Bvh4Builder::buildNode( unsigned int nodeIndex, const Range& range, unsigned int treeDepth )
+{
+	const bool useSah = ( treeDepth <= MAX_SAH_DEPTH );
+
+	// Keep splitting the largest child until we have 4 of them
+	Range children[4];
+	unsigned int childCount = 1;
+	children[0] = range;
+
+	while( childCount < 4 )
+	{
+		int largest = -1;
+		float largestArea = -1.0f;
+		for( unsigned int c = 0; c < childCount; ++c )
+		{
+			if( children[c].size() <= LEAF_SIZE )
+				continue;
+
+			const float area = children[c].box.surfaceArea();
+			if( area > largestArea )
+			{
+				largestArea = area;
+				largest = c;
+			}
+		}
+
+		if( largest < 0 )
+			break;
+
+		Range left;
+		Range right;
+		split( children[largest], left, right, useSah );
+		children[largest] = left;
+		children[childCount++] = right;
+	}
+
+	// Reserve child nodes first, so that recursion can't move the node we are writing
+	unsigned int childNodes[4];
+	for( unsigned int c = 0; c < childCount; ++c )
+	{
+		if( children[c].size() > LEAF_SIZE )
+			childNodes[c] = _result->nodeCount++;
+	}
+
+	Bvh4Node& node = _result->nodes[nodeIndex];
+	for( unsigned int c = 0; c < 4; ++c )
+	{
+		if( c >= childCount )
+			node.setEmptyChild( c );
+		else if( children[c].size() <= LEAF_SIZE )
+			node.setLeafChild( c, children[c].box, children[c].begin, children[c].size() );
+		else
+			node.setChild( c, children[c].box, childNodes[c] );
+	}
+
+	for( unsigned int c = 0; c < childCount; ++c )
+	{
+		if( children[c].size() > LEAF_SIZE )
+			buildNode( childNodes[c], children[c], treeDepth + 1 );
+	}
+}
+
+void Bvh4Builder::split( const Range& range, Range& left, Range& right, bool useSah )
+{
+	unsigned int* const ids = &_ids[0];
+	unsigned int middle;
+
+	unsigned int axis;
+	unsigned int bin;
+	if( useSah && findSplitBinned( range, axis, bin ) )
+	{
+		// Same bin computation as findSplitBinned
+		const float minPos = range.centroidBox.minv[axis];
+		const float scale = ( BIN_COUNT * 0.99999f ) / ( range.centroidBox.maxv[axis] - minPos );
+
+		unsigned int* const middlePtr = std::partition( ids + range.begin, ids + range.end,
+			                                            BinPredicate( &_centroids[0], axis, minPos, scale, bin ) );
+		middle = middlePtr - ids;
+	}
+	else
+	{
+		// Object median along largest centroid extent. Always gives two non-empty halves.
+		const rtu::float3 extent = range.centroidBox.maxv - range.centroidBox.minv;
+		axis = ( extent.x > extent.y ) ? ( ( extent.x > extent.z ) ? 0 : 2 ) : ( ( extent.y > extent.z ) ? 1 : 2 );
+		middle = ( range.begin + range.end ) / 2;
+
+		std::nth_element( ids + range.begin, ids + middle, ids + range.end,
+			              CentroidOrder( &_centroids[0], axis ) );
+	}
+
+	left.begin = range.begin;
+	left.end = middle;
+	right.begin = middle;
+	right.end = range.end;
+	computeBoxes( left );
+	computeBoxes( right );
+}
+
+bool Bvh4Builder::findSplitBinned( const Range& range, unsigned int& axis, unsigned int& bin )
+{
+	float bestCost = rtu::mathf::MAX_VALUE;
+
+	for( unsigned int a = 0; a < 3; ++a )
+	{
+		const float minPos = range.centroidBox.minv[a];
+		const float extent = range.centroidBox.maxv[a] - minPos;
+		if( extent <= 0.0f )
+			continue;
+
+		const float scale = ( BIN_COUNT * 0.99999f ) / extent;
+
+		// Fill bins
+		std::fill_n( _binCounts, BIN_COUNT, 0 );
+		for( unsigned int i = range.begin; i < range.end; ++i )
+		{
+			const unsigned int t = _ids[i];
+			const unsigned int b = static_cast<unsigned int>( ( _centroids[t][a] - minPos ) * scale );
+
+			if( _binCounts[b]++ == 0 )
+				_binBoxes[b] = _boxes[t];
+			else
+				_binBoxes[b].expandBy( _boxes[t] );
+		}
+
+		// Sweep from right to left, storing cost of right side of each bin border
+		AABB box;
+		unsigned int count = 0;
+		for( unsigned int b = BIN_COUNT - 1; b > 0; --b )
+		{
+			if( _binCounts[b] > 0 )
+			{
+				if( count == 0 )
+					box = _binBoxes[b];
+				else
+					box.expandBy( _binBoxes[b] );
+				count += _binCounts[b];
+			}
+			_rightCosts[b] = ( count > 0 ) ? box.surfaceArea() * count : -1.0f;
+		}
+
+		// Sweep from left to right, evaluating SAH at each border with triangles on both sides
+		count = 0;
+		for( unsigned int b = 1; b < BIN_COUNT; ++b )
+		{
+			if( _binCounts[b - 1] > 0 )
+			{
+				if( count == 0 )
+					box = _binBoxes[b - 1];
+				else
+					box.expandBy( _binBoxes[b - 1] );
+				count += _binCounts[b - 1];
+			}
+
+			if( ( count == 0 ) || ( _rightCosts[b] < 0.0f ) )
+				continue;
+
+			const float cost = box.surfaceArea() * count + _rightCosts[b];
+			if( cost < bestCost )
+			{
+				bestCost = cost;
+				axis = a;
+				bin = b;
+			}
+		}
+	}
+
+	// No valid border if all centroids fall in the same bin
+	return ( bestCost < rtu::mathf::MAX_VALUE );
+}
+
+void Bvh4Builder::computeBoxes( Range& range )
+{
+	const unsigned int first = _ids[range.begin];
+	range.box = _boxes[first];
+	range.centroidBox.buildFrom( &_centroids[first], 1 );
+
+	for( unsigned int i = range.begin + 1; i < range.end; ++i )
+	{
+		const unsigned int t = _ids[i];
+		range.box.expandBy( _boxes[t] );
+		range.centroidBox.expandBy( &_centroids[t], 1 );
+	}
+}
+
+} // namespace rtc
@@ -0,0 +1,117 @@
+#pragma once
+#ifndef _RTC_BVH4BUILDER_H_
+#define _RTC_BVH4BUILDER_H_
+
+#include <rtu/common.h>
+#include <rtc/Bvh4.h>
+#include <rtc/Geometry.h>
+#include <vector>
+
+namespace rtc {
+
+/*
+ *	Builds a Bvh4 over the triangles of a geometry.
+ *	Binary splits are found with binned SAH over triangle centroids, and each node collapses up to 3 of them
+ *	(always splitting the child with largest area) to get its 4 children.
+ *	Much faster to build than a SAH kd-tree, since triangles are never clipped nor duplicated.
+ */
+class Bvh4Builder
+{
+public:
+	static const unsigned int BIN_COUNT = 16;
+	// Triangles per leaf
+	static const unsigned int LEAF_SIZE = 4;
+	// Deeper than this, use object median splits only, which at least halve triangle count at each level.
+	// Keeps trees within Bvh4::MAX_DEPTH (at most 2^27 triangles, see Bvh4Node).
+	static const unsigned int MAX_SAH_DEPTH = 32;
+
+	Bvh4Builder();
+
+	void buildTree( Bvh4& result, const Geometry* geometry );
+
+private:
+	// Triangles in _ids[begin..end)
+	struct Range
+	{
+		inline unsigned int size() const;
+
+		unsigned int begin;
+		unsigned int end;
+		AABB box;
+		AABB centroidBox;
+	};
+
+	// True if triangle centroid falls in a bin before given one
+	struct BinPredicate
+	{
+		inline BinPredicate( const rtu::float3* centroids, unsigned int axis, float minPos, float scale, unsigned int bin );
+		inline bool operator()( unsigned int t ) const;
+
+		const rtu::float3* centroids;
+		unsigned int axis;
+		float minPos;
+		float scale;
+		unsigned int bin;
+	};
+
+	struct CentroidOrder
+	{
+		inline CentroidOrder( const rtu::float3* centroids, unsigned int axis );
+		inline bool operator()( unsigned int first, unsigned int second ) const;
+
+		const rtu::float3* centroids;
+		unsigned int axis;
+	};
+
+	void buildNode( unsigned int nodeIndex, const Range& range, unsigned int treeDepth );
+
+	// Split range in two non-empty halves
+	void split( const Range& range, Range& left, Range& right, bool useSah );
+	bool findSplitBinned( const Range& range, unsigned int& axis, unsigned int& bin );
+	void computeBoxes( Range& range );
+
+	const Geometry* _geometry;
+	Bvh4* _result;
+
+	// Per triangle data
+	std::vector<AABB> _boxes;
+	std::vector<rtu::float3> _centroids;
+	std::vector<unsigned int> _ids;
+
+	// Binned SAH scratch memory
+	unsigned int _binCounts[BIN_COUNT];
+	AABB _binBoxes[BIN_COUNT];
+	float _rightCosts[BIN_COUNT];
+};
+
+inline unsigned int Bvh4Builder::Range::size() const
+{
+	return end - begin;
+}
+
+inline Bvh4Builder::BinPredicate::BinPredicate( const rtu::float3* centroids, unsigned int axis, float minPos, float scale,
+												unsigned int bin )
+: centroids( centroids ), axis( axis ), minPos( minPos ), scale( scale ), bin( bin )
+{
+	// empty
+}
+
+inline bool Bvh4Builder::BinPredicate::operator()( unsigned int t ) const
+{
+	return static_cast<unsigned int>( ( centroids[t][axis] - minPos ) * scale ) < bin;
+}
+
+inline Bvh4Builder::CentroidOrder::CentroidOrder( const rtu::float3* centroids, unsigned int axis )
+: centroids( centroids ), axis( axis )
+{
+	// empty
+}
+
+inline bool Bvh4Builder::CentroidOrder::operator()( unsigned int first, unsigned int second ) const
+{
+	return centroids[first][axis] < centroids[second][axis];
+}
+
+} // namespace rtc
+
+#endif // _RTC_BVH4BUILDER_H_
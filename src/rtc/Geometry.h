@@ -4,15 +4,30 @@
 
 #include <rtu/common.h>
 #include <rtc/KdTree.h>
+#include <rtc/Bvh4.h>
 #include <rtc/Triangle.h>
+#include <rtc/LeafTriangles.h>
+#include <rt/definitions.h>
 #include <vector>
 
 namespace rtc {
 
 struct Geometry
 {
+	inline Geometry();
+
+	// Bounding box of all triangles, from the acceleration structure in use
+	inline const AABB& bbox() const;
+
+	// RT_ACCEL_KDTREE or RT_ACCEL_BVH4, only the corresponding tree is built
+	unsigned int accelStructure;
+	// Whether ray packets read leaf ordered triangle copies instead of looking them up by id (see LeafTriangles)
+	bool leafOrdered;
 	KdTree kdTree;
+	Bvh4 bvh;
 	std::vector<TriAccel> triAccel;
+	// Copies of triAccel in leaf order of the tree in use
+	LeafTriangles leafTriangles;
 	std::vector<TriDesc>  triDesc;
 	std::vector<rtu::float3> vertices;
 	std::vector<rtu::float3> normals;
@@ -20,6 +35,17 @@ struct Geometry
 	std::vector<rtu::float3> texCoords;
 };
 
+inline Geometry::Geometry()
+: accelStructure( RT_ACCEL_KDTREE ), leafOrdered( true )
+{
+	// empty
+}
+
+inline const AABB& Geometry::bbox() const
+{
+	return ( accelStructure == RT_ACCEL_BVH4 ) ? bvh.bbox : kdTree.bbox;
+}
+
 } // namespace rtc
 
 #endif // _RTC_GEOMETRY_H_
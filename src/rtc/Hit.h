@@ -26,8 +26,9 @@ struct HitPacket
 	union { float v1c[RT_PACKET_SIZE]; __m128 v1c4[RT_PACKET_SIMD_SIZE]; };
 	union { float v2c[RT_PACKET_SIZE]; __m128 v2c4[RT_PACKET_SIMD_SIZE]; };
 	union { float dist[RT_PACKET_SIZE]; __m128 dist4[RT_PACKET_SIMD_SIZE]; };
-	union { const Instance* inst[RT_PACKET_SIZE]; __m128i inst4[RT_PACKET_SIMD_SIZE]; __m128 finst4[RT_PACKET_SIMD_SIZE]; };
-	union { const Geometry* geom[RT_PACKET_SIZE]; __m128i geom4[RT_PACKET_SIMD_SIZE]; __m128 fgeom4[RT_PACKET_SIMD_SIZE]; };
+	// Pointers are written one ray at a time, they don't fit in 4 lanes on 64-bit platforms
+	const Instance* inst[RT_PACKET_SIZE];
+	const Geometry* geom[RT_PACKET_SIZE];
 };
 
 } // namespace rtc
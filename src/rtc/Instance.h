@@ -10,6 +10,11 @@ namespace rtc {
 
 struct Instance
 {
+	// Geometry id of instances not instantiated yet (see rtInstantiate)
+	static const unsigned int INVALID_GEOMETRY = 0xFFFFFFFF;
+
+	Instance() : geometryId( INVALID_GEOMETRY ) {;}
+
 	unsigned int geometryId;
 	Transform    transform;
 	AABB	     bbox;
@@ -1,9 +1,30 @@
 #include <rtc/InstanceTreeBuilder.h>
-#include <rtu/stl.h>
+#include <rt/definitions.h>
+#include <cstring>
 
 namespace rtc {
 
-RawKdTree* InstanceTreeBuilder::buildTree( const std::vector<Instance>& instances )
+// Updated trees are rebuilt once they grow this much larger than when they were built
+static const float MAX_UPDATE_GROWTH = 2.0f;
+
+// Leaves that get new instances in updates are only split again once they hold more instances than this.
+// A few more instances in a leaf cost less than building a new subtree in every frame they move.
+static const unsigned int MAX_UPDATED_LEAF_SIZE = 4;
+
+// Binned SAH parameters. Intersecting an instance means traversing a whole geometry kd-tree,
+// so it is much more costly than traversing a node.
+static const unsigned int BIN_COUNT = 32;
+static const float TRAVERSAL_COST = 1.0f;
+static const float INTERSECTION_COST = 8.0f;
+
+InstanceTreeBuilder::InstanceTreeBuilder()
+: _builtInstanceCount( 0 ), _builtNodeCount( 0 ), _builtElemIdCount( 0 ), _unusedElemIdCount( 0 ),
+  _treeChanged( false )
+{
+	// empty
+}
+
+RawKdTree* InstanceTreeBuilder::buildTree( const std::vector<Instance>& instances, unsigned int buildMode )
 {
 	// Create instance vector for entire scene
 	unsigned int instanceCount = instances.size();
@@ -11,12 +32,15 @@ RawKdTree* InstanceTreeBuilder::buildTree( const std::vector<Instance>& instance
 	if( instanceCount == 0 )
 		return new RawKdTree();
 
-	RawKdNode::Elements initialInstances( instanceCount );
 	_instances = &instances;
+	_buildMode = buildMode;
 
 	RawKdTree* tree = new RawKdTree();
 	_stats = &tree->stats;
 	_stats->reset();
+	_nodes = &tree->arena;
+
+	RawKdNode::Elements initialInstances( _scratch.allocate<unsigned int>( instanceCount ), instanceCount );
 
 	AABB& sceneBox = tree->bbox;
 	sceneBox = instances[0].bbox;
@@ -30,12 +54,75 @@ RawKdTree* InstanceTreeBuilder::buildTree( const std::vector<Instance>& instance
 	}
 
 	// Recursive tree build
-	tree->root = recursiveBuild( initialInstances, tree->bbox, 0 );
+	tree->root = buildSubtree( initialInstances, tree->bbox, 0 );
+	_scratch.release();
+
+	_builtInstanceCount = instanceCount;
+	_builtNodeCount = _stats->nodeCount;
+	_builtElemIdCount = _stats->elemIdCount;
+	_unusedElemIdCount = 0;
+
+	_treeBoxes.resize( instanceCount );
+	for( unsigned int i = 0; i < instanceCount; ++i )
+		_treeBoxes[i] = instances[i].bbox;
+
 	return tree;
 }
 
+bool InstanceTreeBuilder::updateTree( RawKdTree* tree, const std::vector<Instance>& instances, const std::vector<unsigned int>& movedInstances )
+{
+	const unsigned int instanceCount = instances.size();
+
+	// Tree was built for other instances
+	if( ( tree->root == NULL ) || ( instanceCount != _builtInstanceCount ) )
+		return false;
+
+	_instances = &instances;
+	_stats = &tree->stats;
+	_nodes = &tree->arena;
+
+	// Flag moved instances, skipping repeated ids
+	_moved.assign( instanceCount, false );
+	_inserted.assign( instanceCount, false );
+	_treeChanged = false;
+	RawKdNode::Elements moved( _scratch.allocate<unsigned int>( movedInstances.size() ), 0 );
+
+	for( unsigned int i = 0, size = movedInstances.size(); i < size; ++i )
+	{
+		const unsigned int instanceId = movedInstances[i];
+		if( ( instanceId >= instanceCount ) || _moved[instanceId] )
+			continue;
+
+		_moved[instanceId] = true;
+		moved[moved.count++] = instanceId;
+
+		// Scene box may only grow, leaves on its border grow with it
+		tree->bbox.expandBy( instances[instanceId].bbox );
+	}
+
+	updateNode( tree->root, moved, moved, tree->bbox, 0 );
+
+	for( unsigned int i = 0, size = moved.size(); i < size; ++i )
+		_treeBoxes[moved[i]] = instances[moved[i]].bbox;
+	_scratch.release();
+
+	// Moved instances leave behind split planes that no longer fit the scene, and leaves that reference them more
+	// than once. Rebuild when that made the tree too large, or when too much arena memory is no longer used.
+	return ( _stats->nodeCount <= MAX_UPDATE_GROWTH * _builtNodeCount ) &&
+		   ( _stats->elemIdCount <= MAX_UPDATE_GROWTH * _builtElemIdCount ) &&
+		   ( _unusedElemIdCount <= _builtElemIdCount );
+}
+
 // Private methods
 
+RawKdNode* InstanceTreeBuilder::buildSubtree( const RawKdNode::Elements& instances, const AABB& bbox, unsigned int treeDepth )
+{
+	if( _buildMode == RT_BUILD_SAH_BINNED )
+		return recursiveBuildBinned( instances, bbox, treeDepth );
+	else
+		return recursiveBuild( instances, bbox, treeDepth );
+}
+
 RawKdNode* InstanceTreeBuilder::recursiveBuild( const RawKdNode::Elements& instances, const AABB& bbox, unsigned int treeDepth )
 {
 	++_stats->nodeCount;
@@ -73,6 +160,7 @@ RawKdNode* InstanceTreeBuilder::recursiveBuild( const RawKdNode::Elements& insta
 	center *= 0.5f;
 
 	// Child elements, if any
+	const Arena::Mark scratchMark = _scratch.mark();
 	RawKdNode::Elements leftInstances;
 	RawKdNode::Elements rightInstances;
 
@@ -80,8 +168,11 @@ RawKdNode* InstanceTreeBuilder::recursiveBuild( const RawKdNode::Elements& insta
 	for( unsigned int k = 0; k < 3; ++k )
 	{
 		axis = orderedAxis[k];
-		leftInstances.clear();
-		rightInstances.clear();
+
+		// Discard lists of previous axis, children never hold more instances than their parent
+		_scratch.rewind( scratchMark );
+		leftInstances = RawKdNode::Elements( _scratch.allocate<unsigned int>( currentInstanceCount ), 0 );
+		rightInstances = RawKdNode::Elements( _scratch.allocate<unsigned int>( currentInstanceCount ), 0 );
 
 		// Get "best" split position: closest object border to center of bbox
 		for( unsigned int i = 0; i < currentInstanceCount; ++i )
@@ -161,18 +252,18 @@ RawKdNode* InstanceTreeBuilder::recursiveBuild( const RawKdNode::Elements& insta
 			if( ( currentBox.minv[axis] <= plane.position ) && ( currentBox.maxv[axis] <= plane.position ) )
 			{
 				// Completely on left side
-				leftInstances.push_back( instanceId );
+				leftInstances[leftInstances.count++] = instanceId;
 			}
 			else if( ( currentBox.minv[axis] >= plane.position ) && ( currentBox.maxv[axis] >= plane.position ) )
 			{
 				// Completely on right side
-				rightInstances.push_back( instanceId );
+				rightInstances[rightInstances.count++] = instanceId;
 			}
 			else
 			{
 				// On both sides
-				leftInstances.push_back( instanceId );
-				rightInstances.push_back( instanceId );
+				leftInstances[leftInstances.count++] = instanceId;
+				rightInstances[rightInstances.count++] = instanceId;
 			}
 		}
 
@@ -188,17 +279,176 @@ RawKdNode* InstanceTreeBuilder::recursiveBuild( const RawKdNode::Elements& insta
 
 		// Recursive tree build for both children
 		RawKdNode* left  = recursiveBuild( leftInstances, leftBox, treeDepth + 1 );
-		rtu::vectorFreeMemory( leftInstances );
 		RawKdNode* right = recursiveBuild( rightInstances, rightBox, treeDepth + 1 );
-		rtu::vectorFreeMemory( rightInstances );
+		_scratch.rewind( scratchMark );
 
-		return new RawKdNode( plane, left, right );
+		return RawKdNode::create( *_nodes, plane, left, right );
 	}
 
 	// No valid split plane could be found
+	_scratch.rewind( scratchMark );
 	return leafNode( instances, treeDepth );
 }
 
+RawKdNode* InstanceTreeBuilder::recursiveBuildBinned( const RawKdNode::Elements& instances, const AABB& bbox, unsigned int treeDepth )
+{
+	++_stats->nodeCount;
+
+	// Check trivial case
+	const unsigned int instanceCount = instances.size();
+	if( instanceCount <= 1 )
+		return leafNode( instances, treeDepth );
+
+	SplitPlane plane;
+	float cost;
+	findPlaneBinned( plane, cost, instances, bbox );
+
+	// Further subdivision does not pay off if even the best split is more costly than not splitting at all
+	if( cost >= INTERSECTION_COST * instanceCount )
+		return leafNode( instances, treeDepth );
+
+	// Split current bounding box according to chosen split plane
+	AABB leftBox;
+	AABB rightBox;
+	bbox.split( leftBox, rightBox, plane );
+
+	// Partition current instances into both child bounding boxes
+	const Arena::Mark scratchMark = _scratch.mark();
+	RawKdNode::Elements leftInstances;
+	RawKdNode::Elements rightInstances;
+	partitionBinned( leftInstances, rightInstances, plane, instances, bbox );
+
+	// Recursive tree build for both children
+	RawKdNode* left  = recursiveBuildBinned( leftInstances, leftBox, treeDepth + 1 );
+	RawKdNode* right = recursiveBuildBinned( rightInstances, rightBox, treeDepth + 1 );
+	_scratch.rewind( scratchMark );
+
+	return RawKdNode::create( *_nodes, plane, left, right );
+}
+
+void InstanceTreeBuilder::findPlaneBinned( SplitPlane& plane, float& cost, const RawKdNode::Elements& instances, const AABB& bbox ) const
+{
+	const std::vector<Instance>& originalInstances = *_instances;
+	const unsigned int size = instances.size();
+
+	unsigned int startBins[BIN_COUNT];
+	unsigned int endBins[BIN_COUNT];
+	SplitPlane currentPlane;
+
+	// Reset best split
+	plane.axis = 0;
+	plane.position = rtu::mathf::MAX_VALUE;
+	cost = rtu::mathf::MAX_VALUE;
+
+	const float totalArea = bbox.surfaceArea();
+	if( totalArea <= 0.0f )
+		return;
+	const float invTotalArea = 1.0f / totalArea;
+
+	for( unsigned int k = 0; k < 3; ++k )
+	{
+		const float boxMin = bbox.minv[k];
+		const float boxMax = bbox.maxv[k];
+		const float extent = boxMax - boxMin;
+		if( extent <= 0.0f )
+			continue;
+
+		// Count instances starting and ending in each bin, with their boxes clamped to node box
+		const float scale = BIN_COUNT / extent;
+		for( unsigned int b = 0; b < BIN_COUNT; ++b )
+		{
+			startBins[b] = 0;
+			endBins[b] = 0;
+		}
+
+		for( unsigned int i = 0; i < size; ++i )
+		{
+			const AABB& currentBox = originalInstances[instances[i]].bbox;
+			const float instMin = rtu::mathf::min( rtu::mathf::max( currentBox.minv[k], boxMin ), boxMax );
+			const float instMax = rtu::mathf::min( rtu::mathf::max( currentBox.maxv[k], boxMin ), boxMax );
+
+			const unsigned int startBin = (unsigned int)( ( instMin - boxMin ) * scale );
+			const unsigned int endBin = (unsigned int)( ( instMax - boxMin ) * scale );
+			++startBins[( startBin < BIN_COUNT ) ? startBin : BIN_COUNT - 1];
+			++endBins[( endBin < BIN_COUNT ) ? endBin : BIN_COUNT - 1];
+		}
+
+		// Sweep bin borders. Child areas (halved, as in AABB::surfaceArea) only depend on their extent along split axis:
+		// area = e1 * e2 + ( e1 + e2 ) * extent, where e1 and e2 are the extents along the other axis
+		const float e1 = bbox.maxv[( k + 1 ) % 3] - bbox.minv[( k + 1 ) % 3];
+		const float e2 = bbox.maxv[( k + 2 ) % 3] - bbox.minv[( k + 2 ) % 3];
+		const float capArea = e1 * e2;
+		const float sideLength = e1 + e2;
+
+		currentPlane.axis = k;
+		unsigned int nL = 0;
+		unsigned int nR = size;
+
+		for( unsigned int b = 1; b < BIN_COUNT; ++b )
+		{
+			nL += startBins[b-1];
+			nR -= endBins[b-1];
+			const float leftExtent = extent * b / BIN_COUNT;
+			currentPlane.position = boxMin + leftExtent;
+
+			const float leftArea = capArea + sideLength * leftExtent;
+			const float rightArea = capArea + sideLength * ( extent - leftExtent );
+			const float currentCost = TRAVERSAL_COST + INTERSECTION_COST * invTotalArea * ( leftArea * nL + rightArea * nR );
+
+			if( currentCost < cost )
+			{
+				cost = currentCost;
+				plane = currentPlane;
+			}
+		}
+	}
+}
+
+void InstanceTreeBuilder::partitionBinned( RawKdNode::Elements& left, RawKdNode::Elements& right, const SplitPlane& plane, 
+										   const RawKdNode::Elements& instances, const AABB& bbox )
+{
+	const std::vector<Instance>& originalInstances = *_instances;
+	const unsigned int size = instances.size();
+
+	// Children never hold more instances than their parent
+	left = RawKdNode::Elements( _scratch.allocate<unsigned int>( size ), 0 );
+	right = RawKdNode::Elements( _scratch.allocate<unsigned int>( size ), 0 );
+
+	for( unsigned int i = 0; i < size; ++i )
+	{
+		const unsigned int instanceId = instances[i];
+		bool toLeft;
+		bool toRight;
+		classify( toLeft, toRight, originalInstances[instanceId].bbox, plane, bbox );
+
+		if( toLeft )
+			left[left.count++] = instanceId;
+		if( toRight )
+			right[right.count++] = instanceId;
+	}
+}
+
+void InstanceTreeBuilder::classify( bool& left, bool& right, const AABB& box, const SplitPlane& plane, const AABB& bbox ) const
+{
+	const unsigned int k = plane.axis;
+
+	if( _buildMode == RT_BUILD_SAH_BINNED )
+	{
+		// Same classification used when binning: instances starting before the plane go left, 
+		// instances ending after it go right. Instances lying on the plane go right.
+		const float instMin = rtu::mathf::max( box.minv[k], bbox.minv[k] );
+		const float instMax = rtu::mathf::min( box.maxv[k], bbox.maxv[k] );
+		left = ( instMin < plane.position );
+		right = ( instMax > plane.position ) || ( instMin >= plane.position );
+	}
+	else
+	{
+		// As partitioned in recursiveBuild: instances lying on the plane go left
+		left = ( box.minv[k] < plane.position ) || ( box.maxv[k] <= plane.position );
+		right = ( box.maxv[k] > plane.position );
+	}
+}
+
 void InstanceTreeBuilder::orderAxis( unsigned int* axis, const AABB& bbox )
 {
 	// Find axis in descending order of maximum extent
@@ -252,6 +502,132 @@ void InstanceTreeBuilder::orderAxis( unsigned int* axis, const AABB& bbox )
 	}
 }
 
+void InstanceTreeBuilder::updateNode( RawKdNode* node, const RawKdNode::Elements& removed, const RawKdNode::Elements& inserted,
+									  const AABB& bbox, unsigned int treeDepth )
+{
+	// Subtrees neither left nor entered by moved instances are not visited
+	if( ( removed.size() == 0 ) && ( inserted.size() == 0 ) )
+		return;
+
+	const std::vector<Instance>& instances = *_instances;
+
+	if( !node->isLeaf() )
+	{
+		const SplitPlane& plane = node->split;
+		AABB leftBox;
+		AABB rightBox;
+		bbox.split( leftBox, rightBox, plane );
+
+		const Arena::Mark scratchMark = _scratch.mark();
+		RawKdNode::Elements leftRemoved( _scratch.allocate<unsigned int>( removed.size() ), 0 );
+		RawKdNode::Elements rightRemoved( _scratch.allocate<unsigned int>( removed.size() ), 0 );
+		RawKdNode::Elements leftInserted( _scratch.allocate<unsigned int>( inserted.size() ), 0 );
+		RawKdNode::Elements rightInserted( _scratch.allocate<unsigned int>( inserted.size() ), 0 );
+
+		// Previous boxes are looked for on every side they touch, node boxes may have grown with the scene since they were inserted
+		for( unsigned int i = 0, size = removed.size(); i < size; ++i )
+		{
+			const unsigned int instanceId = removed[i];
+			const AABB& previousBox = _treeBoxes[instanceId];
+
+			if( previousBox.minv[plane.axis] <= plane.position )
+				leftRemoved[leftRemoved.count++] = instanceId;
+			if( previousBox.maxv[plane.axis] >= plane.position )
+				rightRemoved[rightRemoved.count++] = instanceId;
+		}
+
+		// Current boxes go where a build would put them
+		for( unsigned int i = 0, size = inserted.size(); i < size; ++i )
+		{
+			const unsigned int instanceId = inserted[i];
+			bool toLeft;
+			bool toRight;
+			classify( toLeft, toRight, instances[instanceId].bbox, plane, bbox );
+
+			if( toLeft )
+				leftInserted[leftInserted.count++] = instanceId;
+			if( toRight )
+				rightInserted[rightInserted.count++] = instanceId;
+		}
+
+		updateNode( node->left, leftRemoved, leftInserted, leftBox, treeDepth + 1 );
+		updateNode( node->right, rightRemoved, rightInserted, rightBox, treeDepth + 1 );
+		_scratch.rewind( scratchMark );
+		return;
+	}
+
+	// Moved instances both in leaf and inserted in it stay, the other moved ones are removed
+	for( unsigned int i = 0, size = inserted.size(); i < size; ++i )
+		_inserted[inserted[i]] = true;
+
+	RawKdNode::Elements& elements = node->elements;
+	const unsigned int previousCount = elements.size();
+	unsigned int count = 0;
+
+	for( unsigned int i = 0; i < previousCount; ++i )
+	{
+		const unsigned int instanceId = elements[i];
+		if( !_moved[instanceId] )
+		{
+			elements[count++] = instanceId;
+		}
+		else if( _inserted[instanceId] )
+		{
+			elements[count++] = instanceId;
+			_inserted[instanceId] = false;
+		}
+	}
+
+	// Remaining flags are the instances new to this leaf
+	unsigned int addedCount = 0;
+	for( unsigned int i = 0, size = inserted.size(); i < size; ++i )
+	{
+		if( _inserted[inserted[i]] )
+			++addedCount;
+	}
+
+	if( ( count == previousCount ) && ( addedCount == 0 ) )
+		return;
+
+	_treeChanged = true;
+
+	// Add them in new memory if they do not fit
+	if( count + addedCount > previousCount )
+	{
+		unsigned int* ids = _nodes->allocate<unsigned int>( count + addedCount );
+		memcpy( ids, elements.ids, count * sizeof( unsigned int ) );
+		elements.ids = ids;
+		_unusedElemIdCount += previousCount;
+	}
+
+	for( unsigned int i = 0, size = inserted.size(); i < size; ++i )
+	{
+		const unsigned int instanceId = inserted[i];
+		if( _inserted[instanceId] )
+		{
+			elements[count++] = instanceId;
+			_inserted[instanceId] = false;
+		}
+	}
+
+	elements.count = count;
+	_stats->elemIdCount -= previousCount;
+	_stats->elemIdCount += elements.size();
+
+	// Split leaf again only once it grew too large
+	if( ( elements.size() > MAX_UPDATED_LEAF_SIZE ) && ( elements.size() > previousCount ) )
+	{
+		// Leaf is replaced by subtree root, its ids are copied
+		--_stats->nodeCount;
+		--_stats->leafCount;
+		_stats->elemIdCount -= elements.size();
+		_unusedElemIdCount += elements.size();
+
+		RawKdNode* subtree = buildSubtree( elements, bbox, treeDepth );
+		*node = *subtree;
+	}
+}
+
 RawKdNode* InstanceTreeBuilder::leafNode( const RawKdNode::Elements& instances, unsigned int treeDepth )
 {
 	if( treeDepth > _stats->treeDepth )
@@ -260,7 +636,7 @@ RawKdNode* InstanceTreeBuilder::leafNode( const RawKdNode::Elements& instances,
 	_stats->elemIdCount += instances.size();
 	++_stats->leafCount;
 
-	return new RawKdNode( instances );
+	return RawKdNode::create( *_nodes, instances );
 }
 
 } // namespace rtc
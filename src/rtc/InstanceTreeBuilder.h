@@ -11,17 +11,64 @@ namespace rtc {
 class InstanceTreeBuilder
 {
 public:
-	RawKdTree* buildTree( const std::vector<Instance>& instances );
+	InstanceTreeBuilder();
+
+	// Build mode is RT_BUILD_CLOSEST_BORDER or RT_BUILD_SAH_BINNED (see definitions.h)
+	RawKdTree* buildTree( const std::vector<Instance>& instances, unsigned int buildMode );
+
+	// Update last built tree after given instances moved (ids may be repeated).
+	// Moved instances are removed from the leaves they overlapped and inserted in the leaves they now overlap, other subtrees
+	// are not visited. Leaves that grow too large are split again, with the build mode of last build.
+	// Returns false if tree should be rebuilt instead (tree is still valid, but too degraded).
+	bool updateTree( RawKdTree* tree, const std::vector<Instance>& instances, const std::vector<unsigned int>& movedInstances );
+
+	// Whether last update changed any leaf. If not, trees converted from the updated tree are still valid.
+	bool treeChanged() const { return _treeChanged; }
 
 private:
+	// Build subtree with current build mode
+	RawKdNode* buildSubtree( const RawKdNode::Elements& instances, const AABB& bbox, unsigned int treeDepth );
+
+	// Closest object border to bbox center
 	RawKdNode* recursiveBuild( const RawKdNode::Elements& instances, const AABB& bbox, unsigned int treeDepth );
 
+	// Approximate SAH evaluated at a fixed number of bin borders, O( n ) per tree level
+	RawKdNode* recursiveBuildBinned( const RawKdNode::Elements& instances, const AABB& bbox, unsigned int treeDepth );
+	void findPlaneBinned( SplitPlane& plane, float& cost, const RawKdNode::Elements& instances, const AABB& bbox ) const;
+	void partitionBinned( RawKdNode::Elements& left, RawKdNode::Elements& right, const SplitPlane& plane, 
+		                  const RawKdNode::Elements& instances, const AABB& bbox );
+
+	// Sides of split plane the build puts an instance box on, node bbox is only used by RT_BUILD_SAH_BINNED
+	void classify( bool& left, bool& right, const AABB& box, const SplitPlane& plane, const AABB& bbox ) const;
+
+	void updateNode( RawKdNode* node, const RawKdNode::Elements& removed, const RawKdNode::Elements& inserted,
+		             const AABB& bbox, unsigned int treeDepth );
+
 	// Find axis in descending order of maximum extent
 	void orderAxis( unsigned int* axis, const AABB& bbox );
 	RawKdNode* leafNode( const RawKdNode::Elements& instances, unsigned int treeDepth );
 
 	const std::vector<Instance>* _instances;
+	unsigned int _buildMode;
 	RawKdTree::Statistics* _stats;
+
+	// Nodes go to the tree arena, instance lists of nodes being split to scratch memory
+	Arena* _nodes;
+	Arena _scratch;
+
+	// Last built tree, used to detect when updates degraded it too much
+	unsigned int _builtInstanceCount;
+	unsigned int _builtNodeCount;
+	unsigned int _builtElemIdCount;
+	unsigned int _unusedElemIdCount; // ids replaced by updates, still allocated in tree arena
+
+	// Instance boxes as stored in last built or updated tree
+	std::vector<AABB> _treeBoxes;
+
+	// Update only: flags of moved instances, and of the ones inserted in current leaf
+	std::vector<bool> _moved;
+	std::vector<bool> _inserted;
+	bool _treeChanged;
 };
 
 } // namespace rtc
@@ -8,10 +8,11 @@ void KdNode::setInternalNode( const SplitPlane& plane, const KdNode* leftChild )
 	_data = plane.axis;
 	_split = plane.position;
 
-	// Store pointer to left child
-#pragma warning( disable : 4311 )
-	_data += reinterpret_cast<unsigned int>( leftChild );
-#pragma warning( default : 4311 )
+	// Store byte offset to left child.
+	// Nodes are 8 bytes long, so the lower bits are free for the axis.
+	// Left child must be stored after this node, in the same array, at most 2GB ahead.
+	RTU_STATIC_CHECK( sizeof( KdNode ) == 8, kdnode_must_have_8_bytes );
+	_data += static_cast<unsigned int>( reinterpret_cast<const char*>( leftChild ) - reinterpret_cast<const char*>( this ) );
 
 	// Reset leaf flag
 	_data &= 0x7FFFFFFF;
@@ -40,6 +41,10 @@ void KdTree::erase()
 		delete [] root;
 	if( elements != NULL )
 		delete [] elements;
+
+	// Tree may be rebuilt later (see rtNewGeometry)
+	root = NULL;
+	elements = NULL;
 }
 
 } // namespace rtc
@@ -23,7 +23,7 @@ struct KdNode
 private:
 	//--- If internal node ---
 	// bits 0..1 : split axis
-	// bits 2..30 : pointer to left child
+	// bits 2..30 : byte offset from this node to its left child (always positive, multiple of 8)
 	// bit 31 (sign) : flag whether node is a leaf
 	//--- If leaf node ---
 	// bits 0..30 : number of elements stored in leaf
@@ -58,9 +58,9 @@ inline float KdNode::splitPos() const
 
 inline const KdNode* KdNode::leftChild() const
 {
-#pragma warning( disable : 4312 )
-	return reinterpret_cast<const KdNode*>( _data & 0x7FFFFFFC );
-#pragma warning( default : 4312 )
+	// Children are always stored after their parent, so a relative offset is enough.
+	// Independent of pointer size and of where the node array is allocated.
+	return reinterpret_cast<const KdNode*>( reinterpret_cast<const char*>( this ) + ( _data & 0x7FFFFFFC ) );
 }
 
 inline unsigned	int KdNode::elemStart() const
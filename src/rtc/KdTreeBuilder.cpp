@@ -5,23 +5,55 @@ namespace rtc {
 
 TriangleTreeBuilder KdTreeBuilder::_triangleTreeBuilder;
 InstanceTreeBuilder KdTreeBuilder::_instanceTreeBuilder;
+Bvh4Builder KdTreeBuilder::_bvh4Builder;
+rtu::ref_ptr<RawKdTree> KdTreeBuilder::_instanceRawTree;
 
-void KdTreeBuilder::buildTree( Geometry* geometry )
+void KdTreeBuilder::buildTree( Geometry* geometry, unsigned int buildMode, unsigned int binCount )
 {
-	// Create kd-Tree using current geometry data. Ref_ptr will delete object in the end of this method.
-	rtu::ref_ptr<RawKdTree> tree = _triangleTreeBuilder.buildTree( geometry );
+	// Free the tree of the other type, in case geometry was rebuilt with a different one
+	if( geometry->accelStructure == RT_ACCEL_BVH4 )
+	{
+		geometry->kdTree.erase();
+		_bvh4Builder.buildTree( geometry->bvh, geometry );
+	}
+	else
+	{
+		geometry->bvh.erase();
+
+		// Create accelerated kd tree for ray tracing directly, without an intermediate raw tree
+		_triangleTreeBuilder.buildTree( geometry->kdTree, geometry, buildMode, binCount );
+	}
+
+	geometry->leafTriangles.buildFrom( *geometry );
+}
+
+void KdTreeBuilder::buildTree( KdTree& result, const std::vector<Instance>& instances, unsigned int buildMode )
+{
+	// Rebuild instance kd tree. Ref_ptr will delete previous one (and its node arena).
+	_instanceRawTree = _instanceTreeBuilder.buildTree( instances, buildMode );
 
 	// Create accelerated kd tree for ray tracing
-	convertRawTree( geometry->kdTree, tree.get() );
+	convertRawTree( result, _instanceRawTree.get() );
 }
 
-void KdTreeBuilder::buildTree( KdTree& result, const std::vector<Instance>& instances )
+void KdTreeBuilder::updateTree( KdTree& result, const std::vector<Instance>& instances, const std::vector<unsigned int>& movedInstances,
+								unsigned int buildMode )
 {
-	// Rebuild instance kd tree
-	rtu::ref_ptr<RawKdTree> tree = _instanceTreeBuilder.buildTree( instances );
+	if( !_instanceRawTree.valid() || !_instanceTreeBuilder.updateTree( _instanceRawTree.get(), instances, movedInstances ) )
+	{
+		buildTree( result, instances, buildMode );
+		return;
+	}
+
+	// Converted tree is still valid if no leaf changed, only scene box may have grown
+	if( !_instanceTreeBuilder.treeChanged() )
+	{
+		result.bbox = _instanceRawTree->bbox;
+		return;
+	}
 
 	// Create accelerated kd tree for ray tracing
-	convertRawTree( result, tree.get() );
+	convertRawTree( result, _instanceRawTree.get() );
 }
 
 void KdTreeBuilder::convertRawTree( KdTree& result, RawKdTree* tree )
@@ -32,12 +64,12 @@ void KdTreeBuilder::convertRawTree( KdTree& result, RawKdTree* tree )
 	// TODO: avoid reallocation if new size <= current size
 	// Create optimized nodes
 	if( result.root != NULL )
-		delete result.root;
+		delete [] result.root;
 	result.root = new KdNode[tree->stats.nodeCount];
 
 	// Create triangle ids
 	if( result.elements != NULL )
-		delete result.elements;
+		delete [] result.elements;
 	result.elements = new unsigned int[tree->stats.elemIdCount];
 
 	// Store triangle ids and setup optimized nodes
@@ -48,7 +80,7 @@ void KdTreeBuilder::convertRawTree( KdTree& result, RawKdTree* tree )
 
 	RawKdNode* current;
 	std::queue<RawKdNode*> next;
-	next.push( tree->root.get() );
+	next.push( tree->root );
 
 	while( !next.empty() )
 	{
@@ -58,8 +90,8 @@ void KdTreeBuilder::convertRawTree( KdTree& result, RawKdTree* tree )
 		if( !current->isLeaf() )
 		{
 			result.root[dstNode].setInternalNode( current->split, &result.root[childId] );
-			next.push( current->left.get() );
-			next.push( current->right.get() );
+			next.push( current->left );
+			next.push( current->right );
 
 			// Update variables for next iteration
             childId += 2;
@@ -6,19 +6,30 @@
 #include <rtc/KdTree.h>
 #include <rtc/TriangleTreeBuilder.h>
 #include <rtc/InstanceTreeBuilder.h>
+#include <rtc/Bvh4Builder.h>
 
 namespace rtc {
 
 class KdTreeBuilder
 {
 public:
-	static void buildTree( Geometry* geometry );
-	static void buildTree( KdTree& result, const std::vector<Instance>& instances );
+	// Builds the acceleration structure selected in geometry (kd-tree or bvh)
+	static void buildTree( Geometry* geometry, unsigned int buildMode, unsigned int binCount );
+	static void buildTree( KdTree& result, const std::vector<Instance>& instances, unsigned int buildMode );
 	static void convertRawTree( KdTree& result, RawKdTree* tree );
 
+	// Update instance tree after given instances moved (ids may be repeated)
+	// Falls back to a full rebuild when the updated tree degrades too much
+	static void updateTree( KdTree& result, const std::vector<Instance>& instances, const std::vector<unsigned int>& movedInstances,
+		                    unsigned int buildMode );
+
 private:
 	static TriangleTreeBuilder _triangleTreeBuilder;
 	static InstanceTreeBuilder _instanceTreeBuilder;
+	static Bvh4Builder _bvh4Builder;
+
+	// Last instance tree, kept for updates
+	static rtu::ref_ptr<RawKdTree> _instanceRawTree;
 };
 
 } // namespace rtc
@@ -0,0 +1,145 @@
+#include <rtc/LeafTriangles.h>
+#include <rtc/Geometry.h>
+#include <xmmintrin.h>
+#include <algorithm>
+#include <vector>
+
+namespace rtc {
+
+// Non-empty leaf of a kd-tree (kdNode) or of a bvh (child c of bvhNode), and its element range
+struct LeafRange
+{
+	KdNode* kdNode;
+	Bvh4Node* bvhNode;
+	unsigned int c;
+	unsigned int start;
+	unsigned int count;
+};
+
+static void collectLeaves( KdTree& tree, std::vector<LeafRange>& leaves )
+{
+	std::vector<KdNode*> stack;
+	stack.push_back( tree.root );
+
+	while( !stack.empty() )
+	{
+		KdNode* node = stack.back();
+		stack.pop_back();
+
+		if( !node->isLeaf() )
+		{
+			// Nodes are only const for traversal, the tree is ours to modify here
+			KdNode* left = const_cast<KdNode*>( node->leftChild() );
+			stack.push_back( left );
+			stack.push_back( left + 1 );
+			continue;
+		}
+
+		if( node->elemCount() > 0 )
+		{
+			LeafRange leaf = { node, NULL, 0, node->elemStart(), node->elemCount() };
+			leaves.push_back( leaf );
+		}
+	}
+}
+
+static void collectLeaves( Bvh4& bvh, std::vector<LeafRange>& leaves )
+{
+	for( unsigned int n = 0; n < bvh.nodeCount; ++n )
+	{
+		for( unsigned int c = 0; c < 4; ++c )
+		{
+			const unsigned int child = bvh.nodes[n].children[c];
+			if( Bvh4Node::isLeaf( child ) && ( Bvh4Node::elemCount( child ) > 0 ) )
+			{
+				LeafRange leaf = { NULL, &bvh.nodes[n], c, Bvh4Node::elemStart( child ), Bvh4Node::elemCount( child ) };
+				leaves.push_back( leaf );
+			}
+		}
+	}
+}
+
+LeafTriangles::LeafTriangles()
+: blocks( NULL ), triangles( NULL )
+{
+}
+
+void LeafTriangles::erase()
+{
+	if( blocks != NULL )
+		_mm_free( blocks );
+	if( triangles != NULL )
+		_mm_free( triangles );
+
+	blocks = NULL;
+	triangles = NULL;
+}
+
+void LeafTriangles::buildFrom( Geometry& geometry )
+{
+	erase();
+
+	std::vector<LeafRange> leaves;
+	unsigned int** elements;
+	if( geometry.accelStructure == RT_ACCEL_BVH4 )
+	{
+		if( geometry.bvh.nodes == NULL )
+			return;
+		collectLeaves( geometry.bvh, leaves );
+		elements = &geometry.bvh.elements;
+	}
+	else
+	{
+		if( geometry.kdTree.root == NULL )
+			return;
+		collectLeaves( geometry.kdTree, leaves );
+		elements = &geometry.kdTree.elements;
+	}
+
+	unsigned int totalBlocks = 0;
+	for( unsigned int l = 0; l < leaves.size(); ++l )
+	{
+		totalBlocks += blockCount( leaves[l].count );
+	}
+
+	// Every leaf starts at a multiple of 4, padding entries repeat the leaf's last element
+	const unsigned int elementCount = totalBlocks * 4;
+	unsigned int* const leafElements = new unsigned int[elementCount];
+	blocks = static_cast<TriAccel4*>( _mm_malloc( totalBlocks * sizeof( TriAccel4 ), 16 ) );
+	if( geometry.leafOrdered )
+		triangles = static_cast<TriAccel*>( _mm_malloc( elementCount * sizeof( TriAccel ), 16 ) );
+
+	unsigned int start = 0;
+	for( unsigned int l = 0; l < leaves.size(); ++l )
+	{
+		const LeafRange& leaf = leaves[l];
+		const unsigned int paddedCount = blockCount( leaf.count ) * 4;
+
+		for( unsigned int i = 0; i < paddedCount; ++i )
+		{
+			const unsigned int id = ( *elements )[leaf.start + std::min( i, leaf.count - 1 )];
+			const TriAccel& acc = geometry.triAccel[id];
+			leafElements[start + i] = id;
+
+			if( i < leaf.count )
+				blocks[( start + i ) >> 2].set( i & 3, acc );
+			else
+				blocks[( start + i ) >> 2].setEmpty( i & 3 );
+
+			if( triangles != NULL )
+				triangles[start + i] = acc;
+		}
+
+		if( leaf.kdNode != NULL )
+			leaf.kdNode->setLeafNode( start, leaf.count );
+		else
+			leaf.bvhNode->setLeafStart( leaf.c, start );
+
+		start += paddedCount;
+	}
+
+	delete [] *elements;
+	*elements = leafElements;
+}
+
+} // namespace rtc
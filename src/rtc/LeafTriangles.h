@@ -0,0 +1,54 @@
+#pragma once
+#ifndef _RTC_LEAFTRIANGLES_H_
+#define _RTC_LEAFTRIANGLES_H_
+
+#include <rtu/common.h>
+#include <rtc/Triangle.h>
+
+namespace rtc {
+
+struct Geometry;
+
+/*
+ *	Triangles of each leaf of a geometry's kd-tree or bvh, copied in leaf order so that traversal reads them
+ *	from consecutive memory instead of looking up their id in the tree's elements first.
+ *	Leaves are moved to start at a multiple of 4 elements, so that their first TriAccel4 block is found
+ *	directly from their element start. The last block of each leaf is padded with empty slots.
+ *	Triangles in several leaves are copied once per leaf.
+ */
+struct LeafTriangles
+{
+	LeafTriangles();
+	// No destructor, same as KdTree (geometries are shallow copied when their vector is resized)
+
+	void erase();
+
+	// Lays out the leaves of the acceleration structure built for geometry, rewriting their element starts
+	// and the tree's elements. Leaf ordered TriAccel copies are only made if geometry.leafOrdered is set.
+	void buildFrom( Geometry& geometry );
+
+	// First block of the leaf whose elements start at elemStart
+	inline const TriAccel4* leafBlocks( unsigned int elemStart ) const;
+
+	// Blocks holding elemCount triangles
+	static inline unsigned int blockCount( unsigned int elemCount );
+
+	// Blocks for single rays, 16-byte aligned
+	TriAccel4* blocks;
+	// TriAccel of each element for ray packets, 16-byte aligned. NULL if geometry is not leaf ordered.
+	TriAccel* triangles;
+};
+
+inline const TriAccel4* LeafTriangles::leafBlocks( unsigned int elemStart ) const
+{
+	return blocks + ( elemStart >> 2 );
+}
+
+inline unsigned int LeafTriangles::blockCount( unsigned int elemCount )
+{
+	return ( elemCount + 3 ) >> 2;
+}
+
+} // namespace rtc
+
+#endif // _RTC_LEAFTRIANGLES_H_
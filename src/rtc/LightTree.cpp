@@ -0,0 +1,183 @@
+#include <rtc/LightTree.h>
+#include <rtc/Plugins.h>
+
+namespace rtc {
+
+// Orders leaves by the center of their sphere along an axis
+struct LeafCenterLess
+{
+	LeafCenterLess( unsigned int axis ) : axis( axis ) {;}
+
+	bool operator()( const LightTree::Node& a, const LightTree::Node& b ) const
+	{
+		return a.center[axis] < b.center[axis];
+	}
+
+	unsigned int axis;
+};
+
+void LightTree::build( float cutoff )
+{
+	nodes.clear();
+	_leaves.clear();
+
+	// Skip id == 0
+	for( unsigned int i = 1, size = Plugins::lights.size(); i < size; ++i )
+	{
+		if( !Plugins::lights[i].valid() )
+			continue;
+
+		Node leaf;
+		leaf.lightId = i;
+
+		float radius;
+		if( Plugins::lights[i]->influence( cutoff, leaf.center, radius ) )
+		{
+			// Illuminates no point by more than cutoff
+			if( radius <= 0.0f )
+				continue;
+
+			const rtu::float3 extent( radius, radius, radius );
+			leaf.bbox.minv = leaf.center - extent;
+			leaf.bbox.maxv = leaf.center + extent;
+			leaf.radius2 = radius * radius;
+			_leaves.push_back( leaf );
+		}
+		else
+		{
+			// Visited by all queries, before the tree
+			const float inf = rtu::mathf::MAX_VALUE;
+			leaf.bbox.minv.set( -inf, -inf, -inf );
+			leaf.bbox.maxv.set( inf, inf, inf );
+			leaf.center.set( 0.0f, 0.0f, 0.0f );
+			leaf.radius2 = inf;
+			leaf.skip = nodes.size() + 1;
+			nodes.push_back( leaf );
+		}
+	}
+
+	if( !_leaves.empty() )
+		buildNode( 0, _leaves.size() );
+}
+
+void LightTree::buildNode( unsigned int first, unsigned int last )
+{
+	if( last - first == 1 )
+	{
+		nodes.push_back( _leaves[first] );
+		nodes.back().skip = nodes.size();
+		return;
+	}
+
+	const unsigned int index = nodes.size();
+	nodes.push_back( Node() );
+
+	// Split at the median center along the longest axis of the centers' bounds
+	AABB centers;
+	centers.minv = centers.maxv = _leaves[first].center;
+	AABB bbox = _leaves[first].bbox;
+	for( unsigned int i = first + 1; i < last; ++i )
+	{
+		centers.expandBy( &_leaves[i].center, 1 );
+		bbox.expandBy( _leaves[i].bbox );
+	}
+
+	const rtu::float3 extent = centers.maxv - centers.minv;
+	unsigned int axis = ( extent.x > extent.y ) ? 0 : 1;
+	if( extent.z > extent[axis] )
+		axis = 2;
+
+	const unsigned int middle = ( first + last ) / 2;
+	std::nth_element( _leaves.begin() + first, _leaves.begin() + middle, _leaves.begin() + last, LeafCenterLess( axis ) );
+
+	buildNode( first, middle );
+	buildNode( middle, last );
+
+	// Children were appended after this node, which may have moved it
+	Node& node = nodes[index];
+	node.bbox = bbox;
+	node.lightId = 0;
+	node.skip = nodes.size();
+}
+
+unsigned int LightTree::query( const AABB& box, unsigned int& cursor, unsigned int* lightIds, unsigned int maxCount ) const
+{
+	unsigned int count = 0;
+	const unsigned int nodeCount = nodes.size();
+
+	while( ( cursor < nodeCount ) && ( count < maxCount ) )
+	{
+		const Node& node = nodes[cursor];
+
+		if( !overlaps( node, box ) )
+		{
+			cursor = node.skip;
+			continue;
+		}
+
+		if( node.lightId != 0 )
+			lightIds[count++] = node.lightId;
+
+		// Children follow their parent
+		++cursor;
+	}
+
+	return count;
+}
+
+unsigned int LightTree::sample( const AABB& box, const rtu::float3& position, float u, unsigned int count,
+					            unsigned int* lightIds, float* weights, std::vector<Candidate>& candidates ) const
+{
+	static const unsigned int CHUNK_SIZE = 16;
+	unsigned int ids[CHUNK_SIZE];
+
+	// Intensities of all lights overlapping box, and their sum
+	candidates.clear();
+	float total = 0.0f;
+	unsigned int cursor = 0;
+	unsigned int found;
+	while( ( found = query( box, cursor, ids, CHUNK_SIZE ) ) > 0 )
+	{
+		for( unsigned int i = 0; i < found; ++i )
+		{
+			const float intensity = Plugins::lights[ids[i]]->intensityAt( position );
+			if( !( intensity > 0.0f ) )
+				continue;
+
+			const Candidate candidate = { ids[i], intensity };
+			candidates.push_back( candidate );
+			total += intensity;
+		}
+	}
+
+	if( candidates.empty() )
+		return 0;
+
+	// Pick the light under each stratified sample of the cumulative intensities
+	unsigned int picked = 0;
+	float sum = 0.0f;
+	for( unsigned int i = 0, size = candidates.size(); ( i < size ) && ( picked < count ); ++i )
+	{
+		const Candidate& candidate = candidates[i];
+		sum += candidate.intensity;
+
+		while( ( picked < count ) && ( ( picked + u ) * total < sum * count ) )
+		{
+			lightIds[picked] = candidate.lightId;
+			weights[picked] = total / ( candidate.intensity * count );
+			++picked;
+		}
+	}
+
+	// Last strata may be missed by rounding errors
+	const Candidate& last = candidates.back();
+	for( ; picked < count; ++picked )
+	{
+		lightIds[picked] = last.lightId;
+		weights[picked] = total / ( last.intensity * count );
+	}
+
+	return picked;
+}
+
+} // namespace rtc
@@ -0,0 +1,89 @@
+#pragma once
+#ifndef _RTC_LIGHTTREE_H_
+#define _RTC_LIGHTTREE_H_
+
+#include <rtu/common.h>
+#include <rtu/float3.h>
+#include <rtc/AABB.h>
+#include <vector>
+#include <algorithm>
+
+namespace rtc {
+
+/*
+ *	Bounding volume hierarchy over the spheres of influence of the lights (see rts::ILight::influence), so that
+ *	shading points only visit the lights that may illuminate them by more than the light cutoff.
+ *	Nodes are stored in depth-first order, each one followed by its subtree, and know where their subtree ends:
+ *	queries need no stack and can be resumed from a single node index (see rtsQueryLights).
+ *	Lights without sphere of influence are leaves of infinite bounds, visited by all queries.
+ */
+struct LightTree
+{
+	struct Node
+	{
+		AABB bbox;
+		// Index of the first node after the subtree of this one
+		unsigned int skip;
+		// Light id in Plugins::lights if leaf, 0 otherwise (invalid light id)
+		unsigned int lightId;
+		// Sphere of influence of the light, if leaf
+		rtu::float3 center;
+		float radius2;
+	};
+
+	// Light overlapping a sampled box, with its intensity at the sampled position
+	struct Candidate
+	{
+		unsigned int lightId;
+		float intensity;
+	};
+
+	// Rebuilds tree from current lights and their spheres of influence for given cutoff
+	void build( float cutoff );
+
+	// Stores in lightIds the ids of at most maxCount lights whose sphere of influence overlaps box,
+	// starting at node cursor, which is moved past them. Returns number of ids stored.
+	unsigned int query( const AABB& box, unsigned int& cursor, unsigned int* lightIds, unsigned int maxCount ) const;
+
+	// Picks count lights among those overlapping box, with probabilities proportional to their intensity at
+	// position (see rts::ILight::intensityAt), stratified by u in [0,1). Weights are 1 / ( count * probability ).
+	// Lights picked several times are stored next to each other. Candidates is scratch storage for the lights
+	// overlapping box, so that their intensities are evaluated once. Returns number of lights picked, zero if none.
+	unsigned int sample( const AABB& box, const rtu::float3& position, float u, unsigned int count,
+		                 unsigned int* lightIds, float* weights, std::vector<Candidate>& candidates ) const;
+
+	std::vector<Node> nodes;
+
+private:
+	// Appends subtree of leaves [first,last) in depth-first order
+	void buildNode( unsigned int first, unsigned int last );
+
+	static inline bool overlaps( const Node& node, const AABB& box );
+
+	// Leaves being built, sorted in place
+	std::vector<Node> _leaves;
+};
+
+inline bool LightTree::overlaps( const Node& node, const AABB& box )
+{
+	if( ( node.bbox.minv.x > box.maxv.x ) || ( node.bbox.maxv.x < box.minv.x ) ||
+		( node.bbox.minv.y > box.maxv.y ) || ( node.bbox.maxv.y < box.minv.y ) ||
+		( node.bbox.minv.z > box.maxv.z ) || ( node.bbox.maxv.z < box.minv.z ) )
+		return false;
+
+	if( node.lightId == 0 )
+		return true;
+
+	// Squared distance from sphere center to box
+	float distance2 = 0.0f;
+	for( unsigned int i = 0; i < 3; ++i )
+	{
+		const float d = std::max( std::max( box.minv[i] - node.center[i], node.center[i] - box.maxv[i] ), 0.0f );
+		distance2 += d * d;
+	}
+	return ( distance2 <= node.radius2 );
+}
+
+} // namespace rtc
+
+#endif // _RTC_LIGHTTREE_H_
@@ -0,0 +1,84 @@
+#pragma once
+#ifndef _RTC_MAILBOX_H_
+#define _RTC_MAILBOX_H_
+
+#include <rtu/common.h>
+
+namespace rtc {
+
+/*
+ *	Hashed mailbox: remembers which rays were already tested against the last triangles of a geometry's kd-tree,
+ *	so that triangles referenced by several leaves are not tested again in each leaf a ray visits.
+ *	Rays are one bit each, bit r for ray r of a packet, bit 0 for single rays.
+ *	Direct mapped on the triangle id, an entry evicted by another triangle is simply tested again.
+ *	Entries are stamped with the current traversal, so that starting a new one does not need to clear them.
+ */
+struct Mailbox
+{
+	// Power of 2
+	static const unsigned int SIZE = 256;
+
+	// Forgets all entries, must be called once before first use
+	inline void clear();
+
+	// Starts a new traversal, forgetting the triangles tested in the previous one
+	inline void reset();
+
+	// Rays already tested against triangle in current traversal
+	inline unsigned int tested( unsigned int triangleId ) const;
+
+	// Adds rays tested against triangle in current traversal
+	inline void setTested( unsigned int triangleId, unsigned int rays );
+
+	struct Entry
+	{
+		unsigned int triangleId;
+		unsigned int stamp;
+		unsigned int rays;
+		unsigned int pad;
+	};
+
+	unsigned int stamp;
+	Entry entries[SIZE];
+};
+
+inline void Mailbox::clear()
+{
+	stamp = 0;
+	for( unsigned int i = 0; i < SIZE; ++i )
+	{
+		entries[i].stamp = 0;
+	}
+}
+
+inline void Mailbox::reset()
+{
+	// Stamp wrapped around, older entries could look current
+	if( ++stamp == 0 )
+	{
+		clear();
+		stamp = 1;
+	}
+}
+
+inline unsigned int Mailbox::tested( unsigned int triangleId ) const
+{
+	const Entry& entry = entries[triangleId & ( SIZE - 1 )];
+	return ( ( entry.stamp == stamp ) && ( entry.triangleId == triangleId ) ) ? entry.rays : 0;
+}
+
+inline void Mailbox::setTested( unsigned int triangleId, unsigned int rays )
+{
+	Entry& entry = entries[triangleId & ( SIZE - 1 )];
+	if( ( entry.stamp != stamp ) || ( entry.triangleId != triangleId ) )
+	{
+		entry.triangleId = triangleId;
+		entry.stamp = stamp;
+		entry.rays = 0;
+	}
+	entry.rays |= rays;
+}
+
+} // namespace rtc
+
+#endif // _RTC_MAILBOX_H_
@@ -9,6 +9,7 @@
 #include <rts/IMaterial.h>
 #include <rts/ITexture.h>
 #include <rts/ILight.h>
+#include <rts/ISampler.h>
 #include <vector>
 
 namespace rtc {
@@ -18,6 +19,7 @@ struct Plugins
 	static rtu::ref_ptr<rts::IRenderer> renderer;
 	static rtu::ref_ptr<rts::ICamera> camera;
 	static rtu::ref_ptr<rts::IEnvironment> environment;
+	static rtu::ref_ptr<rts::ISampler> sampler;
 	static std::vector< rtu::ref_ptr<rts::ITexture> > textures;
 	static std::vector< rtu::ref_ptr<rts::IMaterial> > materials;
 	static std::vector< rtu::ref_ptr<rts::ILight> > lights;	
@@ -1,23 +1,33 @@
 #include <rtc/RawKdTree.h>
+#include <cstring>
 
 namespace rtc {
 
-RawKdNode::RawKdNode()
-: left( NULL ), right( NULL )
+RawKdNode* RawKdNode::create( Arena& arena )
 {
-	// empty
+	RawKdNode* node = arena.allocate<RawKdNode>( 1 );
+	node->left = NULL;
+	node->right = NULL;
+	node->elements = Elements();
+	return node;
 }
 
-RawKdNode::RawKdNode( const RawKdNode::Elements& ids )
-: left( NULL ), right( NULL ), elements( ids )
+RawKdNode* RawKdNode::create( Arena& arena, const RawKdNode::Elements& ids )
 {
-	// empty
+	RawKdNode* node = create( arena );
+	node->elements.ids = arena.allocate<unsigned int>( ids.count );
+	node->elements.count = ids.count;
+	memcpy( node->elements.ids, ids.ids, ids.count * sizeof( unsigned int ) );
+	return node;
 }
 
-RawKdNode::RawKdNode( const SplitPlane& plane, RawKdNode* leftChild, RawKdNode* rightChild )
-: split( plane ), left( leftChild ), right( rightChild )
+RawKdNode* RawKdNode::create( Arena& arena, const SplitPlane& plane, RawKdNode* leftChild, RawKdNode* rightChild )
 {
-	// empty
+	RawKdNode* node = create( arena );
+	node->split = plane;
+	node->left = leftChild;
+	node->right = rightChild;
+	return node;
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -29,4 +39,10 @@ void RawKdTree::Statistics::reset()
 	elemIdCount = 0;
 }
 
+RawKdTree::RawKdTree()
+: root( NULL )
+{
+	stats.reset();
+}
+
 } // namespace rtc
@@ -5,30 +5,71 @@
 #include <rtu/common.h>
 #include <rtc/AABB.h>
 #include <rtc/SplitPlane.h>
+#include <rtc/Arena.h>
 #include <rtu/refcounting.h>
-#include <vector>
 
 namespace rtc {
 
-struct RawKdNode : public rtu::RefCounted
+// Nodes and element ids are allocated in arenas, never deleted individually
+struct RawKdNode
 {
-	typedef std::vector<unsigned int> Elements;
+	// Array of element ids
+	struct Elements
+	{
+		inline Elements();
+		inline Elements( unsigned int* elementIds, unsigned int elementCount );
+
+		inline unsigned int size() const;
+		inline unsigned int& operator[]( unsigned int i );
+		inline unsigned int operator[]( unsigned int i ) const;
+
+		unsigned int* ids;
+		unsigned int count;
+	};
 
-	RawKdNode();
-	// Leaf node
-	RawKdNode( const Elements& ids );
+	// Empty leaf node
+	static RawKdNode* create( Arena& arena );
+	// Leaf node, copies element ids to arena
+	static RawKdNode* create( Arena& arena, const Elements& ids );
 	// Internal node
-	RawKdNode( const SplitPlane& plane, RawKdNode* leftChild, RawKdNode* rightChild );
+	static RawKdNode* create( Arena& arena, const SplitPlane& plane, RawKdNode* leftChild, RawKdNode* rightChild );
 
-	inline bool isLeaf();
+	inline bool isLeaf() const;
 
 	SplitPlane split;
-	rtu::ref_ptr<RawKdNode> left;
-	rtu::ref_ptr<RawKdNode> right;
+	RawKdNode* left;
+	RawKdNode* right;
 	Elements elements;
 };
 
-inline bool RawKdNode::isLeaf()
+inline RawKdNode::Elements::Elements()
+: ids( NULL ), count( 0 )
+{
+	// empty
+}
+
+inline RawKdNode::Elements::Elements( unsigned int* elementIds, unsigned int elementCount )
+: ids( elementIds ), count( elementCount )
+{
+	// empty
+}
+
+inline unsigned int RawKdNode::Elements::size() const
+{
+	return count;
+}
+
+inline unsigned int& RawKdNode::Elements::operator[]( unsigned int i )
+{
+	return ids[i];
+}
+
+inline unsigned int RawKdNode::Elements::operator[]( unsigned int i ) const
+{
+	return ids[i];
+}
+
+inline bool RawKdNode::isLeaf() const
 {
 	return ( left == NULL ) && ( right == NULL );
 }
@@ -48,9 +89,14 @@ struct RawKdTree : public rtu::RefCounted
 		// TODO: other useful stats
 	};
 
-	rtu::ref_ptr<RawKdNode> root;
+	RawKdTree();
+
+	RawKdNode* root;
 	AABB bbox;
 	Statistics stats;
+
+	// Memory of all nodes and leaf elements, freed in one shot with the tree
+	Arena arena;
 };
 
 } // namespace rtc
@@ -3,6 +3,7 @@
 #define _RTC_RAYSTATE_H_
 
 #include <rtu/common.h>
+#include <rtu/random.h>
 #include <rtc/Ray.h>
 #include <rtc/Hit.h>
 
@@ -14,6 +15,15 @@ struct RayState
 	Hit hit;
 	rtu::float3 resultColor;
 	unsigned int recursionDepth;
+	// Random numbers drawn by shaders (see rtsRandom)
+	rtu::CounterRandom random;
+	// Sample sequence position (see rtsSamples2D): pixel, sample number in pixel and next dimension to draw
+	unsigned int pixel;
+	unsigned int sample;
+	unsigned int sampleDimension;
+	// Queued rays only (see rtsBeginRayQueue): result color times path weight is added to path target once shaded
+	rtu::float3 pathWeight;
+	rtu::float3* pathTarget;
 
 	// Computable attributes by the Shader Programming Interface.
 	// These are necessary for inter-shader communication and several rts functions.
@@ -21,19 +31,32 @@ struct RayState
 	rtu::float3 shadingNormal;
 };
 
-// TODO: SoA for other members! check everything!
+// Per ray attributes are stored as structures of arrays, so that shaders can process 4 rays at once.
+// 3D attributes store x of all rays, then y, then z (same as RayPacket axis accessors).
 RTU_CACHE_ALIGN( 16 )
 struct RayPacketState
 {
 	RayPacket packet;
 	HitPacket hit;
-	rtu::float3 resultColor[RT_PACKET_SIZE];
+
+	// Shadow rays only: rays found occluded by rtsTraceHitPacket
+	union { unsigned int occluded[RT_PACKET_SIZE]; __m128 occluded4[RT_PACKET_SIMD_SIZE]; };
+	union { float resultColor[RT_PACKET_SIZE*3]; __m128 resultColor4[RT_PACKET_SIMD_SIZE*3]; };
 	unsigned int recursionDepth[RT_PACKET_SIZE];
+	rtu::CounterRandom random;
+	// Sample sequence position of each ray (see RayState)
+	unsigned int pixel[RT_PACKET_SIZE];
+	unsigned int sample[RT_PACKET_SIZE];
+	// Next dimension to draw, shared by all rays
+	unsigned int sampleDimension;
+	// Path of each ray (see RayState)
+	float pathWeight[RT_PACKET_SIZE*3];
+	rtu::float3* pathTarget[RT_PACKET_SIZE];
 
 	// Computable attributes by the Shader Programming Interface.
 	// These are necessary for inter-shader communication and several rts functions.
-	rtu::float3 hitPosition; // TODO: parallelize
-	rtu::float3 shadingNormal; // TODO: parallelize
+	union { float hitPosition[RT_PACKET_SIZE*3]; __m128 hitPosition4[RT_PACKET_SIMD_SIZE*3]; };
+	union { float shadingNormal[RT_PACKET_SIZE*3]; __m128 shadingNormal4[RT_PACKET_SIMD_SIZE*3]; };
 };
 
 } // namespace rtc
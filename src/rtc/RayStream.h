@@ -0,0 +1,148 @@
+#pragma once
+#ifndef _RTC_RAYSTREAM_H_
+#define _RTC_RAYSTREAM_H_
+
+#include <rtu/common.h>
+#include <rt/definitions.h>
+#include <rtu/float3.h>
+#include <rtu/random.h>
+#include <rtc/AABB.h>
+#include <algorithm>
+
+namespace rtc {
+
+/*
+ *	Secondary rays enqueued by shaders (see rtsEnqueueRay), waiting to be traced together.
+ *	Sorting them by direction octant, then by the cell of their origin in a coarse grid over the scene,
+ *	brings rays that will traverse the same nodes next to each other, so that they can be traced as coherent packets
+ *	even if they come from different shaded rays.
+ */
+struct RayStream
+{
+	// Origin grid resolution per axis, cells are numbered in Morton order
+	static const unsigned int GRID_BITS = 3;
+	static const unsigned int GRID_SIZE = 1 << GRID_BITS;
+
+	struct Entry
+	{
+		rtu::float3 origin;
+		rtu::float3 direction;
+		unsigned int recursionDepth;
+		// Sampling state inherited from the ray that enqueued this one (see RayState)
+		rtu::CounterRandom random;
+		unsigned int pixel;
+		unsigned int sample;
+		unsigned int sampleDimension;
+
+		// Result color times weight is added to target
+		rtu::float3 weight;
+		rtu::float3* target;
+		// Path of the state that enqueued this ray (see RayState)
+		rtu::float3 pathWeight;
+		rtu::float3* pathTarget;
+	};
+
+	inline void clear();
+
+	inline bool full() const;
+
+	// Sorts keys by direction octant and origin cell of their ray, origins are located in bounds
+	inline void sort( const AABB& bounds );
+
+	// Ray and direction octant of i-th sorted key
+	inline const Entry& sorted( unsigned int i ) const;
+	inline unsigned int octant( unsigned int i ) const;
+
+	// Direction octant, then origin cell of ray. Scale is the number of cells per unit along each axis of bounds.
+	static inline unsigned int sortKey( const Entry& ray, const AABB& bounds, const rtu::float3& scale );
+	static inline rtu::float3 cellScale( const AABB& bounds );
+	static inline unsigned int keyOctant( unsigned int key );
+
+	// Interleaves the 3 lowest bits of v with 2 zero bits
+	static inline unsigned int spreadBits( unsigned int v );
+
+	// Grid cell of x along an axis starting at min
+	static inline unsigned int gridCell( float x, float min, float scale );
+
+	unsigned int count;
+	Entry rays[RT_STREAM_SIZE];
+	// sortKey * RT_STREAM_SIZE + ray index
+	unsigned int keys[RT_STREAM_SIZE];
+};
+
+inline void RayStream::clear()
+{
+	count = 0;
+}
+
+inline bool RayStream::full() const
+{
+	return count == RT_STREAM_SIZE;
+}
+
+inline void RayStream::sort( const AABB& bounds )
+{
+	const rtu::float3 scale = cellScale( bounds );
+	for( unsigned int i = 0; i < count; ++i )
+	{
+		keys[i] = sortKey( rays[i], bounds, scale ) * RT_STREAM_SIZE + i;
+	}
+
+	// Ray index in keys keeps enqueue order among rays of the same cell
+	std::sort( keys, keys + count );
+}
+
+inline const RayStream::Entry& RayStream::sorted( unsigned int i ) const
+{
+	return rays[keys[i] % RT_STREAM_SIZE];
+}
+
+inline unsigned int RayStream::octant( unsigned int i ) const
+{
+	return keyOctant( keys[i] / RT_STREAM_SIZE );
+}
+
+inline unsigned int RayStream::sortKey( const Entry& ray, const AABB& bounds, const rtu::float3& scale )
+{
+	// Same sign bits as RayPacket::preCompute, so that rays of an octant make a coherent packet
+	const unsigned int octant = rtu::mathf::signBit( ray.direction.x ) |
+		                      ( rtu::mathf::signBit( ray.direction.y ) << 1 ) |
+		                      ( rtu::mathf::signBit( ray.direction.z ) << 2 );
+
+	const unsigned int cell = spreadBits( gridCell( ray.origin.x, bounds.minv.x, scale.x ) ) |
+		                     ( spreadBits( gridCell( ray.origin.y, bounds.minv.y, scale.y ) ) << 1 ) |
+		                     ( spreadBits( gridCell( ray.origin.z, bounds.minv.z, scale.z ) ) << 2 );
+
+	return ( octant << ( GRID_BITS * 3 ) ) | cell;
+}
+
+inline rtu::float3 RayStream::cellScale( const AABB& bounds )
+{
+	const rtu::float3 extent = bounds.maxv - bounds.minv;
+	return rtu::float3( ( extent.x > 0.0f ) ? GRID_SIZE / extent.x : 0.0f,
+		                ( extent.y > 0.0f ) ? GRID_SIZE / extent.y : 0.0f,
+		                ( extent.z > 0.0f ) ? GRID_SIZE / extent.z : 0.0f );
+}
+
+inline unsigned int RayStream::keyOctant( unsigned int key )
+{
+	return key >> ( GRID_BITS * 3 );
+}
+
+inline unsigned int RayStream::spreadBits( unsigned int v )
+{
+	return ( v & 1 ) | ( ( v & 2 ) << 2 ) | ( ( v & 4 ) << 4 );
+}
+
+inline unsigned int RayStream::gridCell( float x, float min, float scale )
+{
+	// Origins out of bounds go to the border cells
+	const float c = ( x - min ) * scale;
+	if( !( c > 0.0f ) )
+		return 0;
+	return std::min( static_cast<unsigned int>( c ), GRID_SIZE - 1 );
+}
+
+} // namespace rtc
+
+#endif // _RTC_RAYSTREAM_H_
@@ -1,32 +1,110 @@
 #include <rtc/RayTracer.h>
+#include <rtc/RayTracerKernels.h>
 #include <rtc/Plugins.h>
-#include <omp.h>
+#include <rtu/cpu.h>
+#include <algorithm>
+#include <vector>
+#include <cstring>
+#include <new>
 
 namespace rtc {
 
 #define _TO_RAY_STATE(s) reinterpret_cast<RayState&>( (s) )
 #define _TO_RAY_PACKET_STATE(s) reinterpret_cast<rtc::RayPacketState&>( (s) )
 
-#define _TO_RT_STATE(s) reinterpret_cast<rts::RTstate&>( (s) )
-
 #define KU _modulo[acc.k+1]
 #define KV _modulo[acc.k+2]
 
-#define QKU _quadModulo[acc.k+1]
-#define QKV _quadModulo[acc.k+2]
+// Indices of RayTracer::Context::packetStacks
+static const unsigned int INSTANCE_STACK = 0;
+static const unsigned int GEOMETRY_STACK = 1;
+static const unsigned int SHADOW_INSTANCE_STACK = 2;
+static const unsigned int SHADOW_GEOMETRY_STACK = 3;
+
+// Owns the contexts of all threads that ever traced a ray, freed at exit
+class ContextPool
+{
+public:
+	~ContextPool()
+	{
+		for( unsigned int i = 0; i < _contexts.size(); ++i )
+		{
+			_contexts[i]->~Context();
+			_mm_free( _contexts[i] );
+		}
+	}
 
-__declspec(thread) static RayTracer::SingleStack s_instanceStack;
-__declspec(thread) static RayTracer::SingleStack s_geometryStack;
-__declspec(thread) static unsigned int* s_dirSigns;
+	RayTracer::Context* create()
+	{
+		// Packet stacks need 16-byte alignment
+		void* memory = _mm_malloc( sizeof( RayTracer::Context ), 16 );
+		RayTracer::Context* context = new( memory ) RayTracer::Context;
+		context->dirSigns = NULL;
+		context->queueRays = false;
+		context->singleMailbox.clear();
+		context->packetMailbox.clear();
+		memset( &context->stats, 0, sizeof( RayTracer::Statistics ) );
+
+		#pragma omp critical( rtc_raytracer_contexts )
+		_contexts.push_back( context );
+
+		return context;
+	}
 
-// Needs to be cache aligned to 16 bytes, cannot be inside thread local storage!
-static RayTracer::PacketStack s_packetStacks[RT_MAX_THREAD_COUNT][2];
+	void sumStatistics( RayTracer::Statistics& result )
+	{
+		memset( &result, 0, sizeof( RayTracer::Statistics ) );
 
-static const unsigned int INSTANCE_STACK = 0;
-static const unsigned int GEOMETRY_STACK = 1;
-	
-static const float INTERSECT_EPSILON = 1e-4f;
-static const __m128 SSE_INTERSECT_EPSILON = _mm_set_ps1( INTERSECT_EPSILON );
+		#pragma omp critical( rtc_raytracer_contexts )
+		for( unsigned int i = 0; i < _contexts.size(); ++i )
+		{
+			const RayTracer::Statistics& stats = _contexts[i]->stats;
+			result.singleTests += stats.singleTests;
+			result.packetTests += stats.packetTests;
+			result.singleSkips += stats.singleSkips;
+			result.packetSkips += stats.packetSkips;
+			result.packetTraversals += stats.packetTraversals;
+			result.packetFallbacks += stats.packetFallbacks;
+			result.fallbackRays += stats.fallbackRays;
+			result.streamRays += stats.streamRays;
+			result.streamPackets += stats.streamPackets;
+		}
+	}
+
+	void resetStatistics()
+	{
+		#pragma omp critical( rtc_raytracer_contexts )
+		for( unsigned int i = 0; i < _contexts.size(); ++i )
+		{
+			memset( &_contexts[i]->stats, 0, sizeof( RayTracer::Statistics ) );
+		}
+	}
+
+private:
+	std::vector<RayTracer::Context*> _contexts;
+};
+
+static ContextPool s_contextPool;
+
+// Only a pointer in thread local storage, which cannot hold aligned data
+static RTU_THREAD_LOCAL RayTracer::Context* s_context = NULL;
+
+// Packet kernels used by all ray tracers, see RayTracer::setSimdWidth
+static const RayTracer::PacketKernels* s_packetKernels = NULL;
+
+// Number of rays set in a packet mask
+static RTU_FORCEINLINE unsigned int activeRayCount( const __m128 mask4[RT_PACKET_SIMD_SIZE] )
+{
+	// Set bits in each 4-bit movemask
+	static const unsigned int BIT_COUNT[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+	unsigned int count = 0;
+	for( int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+	{
+		count += BIT_COUNT[_mm_movemask_ps( mask4[p] )];
+	}
+	return count;
+}
 
 RayTracer::RayTracer()
 {
@@ -36,11 +114,10 @@ RayTracer::RayTracer()
 	_modulo[3] = 0;
 	_modulo[4] = 1;
 
-	_quadModulo[0] = 0;
-	_quadModulo[1] = 4;
-	_quadModulo[2] = 8;
-	_quadModulo[3] = 0;
-	_quadModulo[4] = 4;
+	for( int i = 0; i < 5; ++i )
+	{
+		_packetModulo[i] = _modulo[i] * RT_PACKET_SIZE;
+	}
 
 	/*
 	 *	000 111
@@ -61,6 +138,76 @@ RayTracer::RayTracer()
 		_rayDirSigns[i][1][0] = rdy, _rayDirSigns[i][1][1] = rdy ^ 1;
 		_rayDirSigns[i][2][0] = rdz, _rayDirSigns[i][2][1] = rdz ^ 1;
 	}
+
+	// Widest kernels by default, until the first call to setSimdWidth
+	if( s_packetKernels == NULL )
+		setSimdWidth( maxSimdWidth() );
+}
+
+RayTracer::Context& RayTracer::context()
+{
+	if( s_context == NULL )
+		s_context = s_contextPool.create();
+
+	return *s_context;
+}
+
+void RayTracer::statistics( Statistics& result )
+{
+	s_contextPool.sumStatistics( result );
+}
+
+void RayTracer::resetStatistics()
+{
+	s_contextPool.resetStatistics();
+}
+
+unsigned int RayTracer::maxSimdWidth()
+{
+	const unsigned int cpuWidth = rtu::Cpu::simdWidth();
+
+	if( ( cpuWidth >= 16 ) && ( avx512Kernels() != NULL ) )
+		return 16;
+
+	if( ( cpuWidth >= 8 ) && ( avx2Kernels() != NULL ) )
+		return 8;
+
+	return 4;
+}
+
+unsigned int RayTracer::setSimdWidth( unsigned int width )
+{
+	const unsigned int cpuWidth = rtu::Cpu::simdWidth();
+	const PacketKernels* kernels = NULL;
+
+	// Fall back to narrower kernels if these were not compiled in
+	if( ( width >= 16 ) && ( cpuWidth >= 16 ) )
+		kernels = avx512Kernels();
+
+	if( ( kernels == NULL ) && ( width >= 8 ) && ( cpuWidth >= 8 ) )
+		kernels = avx2Kernels();
+
+	if( kernels == NULL )
+		kernels = sseKernels();
+
+	s_packetKernels = kernels;
+	return kernels->simdWidth;
+}
+
+unsigned int RayTracer::simdWidth()
+{
+	if( s_packetKernels == NULL )
+		setSimdWidth( maxSimdWidth() );
+
+	return s_packetKernels->simdWidth;
+}
+
+const RayTracer::PacketKernels* RayTracer::sseKernels()
+{
+	static const PacketKernels s_kernels = { 4, &RayTracer::findLeafPacketSimd<rtu::Simd4>,
+		                                     &RayTracer::intersectPacketSimd<rtu::Simd4>,
+		                                     &RayTracer::clipRayPacketSimd<rtu::Simd4> };
+	return &s_kernels;
 }
 
 void RayTracer::bruteFroce( rts::RTstate& state )
@@ -93,7 +240,7 @@ void RayTracer::bruteFroce( rts::RTstate& state )
 
 	for( unsigned int i = 0, limit = triangles.size(); i < limit; ++i )
 	{
-		intersectSingle( geometry.triAccel[geometry.kdTree.elements[i]], ray, hit, bestDistance );
+		intersectSingle( triangles[i], ray, hit, bestDistance );
 	}
 
 	if( bestDistance < hit.distance )
@@ -131,7 +278,7 @@ bool RayTracer::bruteForceShadow( rts::RTstate& state )
 
 	for( unsigned int i = 0, limit = triangles.size(); i < limit; ++i )
 	{
-		intersectSingle( geometry.triAccel[geometry.kdTree.elements[i]], ray, hit, bestDistance );
+		intersectSingle( triangles[i], ray, hit, bestDistance );
 	}
 
 	if( bestDistance < hit.distance )
@@ -145,6 +292,13 @@ bool RayTracer::bruteForceShadow( rts::RTstate& state )
 
 // Trace a single ray against the entire scene
 void RayTracer::traceSingle( rts::RTstate& state )
+{
+	findHitSingle( state );
+	shadeSingle( state );
+}
+
+// Find closest hit of a single ray against the entire scene, hit geometry stays NULL if ray hits nothing
+void RayTracer::findHitSingle( rts::RTstate& state )
 {
 	RayState& rs = _TO_RAY_STATE( state );
 	Ray& ray = rs.ray;
@@ -163,18 +317,16 @@ void RayTracer::traceSingle( rts::RTstate& state )
 	const KdTree& tree = Scene::instanceTree;
 
 	if( !tree.bbox.clipRay( ray ) )
-	{
-		Plugins::environment->shade( state );
 		return;
-	}
 
+	Context& ctx = context();
 	const Ray originalRay( ray );
 	const KdNode* node = tree.root;
-    s_instanceStack.clear();
+    ctx.instanceStack.clear();
 
 	while( true )
 	{
-		findLeafSingle( node, ray, s_instanceStack );
+		findLeafSingle( node, ray, ctx.instanceStack );
 
 		for( unsigned int i = node->elemStart(), limit = i + node->elemCount(); i < limit; ++i )
 		{
@@ -188,46 +340,117 @@ void RayTracer::traceSingle( rts::RTstate& state )
 			ray = originalRay;
 		}
 
-		if( hit.geometry )
-		{
-			Plugins::materials[hit.geometry->triDesc[hit.triangleId].materialId]->shade( state );
+		if( hit.geometry || ctx.instanceStack.empty() )
 			return;
+
+		const TraversalData& data = ctx.instanceStack.top();
+		ctx.instanceStack.pop();
+		node = data.node;
+		ray.tnear = data.tnear;
+		ray.tfar = data.tfar;
+	}
+}
+
+void RayTracer::shadeSingle( rts::RTstate& state )
+{
+	const Hit& hit = _TO_RAY_STATE( state ).hit;
+
+	if( hit.geometry )
+		Plugins::materials[hit.geometry->triDesc[hit.triangleId].materialId]->shade( state );
+	else
+		Plugins::environment->shade( state );
+}
+
+// Shade traced rays sorted by material, so that each material's code and data are used for all of its rays at once
+void RayTracer::shadeBatch( rts::RTstate* const states[], unsigned int count )
+{
+	Context& ctx = context();
+	ShadeBatch& scratch = ctx.shadeBatches.push();
+	std::vector<rtu::uint64>& keys = scratch.keys;
+	std::vector<rts::RTstate*>& sorted = scratch.states;
+
+	// Material id + 1 (0 for the environment), then index in states to keep their order within each material
+	keys.resize( count );
+	for( unsigned int i = 0; i < count; ++i )
+	{
+		const Hit& hit = _TO_RAY_STATE( *states[i] ).hit;
+		const rtu::uint64 material = hit.geometry ? hit.geometry->triDesc[hit.triangleId].materialId + 1 : 0;
+		keys[i] = ( material << 32 ) | i;
+	}
+
+	std::sort( keys.begin(), keys.end() );
+
+	sorted.resize( count );
+	for( unsigned int i = 0; i < count; ++i )
+	{
+		sorted[i] = states[keys[i] & 0xFFFFFFFF];
+	}
+
+	for( unsigned int first = 0; first < count; )
+	{
+		const unsigned int material = static_cast<unsigned int>( keys[first] >> 32 );
+
+		unsigned int last = first + 1;
+		while( ( last < count ) && ( ( keys[last] >> 32 ) == material ) )
+		{
+			++last;
 		}
 
-		if( s_instanceStack.empty() )
+		if( material == 0 )
 		{
-			Plugins::environment->shade( state );
-			return;
+			for( unsigned int i = first; i < last; ++i )
+			{
+				Plugins::environment->shade( *sorted[i] );
+			}
+		}
+		else
+		{
+			Plugins::materials[material - 1]->shadeBatch( &sorted[first], last - first );
 		}
 
-		const TraversalData& data = s_instanceStack.top();
-		s_instanceStack.pop();
-		node = data.node;
-		ray.tnear = data.tnear;
-		ray.tfar = data.tfar;
+		first = last;
 	}
+
+	ctx.shadeBatches.pop();
 }
 
 void RayTracer::traceGeometrySingle( const Instance& instance, Ray& ray, Hit& hit )
 {
 	const Geometry& geometry = Scene::geometries[instance.geometryId];
+
+	if( geometry.accelStructure == RT_ACCEL_BVH4 )
+	{
+		if( !geometry.bvh.bbox.clipRay( ray ) )
+			return;
+
+		float bestDistance = hit.distance;
+		traceBvhSingle( geometry, ray, hit, bestDistance );
+
+		if( bestDistance < hit.distance )
+		{
+			hit.distance = bestDistance;
+			hit.instance = &instance;
+			hit.geometry = &geometry;
+		}
+		return;
+	}
+
 	const KdTree& tree = geometry.kdTree;
 
 	if( !tree.bbox.clipRay( ray ) )
 		return;
 
+	Context& ctx = context();
 	const KdNode* node = tree.root;
 	float bestDistance = hit.distance;
-    s_geometryStack.clear();
+    ctx.geometryStack.clear();
+	ctx.singleMailbox.reset();
 
 	while( true )
 	{
-		findLeafSingle( node, ray, s_geometryStack );
+		findLeafSingle( node, ray, ctx.geometryStack );
 
-		for( unsigned int i = node->elemStart(), limit = i + node->elemCount(); i < limit; ++i )
-		{
-			intersectSingle( geometry.triAccel[tree.elements[i]], ray, hit, bestDistance );
-		}
+		intersectLeafSingle( ctx, true, geometry.leafTriangles, node->elemStart(), node->elemCount(), ray, hit, bestDistance );
 
 		if( bestDistance < hit.distance )
 		{
@@ -237,11 +460,11 @@ void RayTracer::traceGeometrySingle( const Instance& instance, Ray& ray, Hit& hi
 			return;
 		}
 
-		if( s_geometryStack.empty() )
+		if( ctx.geometryStack.empty() )
 			return;
 
-		const TraversalData& data = s_geometryStack.top();
-		s_geometryStack.pop();
+		const TraversalData& data = ctx.geometryStack.top();
+		ctx.geometryStack.pop();
 		node = data.node;
 		ray.tnear = data.tnear;
 		ray.tfar = data.tfar;
@@ -263,13 +486,14 @@ bool RayTracer::traceHitSingle( rts::RTstate& state )
 	if( !tree.bbox.clipRay( ray ) )
 		return false;
 
+	Context& ctx = context();
 	const Ray originalRay( ray );
 	const KdNode* node = tree.root;
-	s_instanceStack.clear();
+	ctx.instanceStack.clear();
 
 	while( true )
 	{
-		findLeafSingle( node, ray, s_instanceStack );
+		findLeafSingle( node, ray, ctx.instanceStack );
 
 		for( unsigned int i = node->elemStart(), limit = i + node->elemCount(); i < limit; ++i )
 		{
@@ -281,62 +505,36 @@ bool RayTracer::traceHitSingle( rts::RTstate& state )
 			//////////////////////////////////////////////////////////////////////////
 			// Trace Geometry Single
 			const Geometry& geometry = Scene::geometries[instance.geometryId];
+
+			if( geometry.accelStructure == RT_ACCEL_BVH4 )
+			{
+				if( geometry.bvh.bbox.clipRay( ray ) && traceBvhHitSingle( geometry, ray ) )
+					return true;
+
+				ray = originalRay;
+				continue;
+			}
+
 			const KdTree& gtree = geometry.kdTree;
 
 			if( gtree.bbox.clipRay( ray ) )
 			{
 				const KdNode* gnode = gtree.root;
-				s_geometryStack.clear();
+				ctx.geometryStack.clear();
+				ctx.singleMailbox.reset();
 
 				while( true )
 				{
-					findLeafSingle( gnode, ray, s_geometryStack );
+					findLeafSingle( gnode, ray, ctx.geometryStack );
 
-					for( unsigned int i = gnode->elemStart(), limit = i + gnode->elemCount(); i < limit; ++i )
-					{
-						//////////////////////////////////////////////////////////////////////////
-						// Intersect Single
-						const TriAccel& acc = geometry.triAccel[gtree.elements[i]];
-
-						// Start high-latency division as early as possible
-						const float nd = 1.0f / ( ray.direction[acc.k] + acc.n_u * ray.direction[KU] + acc.n_v * ray.direction[KV] );
-						const float f = nd * ( acc.n_d - ray.origin[acc.k] - acc.n_u * ray.origin[KU] - acc.n_v * ray.origin[KV] );
-
-						// Check for valid distance
-						// TODO: find a correct way to get rid of these epsilons and check scene06 for any errors
-						if( ( f < ray.tnear - INTERSECT_EPSILON ) || ( f > ray.tfar + INTERSECT_EPSILON ) )
-							continue;
-
-						// Compute hit point positions on uv plane
-						const float hu = ray.origin[KU] + f * ray.direction[KU];
-						const float hv = ray.origin[KV] + f * ray.direction[KV];
-
-						// Check first barycentric coordinate
-						const float lambda = hu * acc.b_nu + hv * acc.b_nv + acc.b_d;
-						if( lambda < 0.0f )
-							continue;
-
-						// Check second barycentric coordinate
-						const float mue = hu * acc.c_nu + hv * acc.c_nv + acc.c_d;
-						if( mue < 0.0f )
-							continue;
-
-						// Check third barycentric coordinate
-						const float psi = 1.0f - lambda - mue;
-						if( psi < 0.0f )
-							continue;
-
-						// Valid hit
+					if( intersectLeafHitSingle( ctx, true, geometry.leafTriangles, gnode->elemStart(), gnode->elemCount(), ray ) )
 						return true;
-						// Intersect Single
-						//////////////////////////////////////////////////////////////////////////
-					}
 
-					if( s_geometryStack.empty() )
+					if( ctx.geometryStack.empty() )
 						break;
 
-					const TraversalData& gdata = s_geometryStack.top();
-					s_geometryStack.pop();
+					const TraversalData& gdata = ctx.geometryStack.top();
+					ctx.geometryStack.pop();
 					gnode = gdata.node;
 					ray.tnear = gdata.tnear;
 					ray.tfar = gdata.tfar;
@@ -348,25 +546,25 @@ bool RayTracer::traceHitSingle( rts::RTstate& state )
 			ray = originalRay;
 		}
 
-		if( s_instanceStack.empty() )
+		if( ctx.instanceStack.empty() )
 			return false;
 
-		const TraversalData& data = s_instanceStack.top();
-		s_instanceStack.pop();
+		const TraversalData& data = ctx.instanceStack.top();
+		ctx.instanceStack.pop();
 		node = data.node;
 		ray.tnear = data.tnear;
 		ray.tfar = data.tfar;
 	}
 }
 
-// Trace a bundle of rays against the entire scene
+// Find closest hits of a bundle of rays against the entire scene
 void RayTracer::tracePacket( rts::RTstate& state, unsigned int inQ )
 {
-	RayState shadeState;
 	RayPacketState& rs = _TO_RAY_PACKET_STATE( state );
 	RayPacket& packet = rs.packet;
 	HitPacket& hit = rs.hit;
 	const KdTree& tree = Scene::instanceTree;
+	Context& ctx = context();
 
 	// Init ray
 	// Packet pre-computation is done outside, to detect incoherent ray bundles
@@ -374,7 +572,18 @@ void RayTracer::tracePacket( rts::RTstate& state, unsigned int inQ )
 	std::fill_n( packet.tfar, RT_PACKET_SIZE, rtu::mathf::MAX_VALUE );
 
 	// Get ray direction sign bits according to coherence masks computed
-	s_dirSigns = &_rayDirSigns[inQ][0][0];
+	ctx.dirSigns = &_rayDirSigns[inQ][0][0];
+
+	// Init hit of traced rays only, the others keep the hits found in previous calls (incoherent packets)
+	for( unsigned int r = 0; r < RT_PACKET_SIZE; ++r )
+	{
+		if( packet.mask[r] == 0 )
+			continue;
+
+		hit.inst[r] = NULL;
+		hit.geom[r] = NULL;
+		hit.dist[r] = rtu::mathf::MAX_VALUE;
+	}
 
 	// Active ray mask for instance traversal and intersection
 	union
@@ -386,30 +595,10 @@ void RayTracer::tracePacket( rts::RTstate& state, unsigned int inQ )
 	// Clip rays against scene bounding box
 	// Disable incoherent rays using packet.mask4
 	if( !clipRayPacket( tree.bbox, packet, packet.mask4, activeMask4 ) )
-	{
-		// TODO: very slow, need to improve this!
-		for( int r = 0; r < RT_PACKET_SIZE; ++r )
-		{
-			// Skip if incoherent ray (will be traced later)
-			if( packet.mask[r] == 0 )
-				continue;
-
-			// Setup state for shading
-			setupShadingRay( shadeState.ray, packet, r );
-			shadeState.recursionDepth = rs.recursionDepth[r];
-			Plugins::environment->shade( _TO_RT_STATE( shadeState ) );
-			rs.resultColor[r] = shadeState.resultColor;
-		}
 		return;
-	}
-
-	// Init hit
-	std::fill_n( reinterpret_cast<unsigned int*>( hit.inst ), RT_PACKET_SIZE, NULL );
-	std::fill_n( reinterpret_cast<unsigned int*>( hit.geom ), RT_PACKET_SIZE, NULL );
-	std::fill_n( hit.dist, RT_PACKET_SIZE, rtu::mathf::MAX_VALUE );
 
 	// Mask for early ray termination
-	// Identifies rays that have completed tracing, including shading computations
+	// Identifies rays that have found their closest hit
 	union
 	{
 		unsigned int done[RT_PACKET_SIZE];
@@ -426,12 +615,12 @@ void RayTracer::tracePacket( rts::RTstate& state, unsigned int inQ )
 	bool allHit;
 	const RayPacket originalPacket( packet );
 	const KdNode* node = tree.root;
-	PacketStack& s_instancePacketStack = s_packetStacks[omp_get_thread_num()][INSTANCE_STACK];
-	s_instancePacketStack.clear();
+	PacketStack& instancePacketStack = ctx.packetStacks[INSTANCE_STACK];
+	instancePacketStack.clear();
 
 	while( true )
 	{
-		findLeafPacket( node, packet, s_instancePacketStack, activeMask4 );
+		findLeafPacket( node, packet, instancePacketStack, activeMask4 );
 
 		for( unsigned int i = node->elemStart(), limit = i + node->elemCount(); i < limit; ++i )
 		{
@@ -466,20 +655,19 @@ void RayTracer::tracePacket( rts::RTstate& state, unsigned int inQ )
 								packet.mask[i1] = originalPacket.mask[i1];
 						}
 						packet.isCoherent = false;
-						s_dirSigns = &_rayDirSigns[q][0][0];
+						ctx.dirSigns = &_rayDirSigns[q][0][0];
 						traceGeometryPacket( instance, packet, hit, activeMask4 );
 					}
 				}
 			}
 
-			s_dirSigns = &_rayDirSigns[inQ][0][0];
+			ctx.dirSigns = &_rayDirSigns[inQ][0][0];
 			packet = originalPacket;
 		}
 
 		// Check early exit
 		allHit = true;
 
-		// TODO: very slow, need to improve this!
 		for( int r = 0; r < RT_PACKET_SIZE; ++r )
 		{
 			const bool haveHit = hit.geom[r] != NULL;
@@ -489,46 +677,18 @@ void RayTracer::tracePacket( rts::RTstate& state, unsigned int inQ )
 				continue;
 
 			// Update early termination
-			done[r] |= activeMask[r] & ( ( hit.geom[r] != NULL ) ? 0xFFFFFFFF : 0 );
+			done[r] |= activeMask[r] & ( haveHit ? 0xFFFFFFFF : 0 );
 			activeMask[r] &= ~done[r];
-
-			if( !haveHit )
-				continue;
-
-			// Setup state for shading
-			setupShadingRay( shadeState.ray, packet, r );
-			setupShadingHit( shadeState.hit, hit, r );
-			shadeState.recursionDepth = rs.recursionDepth[r];
-			Plugins::materials[hit.geom[r]->triDesc[hit.tId[r]].materialId]->shade( _TO_RT_STATE( shadeState ) );
-			rs.resultColor[r] = shadeState.resultColor;
 		}
 
 		// Early ray termination
-		if( allHit )
-			return;
-
-		if( s_instancePacketStack.empty() )
-		{
-			// TODO: very slow, need to improve this!
-			for( int r = 0; r < RT_PACKET_SIZE; ++r )
-			{
-				// Skip if incoherent ray or if have hit (already computed shading for these)
-				if( ( packet.mask[r] == 0 ) || ( hit.geom[r] != NULL ) )
-					continue;
-
-				// Setup state for shading
-				setupShadingRay( shadeState.ray, packet, r );
-				shadeState.recursionDepth = rs.recursionDepth[r];
-				Plugins::environment->shade( _TO_RT_STATE( shadeState ) );
-				rs.resultColor[r] = shadeState.resultColor;
-			}
+		if( allHit || instancePacketStack.empty() )
 			return;
-		}
 
-		const PacketTraversalData& data = s_instancePacketStack.top();
-		s_instancePacketStack.pop();
+		const PacketTraversalData& data = instancePacketStack.top();
+		instancePacketStack.pop();
 
-		// Deactivate rays that are done (found a valid hit and have already been shaded)
+		// Deactivate rays that are done (found a valid hit)
 		node = data.node;
 		packet.tnear4[0] = data.tnear4[0];
 		packet.tfar4[0] = data.tfar4[0];
@@ -548,109 +708,377 @@ void RayTracer::tracePacket( rts::RTstate& state, unsigned int inQ )
 	}
 }
 
-// Disable pointer truncation warning
-#pragma warning( disable : 4311 )
+// Trace all rays of a stream, in packets of rays with the same direction signs and nearby origins
+void RayTracer::traceStream( RayStream& stream )
+{
+	Context& ctx = context();
+	if( ctx.queueRays )
+	{
+		queueStream( ctx, stream );
+		return;
+	}
+
+	stream.sort( Scene::instanceTree.bbox );
 
-void RayTracer::traceGeometryPacket( const Instance& instance, RayPacket& packet, HitPacket& hit,
-									 __m128 instActiveMask4[RT_PACKET_SIMD_SIZE] )
+	const RayStream::Entry* rays[RT_STREAM_SIZE];
+	unsigned int octants[RT_STREAM_SIZE];
+	for( unsigned int i = 0; i < stream.count; ++i )
+	{
+		rays[i] = &stream.sorted( i );
+		octants[i] = stream.octant( i );
+	}
+
+	traceSorted( ctx, rays, octants, stream.count );
+	stream.clear();
+}
+
+// Starts queueing the rays of streams traced by the calling thread
+void RayTracer::beginQueue()
 {
-	const Geometry& geometry = Scene::geometries[instance.geometryId];
-	const KdTree& tree = geometry.kdTree;
+	Context& ctx = context();
+	ctx.queueRays = true;
+	ctx.queuedRays.clear();
+}
 
-	// Active ray mask for geometry traversal and intersection
-	union
-	{ 
-		unsigned int activeMask[RT_PACKET_SIZE];
-		__m128       activeMask4[RT_PACKET_SIMD_SIZE];
-	};
+// Stops queueing, forgetting rays not traced yet
+void RayTracer::endQueue()
+{
+	Context& ctx = context();
+	ctx.queueRays = false;
+	ctx.queuedRays.clear();
+}
 
-	// Clip ray packet against geometry bounding box
-	// Disable rays that we don't need to trace with instActiveMask4 (incoherent rays were previously disabled)
-	if( !clipRayPacket( tree.bbox, packet, instActiveMask4, activeMask4 ) )
-		return;
+// Trace all rays queued by the calling thread, queueing the rays enqueued by their shaders for the next call
+unsigned int RayTracer::traceQueue()
+{
+	Context& ctx = context();
+	std::vector<RayStream::Entry>& rays = ctx.tracedRays;
+	rays.swap( ctx.queuedRays );
+	ctx.queuedRays.clear();
+
+	const unsigned int count = static_cast<unsigned int>( rays.size() );
+	if( count == 0 )
+		return 0;
+
+	// Sort key in high bits, ray index in low bits
+	const AABB& bounds = Scene::instanceTree.bbox;
+	const rtu::float3 scale = RayStream::cellScale( bounds );
+	std::vector<rtu::uint64>& keys = ctx.queueKeys;
+	keys.resize( count );
+	for( unsigned int i = 0; i < count; ++i )
+	{
+		keys[i] = ( static_cast<rtu::uint64>( RayStream::sortKey( rays[i], bounds, scale ) ) << 32 ) | i;
+	}
+	std::sort( keys.begin(), keys.end() );
 
-	// Save previous best distances
-	union
+	// Trace sorted rays in chunks of a stream, shaders queue new rays in ctx.queuedRays meanwhile
+	const RayStream::Entry* chunk[RT_STREAM_SIZE];
+	unsigned int octants[RT_STREAM_SIZE];
+	for( unsigned int first = 0; first < count; first += RT_STREAM_SIZE )
 	{
-		float  bestDist[RT_PACKET_SIZE];
-		__m128 bestDist4[RT_PACKET_SIMD_SIZE];
-	};
-	std::copy( hit.dist, hit.dist + RT_PACKET_SIZE, bestDist );
+		const unsigned int chunkSize = std::min( count - first, static_cast<unsigned int>( RT_STREAM_SIZE ) );
+		for( unsigned int i = 0; i < chunkSize; ++i )
+		{
+			const rtu::uint64 key = keys[first + i];
+			chunk[i] = &rays[static_cast<unsigned int>( key )];
+			octants[i] = RayStream::keyOctant( static_cast<unsigned int>( key >> 32 ) );
+		}
 
-	// Mask for early ray termination
-	__m128 done4[RT_PACKET_SIMD_SIZE];
+		traceSorted( ctx, chunk, octants, chunkSize );
+	}
 
-	// No need to trace rays that came disabled from instance (i.e. incoherent)
-	// Additionally, no need to trace clipped rays as well
-	for( int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+	rays.clear();
+	return count;
+}
+
+// Moves rays of stream to the queue, adding their results to their paths' targets
+void RayTracer::queueStream( Context& ctx, RayStream& stream )
+{
+	for( unsigned int i = 0; i < stream.count; ++i )
 	{
-		done4[p] = _mm_andnot_ps( activeMask4[p], rtu::SSE_ALL_ON );
+		// Nowhere to add result
+		const RayStream::Entry& ray = stream.rays[i];
+		if( ray.pathTarget == NULL )
+			continue;
+
+		ctx.queuedRays.push_back( ray );
+		RayStream::Entry& queued = ctx.queuedRays.back();
+		queued.weight = ray.weight * ray.pathWeight;
+		queued.target = ray.pathTarget;
+		queued.pathWeight = queued.weight;
+		queued.pathTarget = queued.target;
 	}
+	stream.clear();
+}
 
-	// Mask for updating hit data
-	union
-	{
-		__m128  mask4;
-		__m128i imask4;
-	};
+// Trace rays sorted by octant, in batches of packets: all packets of a batch are traced, then all of them shaded
+void RayTracer::traceSorted( Context& ctx, const RayStream::Entry* const* rays, const unsigned int* octants,
+							 unsigned int count )
+{
+	ctx.stats.streamRays += count;
 
-	bool allHit;
-	const KdNode* node = tree.root;
-	PacketStack& s_geometryPacketStack = s_packetStacks[omp_get_thread_num()][GEOMETRY_STACK];
-	s_geometryPacketStack.clear();
+	StreamBatch& batch = ctx.streamBatches.push();
+	unsigned int batchSize = 0;
 
-	while( true )
+	for( unsigned int first = 0, last; first < count; first = last )
 	{
-		findLeafPacket( node, packet, s_geometryPacketStack, activeMask4 );
+		// Next sorted rays in the same octant, up to a packet
+		const unsigned int octant = octants[first];
+		for( last = first + 1; ( last < count ) && ( last - first < RT_PACKET_SIZE ); ++last )
+		{
+			if( octants[last] != octant )
+				break;
+		}
 
-		if( node->elemCount() > 0 )
+		if( last - first < Scene::packetMinActiveRays )
 		{
-			for( unsigned int i = node->elemStart(), limit = i + node->elemCount(); i < limit; ++i )
+			// Too few rays left in the octant to fill a packet, trace them one at a time
+			RayState& rs = _TO_RAY_STATE( batch.single );
+			for( unsigned int i = first; i < last; ++i )
 			{
-				intersectPacket( geometry.triAccel[tree.elements[i]], packet, hit, bestDist4, activeMask4 );
+				const RayStream::Entry& ray = *rays[i];
+				rs.ray.origin = ray.origin;
+				rs.ray.direction = ray.direction;
+				rs.recursionDepth = ray.recursionDepth;
+				rs.random = ray.random;
+				rs.pixel = ray.pixel;
+				rs.sample = ray.sample;
+				rs.sampleDimension = ray.sampleDimension;
+				rs.pathWeight = ray.pathWeight;
+				rs.pathTarget = ray.pathTarget;
+
+				traceSingle( batch.single );
+				*ray.target += rs.resultColor * ray.weight;
 			}
-
-			// Check early exit
-			allHit = true;
-
-			// TODO: very slow, need to improve this!
-			for( int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+		}
+		else
+		{
+			// Packet rays share the random numbers and sample dimension of the first one,
+			// disabled rays copy the first one to keep the packet coherent
+			RayPacketState& rps = _TO_RAY_PACKET_STATE( batch.packets[batchSize] );
+			RayPacket& packet = rps.packet;
+			const RayStream::Entry& head = *rays[first];
+			rps.random = head.random;
+			rps.sampleDimension = head.sampleDimension;
+
+			for( unsigned int r = 0; r < RT_PACKET_SIZE; ++r )
 			{
-				// TODO: branch here? if( _mm_movemask_ps( activeMask4[r] ) == 0 ) continue;
+				const bool enabled = ( first + r < last );
+				const RayStream::Entry& ray = enabled ? *rays[first + r] : head;
+				packet.ox[r] = ray.origin.x; packet.oy[r] = ray.origin.y; packet.oz[r] = ray.origin.z;
+				packet.dx[r] = ray.direction.x; packet.dy[r] = ray.direction.y; packet.dz[r] = ray.direction.z;
+				packet.mask[r] = enabled ? 0xFFFFFFFF : 0;
+				rps.recursionDepth[r] = ray.recursionDepth;
+				rps.pixel[r] = ray.pixel;
+				rps.sample[r] = ray.sample;
+				rps.pathWeight[r] = ray.pathWeight.x;
+				rps.pathWeight[RT_PACKET_SIZE+r] = ray.pathWeight.y;
+				rps.pathWeight[RT_PACKET_SIZE*2+r] = ray.pathWeight.z;
+				rps.pathTarget[r] = ray.pathTarget;
+			}
 
-				// If we found a hit in an active ray
-				mask4 = _mm_and_ps( activeMask4[p], _mm_cmplt_ps( bestDist4[p], hit.dist4[p] ) );
+			batch.octants[batchSize] = octant;
+			batch.rays[batchSize] = rays + first;
+			batch.counts[batchSize] = last - first;
+			++batchSize;
+		}
 
-				// TODO: branch here? if( _mm_movemask_ps( mask4 ) == 0 ) continue;
+		// Wait for a full batch, or the last rays
+		if( ( batchSize == 0 ) || ( ( batchSize < STREAM_BATCH_SIZE ) && ( last < count ) ) )
+			continue;
 
-				// Update hit parameters
-				hit.dist4[p] = _mm_or_ps( _mm_andnot_ps( mask4, hit.dist4[p] ), _mm_and_ps( mask4, bestDist4[p] ) );
-				hit.inst4[p] = _mm_or_si128( _mm_andnot_si128( imask4, hit.inst4[p] ), _mm_and_si128( imask4, _mm_set1_epi32( (unsigned int)&instance ) ) );
-				hit.geom4[p] = _mm_or_si128( _mm_andnot_si128( imask4, hit.geom4[p] ), _mm_and_si128( imask4, _mm_set1_epi32( (unsigned int)&geometry ) ) );
+		// Trace all packets of the batch, then shade them
+		for( unsigned int b = 0; b < batchSize; ++b )
+		{
+			_TO_RAY_PACKET_STATE( batch.packets[b] ).packet.preCompute();
+			tracePacket( batch.packets[b], batch.octants[b] );
+		}
 
-				// Update early termination
-				done4[p] = _mm_or_ps( done4[p], mask4 );
-				allHit &= ( _mm_movemask_ps( done4[p] ) == 0xF );
-			}
+		for( unsigned int b = 0; b < batchSize; ++b )
+		{
+			shadePacket( batch.packets[b] );
 
-			// Early ray termination
-			if( allHit )
-				return;
+			const RayPacketState& shaded = _TO_RAY_PACKET_STATE( batch.packets[b] );
+			for( unsigned int r = 0; r < batch.counts[b]; ++r )
+			{
+				const RayStream::Entry& ray = *batch.rays[b][r];
+				const rtu::float3 color( shaded.resultColor[r], shaded.resultColor[RT_PACKET_SIZE+r], shaded.resultColor[RT_PACKET_SIZE*2+r] );
+				*ray.target += color * ray.weight;
+			}
 		}
 
-		if( s_geometryPacketStack.empty() )
-			return;
+		ctx.stats.streamPackets += batchSize;
+		batchSize = 0;
+	}
 
-		const PacketTraversalData& data = s_geometryPacketStack.top();
-		s_geometryPacketStack.pop();
+	ctx.streamBatches.pop();
+}
 
-		// Deactivate rays that found a valid hit
-		node = data.node;
-		packet.tnear4[0] = data.tnear4[0];
-		packet.tfar4[0] = data.tfar4[0];
-		activeMask4[0] = _mm_andnot_ps( done4[0], _mm_cmple_ps( data.tnear4[0], data.tfar4[0] ) );
+// Shade traced rays of the packet (packet.mask), one call for each material hit and one for the environment
+void RayTracer::shadePacket( rts::RTstate& state )
+{
+	RayPacketState& rs = _TO_RAY_PACKET_STATE( state );
+	const RayPacket& packet = rs.packet;
+	const HitPacket& hit = rs.hit;
 
-		packet.tnear4[1] = data.tnear4[1];
+	// Rays not shaded yet
+	union
+	{
+		unsigned int hitMask[RT_PACKET_SIZE];
+		__m128       hitMask4[RT_PACKET_SIMD_SIZE];
+	};
+
+	// Rays shaded by current plugin
+	union
+	{
+		unsigned int shadeMask[RT_PACKET_SIZE];
+		__m128       shadeMask4[RT_PACKET_SIMD_SIZE];
+	};
+
+	unsigned int materialIds[RT_PACKET_SIZE];
+	for( int r = 0; r < RT_PACKET_SIZE; ++r )
+	{
+		hitMask[r] = ( ( packet.mask[r] != 0 ) && ( hit.geom[r] != NULL ) ) ? 0xFFFFFFFF : 0;
+		if( hitMask[r] != 0 )
+			materialIds[r] = hit.geom[r]->triDesc[hit.tId[r]].materialId;
+	}
+
+	// Rays that missed everything
+	int missBits = 0;
+	for( int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+	{
+		shadeMask4[p] = _mm_andnot_ps( hitMask4[p], packet.mask4[p] );
+		missBits |= _mm_movemask_ps( shadeMask4[p] );
+	}
+
+	if( missBits != 0 )
+		Plugins::environment->shadePacket( state, shadeMask4 );
+
+	// Rays that hit something, grouped by material
+	for( int r = 0; r < RT_PACKET_SIZE; ++r )
+	{
+		if( hitMask[r] == 0 )
+			continue;
+
+		const unsigned int materialId = materialIds[r];
+		std::fill_n( shadeMask, r, 0 );
+		for( int r1 = r; r1 < RT_PACKET_SIZE; ++r1 )
+		{
+			shadeMask[r1] = ( ( hitMask[r1] != 0 ) && ( materialIds[r1] == materialId ) ) ? 0xFFFFFFFF : 0;
+			hitMask[r1] &= ~shadeMask[r1];
+		}
+
+		Plugins::materials[materialId]->shadePacket( state, shadeMask4 );
+	}
+}
+
+void RayTracer::traceGeometryPacket( const Instance& instance, RayPacket& packet, HitPacket& hit,
+									 __m128 instActiveMask4[RT_PACKET_SIMD_SIZE] )
+{
+	const Geometry& geometry = Scene::geometries[instance.geometryId];
+
+	// Active ray mask for geometry traversal and intersection
+	union
+	{ 
+		unsigned int activeMask[RT_PACKET_SIZE];
+		__m128       activeMask4[RT_PACKET_SIMD_SIZE];
+	};
+
+	// Clip ray packet against geometry bounding box
+	// Disable rays that we don't need to trace with instActiveMask4 (incoherent rays were previously disabled)
+	if( !clipRayPacket( geometry.bbox(), packet, instActiveMask4, activeMask4 ) )
+		return;
+
+	// No packet traversal for bvh geometries, and not worth it for a few rays
+	Context& ctx = context();
+	if( ( geometry.accelStructure == RT_ACCEL_BVH4 ) || ( activeRayCount( activeMask4 ) < Scene::packetMinActiveRays ) )
+	{
+		traceGeometryRays( ctx, instance, geometry, packet, hit, activeMask );
+		return;
+	}
+	++ctx.stats.packetTraversals;
+
+	const KdTree& tree = geometry.kdTree;
+
+	// Save previous best distances
+	union
+	{
+		float  bestDist[RT_PACKET_SIZE];
+		__m128 bestDist4[RT_PACKET_SIMD_SIZE];
+	};
+	std::copy( hit.dist, hit.dist + RT_PACKET_SIZE, bestDist );
+
+	// Mask for early ray termination
+	__m128 done4[RT_PACKET_SIMD_SIZE];
+
+	// No need to trace rays that came disabled from instance (i.e. incoherent)
+	// Additionally, no need to trace clipped rays as well
+	for( int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+	{
+		done4[p] = _mm_andnot_ps( activeMask4[p], rtu::SSE_ALL_ON );
+	}
+
+	bool allHit;
+	const KdNode* node = tree.root;
+	PacketStack& geometryPacketStack = ctx.packetStacks[GEOMETRY_STACK];
+	geometryPacketStack.clear();
+	ctx.packetMailbox.reset();
+
+	while( true )
+	{
+		findLeafPacket( node, packet, geometryPacketStack, activeMask4 );
+
+		if( node->elemCount() > 0 )
+		{
+			intersectLeafPacket( ctx, geometry, node->elemStart(), node->elemCount(), packet, hit, bestDist4, activeMask4 );
+
+			// Check early exit
+			allHit = true;
+
+			// TODO: very slow, need to improve this!
+			for( int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+			{
+				// TODO: branch here? if( _mm_movemask_ps( activeMask4[r] ) == 0 ) continue;
+
+				// If we found a hit in an active ray
+				const __m128 mask4 = _mm_and_ps( activeMask4[p], _mm_cmplt_ps( bestDist4[p], hit.dist4[p] ) );
+
+				// Update hit parameters
+				hit.dist4[p] = _mm_or_ps( _mm_andnot_ps( mask4, hit.dist4[p] ), _mm_and_ps( mask4, bestDist4[p] ) );
+
+				const int hitBits = _mm_movemask_ps( mask4 );
+				for( int i = 0; i < 4; ++i )
+				{
+					if( hitBits & ( 1 << i ) )
+					{
+						hit.inst[p*4+i] = &instance;
+						hit.geom[p*4+i] = &geometry;
+					}
+				}
+
+				// Update early termination
+				done4[p] = _mm_or_ps( done4[p], mask4 );
+				allHit &= ( _mm_movemask_ps( done4[p] ) == 0xF );
+			}
+
+			// Early ray termination
+			if( allHit )
+				return;
+		}
+
+		if( geometryPacketStack.empty() )
+			return;
+
+		const PacketTraversalData& data = geometryPacketStack.top();
+		geometryPacketStack.pop();
+
+		// Deactivate rays that found a valid hit
+		node = data.node;
+		packet.tnear4[0] = data.tnear4[0];
+		packet.tfar4[0] = data.tfar4[0];
+		activeMask4[0] = _mm_andnot_ps( done4[0], _mm_cmple_ps( data.tnear4[0], data.tfar4[0] ) );
+
+		packet.tnear4[1] = data.tnear4[1];
 		packet.tfar4[1] = data.tfar4[1];
 		activeMask4[1] = _mm_andnot_ps( done4[1], _mm_cmple_ps( data.tnear4[1], data.tfar4[1] ) );
 
@@ -664,14 +1092,244 @@ void RayTracer::traceGeometryPacket( const Instance& instance, RayPacket& packet
 	}
 }
 
-// Enable pointer truncation warning
-#pragma warning( default : 4311 )
-
 // Returns how many rays hit any object
-unsigned int RayTracer::traceHitPacket( rts::RTstate& state )
+unsigned int RayTracer::traceHitPacket( rts::RTstate& state, unsigned int inQ )
 {
-	// TODO: 
-	return 0;
+	RayPacketState& rs = _TO_RAY_PACKET_STATE( state );
+	RayPacket& packet = rs.packet;
+	const KdTree& tree = Scene::instanceTree;
+	Context& ctx = context();
+
+	// Init ray, keeping ray maximum distances set by caller
+	std::fill_n( packet.tnear, RT_PACKET_SIZE, rtc::Scene::rayEpsilon );
+
+	// Shaders may trace shadow packets in the middle of tracePacket, restore its direction signs when done
+	const unsigned int* const callerDirSigns = ctx.dirSigns;
+
+	// Get ray direction sign bits according to coherence masks computed
+	ctx.dirSigns = &_rayDirSigns[inQ][0][0];
+
+	// Active ray mask for instance traversal and intersection
+	__m128 activeMask4[RT_PACKET_SIMD_SIZE];
+
+	// Clip rays against scene bounding box
+	// Disable incoherent rays using packet.mask4
+	if( !clipRayPacket( tree.bbox, packet, packet.mask4, activeMask4 ) )
+	{
+		ctx.dirSigns = callerDirSigns;
+		return 0;
+	}
+
+	// Mask for early ray termination: rays already occluded or never traced
+	__m128 done4[RT_PACKET_SIMD_SIZE];
+	for( int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+	{
+		done4[p] = _mm_or_ps( rs.occluded4[p], _mm_andnot_ps( activeMask4[p], rtu::SSE_ALL_ON ) );
+	}
+
+	// Rays traced in this call, one bit per ray (same as direction sign masks)
+	const unsigned int rayBits = _mm_movemask_ps( packet.mask4[0] ) +
+		                        ( _mm_movemask_ps( packet.mask4[1] ) << 4 ) +
+		                        ( _mm_movemask_ps( packet.mask4[2] ) << 8 ) +
+		                        ( _mm_movemask_ps( packet.mask4[3] ) << 12 );
+
+	bool allHit = false;
+	const RayPacket originalPacket( packet );
+	const KdNode* node = tree.root;
+	PacketStack& instancePacketStack = ctx.packetStacks[SHADOW_INSTANCE_STACK];
+	instancePacketStack.clear();
+
+	while( true )
+	{
+		findLeafPacket( node, packet, instancePacketStack, activeMask4 );
+
+		for( unsigned int i = node->elemStart(), limit = i + node->elemCount(); i < limit; ++i )
+		{
+			const Instance& instance = Scene::instances[tree.elements[i]];
+
+			instance.transform.inverseTransform( packet );
+			packet.preCompute();
+
+			// Packet traversal is only valid if direction signs of traced rays did not change
+			const unsigned int changedSigns = ( packet.xmask ^ originalPacket.xmask ) |
+				                              ( packet.ymask ^ originalPacket.ymask ) |
+				                              ( packet.zmask ^ originalPacket.zmask );
+			if( ( changedSigns & rayBits ) == 0 )
+			{
+				traceGeometryHitPacket( instance, packet, rs.occluded4, activeMask4 );
+			}
+			else
+			{
+				// Rare case, trace each active ray on its own
+				traceGeometryHitRays( ctx, Scene::geometries[instance.geometryId], packet, rs.occluded,
+					                  reinterpret_cast<const unsigned int*>( activeMask4 ) );
+			}
+
+			ctx.dirSigns = &_rayDirSigns[inQ][0][0];
+			packet = originalPacket;
+
+			// Early ray termination
+			allHit = true;
+			for( int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+			{
+				done4[p] = _mm_or_ps( done4[p], rs.occluded4[p] );
+				activeMask4[p] = _mm_andnot_ps( done4[p], activeMask4[p] );
+				allHit &= ( _mm_movemask_ps( done4[p] ) == 0xF );
+			}
+
+			if( allHit )
+				break;
+		}
+
+		if( allHit || instancePacketStack.empty() )
+			break;
+
+		const PacketTraversalData& data = instancePacketStack.top();
+		instancePacketStack.pop();
+
+		// Deactivate rays that are done (found a valid hit)
+		node = data.node;
+		for( int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+		{
+			packet.tnear4[p] = data.tnear4[p];
+			packet.tfar4[p] = data.tfar4[p];
+			activeMask4[p] = _mm_andnot_ps( done4[p], _mm_cmple_ps( data.tnear4[p], data.tfar4[p] ) );
+		}
+	}
+
+	ctx.dirSigns = callerDirSigns;
+
+	// Count occluded rays traced in this call
+	unsigned int hitCount = 0;
+	for( int r = 0; r < RT_PACKET_SIZE; ++r )
+	{
+		if( ( packet.mask[r] != 0 ) && ( rs.occluded[r] != 0 ) )
+			++hitCount;
+	}
+	return hitCount;
+}
+
+void RayTracer::traceGeometryHitPacket( const Instance& instance, RayPacket& packet, __m128 occluded4[RT_PACKET_SIMD_SIZE],
+									    __m128 instActiveMask4[RT_PACKET_SIMD_SIZE] )
+{
+	const Geometry& geometry = Scene::geometries[instance.geometryId];
+
+	// Active ray mask for geometry traversal and intersection
+	union
+	{ 
+		unsigned int activeMask[RT_PACKET_SIZE];
+		__m128       activeMask4[RT_PACKET_SIMD_SIZE];
+	};
+
+	// Clip ray packet against geometry bounding box
+	// Disable rays that we don't need to trace with instActiveMask4 (incoherent and occluded rays were previously disabled)
+	if( !clipRayPacket( geometry.bbox(), packet, instActiveMask4, activeMask4 ) )
+		return;
+
+	// No packet traversal for bvh geometries, and not worth it for a few rays
+	Context& ctx = context();
+	if( ( geometry.accelStructure == RT_ACCEL_BVH4 ) || ( activeRayCount( activeMask4 ) < Scene::packetMinActiveRays ) )
+	{
+		traceGeometryHitRays( ctx, geometry, packet, reinterpret_cast<unsigned int*>( occluded4 ), activeMask );
+		return;
+	}
+	++ctx.stats.packetTraversals;
+
+	const KdTree& tree = geometry.kdTree;
+
+	// Any hit will do, only need to know which rays found one
+	HitPacket hit;
+	__m128 bestDist4[RT_PACKET_SIMD_SIZE];
+	std::fill_n( bestDist4, RT_PACKET_SIMD_SIZE, _mm_set_ps1( rtu::mathf::MAX_VALUE ) );
+
+	// Mask for early ray termination
+	__m128 done4[RT_PACKET_SIMD_SIZE];
+	for( int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+	{
+		done4[p] = _mm_or_ps( occluded4[p], _mm_andnot_ps( activeMask4[p], rtu::SSE_ALL_ON ) );
+	}
+
+	bool allHit;
+	const KdNode* node = tree.root;
+	PacketStack& geometryPacketStack = ctx.packetStacks[SHADOW_GEOMETRY_STACK];
+	geometryPacketStack.clear();
+	ctx.packetMailbox.reset();
+
+	while( true )
+	{
+		findLeafPacket( node, packet, geometryPacketStack, activeMask4 );
+
+		if( node->elemCount() > 0 )
+		{
+			intersectLeafPacket( ctx, geometry, node->elemStart(), node->elemCount(), packet, hit, bestDist4, activeMask4 );
+
+			// Check early exit
+			allHit = true;
+
+			for( int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+			{
+				// Any active ray with a valid distance is occluded, no need to trace it further
+				const __m128 mask4 = _mm_and_ps( activeMask4[p], _mm_cmplt_ps( bestDist4[p], _mm_set_ps1( rtu::mathf::MAX_VALUE ) ) );
+				occluded4[p] = _mm_or_ps( occluded4[p], mask4 );
+				done4[p] = _mm_or_ps( done4[p], mask4 );
+				activeMask4[p] = _mm_andnot_ps( mask4, activeMask4[p] );
+				allHit &= ( _mm_movemask_ps( done4[p] ) == 0xF );
+			}
+
+			// Early ray termination
+			if( allHit )
+				return;
+		}
+
+		if( geometryPacketStack.empty() )
+			return;
+
+		const PacketTraversalData& data = geometryPacketStack.top();
+		geometryPacketStack.pop();
+
+		// Deactivate rays that found a valid hit
+		node = data.node;
+		for( int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+		{
+			packet.tnear4[p] = data.tnear4[p];
+			packet.tfar4[p] = data.tfar4[p];
+			activeMask4[p] = _mm_andnot_ps( done4[p], _mm_cmple_ps( data.tnear4[p], data.tfar4[p] ) );
+		}
+	}
+}
+
+// Returns true if ray, already in geometry space, hits any triangle of geometry
+bool RayTracer::traceGeometryHitSingle( const Geometry& geometry, Ray& ray )
+{
+	if( geometry.accelStructure == RT_ACCEL_BVH4 )
+		return geometry.bvh.bbox.clipRay( ray ) && traceBvhHitSingle( geometry, ray );
+
+	const KdTree& tree = geometry.kdTree;
+
+	if( !tree.bbox.clipRay( ray ) )
+		return false;
+
+	Context& ctx = context();
+	const KdNode* node = tree.root;
+	ctx.geometryStack.clear();
+	ctx.singleMailbox.reset();
+
+	while( true )
+	{
+		findLeafSingle( node, ray, ctx.geometryStack );
+
+		if( intersectLeafHitSingle( ctx, true, geometry.leafTriangles, node->elemStart(), node->elemCount(), ray ) )
+			return true;
+
+		if( ctx.geometryStack.empty() )
+			return false;
+
+		const TraversalData& data = ctx.geometryStack.top();
+		ctx.geometryStack.pop();
+		node = data.node;
+		ray.tnear = data.tnear;
+		ray.tfar = data.tfar;
+	}
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -723,75 +1381,214 @@ void RayTracer::findLeafSingle( const KdNode*& node, Ray& ray, SingleStack& stac
 void RayTracer::findLeafPacket( const KdNode*& node, RayPacket& packet, PacketStack& stack,
 					            __m128 activeMask4[RT_PACKET_SIMD_SIZE] )
 {
-	// TODO: from arauna_src
-	// TODO: avoid nans
-	// TODO: check if we can use mask4 inside ray packet or if we need commented out static global mask
-	// TODO: try to use loops instead (see [Benthin] phd.pdf pg.62)
-	while( !node->isLeaf() )
+	( this->*s_packetKernels->findLeaf )( node, packet, stack, activeMask4 );
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Ray-bvh traversal routines
+
+void RayTracer::traceBvhSingle( const Geometry& geometry, const Ray& ray, Hit& hit, float& bestDistance )
+{
+	const Bvh4& bvh = geometry.bvh;
+
+	const __m128 ox4 = _mm_set_ps1( ray.origin.x );
+	const __m128 oy4 = _mm_set_ps1( ray.origin.y );
+	const __m128 oz4 = _mm_set_ps1( ray.origin.z );
+	const __m128 rdx4 = _mm_set_ps1( ray.invDir.x );
+	const __m128 rdy4 = _mm_set_ps1( ray.invDir.y );
+	const __m128 rdz4 = _mm_set_ps1( ray.invDir.z );
+	const __m128 rayTnear4 = _mm_set_ps1( ray.tnear );
+
+	// Near and far box planes, according to ray direction signs (see Bvh4Node::bounds)
+	const unsigned int nearX = ray.dirSigns[0];
+	const unsigned int nearY = 2 + ray.dirSigns[1];
+	const unsigned int nearZ = 4 + ray.dirSigns[2];
+
+	union
+	{
+		float  tnear[4];
+		__m128 tnear4;
+	};
+
+	Context& ctx = context();
+	ctx.bvhStack.clear();
+	ctx.bvhStack.push();
+	ctx.bvhStack.top().child = 0;
+	ctx.bvhStack.top().tnear = ray.tnear;
+
+	while( !ctx.bvhStack.empty() )
+	{
+		const BvhTraversalData data = ctx.bvhStack.top();
+		ctx.bvhStack.pop();
+
+		// Cull children entered beyond closest hit found so far
+		if( data.tnear > bestDistance )
+			continue;
+
+		if( Bvh4Node::isLeaf( data.child ) )
+		{
+			intersectLeafSingle( ctx, false, geometry.leafTriangles, Bvh4Node::elemStart( data.child ),
+				                 Bvh4Node::elemCount( data.child ), ray, hit, bestDistance );
+			continue;
+		}
+
+		const Bvh4Node& node = bvh.nodes[Bvh4Node::nodeIndex( data.child )];
+
+		// Intersect ray with all 4 child boxes
+		// Using reciprocal directions in first argument of min and max to filter them out in case of NaNs
+		const __m128 rayTfar4 = _mm_set_ps1( ( bestDistance < ray.tfar ) ? bestDistance : ray.tfar );
+		tnear4 = _mm_max_ps( _mm_mul_ps( _mm_sub_ps( node.bounds4[nearX], ox4 ), rdx4 ),
+			     _mm_max_ps( _mm_mul_ps( _mm_sub_ps( node.bounds4[nearY], oy4 ), rdy4 ),
+			     _mm_max_ps( _mm_mul_ps( _mm_sub_ps( node.bounds4[nearZ], oz4 ), rdz4 ), rayTnear4 ) ) );
+		const __m128 tfar4 = _mm_min_ps( _mm_mul_ps( _mm_sub_ps( node.bounds4[nearX ^ 1], ox4 ), rdx4 ),
+			                 _mm_min_ps( _mm_mul_ps( _mm_sub_ps( node.bounds4[nearY ^ 1], oy4 ), rdy4 ),
+			                 _mm_min_ps( _mm_mul_ps( _mm_sub_ps( node.bounds4[nearZ ^ 1], oz4 ), rdz4 ), rayTfar4 ) ) );
+
+		const int hitMask = _mm_movemask_ps( _mm_cmple_ps( tnear4, tfar4 ) );
+		if( hitMask == 0 )
+			continue;
+
+		// Sort hit children by distance, farthest first
+		BvhTraversalData hits[4];
+		unsigned int hitCount = 0;
+		for( unsigned int c = 0; c < 4; ++c )
+		{
+			if( ( hitMask & ( 1 << c ) ) == 0 )
+				continue;
+
+			unsigned int h = hitCount++;
+			for( ; ( h > 0 ) && ( hits[h - 1].tnear < tnear[c] ); --h )
+			{
+				hits[h] = hits[h - 1];
+			}
+			hits[h].child = node.children[c];
+			hits[h].tnear = tnear[c];
+		}
+
+		// Push them so that closest child is traversed next
+		for( unsigned int h = 0; h < hitCount; ++h )
+		{
+			ctx.bvhStack.push();
+			ctx.bvhStack.top() = hits[h];
+		}
+	}
+}
+
+bool RayTracer::traceBvhHitSingle( const Geometry& geometry, const Ray& ray )
+{
+	const Bvh4& bvh = geometry.bvh;
+
+	const __m128 ox4 = _mm_set_ps1( ray.origin.x );
+	const __m128 oy4 = _mm_set_ps1( ray.origin.y );
+	const __m128 oz4 = _mm_set_ps1( ray.origin.z );
+	const __m128 rdx4 = _mm_set_ps1( ray.invDir.x );
+	const __m128 rdy4 = _mm_set_ps1( ray.invDir.y );
+	const __m128 rdz4 = _mm_set_ps1( ray.invDir.z );
+	const __m128 rayTnear4 = _mm_set_ps1( ray.tnear );
+	const __m128 rayTfar4 = _mm_set_ps1( ray.tfar );
+
+	// Near and far box planes, according to ray direction signs (see Bvh4Node::bounds)
+	const unsigned int nearX = ray.dirSigns[0];
+	const unsigned int nearY = 2 + ray.dirSigns[1];
+	const unsigned int nearZ = 4 + ray.dirSigns[2];
+
+	// Any hit will do, no need to traverse in order
+	Context& ctx = context();
+	ctx.bvhStack.clear();
+	ctx.bvhStack.push();
+	ctx.bvhStack.top().child = 0;
+
+	while( !ctx.bvhStack.empty() )
 	{
-		// Correct axis index to access direction signs (axis*2)
-		unsigned int axis = node->axis() << 1;
-		const __m128 splitPos4 = _mm_set_ps1( node->splitPos() );
-
-		// Front and back children, according to packet direction signs
-		const KdNode* const front = node->leftChild() + s_dirSigns[axis];
-		const KdNode* const back  = node->leftChild() + s_dirSigns[axis + 1];
-
-		// Correct axis index to access packet data (axis*4)
-		axis <<= 1;
-
-		// Compute split plane intersection with ray segments
-		__m128 d4[4];
-		d4[0] = _mm_mul_ps( _mm_sub_ps( splitPos4, packet.oa4[axis+0] ), packet.rda4[axis+0] );
-		d4[1] = _mm_mul_ps( _mm_sub_ps( splitPos4, packet.oa4[axis+1] ), packet.rda4[axis+1] );
-		d4[2] = _mm_mul_ps( _mm_sub_ps( splitPos4, packet.oa4[axis+2] ), packet.rda4[axis+2] );
-		d4[3] = _mm_mul_ps( _mm_sub_ps( splitPos4, packet.oa4[axis+3] ), packet.rda4[axis+3] );
-
-		// Original version, does not handle NaNs generated in d4 correctly!
-		// Check if all rays go to back child
-		unsigned int dnear = _mm_movemask_ps( _mm_and_ps( activeMask4[0], _mm_cmple_ps( packet.tnear4[0], d4[0] ) ) );
-		dnear |= _mm_movemask_ps( _mm_and_ps( activeMask4[1], _mm_cmple_ps( packet.tnear4[1], d4[1] ) ) );
-		dnear |= _mm_movemask_ps( _mm_and_ps( activeMask4[2], _mm_cmple_ps( packet.tnear4[2], d4[2] ) ) );
-		dnear |= _mm_movemask_ps( _mm_and_ps( activeMask4[3], _mm_cmple_ps( packet.tnear4[3], d4[3] ) ) );
-		node = back;
-		if( dnear == 0 )
-			continue; // traverse back child
-
-		// Check if all rays go to front child
-		unsigned int dfar = _mm_movemask_ps( _mm_and_ps( activeMask4[0], _mm_cmpge_ps( packet.tfar4[0], d4[0] ) ) );
-		dfar  |= _mm_movemask_ps( _mm_and_ps( activeMask4[1], _mm_cmpge_ps( packet.tfar4[1], d4[1] ) ) );
-		dfar  |= _mm_movemask_ps( _mm_and_ps( activeMask4[2], _mm_cmpge_ps( packet.tfar4[2], d4[2] ) ) );
-		dfar  |= _mm_movemask_ps( _mm_and_ps( activeMask4[3], _mm_cmpge_ps( packet.tfar4[3], d4[3] ) ) );
-		node = front;
-		if( dfar == 0 )
-			continue; // traverse front child
-
-		// Push back child to stack and traverse front one
-		// NaNs are handled by placing d4 in first operand of min and max
-		stack.push();
-		PacketTraversalData& data = stack.top();
-
-		data.node = back;
-
-		data.tfar4[0] = packet.tfar4[0];
-		data.tnear4[0] = _mm_max_ps( d4[0], packet.tnear4[0] );
-		packet.tfar4[0] = _mm_min_ps( d4[0], packet.tfar4[0] );
-		activeMask4[0] = _mm_and_ps( activeMask4[0], _mm_cmple_ps( packet.tnear4[0], packet.tfar4[0] ) );
-
-		data.tfar4[1] = packet.tfar4[1];
-		data.tnear4[1] = _mm_max_ps( d4[1], packet.tnear4[1] );
-		packet.tfar4[1] = _mm_min_ps( d4[1], packet.tfar4[1] );
-		activeMask4[1] = _mm_and_ps( activeMask4[1], _mm_cmple_ps( packet.tnear4[1], packet.tfar4[1] ) );
-
-		data.tfar4[2] = packet.tfar4[2];
-		data.tnear4[2] = _mm_max_ps( d4[2], packet.tnear4[2] );
-		packet.tfar4[2] = _mm_min_ps( d4[2], packet.tfar4[2] );
-		activeMask4[2] = _mm_and_ps( activeMask4[2], _mm_cmple_ps( packet.tnear4[2], packet.tfar4[2] ) );
-
-		data.tfar4[3] = packet.tfar4[3];
-		data.tnear4[3] = _mm_max_ps( d4[3], packet.tnear4[3] );
-		packet.tfar4[3] = _mm_min_ps( d4[3], packet.tfar4[3] );
-		activeMask4[3] = _mm_and_ps( activeMask4[3], _mm_cmple_ps( packet.tnear4[3], packet.tfar4[3] ) );
+		const unsigned int child = ctx.bvhStack.top().child;
+		ctx.bvhStack.pop();
+
+		if( Bvh4Node::isLeaf( child ) )
+		{
+			if( intersectLeafHitSingle( ctx, false, geometry.leafTriangles, Bvh4Node::elemStart( child ),
+				                        Bvh4Node::elemCount( child ), ray ) )
+				return true;
+			continue;
+		}
+
+		const Bvh4Node& node = bvh.nodes[Bvh4Node::nodeIndex( child )];
+
+		const __m128 tnear4 = _mm_max_ps( _mm_mul_ps( _mm_sub_ps( node.bounds4[nearX], ox4 ), rdx4 ),
+			                  _mm_max_ps( _mm_mul_ps( _mm_sub_ps( node.bounds4[nearY], oy4 ), rdy4 ),
+			                  _mm_max_ps( _mm_mul_ps( _mm_sub_ps( node.bounds4[nearZ], oz4 ), rdz4 ), rayTnear4 ) ) );
+		const __m128 tfar4 = _mm_min_ps( _mm_mul_ps( _mm_sub_ps( node.bounds4[nearX ^ 1], ox4 ), rdx4 ),
+			                 _mm_min_ps( _mm_mul_ps( _mm_sub_ps( node.bounds4[nearY ^ 1], oy4 ), rdy4 ),
+			                 _mm_min_ps( _mm_mul_ps( _mm_sub_ps( node.bounds4[nearZ ^ 1], oz4 ), rdz4 ), rayTfar4 ) ) );
+
+		const int hitMask = _mm_movemask_ps( _mm_cmple_ps( tnear4, tfar4 ) );
+		for( unsigned int c = 0; c < 4; ++c )
+		{
+			if( hitMask & ( 1 << c ) )
+			{
+				ctx.bvhStack.push();
+				ctx.bvhStack.top().child = node.children[c];
+			}
+		}
+	}
+
+	return false;
+}
+
+// Traces each active ray of the packet on its own
+void RayTracer::traceGeometryRays( Context& ctx, const Instance& instance, const Geometry& geometry, const RayPacket& packet,
+								   HitPacket& hit, const unsigned int activeMask[RT_PACKET_SIZE] )
+{
+	++ctx.stats.packetFallbacks;
+
+	Ray ray;
+	Hit rayHit;
+
+	for( int r = 0; r < RT_PACKET_SIZE; ++r )
+	{
+		// Skip clipped rays and rays traced in another call (incoherent packets are split by direction signs)
+		if( ( activeMask[r] == 0 ) || ( packet.mask[r] == 0 ) )
+			continue;
+
+		++ctx.stats.fallbackRays;
+
+		setupShadingRay( ray, packet, r );
+		ray.update();
+
+		rayHit.geometry = NULL;
+		rayHit.distance = hit.dist[r];
+		traceGeometrySingle( instance, ray, rayHit );
+
+		if( rayHit.geometry != NULL )
+		{
+			hit.dist[r] = rayHit.distance;
+			hit.inst[r] = &instance;
+			hit.geom[r] = &geometry;
+			hit.tId[r] = rayHit.triangleId;
+			hit.v0c[r] = rayHit.v0Coord;
+			hit.v1c[r] = rayHit.v1Coord;
+			hit.v2c[r] = rayHit.v2Coord;
+		}
+	}
+}
+
+// Tests each active ray of the packet for occlusion on its own
+void RayTracer::traceGeometryHitRays( Context& ctx, const Geometry& geometry, const RayPacket& packet,
+									  unsigned int occluded[RT_PACKET_SIZE], const unsigned int activeMask[RT_PACKET_SIZE] )
+{
+	++ctx.stats.packetFallbacks;
+
+	Ray ray;
+	for( int r = 0; r < RT_PACKET_SIZE; ++r )
+	{
+		if( ( activeMask[r] == 0 ) || ( occluded[r] != 0 ) )
+			continue;
+
+		++ctx.stats.fallbackRays;
+
+		setupShadingRay( ray, packet, r );
+		ray.update();
+		if( traceGeometryHitSingle( geometry, ray ) )
+			occluded[r] = 0xFFFFFFFF;
 	}
 }
 
@@ -837,117 +1634,197 @@ void RayTracer::intersectSingle( const TriAccel& acc, const Ray& ray, Hit& hit,
 	hit.v2Coord = mue;
 }
 
-// Intersect a single triangle with a packet of rays
-void RayTracer::intersectPacket( const TriAccel& acc, const RayPacket& packet, HitPacket& hit, 
-								 __m128 bestDist4[RT_PACKET_SIMD_SIZE], __m128 activeMask4[RT_PACKET_SIMD_SIZE] )
+// Tests a single ray (broadcast in o4, d4) against the 4 triangles of block.
+// Returns mask bits of the triangles hit closer than bestDistance, with their distance and barycentric coordinates.
+// Sets farBits to the triangles whose plane is hit beyond the ray segment, which may still be hit in a later leaf.
+static RTU_FORCEINLINE int intersectBlock( const TriAccel4& block, const __m128 o4[3], const __m128 d4[3], __m128 ntol4, __m128 ftol4,
+										   float bestDistance, __m128& f4, __m128& lambda4, __m128& mue4, int& farBits )
 {
-	union
+	// Start high-latency division as early as possible
+	const __m128 nd4 = _mm_div_ps( rtu::SSE_ONE, _mm_add_ps( _mm_add_ps( _mm_mul_ps( block.nx4, d4[0] ), _mm_mul_ps( block.ny4, d4[1] ) ),
+		                                                     _mm_mul_ps( block.nz4, d4[2] ) ) );
+	f4 = _mm_mul_ps( nd4, _mm_sub_ps( block.n_d4, _mm_add_ps( _mm_add_ps( _mm_mul_ps( block.nx4, o4[0] ), _mm_mul_ps( block.ny4, o4[1] ) ),
+		                                                      _mm_mul_ps( block.nz4, o4[2] ) ) ) );
+	farBits = _mm_movemask_ps( _mm_cmplt_ps( ftol4, f4 ) );
+
+	// Check for valid distance, also filtering out NaNs of empty slots and rays parallel to the plane
+	__m128 mask4 = _mm_and_ps( _mm_and_ps( _mm_cmplt_ps( f4, _mm_set_ps1( bestDistance ) ), _mm_cmpge_ps( f4, ntol4 ) ),
+		                       _mm_cmple_ps( f4, ftol4 ) );
+	if( _mm_movemask_ps( mask4 ) == 0 )
+		return 0;
+
+	// Hit point, line equations are zero along each triangle's projection axis
+	const __m128 hx4 = _mm_add_ps( o4[0], _mm_mul_ps( f4, d4[0] ) );
+	const __m128 hy4 = _mm_add_ps( o4[1], _mm_mul_ps( f4, d4[1] ) );
+	const __m128 hz4 = _mm_add_ps( o4[2], _mm_mul_ps( f4, d4[2] ) );
+
+	// Barycentric coordinates
+	lambda4 = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( block.bx4, hx4 ), _mm_mul_ps( block.by4, hy4 ) ),
+		                              _mm_mul_ps( block.bz4, hz4 ) ), block.b_d4 );
+	mue4 = _mm_add_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( block.cx4, hx4 ), _mm_mul_ps( block.cy4, hy4 ) ),
+		                           _mm_mul_ps( block.cz4, hz4 ) ), block.c_d4 );
+	const __m128 psi4 = _mm_sub_ps( _mm_sub_ps( rtu::SSE_ONE, lambda4 ), mue4 );
+
+	mask4 = _mm_and_ps( mask4, _mm_cmpge_ps( lambda4, rtu::SSE_ZERO ) );
+	mask4 = _mm_and_ps( mask4, _mm_cmpge_ps( mue4, rtu::SSE_ZERO ) );
+	mask4 = _mm_and_ps( mask4, _mm_cmpge_ps( psi4, rtu::SSE_ZERO ) );
+	return _mm_movemask_ps( mask4 );
+}
+
+// Used slots of block whose triangle was already tested against the ray, one bit each
+static RTU_FORCEINLINE int testedSlots( const Mailbox& mailbox, const TriAccel4& block, int slots )
+{
+	int tested = 0;
+	for( unsigned int i = 0; i < 4; ++i )
 	{
-		__m128   mask4;
-		__m128i imask4;
-	};
+		if( slots & ( 1 << i ) )
+			tested |= mailbox.tested( block.triangleId[i] ) << i;
+	}
+	return tested;
+}
 
-	// Accurate axis index to access packet data (axis*4)
-	const unsigned int qk = acc.k << 2;
+static RTU_FORCEINLINE void setTestedSlots( Mailbox& mailbox, const TriAccel4& block, int slots )
+{
+	for( unsigned int i = 0; i < 4; ++i )
+	{
+		if( slots & ( 1 << i ) )
+			mailbox.setTested( block.triangleId[i], 1 );
+	}
+}
 
-	for( int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+// Intersect the triangles of a leaf with a single ray, 4 at a time
+void RayTracer::intersectLeafSingle( Context& ctx, bool mailboxed, const LeafTriangles& leaves, unsigned int elemStart,
+									 unsigned int elemCount, const Ray& ray, Hit& hit, float& bestDistance )
+{
+	if( elemCount == 0 )
+		return;
+
+	const __m128 o4[3] = { _mm_set_ps1( ray.origin.x ), _mm_set_ps1( ray.origin.y ), _mm_set_ps1( ray.origin.z ) };
+	const __m128 d4[3] = { _mm_set_ps1( ray.direction.x ), _mm_set_ps1( ray.direction.y ), _mm_set_ps1( ray.direction.z ) };
+	const __m128 ntol4 = _mm_set_ps1( ray.tnear - INTERSECT_EPSILON );
+	const __m128 ftol4 = _mm_set_ps1( ray.tfar + INTERSECT_EPSILON );
+
+	union { float f[4]; __m128 f4; };
+	union { float lambda[4]; __m128 lambda4; };
+	union { float mue[4]; __m128 mue4; };
+
+	const TriAccel4* const blocks = leaves.leafBlocks( elemStart );
+	for( unsigned int b = 0, limit = LeafTriangles::blockCount( elemCount ); b < limit; ++b )
 	{
-		if( _mm_movemask_ps( activeMask4[p] ) == 0 )
+		const unsigned int slotCount = std::min( elemCount - b * 4, 4u );
+		const int slots = ( 1 << slotCount ) - 1;
+
+		// Skip blocks only if all their triangles were tested, testing 4 of them costs about the same as 1
+		if( mailboxed && ( testedSlots( ctx.singleMailbox, blocks[b], slots ) == slots ) )
+		{
+			ctx.stats.singleSkips += slotCount;
 			continue;
+		}
+		ctx.stats.singleTests += slotCount;
+
+		int farBits;
+		const int hitBits = intersectBlock( blocks[b], o4, d4, ntol4, ftol4, bestDistance, f4, lambda4, mue4, farBits );
+
+		if( mailboxed )
+			setTestedSlots( ctx.singleMailbox, blocks[b], slots & ~farBits );
 
-		// TODO: testing fast reciprocal
-		// Start high-latency division as early as possible
-		const __m128 nd4 = rtu::sseFastRcp( _mm_add_ps( packet.da4[qk+p], 
-			                                            _mm_add_ps( _mm_mul_ps( _mm_set_ps1( acc.n_u ), 
-													                            packet.da4[QKU+p] ), 
-			                                                        _mm_mul_ps( _mm_set_ps1( acc.n_v ), 
-																                packet.da4[QKV+p] ) ) ) );
-
-		// Compute intersection distance
-		const __m128 f4 = _mm_mul_ps( nd4, 
-			                          _mm_sub_ps( _mm_sub_ps( _mm_sub_ps( _mm_set_ps1( acc.n_d ), packet.oa4[qk+p] ), 
-									                          _mm_mul_ps( _mm_set_ps1( acc.n_u ), packet.oa4[QKU+p] ) ), 
-												  _mm_mul_ps( _mm_set_ps1( acc.n_v ), packet.oa4[QKV+p] ) ) );
-
-		// TODO: find a correct way to get rid of these epsilons and check scene06 for any errors
-		// Tolerances to near and far comparisons
-		const __m128 ntol4 = _mm_sub_ps( packet.tnear4[p], SSE_INTERSECT_EPSILON );
-		const __m128 ftol4 = _mm_add_ps( packet.tfar4[p], SSE_INTERSECT_EPSILON );
-
-		// Check for valid distance
-		mask4 = _mm_and_ps( _mm_and_ps( _mm_cmplt_ps( f4, bestDist4[p] ), 
-			                            _mm_cmpge_ps( f4, ntol4 ) ), 
-			                _mm_cmple_ps( f4, ftol4 ) );
-
-		if( _mm_movemask_ps( mask4 ) == 0 )
-			continue; // invalid distance
-
-		// Compute hit point positions on uv plane
-		const __m128 hu = _mm_add_ps( packet.oa4[QKU+p], _mm_mul_ps( f4, packet.da4[QKU+p] ) );
-		const __m128 hv = _mm_add_ps( packet.oa4[QKV+p], _mm_mul_ps( f4, packet.da4[QKV+p] ) );
-
-		// Compute first barycentric coordinate (lambda)
-		const __m128 lambda4 = _mm_add_ps( _mm_set_ps1( acc.b_d ), 
-			                               _mm_add_ps( _mm_mul_ps( hu, _mm_set_ps1( acc.b_nu ) ),
-			                                           _mm_mul_ps( hv, _mm_set_ps1( acc.b_nv ) ) ) );
-		mask4 = _mm_and_ps( mask4, _mm_cmpge_ps( lambda4, _mm_setzero_ps() ) );
-
-		if( _mm_movemask_ps( mask4 ) == 0 )
-			continue; // invalid lambda
-
-		// Compute second barycentric coordinate (mue)
-		const __m128 mue4 = _mm_add_ps( _mm_set_ps1( acc.c_d ), 
-			                            _mm_add_ps( _mm_mul_ps( hu, _mm_set_ps1( acc.c_nu ) ),
-			                                        _mm_mul_ps( hv, _mm_set_ps1( acc.c_nv ) ) ) );
-		mask4 = _mm_and_ps( mask4, _mm_cmpge_ps( mue4, _mm_setzero_ps() ) );
-
-		if( _mm_movemask_ps( mask4 ) == 0 )
-			continue; // invalid mue
-
-		// Compute third barycentric coordinate (psi)
-		const __m128 psi4 = _mm_sub_ps( rtu::SSE_ONE, _mm_add_ps( lambda4, mue4 ) );
-		mask4 = _mm_and_ps( mask4, _mm_cmpge_ps( psi4, _mm_setzero_ps() ) );
-
-		if( _mm_movemask_ps( mask4 ) == 0 )
-			continue; // invalid psi
-
-		// Have a valid hit point here. Store it.
-		bestDist4[p] = _mm_or_ps( _mm_andnot_ps( mask4, bestDist4[p] ), _mm_and_ps( mask4, f4 ) );
-		hit.tId4[p] = _mm_or_si128( _mm_andnot_si128( imask4, hit.tId4[p] ), _mm_and_si128( imask4, _mm_set1_epi32( acc.triangleId ) ) );
-		hit.v0c4[p] = _mm_or_ps( _mm_andnot_ps( mask4, hit.v0c4[p] ), _mm_and_ps( mask4, psi4 ) );
-		hit.v1c4[p] = _mm_or_ps( _mm_andnot_ps( mask4, hit.v1c4[p] ), _mm_and_ps( mask4, lambda4 ) );
-		hit.v2c4[p] = _mm_or_ps( _mm_andnot_ps( mask4, hit.v2c4[p] ), _mm_and_ps( mask4, mue4 ) );
+		if( hitBits == 0 )
+			continue;
+
+		// Closest hit of the block, first one on ties (same as testing triangles in order)
+		for( unsigned int i = 0; i < 4; ++i )
+		{
+			if( ( hitBits & ( 1 << i ) ) && ( f[i] < bestDistance ) )
+			{
+				bestDistance = f[i];
+				hit.triangleId = blocks[b].triangleId[i];
+				hit.v0Coord = 1.0f - lambda[i] - mue[i];
+				hit.v1Coord = lambda[i];
+				hit.v2Coord = mue[i];
+			}
+		}
 	}
 }
 
-// Clip all rays in packet to given AABB
-bool RayTracer::clipRayPacket( const AABB& bbox, RayPacket& p, const __m128 inputMask4[RT_PACKET_SIMD_SIZE],
-				               __m128 outputMask4[RT_PACKET_SIMD_SIZE] )
+// Returns true if ray hits any triangle of the leaf
+bool RayTracer::intersectLeafHitSingle( Context& ctx, bool mailboxed, const LeafTriangles& leaves, unsigned int elemStart,
+										unsigned int elemCount, const Ray& ray )
 {
-	// xmin, xmax, ymin, ymax, zmin, zmax
-	const __m128 bb[6] = { _mm_set_ps1( bbox.minv.x ), _mm_set_ps1( bbox.maxv.x ),
-		                   _mm_set_ps1( bbox.minv.y ), _mm_set_ps1( bbox.maxv.y ),
-		                   _mm_set_ps1( bbox.minv.z ), _mm_set_ps1( bbox.maxv.z ) };
+	if( elemCount == 0 )
+		return false;
+
+	const __m128 o4[3] = { _mm_set_ps1( ray.origin.x ), _mm_set_ps1( ray.origin.y ), _mm_set_ps1( ray.origin.z ) };
+	const __m128 d4[3] = { _mm_set_ps1( ray.direction.x ), _mm_set_ps1( ray.direction.y ), _mm_set_ps1( ray.direction.z ) };
+	const __m128 ntol4 = _mm_set_ps1( ray.tnear - INTERSECT_EPSILON );
+	const __m128 ftol4 = _mm_set_ps1( ray.tfar + INTERSECT_EPSILON );
 
-	bool hit = false;
+	__m128 f4;
+	__m128 lambda4;
+	__m128 mue4;
 
-	for( int i = 0; i < RT_PACKET_SIMD_SIZE; ++i )
+	const TriAccel4* const blocks = leaves.leafBlocks( elemStart );
+	for( unsigned int b = 0, limit = LeafTriangles::blockCount( elemCount ); b < limit; ++b )
 	{
-		for( int a = 0; a < 6; a += 2 )
+		const unsigned int slotCount = std::min( elemCount - b * 4, 4u );
+		const int slots = ( 1 << slotCount ) - 1;
+
+		if( mailboxed && ( testedSlots( ctx.singleMailbox, blocks[b], slots ) == slots ) )
 		{
-			// Using reciprocal directions in first argument of min and max to filter them out in case of NaNs
-			p.tnear4[i] = _mm_max_ps( _mm_mul_ps( _mm_sub_ps( bb[a + s_dirSigns[a]], p.oa4[a*2+i] ), p.rda4[a*2+i] ), p.tnear4[i] );
-			p.tfar4[i]  = _mm_min_ps( _mm_mul_ps( _mm_sub_ps( bb[a + s_dirSigns[a+1]], p.oa4[a*2+i] ), p.rda4[a*2+i] ), p.tfar4[i] );
+			ctx.stats.singleSkips += slotCount;
+			continue;
 		}
+		ctx.stats.singleTests += slotCount;
 
-		// TODO: check if we need this
-		// If packet is incoherent, use active ray mask to write invalid tfar and disable incoherent rays
-		//p.tfar4[r] = _mm_or_ps( _mm_andnot_ps( inputMask[r], rtu::SSE_ZERO ), _mm_and_ps( p.mask4[r], p.tfar4[r] ) );
+		int farBits;
+		if( intersectBlock( blocks[b], o4, d4, ntol4, ftol4, rtu::mathf::MAX_VALUE, f4, lambda4, mue4, farBits ) != 0 )
+			return true;
 
-		outputMask4[i] = _mm_and_ps( inputMask4[i], _mm_cmple_ps( p.tnear4[i], p.tfar4[i] ) );
-		hit |= ( _mm_movemask_ps( outputMask4[i] ) != 0 );
+		if( mailboxed )
+			setTestedSlots( ctx.singleMailbox, blocks[b], slots & ~farBits );
 	}
-	return hit;
+	return false;
+}
+
+// Intersect a single triangle with a packet of rays
+unsigned int RayTracer::intersectPacket( const TriAccel& acc, const RayPacket& packet, HitPacket& hit, 
+										 __m128 bestDist4[RT_PACKET_SIMD_SIZE], __m128 activeMask4[RT_PACKET_SIMD_SIZE] )
+{
+	return ( this->*s_packetKernels->intersect )( acc, packet, hit, bestDist4, activeMask4 );
+}
+
+// Intersect the triangles of a kd-tree leaf with a packet of rays
+void RayTracer::intersectLeafPacket( Context& ctx, const Geometry& geometry, unsigned int elemStart, unsigned int elemCount,
+									 const RayPacket& packet, HitPacket& hit, __m128 bestDist4[RT_PACKET_SIMD_SIZE],
+									 __m128 activeMask4[RT_PACKET_SIMD_SIZE] )
+{
+	// Leaf ordered copies if any, else look triangles up by id
+	const TriAccel* const triangles = geometry.leafTriangles.triangles;
+	const unsigned int* const elements = geometry.kdTree.elements;
+
+	const unsigned int activeRays = _mm_movemask_ps( activeMask4[0] ) | ( _mm_movemask_ps( activeMask4[1] ) << 4 ) |
+		                            ( _mm_movemask_ps( activeMask4[2] ) << 8 ) | ( _mm_movemask_ps( activeMask4[3] ) << 12 );
+
+	for( unsigned int i = elemStart, limit = elemStart + elemCount; i < limit; ++i )
+	{
+		const TriAccel& acc = ( triangles != NULL ) ? triangles[i] : geometry.triAccel[elements[i]];
+
+		// Skip triangle if all active rays already tested it in another leaf
+		if( ( activeRays & ~ctx.packetMailbox.tested( acc.triangleId ) ) == 0 )
+		{
+			++ctx.stats.packetSkips;
+			continue;
+		}
+		++ctx.stats.packetTests;
+
+		ctx.packetMailbox.setTested( acc.triangleId, intersectPacket( acc, packet, hit, bestDist4, activeMask4 ) );
+	}
+}
+
+// Clip all rays in packet to given AABB
+bool RayTracer::clipRayPacket( const AABB& bbox, RayPacket& p, const __m128 inputMask4[RT_PACKET_SIMD_SIZE],
+				               __m128 outputMask4[RT_PACKET_SIMD_SIZE] )
+{
+	return ( this->*s_packetKernels->clip )( bbox, p, inputMask4, outputMask4 );
 }
 
 void RayTracer::setupShadingRay( Ray& ray, const RayPacket& packet, unsigned int r )
@@ -958,17 +1835,6 @@ void RayTracer::setupShadingRay( Ray& ray, const RayPacket& packet, unsigned int
 	ray.tfar = packet.tfar[r];
 }
 
-void RayTracer::setupShadingHit( Hit& hit, const HitPacket& hitp, unsigned int r )
-{
-	hit.distance = hitp.dist[r];
-	hit.geometry = hitp.geom[r];
-	hit.instance = hitp.inst[r];
-	hit.triangleId = hitp.tId[r];
-	hit.v0Coord = hitp.v0c[r];
-	hit.v1Coord = hitp.v1c[r];
-	hit.v2Coord = hitp.v2c[r];
-}
-
 /*
 // TODO: the version above is faster on a P4 2.6Ghz HT, 1,5GB RAM DDR 400
 // TODO: and also on an Athlon XP 3800+ 2.4Ghz, 2GB RAM DDR 400
@@ -1021,9 +1887,6 @@ void RayTracer::findLeafSingle( const KdNode*& node, Ray& ray, Stack<TraversalDa
 #undef KU
 #undef KV
 
-#undef QKU
-#undef QKV
-
 #undef _TO_RAY_STATE
 #undef _TO_RAY_PACKET_STATE
 
@@ -5,10 +5,15 @@
 #include <rtu/common.h>
 #include <rtc/RayState.h>
 #include <rtc/KdTree.h>
+#include <rtc/Bvh4.h>
 #include <rtc/Triangle.h>
 #include <rtc/Stack.h>
+#include <rtc/Mailbox.h>
+#include <rtc/RayStream.h>
 #include <rtc/Scene.h>
 #include <rts/RTstate.h>
+#include <rts/RTstream.h>
+#include <vector>
 
 namespace rtc {
 
@@ -16,6 +21,8 @@ class RayTracer
 {
 public:
 	static const unsigned int MAX_STACK_SIZE = 128;
+	// Packets traced together from a stream or queue, before shading any of them
+	static const unsigned int STREAM_BATCH_SIZE = RT_STREAM_SIZE / RT_PACKET_SIZE;
 
 	// Traversal stack information
 	struct TraversalData
@@ -33,8 +40,112 @@ public:
 		union { float tfar[16];  __m128 tfar4[4]; };
 	};
 
+	// Bvh child reference (see Bvh4Node) and its entry distance
+	struct BvhTraversalData
+	{
+		unsigned int child;
+		float tnear;
+	};
+
 	typedef StaticStack<TraversalData, MAX_STACK_SIZE>       SingleStack;
 	typedef StaticStack<PacketTraversalData, MAX_STACK_SIZE> PacketStack;
+	// At most 3 children pushed per level
+	typedef StaticStack<BvhTraversalData, Bvh4::MAX_DEPTH * 3> BvhStack;
+
+	// Triangle tests counted by each thread
+	struct Statistics
+	{
+		// Triangles tested against single rays and ray packets
+		rtu::uint64 singleTests;
+		rtu::uint64 packetTests;
+		// Triangles not tested again, found in the ray's or packet's mailbox
+		rtu::uint64 singleSkips;
+		rtu::uint64 packetSkips;
+		// Geometries traversed by ray packets, and by their rays one at a time
+		rtu::uint64 packetTraversals;
+		rtu::uint64 packetFallbacks;
+		// Rays traced one at a time by these fallbacks
+		rtu::uint64 fallbackRays;
+		// Rays traced from ray streams and queues, and packets they were regrouped into
+		rtu::uint64 streamRays;
+		rtu::uint64 streamPackets;
+	};
+
+	// Packets traced together by traceSorted before shading any of them
+	struct StreamBatch
+	{
+		rts::RTstate packets[STREAM_BATCH_SIZE];
+		unsigned int octants[STREAM_BATCH_SIZE];
+		// Sorted rays of each packet
+		const RayStream::Entry* const* rays[STREAM_BATCH_SIZE];
+		unsigned int counts[STREAM_BATCH_SIZE];
+		// Rays too few to fill a packet, traced one at a time
+		rts::RTstate single;
+	};
+
+	// Material ids and states sorted by shadeBatch
+	struct ShadeBatch
+	{
+		std::vector<rtu::uint64> keys;
+		std::vector<rts::RTstate*> states;
+	};
+
+	// Traversal state owned by each thread, created the first time it traces a ray
+	struct Context
+	{
+		PacketStack packetStacks[4];
+		SingleStack instanceStack;
+		SingleStack geometryStack;
+		BvhStack bvhStack;
+		// Ray direction sign bits of current packet quadrant
+		const unsigned int* dirSigns;
+		// Triangles tested in current kd-tree traversal of a geometry
+		Mailbox singleMailbox;
+		Mailbox packetMailbox;
+		Statistics stats;
+		// Rays of streams are queued instead of being traced (see beginQueue), for the next traceQueue
+		bool queueRays;
+		std::vector<RayStream::Entry> queuedRays;
+		// Rays traced by current traceQueue, and their sort keys
+		std::vector<RayStream::Entry> tracedRays;
+		std::vector<rtu::uint64> queueKeys;
+		// Batch of each traceSorted in progress, too large for thread stacks: shaders trace streams of their own
+		// while the packets of a batch are shaded
+		ScratchStack<StreamBatch> streamBatches;
+		// Streams of shaders (see rtsAcquireRayStream)
+		ScratchStack<rts::RTstream> shaderStreams;
+		// Scratch of each shadeBatch in progress: materials may trace and shade batches of their own
+		ScratchStack<ShadeBatch> shadeBatches;
+		// Lights of current light sampling (see LightTree::sample)
+		std::vector<LightTree::Candidate> lightCandidates;
+	};
+
+	// Context of calling thread
+	static Context& context();
+
+	// Packet kernels instantiated for one SIMD width (see RayTracerKernels.h)
+	struct PacketKernels
+	{
+		unsigned int simdWidth;
+		void (RayTracer::*findLeaf)( const KdNode*& node, RayPacket& packet, PacketStack& stack,
+		                             __m128 activeMask4[RT_PACKET_SIMD_SIZE] );
+		unsigned int (RayTracer::*intersect)( const TriAccel& acc, const RayPacket& packet, HitPacket& hit, 
+		                              __m128 bestDist4[RT_PACKET_SIMD_SIZE], __m128 activeMask4[RT_PACKET_SIMD_SIZE] );
+		bool (RayTracer::*clip)( const AABB& bbox, RayPacket& p, const __m128 inputMask4[RT_PACKET_SIMD_SIZE],
+		                         __m128 outputMask4[RT_PACKET_SIMD_SIZE] );
+	};
+
+	// Widest packet kernels both compiled in and supported by the host: 4 (SSE2), 8 (AVX2) or 16 (AVX-512F)
+	static unsigned int maxSimdWidth();
+
+	// Selects packet kernels used by all threads, clamping width to a supported one. Returns selected width.
+	// Must not be called while tracing.
+	static unsigned int setSimdWidth( unsigned int width );
+	static unsigned int simdWidth();
+
+	// Sum of the statistics of all threads, only exact while no thread is tracing
+	static void statistics( Statistics& result );
+	static void resetStatistics();
 
 	RayTracer();
 
@@ -46,20 +157,56 @@ public:
 
 	// Trace a single ray against the entire scene
 	void traceSingle( rts::RTstate& state );
+
+	// Same as traceSingle, in two steps: find closest hit of ray, then shade it with its material or the environment
+	void findHitSingle( rts::RTstate& state );
+	void shadeSingle( rts::RTstate& state );
+
+	// Shade traced rays with a single call to each material hit (see rts::IMaterial::shadeBatch), in material id order.
+	// Rays hitting nothing are shaded by the environment. Must not be called by shaders.
+	void shadeBatch( rts::RTstate* const states[], unsigned int count );
 	void traceGeometrySingle( const Instance& instance, Ray& ray, Hit& hit );
 
 	// Returns true if ray hits any object, false otherwise
 	bool traceHitSingle( rts::RTstate& state );
 
-	// Trace a bundle of rays against the entire scene
+	// Find closest hits of the rays of a bundle (packet.mask) with the same direction signs q against the entire scene.
+	// Other rays keep their hits. Rays are not shaded (see shadePacket).
 	void tracePacket( rts::RTstate& state, unsigned int q );
 	void traceGeometryPacket( const Instance& instance, RayPacket& packet, HitPacket& hit, 
 		                      __m128 instActiveMask4[RT_PACKET_SIMD_SIZE] );
 
-	// Returns how many rays hit any object
-	unsigned int traceHitPacket( rts::RTstate& state );
+	// Trace all rays of a stream, in packets of rays with the same direction signs and nearby origins, and add their
+	// weighted result colors to their targets. Leaves stream empty.
+	// While the calling thread queues rays, moves them to its queue instead.
+	void traceStream( RayStream& stream );
+
+	// Breadth-first tracing on the calling thread: between beginQueue and endQueue, rays of streams are queued,
+	// with their weights and targets composed with the paths of the states that enqueued them (see RayState).
+	// Each traceQueue traces all rays queued so far and queues the rays enqueued by their shaders.
+	// Returns number of rays traced. Must not be called by shaders.
+	void beginQueue();
+	void endQueue();
+	unsigned int traceQueue();
+
+	// Shade traced rays of a bundle with a single call to each material and to the environment
+	void shadePacket( rts::RTstate& state );
+
+	// Tests active rays of a bundle for occlusion, tracing until all of them hit any object.
+	// Occluded rays are flagged in state (see RayPacketState::occluded). Returns how many rays hit any object.
+	unsigned int traceHitPacket( rts::RTstate& state, unsigned int q );
+	void traceGeometryHitPacket( const Instance& instance, RayPacket& packet, __m128 occluded4[RT_PACKET_SIMD_SIZE],
+		                         __m128 instActiveMask4[RT_PACKET_SIMD_SIZE] );
+
+	// Returns true if ray, already in geometry space, hits any triangle of geometry
+	bool traceGeometryHitSingle( const Geometry& geometry, Ray& ray );
 
 private:
+	void queueStream( Context& ctx, RayStream& stream );
+
+	// Trace rays sorted by direction octant (octants[i] is the octant of rays[i]), then add their weighted results
+	void traceSorted( Context& ctx, const RayStream::Entry* const* rays, const unsigned int* octants, unsigned int count );
+
 	//////////////////////////////////////////////////////////////////////////
 	// Ray-kdtree traversal routines
 
@@ -67,32 +214,80 @@ private:
     void findLeafSingle( const KdNode*& node, Ray& ray, SingleStack& stack );
 
 	// Returns leaf in node
-	//void findLeafPacket( const KdNode*& node, RayPacket& packet, PacketStack& stack,
-	//	                 __m128 activeMask4[RT_PACKET_SIMD_SIZE] );
-
 	void findLeafPacket( const KdNode*& node, RayPacket& packet, PacketStack& stack,
 		                 __m128 activeMask4[RT_PACKET_SIMD_SIZE] );
 
+	//////////////////////////////////////////////////////////////////////////
+	// Ray-bvh traversal routines (geometries with RT_ACCEL_BVH4)
+
+	// Closest hit. Ray must be already clipped to bvh bounding box.
+	void traceBvhSingle( const Geometry& geometry, const Ray& ray, Hit& hit, float& bestDistance );
+
+	// Any hit. Ray must be already clipped to bvh bounding box.
+	bool traceBvhHitSingle( const Geometry& geometry, const Ray& ray );
+
+	// Traces each active ray of a packet on its own, in geometry space.
+	// Used for bvh geometries, and for packets with too few active rays (see Scene::packetMinActiveRays).
+	void traceGeometryRays( Context& ctx, const Instance& instance, const Geometry& geometry, const RayPacket& packet,
+		                    HitPacket& hit, const unsigned int activeMask[RT_PACKET_SIZE] );
+	void traceGeometryHitRays( Context& ctx, const Geometry& geometry, const RayPacket& packet,
+		                       unsigned int occluded[RT_PACKET_SIZE], const unsigned int activeMask[RT_PACKET_SIZE] );
+
 	//////////////////////////////////////////////////////////////////////////
 	// Ray-triangle intersection routines
 
 	// Intersect a single triangle with a single ray
 	void intersectSingle( const TriAccel& acc, const Ray& ray, Hit& hit, float& bestDistance );
 
-	// Intersect a single triangle with a packet of rays
-	void intersectPacket( const TriAccel& acc, const RayPacket& packet, HitPacket& hit, 
+	// Intersect the triangles of a leaf with a single ray, testing 4 of them at once (see LeafTriangles).
+	// Kd-tree leaves skip triangles already tested in ctx.singleMailbox (bvh leaves do not share triangles).
+	void intersectLeafSingle( Context& ctx, bool mailboxed, const LeafTriangles& leaves, unsigned int elemStart,
+		                      unsigned int elemCount, const Ray& ray, Hit& hit, float& bestDistance );
+
+	// Returns true if ray hits any triangle of the leaf
+	bool intersectLeafHitSingle( Context& ctx, bool mailboxed, const LeafTriangles& leaves, unsigned int elemStart,
+		                         unsigned int elemCount, const Ray& ray );
+
+	// Intersect a single triangle with a packet of rays.
+	// Returns rays whose result is final, i.e. that need not test this triangle again in a later leaf.
+	unsigned int intersectPacket( const TriAccel& acc, const RayPacket& packet, HitPacket& hit, 
 		                  __m128 bestDist4[RT_PACKET_SIMD_SIZE], __m128 activeMask4[RT_PACKET_SIMD_SIZE] );
 
+	// Intersect the triangles of a kd-tree leaf with a packet of rays, skipping those already tested in ctx.packetMailbox
+	void intersectLeafPacket( Context& ctx, const Geometry& geometry, unsigned int elemStart, unsigned int elemCount,
+		                      const RayPacket& packet, HitPacket& hit, __m128 bestDist4[RT_PACKET_SIMD_SIZE],
+		                      __m128 activeMask4[RT_PACKET_SIMD_SIZE] );
+
 	// Clip all rays in packet to given AABB
 	bool clipRayPacket( const AABB& bbox, RayPacket& p, const __m128 inputMask4[RT_PACKET_SIMD_SIZE],
 		                __m128 outputMask4[RT_PACKET_SIMD_SIZE] );
 
 	void setupShadingRay( Ray& ray, const RayPacket& packet, unsigned int r );
-	void setupShadingHit( Hit& hit, const HitPacket& hitp, unsigned int r );
+
+	//////////////////////////////////////////////////////////////////////////
+	// Packet kernels for each SIMD width (see RayTracerKernels.h)
+
+	// Same as findLeafPacket, intersectPacket and clipRayPacket, processing Simd::WIDTH rays at once
+	template<class Simd>
+	void findLeafPacketSimd( const KdNode*& node, RayPacket& packet, PacketStack& stack,
+		                     __m128 activeMask4[RT_PACKET_SIMD_SIZE] );
+	template<class Simd>
+	unsigned int intersectPacketSimd( const TriAccel& acc, const RayPacket& packet, HitPacket& hit, 
+		                      __m128 bestDist4[RT_PACKET_SIMD_SIZE], __m128 activeMask4[RT_PACKET_SIMD_SIZE] );
+	template<class Simd>
+	bool clipRayPacketSimd( const AABB& bbox, RayPacket& p, const __m128 inputMask4[RT_PACKET_SIMD_SIZE],
+		                    __m128 outputMask4[RT_PACKET_SIMD_SIZE] );
+
+	// Kernels of each width, NULL if the compiler could not generate them.
+	// Defined in RayTracer.cpp, RayTracerAvx2.cpp and RayTracerAvx512.cpp, each compiled for its instruction set.
+	static const PacketKernels* sseKernels();
+	static const PacketKernels* avx2Kernels();
+	static const PacketKernels* avx512Kernels();
 
 	// Intersection
 	unsigned int _modulo[5];
-	unsigned int _quadModulo[5];
+	// Same as _modulo, times RT_PACKET_SIZE to index packet axis arrays
+	unsigned int _packetModulo[5];
 	/*
 	 *	Ray Direction Signs used in bounding box clipping and determining near and far nodes
 	 *	000 111
@@ -0,0 +1,28 @@
+#include <rtc/RayTracerKernels.h>
+
+// Packet kernels for AVX2, selected at run time if the host supports it (see RayTracer::setSimdWidth).
+// With gcc, this file must be compiled with -mavx2. Keep it to kernel instantiations only, so that no code
+// shared with other files is generated for AVX2.
+
+namespace rtc {
+
+#if defined(RTU_HAS_AVX2)
+
+const RayTracer::PacketKernels* RayTracer::avx2Kernels()
+{
+	static const PacketKernels s_kernels = { 8, &RayTracer::findLeafPacketSimd<rtu::Simd8>,
+		                                     &RayTracer::intersectPacketSimd<rtu::Simd8>,
+		                                     &RayTracer::clipRayPacketSimd<rtu::Simd8> };
+	return &s_kernels;
+}
+
+#else
+
+const RayTracer::PacketKernels* RayTracer::avx2Kernels()
+{
+	return NULL;
+}
+
+#endif // RTU_HAS_AVX2
+
+} // namespace rtc
@@ -0,0 +1,28 @@
+#include <rtc/RayTracerKernels.h>
+
+// Packet kernels for AVX-512F, selected at run time if the host supports it (see RayTracer::setSimdWidth).
+// With gcc, this file must be compiled with -mavx512f. Keep it to kernel instantiations only, so that no code
+// shared with other files is generated for AVX-512F.
+
+namespace rtc {
+
+#if defined(RTU_HAS_AVX512)
+
+const RayTracer::PacketKernels* RayTracer::avx512Kernels()
+{
+	static const PacketKernels s_kernels = { 16, &RayTracer::findLeafPacketSimd<rtu::Simd16>,
+		                                     &RayTracer::intersectPacketSimd<rtu::Simd16>,
+		                                     &RayTracer::clipRayPacketSimd<rtu::Simd16> };
+	return &s_kernels;
+}
+
+#else
+
+const RayTracer::PacketKernels* RayTracer::avx512Kernels()
+{
+	return NULL;
+}
+
+#endif // RTU_HAS_AVX512
+
+} // namespace rtc
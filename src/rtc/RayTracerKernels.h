@@ -0,0 +1,248 @@
+#pragma once
+#ifndef _RTC_RAYTRACERKERNELS_H_
+#define _RTC_RAYTRACERKERNELS_H_
+
+#include <rtc/RayTracer.h>
+#include <rtu/simd.h>
+
+/*
+ *	Packet traversal kernels, templated on SIMD width (see rtu/simd.h).
+ *	Packet data has RT_PACKET_SIZE floats per attribute whatever the width, which is processed in groups of
+ *	Simd::WIDTH consecutive rays (4 groups with SSE, 2 with AVX2, a single one with AVX-512).
+ *	Only included by the files instantiating them, so that each width is compiled for its own instruction set.
+ */
+
+namespace rtc {
+
+static const float INTERSECT_EPSILON = 1e-4f;
+
+// Returns leaf in node
+template<class Simd>
+void RayTracer::findLeafPacketSimd( const KdNode*& node, RayPacket& packet, PacketStack& stack,
+					                __m128 activeMask4[RT_PACKET_SIMD_SIZE] )
+{
+	typedef typename Simd::Float Float;
+	typedef typename Simd::Mask Mask;
+	const unsigned int W = Simd::WIDTH;
+	const unsigned int GROUPS = RT_PACKET_SIZE / Simd::WIDTH;
+
+	const unsigned int* const dirSigns = context().dirSigns;
+
+	// Keep active masks in registers until we find the leaf
+	float* const activeMask = reinterpret_cast<float*>( activeMask4 );
+	Mask active[GROUPS];
+	for( unsigned int g = 0; g < GROUPS; ++g )
+	{
+		active[g] = Simd::loadMask( activeMask + g*W );
+	}
+
+	while( !node->isLeaf() )
+	{
+		// Correct axis index to access direction signs (axis*2)
+		const unsigned int axis = node->axis() << 1;
+		const Float splitPos = Simd::set1( node->splitPos() );
+
+		// Front and back children, according to packet direction signs
+		const KdNode* const front = node->leftChild() + dirSigns[axis];
+		const KdNode* const back  = node->leftChild() + dirSigns[axis + 1];
+
+		// Packet data of this axis, stored after the RT_PACKET_SIZE values of each previous axis
+		const float* const oa = packet.oa + ( axis >> 1 ) * RT_PACKET_SIZE;
+		const float* const rda = packet.rda + ( axis >> 1 ) * RT_PACKET_SIZE;
+
+		// Compute split plane intersection with ray segments
+		Float d[GROUPS];
+		for( unsigned int g = 0; g < GROUPS; ++g )
+		{
+			d[g] = Simd::mul( Simd::sub( splitPos, Simd::load( oa + g*W ) ), Simd::load( rda + g*W ) );
+		}
+
+		// Check if all rays go to back child
+		unsigned int dnear = 0;
+		for( unsigned int g = 0; g < GROUPS; ++g )
+		{
+			dnear |= Simd::maskBits( Simd::andMask( active[g], Simd::cmple( Simd::load( packet.tnear + g*W ), d[g] ) ) );
+		}
+		node = back;
+		if( dnear == 0 )
+			continue; // traverse back child
+
+		// Check if all rays go to front child
+		unsigned int dfar = 0;
+		for( unsigned int g = 0; g < GROUPS; ++g )
+		{
+			dfar |= Simd::maskBits( Simd::andMask( active[g], Simd::cmpge( Simd::load( packet.tfar + g*W ), d[g] ) ) );
+		}
+		node = front;
+		if( dfar == 0 )
+			continue; // traverse front child
+
+		// Push back child to stack and traverse front one
+		// NaNs are handled by placing d in first operand of min and max
+		stack.push();
+		PacketTraversalData& data = stack.top();
+
+		data.node = back;
+
+		for( unsigned int g = 0; g < GROUPS; ++g )
+		{
+			const Float tnear = Simd::load( packet.tnear + g*W );
+			const Float tfar = Simd::load( packet.tfar + g*W );
+			const Float frontTfar = Simd::min( d[g], tfar );
+
+			Simd::store( data.tfar + g*W, tfar );
+			Simd::store( data.tnear + g*W, Simd::max( d[g], tnear ) );
+			Simd::store( packet.tfar + g*W, frontTfar );
+			active[g] = Simd::andMask( active[g], Simd::cmple( tnear, frontTfar ) );
+		}
+	}
+
+	for( unsigned int g = 0; g < GROUPS; ++g )
+	{
+		Simd::storeMask( activeMask + g*W, active[g] );
+	}
+}
+
+// Intersect a single triangle with a packet of rays
+template<class Simd>
+unsigned int RayTracer::intersectPacketSimd( const TriAccel& acc, const RayPacket& packet, HitPacket& hit,
+								     __m128 bestDist4[RT_PACKET_SIMD_SIZE], __m128 activeMask4[RT_PACKET_SIMD_SIZE] )
+{
+	typedef typename Simd::Float Float;
+	typedef typename Simd::Mask Mask;
+	const unsigned int W = Simd::WIDTH;
+	const unsigned int GROUPS = RT_PACKET_SIZE / Simd::WIDTH;
+
+	// Packet data of projection axis and of the other two (axis*RT_PACKET_SIZE)
+	const unsigned int k = _packetModulo[acc.k];
+	const unsigned int ku = _packetModulo[acc.k+1];
+	const unsigned int kv = _packetModulo[acc.k+2];
+
+	const Float n_u = Simd::set1( acc.n_u );
+	const Float n_v = Simd::set1( acc.n_v );
+	const Float n_d = Simd::set1( acc.n_d );
+	const Float epsilon = Simd::set1( INTERSECT_EPSILON );
+	const Float zero = Simd::zero();
+
+	float* const bestDist = reinterpret_cast<float*>( bestDist4 );
+	const float* const activeMask = reinterpret_cast<const float*>( activeMask4 );
+	unsigned int finalRays = 0;
+
+	for( unsigned int g = 0, o = 0; g < GROUPS; ++g, o += W )
+	{
+		// Only active rays, others may be done or traced in another call (incoherent packets)
+		Mask mask = Simd::loadMask( activeMask + o );
+		if( Simd::maskBits( mask ) == 0 )
+			continue;
+
+		// Start high-latency division as early as possible
+		const Float nd = Simd::rcp( Simd::add( Simd::load( packet.da + k + o ),
+			                                   Simd::add( Simd::mul( n_u, Simd::load( packet.da + ku + o ) ),
+			                                              Simd::mul( n_v, Simd::load( packet.da + kv + o ) ) ) ) );
+
+		// Compute intersection distance
+		const Float f = Simd::mul( nd, Simd::sub( Simd::sub( Simd::sub( n_d, Simd::load( packet.oa + k + o ) ),
+			                                                 Simd::mul( n_u, Simd::load( packet.oa + ku + o ) ) ),
+			                                      Simd::mul( n_v, Simd::load( packet.oa + kv + o ) ) ) );
+
+		// TODO: find a correct way to get rid of these epsilons and check scene06 for any errors
+		// Tolerances to near and far comparisons
+		const Float ntol = Simd::sub( Simd::load( packet.tnear + o ), epsilon );
+		const Float ftol = Simd::add( Simd::load( packet.tfar + o ), epsilon );
+
+		// Only rays hitting the plane beyond their current segment may hit the triangle in a later leaf
+		finalRays |= ( Simd::maskBits( mask ) & ~Simd::maskBits( Simd::cmplt( ftol, f ) ) ) << o;
+
+		// Check for valid distance
+		mask = Simd::andMask( mask, Simd::cmplt( f, Simd::load( bestDist + o ) ) );
+		mask = Simd::andMask( mask, Simd::andMask( Simd::cmpge( f, ntol ), Simd::cmple( f, ftol ) ) );
+
+		if( Simd::maskBits( mask ) == 0 )
+			continue; // invalid distance
+
+		// Compute hit point positions on uv plane
+		const Float hu = Simd::add( Simd::load( packet.oa + ku + o ), Simd::mul( f, Simd::load( packet.da + ku + o ) ) );
+		const Float hv = Simd::add( Simd::load( packet.oa + kv + o ), Simd::mul( f, Simd::load( packet.da + kv + o ) ) );
+
+		// Compute first barycentric coordinate (lambda)
+		const Float lambda = Simd::add( Simd::set1( acc.b_d ), Simd::add( Simd::mul( hu, Simd::set1( acc.b_nu ) ),
+			                                                              Simd::mul( hv, Simd::set1( acc.b_nv ) ) ) );
+		mask = Simd::andMask( mask, Simd::cmpge( lambda, zero ) );
+
+		if( Simd::maskBits( mask ) == 0 )
+			continue; // invalid lambda
+
+		// Compute second barycentric coordinate (mue)
+		const Float mue = Simd::add( Simd::set1( acc.c_d ), Simd::add( Simd::mul( hu, Simd::set1( acc.c_nu ) ),
+			                                                           Simd::mul( hv, Simd::set1( acc.c_nv ) ) ) );
+		mask = Simd::andMask( mask, Simd::cmpge( mue, zero ) );
+
+		if( Simd::maskBits( mask ) == 0 )
+			continue; // invalid mue
+
+		// Compute third barycentric coordinate (psi)
+		const Float psi = Simd::sub( Simd::set1( 1.0f ), Simd::add( lambda, mue ) );
+		mask = Simd::andMask( mask, Simd::cmpge( psi, zero ) );
+
+		if( Simd::maskBits( mask ) == 0 )
+			continue; // invalid psi
+
+		// Have a valid hit point here. Store it.
+		Simd::maskStore( bestDist + o, mask, f );
+		Simd::maskStore( hit.tId + o, mask, acc.triangleId );
+		Simd::maskStore( hit.v0c + o, mask, psi );
+		Simd::maskStore( hit.v1c + o, mask, lambda );
+		Simd::maskStore( hit.v2c + o, mask, mue );
+	}
+	return finalRays;
+}
+
+// Clip all rays in packet to given AABB
+template<class Simd>
+bool RayTracer::clipRayPacketSimd( const AABB& bbox, RayPacket& p, const __m128 inputMask4[RT_PACKET_SIMD_SIZE],
+				                   __m128 outputMask4[RT_PACKET_SIMD_SIZE] )
+{
+	typedef typename Simd::Float Float;
+	typedef typename Simd::Mask Mask;
+	const unsigned int W = Simd::WIDTH;
+	const unsigned int GROUPS = RT_PACKET_SIZE / Simd::WIDTH;
+
+	// xmin, xmax, ymin, ymax, zmin, zmax
+	const Float bb[6] = { Simd::set1( bbox.minv.x ), Simd::set1( bbox.maxv.x ),
+		                  Simd::set1( bbox.minv.y ), Simd::set1( bbox.maxv.y ),
+		                  Simd::set1( bbox.minv.z ), Simd::set1( bbox.maxv.z ) };
+
+	const unsigned int* const dirSigns = context().dirSigns;
+	const float* const inputMask = reinterpret_cast<const float*>( inputMask4 );
+	float* const outputMask = reinterpret_cast<float*>( outputMask4 );
+	unsigned int hitBits = 0;
+
+	for( unsigned int g = 0, o = 0; g < GROUPS; ++g, o += W )
+	{
+		Float tnear = Simd::load( p.tnear + o );
+		Float tfar = Simd::load( p.tfar + o );
+
+		for( unsigned int a = 0; a < 6; a += 2 )
+		{
+			// Packet data of axis a/2
+			const Float oa = Simd::load( p.oa + ( a >> 1 ) * RT_PACKET_SIZE + o );
+			const Float rda = Simd::load( p.rda + ( a >> 1 ) * RT_PACKET_SIZE + o );
+
+			// Using reciprocal directions in first argument of min and max to filter them out in case of NaNs
+			tnear = Simd::max( Simd::mul( Simd::sub( bb[a + dirSigns[a]], oa ), rda ), tnear );
+			tfar  = Simd::min( Simd::mul( Simd::sub( bb[a + dirSigns[a+1]], oa ), rda ), tfar );
+		}
+
+		Simd::store( p.tnear + o, tnear );
+		Simd::store( p.tfar + o, tfar );
+
+		const Mask output = Simd::andMask( Simd::loadMask( inputMask + o ), Simd::cmple( tnear, tfar ) );
+		Simd::storeMask( outputMask + o, output );
+		hitBits |= Simd::maskBits( output );
+	}
+	return ( hitBits != 0 );
+}
+
+} // namespace rtc
+
+#endif // _RTC_RAYTRACERKERNELS_H_
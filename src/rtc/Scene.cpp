@@ -9,5 +9,15 @@ float* Scene::frameBuffer;
 float Scene::rayEpsilon;
 unsigned int Scene::maxRayRecursionDepth;
 float Scene::mediumRefractionIndex;
+unsigned int Scene::geometryBuildMode;
+unsigned int Scene::geometryBinCount;
+unsigned int Scene::instanceBuildMode;
+unsigned int Scene::geometryAccelStructure;
+bool Scene::geometryLeafOrdered;
+unsigned int Scene::packetMinActiveRays;
+unsigned int Scene::randomSeed;
+LightTree Scene::lightTree;
+float Scene::lightCutoff;
+unsigned int Scene::lightSampleCount;
 
 } // namespace rtc
@@ -6,6 +6,7 @@
 #include <rtc/KdTree.h>
 #include <rtc/Instance.h>
 #include <rtc/Geometry.h>
+#include <rtc/LightTree.h>
 #include <vector>
 
 namespace rtc {
@@ -19,6 +20,16 @@ struct Scene
 	static float rayEpsilon;
 	static unsigned int maxRayRecursionDepth;
 	static float mediumRefractionIndex;
+	static unsigned int geometryBuildMode;
+	static unsigned int geometryBinCount;
+	static unsigned int instanceBuildMode;
+	static unsigned int geometryAccelStructure;
+	static bool geometryLeafOrdered;
+	static unsigned int packetMinActiveRays;
+	static unsigned int randomSeed;
+	static LightTree lightTree;
+	static float lightCutoff;
+	static unsigned int lightSampleCount;
 };
 
 } // namespace rtc
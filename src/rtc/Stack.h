@@ -3,6 +3,8 @@
 #define _RTC_STACK_H_
 
 #include <rtu/common.h>
+#include <vector>
+#include <new>
 
 namespace rtc {
 
@@ -123,6 +125,60 @@ bool StaticStack<T, SIZE>::empty() const
     return ( topIdx < 0 );
 }
 
+// Scratch buffers of a re-entrant function, one per nesting level.
+// A level is allocated (16-byte aligned) the first time it is pushed and kept for next calls,
+// so its buffer stays valid while deeper levels are pushed.
+template<typename T>
+class ScratchStack
+{
+public:
+	inline ScratchStack();
+	inline ~ScratchStack();
+
+	// Buffer of next level
+	inline T& push();
+	inline void pop();
+
+private:
+	// Not copyable
+	ScratchStack( const ScratchStack& );
+	ScratchStack& operator=( const ScratchStack& );
+
+	std::vector<T*> _levels;
+	unsigned int _depth;
+};
+
+template<typename T>
+ScratchStack<T>::ScratchStack()
+: _depth( 0 )
+{
+}
+
+template<typename T>
+ScratchStack<T>::~ScratchStack()
+{
+	for( unsigned int i = 0; i < _levels.size(); ++i )
+	{
+		_levels[i]->~T();
+		_mm_free( _levels[i] );
+	}
+}
+
+template<typename T>
+T& ScratchStack<T>::push()
+{
+	if( _depth == _levels.size() )
+		_levels.push_back( new( _mm_malloc( sizeof( T ), 16 ) ) T );
+
+	return *_levels[_depth++];
+}
+
+template<typename T>
+void ScratchStack<T>::pop()
+{
+	--_depth;
+}
+
 } // namespace rtc
 
 #endif // _RTC_STACK_H_
@@ -62,4 +62,40 @@ bool TriAccel::valid()
 		      rtu::mathf::isInvalid( c_nu ) || rtu::mathf::isInvalid( c_nv ) || rtu::mathf::isInvalid( c_d )  );
 }
 
+void TriAccel4::set( unsigned int slot, const TriAccel& acc )
+{
+	const unsigned int u = ( acc.k + 1 ) % 3;
+	const unsigned int v = ( acc.k + 2 ) % 3;
+
+	float* const n[3] = { nx, ny, nz };
+	float* const b[3] = { bx, by, bz };
+	float* const c[3] = { cx, cy, cz };
+
+	n[acc.k][slot] = 1.0f;
+	n[u][slot] = acc.n_u;
+	n[v][slot] = acc.n_v;
+	n_d[slot] = acc.n_d;
+
+	b[acc.k][slot] = 0.0f;
+	b[u][slot] = acc.b_nu;
+	b[v][slot] = acc.b_nv;
+	b_d[slot] = acc.b_d;
+
+	c[acc.k][slot] = 0.0f;
+	c[u][slot] = acc.c_nu;
+	c[v][slot] = acc.c_nv;
+	c_d[slot] = acc.c_d;
+
+	triangleId[slot] = acc.triangleId;
+}
+
+void TriAccel4::setEmpty( unsigned int slot )
+{
+	// Zero plane: distance is 0 / 0
+	nx[slot] = ny[slot] = nz[slot] = n_d[slot] = 0.0f;
+	bx[slot] = by[slot] = bz[slot] = b_d[slot] = 0.0f;
+	cx[slot] = cy[slot] = cz[slot] = c_d[slot] = 0.0f;
+	triangleId[slot] = 0;
+}
+
 } // namespace rtc
@@ -4,6 +4,7 @@
 
 #include <rtu/common.h>
 #include <rtu/float3.h>
+#include <rtu/sse.h>
 
 namespace rtc {
 
@@ -42,6 +43,38 @@ struct TriAccel
 	unsigned int triangleId; // pad to 48 bytes for cache alignment purposes
 };
 
+/*
+ *	Four TriAccel stored as a structure of arrays, tested against a single ray at once with SSE.
+ *	Projected plane and line equations are expanded back to x, y, z (zero along the projection axis for lines,
+ *	one for the plane), so that each slot may have a different projection axis.
+ */
+struct TriAccel4
+{
+	void set( unsigned int slot, const TriAccel& acc );
+	// Slot never hit by any ray (distance is always NaN)
+	void setEmpty( unsigned int slot );
+
+	// plane: N' (N'[k] = 1) and its constant
+	union { float nx[4]; __m128 nx4; };
+	union { float ny[4]; __m128 ny4; };
+	union { float nz[4]; __m128 nz4; };
+	union { float n_d[4]; __m128 n_d4; };
+
+	// line equation for line ac
+	union { float bx[4]; __m128 bx4; };
+	union { float by[4]; __m128 by4; };
+	union { float bz[4]; __m128 bz4; };
+	union { float b_d[4]; __m128 b_d4; };
+
+	// line equation for line ab
+	union { float cx[4]; __m128 cx4; };
+	union { float cy[4]; __m128 cy4; };
+	union { float cz[4]; __m128 cz4; };
+	union { float c_d[4]; __m128 c_d4; };
+
+	unsigned int triangleId[4];
+};
+
 } // namespace rtc
 
 #endif // _RTC_TRIANGLE_H_
@@ -1,69 +1,293 @@
 #include <rtc/TriangleTreeBuilder.h>
+#include <rt/definitions.h>
 #include <rtu/stl.h>
+#include <rtu/sse.h>
 #include <algorithm>
+#include <cstring>
+#include <omp.h>
 
 namespace rtc {
 
+// Nodes with fewer triangles are never split with parallel loops nor deferred as jobs
+static const unsigned int PARALLEL_MIN_TRIANGLES = 4096;
+
+// Triangle is not stored in child node
+static const unsigned int INVALID_INDEX = 0xFFFFFFFF;
+
 TriangleTreeBuilder::TriangleTreeBuilder()
-: _events( 3 ), _traversalCost( 1.0f ), _intersectionCost( 1.4f )
+: _parallelDepth( 0 ), _traversalCost( 1.0f ), _intersectionCost( 1.4f )
 {
 	// empty
 }
 
-RawKdTree* TriangleTreeBuilder::buildTree( Geometry* geometry )
+void TriangleTreeBuilder::buildTree( KdTree& result, Geometry* geometry, unsigned int buildMode, unsigned int binCount )
 {
 	// Store geometry reference
 	_geometry = geometry;
+	_buildMode = buildMode;
+	_binCount = ( binCount > 1 ) ? binCount : 2;
 	
 	unsigned int triangleCount = _geometry->triDesc.size();
 
-	// Reset triangle data
-	rtu::vectorExactResize( _triangleSides, triangleCount );
-	rtu::vectorExactResize( _triangleBoxes, triangleCount );
+	// Free previous tree before building the new one
+	result.erase();
+	result.bbox.buildFrom( &_geometry->vertices[0], _geometry->vertices.size() );
+
+	// Build the top of the tree serially, and defer subtrees as jobs once there are
+	// enough of them to keep all threads busy (about 8 per thread)
+	const unsigned int threadCount = omp_get_max_threads();
+	_parallelDepth = 0;
+	if( ( threadCount > 1 ) && ( triangleCount >= PARALLEL_MIN_TRIANGLES ) )
+	{
+		while( ( 1u << _parallelDepth ) < threadCount * 8 )
+			++_parallelDepth;
+	}
 
-	// Pre-allocate event data
-	_events[0].reserve( triangleCount*2 );
-	_events[1].reserve( triangleCount*2 );
-	_events[2].reserve( triangleCount*2 );
+	BuildContext context;
+	context.parallel = ( _parallelDepth > 0 );
+	context.stats.reset();
 
-	// Create triangle id vector for entire scene
-	RawKdNode::Elements initialTriangles( triangleCount );
+	// Create triangle id list for entire scene
+	RawKdNode::Elements initialTriangles( context.scratch.allocate<unsigned int>( triangleCount ), triangleCount );
 
 	for( unsigned int i = 0; i < triangleCount; ++i )
 	{
 		initialTriangles[i] = i;
 	}
-	
-	// Create new raw kd tree
-	RawKdTree* tree = new RawKdTree();
-	tree->bbox.buildFrom( &_geometry->vertices[0], _geometry->vertices.size() );
-	_stats = &tree->stats;
-	_stats->reset();
+
+	// Root node
+	context.nodes.resize( 1 );
 
 	// Recursive tree build
-	tree->root = recursiveBuild( initialTriangles, tree->bbox, 0 );
+	if( _buildMode == RT_BUILD_SAH_PRESORTED )
+	{
+		// Compute triangle boxes, skip degenerate triangles and sort events only once
+		std::vector<AABB>& boxes = context.boxes;
+		boxes.resize( triangleCount );
+		const std::vector<rtu::float3>& vertices = _geometry->vertices;
+
+		#pragma omp parallel for if( context.parallel )
+		for( int t = 0; t < (int)triangleCount; ++t )
+		{
+			const TriDesc& triDesc = _geometry->triDesc[t];
+			result.bbox.clipTriangle( boxes[t], vertices[triDesc.v0], vertices[triDesc.v1], vertices[triDesc.v2] );
+		}
+
+		std::vector<Event> events[3];
+		unsigned int validCount = 0;
+		for( unsigned int t = 0; t < triangleCount; ++t )
+		{
+			if( boxes[t].isDegenerate() )
+				continue;
+			addEvents( events, boxes[t], validCount );
+			initialTriangles[validCount++] = t;
+		}
+		initialTriangles.count = validCount;
+		rtu::vectorFreeMemory( boxes );
+
+		#pragma omp parallel for if( context.parallel )
+		for( int k = 0; k < 3; ++k )
+		{
+			std::sort( events[k].begin(), events[k].end(), EventOrder() );
+		}
+
+		recursiveBuildSorted( context, 0, initialTriangles, events, result.bbox, 0 );
+	}
+	else if( _buildMode == RT_BUILD_SAH_BINNED )
+	{
+		// Compute triangle boxes once
+		_triangleBounds.resize( triangleCount * 8 );
+		const std::vector<rtu::float3>& vertices = _geometry->vertices;
+
+		#pragma omp parallel for if( context.parallel )
+		for( int t = 0; t < (int)triangleCount; ++t )
+		{
+			const TriDesc& triDesc = _geometry->triDesc[t];
+			AABB box;
+			box.buildFrom( &vertices[triDesc.v0], 1 );
+			box.expandBy( &vertices[triDesc.v1], 1 );
+			box.expandBy( &vertices[triDesc.v2], 1 );
 
-	// Cleanup
-	rtu::vectorFreeMemory( _triangleSides );
-	rtu::vectorFreeMemory( _triangleBoxes );
-	rtu::vectorFreeMemory( _events[0] );
-	rtu::vectorFreeMemory( _events[1] );
-	rtu::vectorFreeMemory( _events[2] );
+			float* bounds = &_triangleBounds[t*8];
+			bounds[0] = box.minv.x; bounds[1] = box.minv.y; bounds[2] = box.minv.z; bounds[3] = 0.0f;
+			bounds[4] = box.maxv.x; bounds[5] = box.maxv.y; bounds[6] = box.maxv.z; bounds[7] = 0.0f;
+		}
+
+		recursiveBuildBinned( context, 0, initialTriangles, result.bbox, 0 );
+	}
+	else
+	{
+		recursiveBuild( context, 0, initialTriangles, result.bbox, 0 );
+	}
+	context.freeMemory();
 
-	return tree;
+	// Finish deferred subtrees
+	buildJobs();
+	rtu::vectorFreeMemory( _triangleBounds );
+
+	storeTree( result, context );
 }
 
 // Private methods
 
-RawKdNode* TriangleTreeBuilder::leafNode( const RawKdNode::Elements& triangles, unsigned int treeDepth )
+TriangleTreeBuilder::BuildContext::BuildContext()
+: parallel( false )
+{
+	// empty
+}
+
+void TriangleTreeBuilder::BuildContext::freeMemory()
 {
-	if( treeDepth > _stats->treeDepth )
-		_stats->treeDepth = treeDepth;
+	rtu::vectorFreeMemory( events[0] );
+	rtu::vectorFreeMemory( events[1] );
+	rtu::vectorFreeMemory( events[2] );
+	rtu::vectorFreeMemory( sides );
+	rtu::vectorFreeMemory( boxes );
+	for( unsigned int k = 0; k < 3; ++k )
+	{
+		rtu::vectorFreeMemory( straddling[0][k] );
+		rtu::vectorFreeMemory( straddling[1][k] );
+	}
+	rtu::vectorFreeMemory( remap[0] );
+	rtu::vectorFreeMemory( remap[1] );
+	rtu::vectorFreeMemory( bins );
+	scratch.release();
+}
+
+TriangleTreeBuilder::BuildJob& TriangleTreeBuilder::addJob( BuildContext& context, unsigned int node, const RawKdNode::Elements& triangles, 
+															 const AABB& bbox, unsigned int treeDepth )
+{
+	_jobs.push_back( BuildJob() );
+	BuildJob& job = _jobs.back();
+	job.node = node;
+	job.bbox = bbox;
+	job.treeDepth = treeDepth;
 
-	_stats->elemIdCount += triangles.size();
-	++_stats->leafCount;
+	// Node triangles live in scratch memory, which is rewound before the job is built
+	job.triangles.ids = _jobArena.allocate<unsigned int>( triangles.size() );
+	job.triangles.count = triangles.size();
+	memcpy( job.triangles.ids, triangles.ids, triangles.size() * sizeof( unsigned int ) );
 
-	return new RawKdNode( triangles );
+	return job;
+}
+
+void TriangleTreeBuilder::buildJobs()
+{
+	const int jobCount = _jobs.size();
+	if( jobCount == 0 )
+		return;
+
+	std::vector<BuildJob*> jobs( jobCount );
+	for( int i = 0; i < jobCount; ++i )
+		jobs[i] = &_jobs[i];
+	std::sort( jobs.begin(), jobs.end(), BuildJobOrder() );
+
+	// One context per thread (contexts own arenas, so they cannot be copied into a vector)
+	const unsigned int contextCount = omp_get_max_threads();
+	BuildContext* contexts = new BuildContext[contextCount];
+	for( unsigned int i = 0; i < contextCount; ++i )
+		contexts[i].stats.reset();
+
+	#pragma omp parallel for schedule( dynamic, 1 )
+	for( int i = 0; i < jobCount; ++i )
+	{
+		BuildContext& context = contexts[omp_get_thread_num()];
+		BuildJob& job = *jobs[i];
+
+		// Build subtree in context output, then move it to the job
+		context.nodes.resize( 1 );
+		if( _buildMode == RT_BUILD_SAH_PRESORTED )
+			recursiveBuildSorted( context, 0, job.triangles, job.events, job.bbox, job.treeDepth );
+		else if( _buildMode == RT_BUILD_SAH_BINNED )
+			recursiveBuildBinned( context, 0, job.triangles, job.bbox, job.treeDepth );
+		else
+			recursiveBuild( context, 0, job.triangles, job.bbox, job.treeDepth );
+
+		job.nodes.swap( context.nodes );
+		job.elements.swap( context.elements );
+	}
+
+	delete [] contexts;
+	_jobArena.release();
+}
+
+void TriangleTreeBuilder::storeTree( KdTree& result, BuildContext& context )
+{
+	Array<KdNode>& treeNodes = context.nodes;
+	Array<unsigned int>& treeElements = context.elements;
+
+	if( !_jobs.empty() )
+	{
+		unsigned int nodeCount = treeNodes.size();
+		unsigned int elementCount = treeElements.size();
+		for( unsigned int j = 0; j < _jobs.size(); ++j )
+		{
+			// Subtree root replaces its placeholder
+			nodeCount += _jobs[j].nodes.size() - 1;
+			elementCount += _jobs[j].elements.size();
+		}
+
+		// Top of the tree only holds the first levels, so growing it to final size copies little
+		treeNodes.reserve( nodeCount );
+		treeElements.reserve( elementCount );
+	}
+
+	// Append subtrees, subtree node i (except root) goes to nodeBase + i - 1.
+	// Child offsets are relative, so other nodes can be copied as they are.
+	for( unsigned int j = 0; j < _jobs.size(); ++j )
+	{
+		BuildJob& job = _jobs[j];
+		const Array<KdNode>& nodes = job.nodes;
+		const unsigned int nodeBase = treeNodes.size();
+		const unsigned int elementBase = treeElements.size();
+
+		treeNodes.resize( nodeBase + nodes.size() - 1 );
+		for( unsigned int i = 0, size = nodes.size(); i < size; ++i )
+		{
+			const KdNode& node = nodes[i];
+			KdNode& target = ( i == 0 ) ? treeNodes[job.node] : treeNodes[nodeBase + i - 1];
+
+			if( node.isLeaf() )
+			{
+				target.setLeafNode( elementBase + node.elemStart(), node.elemCount() );
+			}
+			else if( i == 0 )
+			{
+				// Root moved, so offset to its children must be recomputed
+				SplitPlane plane;
+				plane.axis = node.axis();
+				plane.position = node.splitPos();
+				target.setInternalNode( plane, &treeNodes[nodeBase + ( node.leftChild() - &nodes[0] ) - 1] );
+			}
+			else
+			{
+				target = node;
+			}
+		}
+
+		treeElements.append( &job.elements[0], job.elements.size() );
+		job.nodes.freeMemory();
+		job.elements.freeMemory();
+	}
+
+	_jobs.clear();
+
+	// No copy, result takes the arrays over
+	result.root = treeNodes.release();
+	result.elements = treeElements.release();
+}
+
+void TriangleTreeBuilder::leafNode( BuildContext& context, unsigned int node, const RawKdNode::Elements& triangles, unsigned int treeDepth )
+{
+	RawKdTree::Statistics& stats = context.stats;
+	if( treeDepth > stats.treeDepth )
+		stats.treeDepth = treeDepth;
+
+	stats.elemIdCount += triangles.size();
+	++stats.leafCount;
+
+	context.nodes[node].setLeafNode( context.elements.size(), triangles.size() );
+	context.elements.append( triangles.ids, triangles.size() );
 }
 
 bool TriangleTreeBuilder::terminate( const SahResult& bestResult, unsigned int triangleCount ) const
@@ -73,7 +297,7 @@ bool TriangleTreeBuilder::terminate( const SahResult& bestResult, unsigned int t
 }
 
 void TriangleTreeBuilder::sah( SahResult& result, const SplitPlane& plane, const AABB& bbox, 
-							   unsigned int nL, unsigned int nP, unsigned int nR )
+							   unsigned int nL, unsigned int nP, unsigned int nR ) const
 {
 	AABB left;
 	AABB right;
@@ -119,19 +343,30 @@ void TriangleTreeBuilder::sah( SahResult& result, const SplitPlane& plane, const
 	}
 }
 
-RawKdNode* TriangleTreeBuilder::recursiveBuild( const RawKdNode::Elements& triangles, const AABB& bbox, unsigned int treeDepth )
+void TriangleTreeBuilder::recursiveBuild( BuildContext& context, unsigned int node, const RawKdNode::Elements& triangles, 
+										  const AABB& bbox, unsigned int treeDepth )
 {
+	// Defer large subtrees to be built in parallel, leaving an empty node in their place
+	if( context.parallel && ( treeDepth == _parallelDepth ) && ( triangles.size() >= PARALLEL_MIN_TRIANGLES ) )
+	{
+		addJob( context, node, triangles, bbox, treeDepth );
+		return;
+	}
+
 	SplitPlane plane;
 	SahResult sahResult;
 	unsigned int triangleCount = triangles.size();
-	++_stats->nodeCount;
+	++context.stats.nodeCount;
 
 	// Compute cost-optimized split plane for given set of triangles and enclosing bounding box
-	findPlane( plane, sahResult, triangleCount, triangles, bbox );
+	findPlane( context, plane, sahResult, triangleCount, triangles, bbox );
 
 	// Further subdivision does not pay off if even	the best split is more costly then not splitting at all
 	if( terminate( sahResult, triangleCount ) )
-		return leafNode( triangles, treeDepth );
+	{
+		leafNode( context, node, triangles, treeDepth );
+		return;
+	}
 
 	// Split current bounding box according to chosen split plane
 	AABB leftBox;
@@ -139,176 +374,218 @@ RawKdNode* TriangleTreeBuilder::recursiveBuild( const RawKdNode::Elements& trian
 	bbox.split( leftBox, rightBox, plane );
 
 	// Partition current triangles into both child bounding boxes
+	const Arena::Mark scratchMark = context.scratch.mark();
 	RawKdNode::Elements leftTriangles;
 	RawKdNode::Elements rightTriangles;
-	partition( leftTriangles, rightTriangles, sahResult, plane, triangles );
+	partition( context, leftTriangles, rightTriangles, sahResult, plane, triangles );
 
-	// Recursive tree build for both children
-	RawKdNode* left  = recursiveBuild( leftTriangles, leftBox, treeDepth + 1 );
-	rtu::vectorFreeMemory( leftTriangles );
-	RawKdNode* right = recursiveBuild( rightTriangles, rightBox, treeDepth + 1 );
-	rtu::vectorFreeMemory( rightTriangles );
+	// Recursive tree build for both children, stored next to each other
+	const unsigned int left = allocateChildren( context );
+	recursiveBuild( context, left, leftTriangles, leftBox, treeDepth + 1 );
+	recursiveBuild( context, left + 1, rightTriangles, rightBox, treeDepth + 1 );
+	context.scratch.rewind( scratchMark );
 
-	return new RawKdNode( plane, left, right );
+	context.nodes[node].setInternalNode( plane, &context.nodes[left] );
 }
 
-void TriangleTreeBuilder::findPlane( SplitPlane& plane, SahResult& sahResult, unsigned int& triangleCount, 
+void TriangleTreeBuilder::findPlane( BuildContext& context, SplitPlane& plane, SahResult& sahResult, unsigned int& triangleCount, 
 									 const RawKdNode::Elements& triangles, const AABB& bbox )
 {
-	// TODO: may put some of these as members of class, if it improves performance
-	SplitPlane currentPlane;
-	SahResult currentSahResult;
-
-	rtu::float3 v0;
-	rtu::float3 v1;
-	rtu::float3 v2;
-
-	Event event;
 	EventOrder predicate;
-	unsigned int nL;
-	unsigned int nP;
-	unsigned int nR;
-	unsigned int numStartEvents;
-	unsigned int numPlanarEvents;
-	unsigned int numEndEvents;
 
 	const std::vector<rtu::float3>& vertices = _geometry->vertices;
+	const int size = triangles.size();
+	const bool parallel = context.parallel && ( size >= (int)PARALLEL_MIN_TRIANGLES );
+
+	std::vector<Event>* events = context.events;
+	std::vector<Side>& sides = context.sides;
+	std::vector<AABB>& boxes = context.boxes;
 
 	// Reset data, but preserve memory allocation
 	triangleCount = 0;
-	_events[0].clear();
-	_events[1].clear();
-	_events[2].clear();
+	events[0].clear();
+	events[1].clear();
+	events[2].clear();
+	sides.resize( size );
+	boxes.resize( size );
 
 	// Clip triangles to current bbox (perfect splits)
+	#pragma omp parallel for if( parallel )
+	for( int t = 0; t < size; ++t )
+	{
+		const TriDesc& triDesc = _geometry->triDesc[triangles[t]];
+		bbox.clipTriangle( boxes[t], vertices[triDesc.v0], 
+			                         vertices[triDesc.v1], 
+									 vertices[triDesc.v2] );
+	}
+
 	// Compute unsorted event lists
 	// Reset triangle classifications
-	for( unsigned int t = 0, limit = triangles.size(); t < limit; ++t )
+	for( int t = 0; t < size; ++t )
 	{
-		unsigned int triangleId = triangles[t];
-		// Get triangle bbox
-		AABB& currentBox = _triangleBoxes[triangleId];
-		// Get triangle vertices and update bbox
-		const TriDesc& triDesc = _geometry->triDesc[triangleId];
-		bbox.clipTriangle( currentBox, vertices[triDesc.v0], 
-			                           vertices[triDesc.v1], 
-									   vertices[triDesc.v2] );
+		const AABB& currentBox = boxes[t];
 
 		// Degenerate box, skip triangle
 		if( currentBox.isDegenerate() )
 		{
-			_triangleSides[triangleId] = INVALID;
+			sides[t] = INVALID;
 			continue;
 		}
 
 		// Validate triangle
 		++triangleCount;
-		_triangleSides[triangleId] = BOTH;
+		sides[t] = BOTH;
 
 		// Insert triangle events in lists
-		for( unsigned int k = 0; k < 3; ++k )
+		addEvents( events, currentBox, t );
+	}
+
+	// Sort event lists
+	#pragma omp parallel for if( parallel )
+	for( int k = 0; k < 3; ++k )
+	{
+		std::sort( events[k].begin(), events[k].end(), predicate );
+	}
+
+	findBestPlane( plane, sahResult, events, triangleCount, bbox, parallel );
+}
+
+void TriangleTreeBuilder::addEvents( std::vector<Event> events[3], const AABB& box, unsigned int triangle ) const
+{
+	Event event;
+	event.triangle = triangle;
+
+	for( unsigned int k = 0; k < 3; ++k )
+	{
+		std::vector<Event>& currentEvents = events[k];
+
+		if( !box.isPlanar( k ) )
 		{
-			std::vector<Event>& currentEvents = _events[k];
+			// Add two distinct events
+			event.position = box.minv[k];
+			event.type = Event::START;
+			currentEvents.push_back( event );
+			event.position = box.maxv[k];
+			event.type = Event::END;
+			currentEvents.push_back( event );
+		}
+		else
+		{
+			// Add one planar event
+			event.position = box.minv[k];
+			event.type = Event::PLANAR;
+			currentEvents.push_back( event );
+		}
+	}
+}
 
-			if( !currentBox.isPlanar( k ) )
-			{
-				// Add two distinct events
-				event.triangleId = triangles[t];
-				event.position = currentBox.minv[k];
-				event.type = Event::START;
-				currentEvents.push_back( event );
-				event.position = currentBox.maxv[k];
-				event.type = Event::END;
-				currentEvents.push_back( event );
-			}
-			else
-			{
-				// Add one planar event
-				event.triangleId = triangles[t];
-				event.position = currentBox.minv[k];
-				event.type = Event::PLANAR;
-				currentEvents.push_back( event );
-			}
+void TriangleTreeBuilder::findBestPlane( SplitPlane& plane, SahResult& sahResult, const std::vector<Event> events[3], 
+										 unsigned int triangleCount, const AABB& bbox, bool parallel ) const
+{
+	// Sweep each axis independently
+	SplitPlane axisPlanes[3];
+	SahResult axisResults[3];
+
+	#pragma omp parallel for if( parallel )
+	for( int k = 0; k < 3; ++k )
+	{
+		sweep( events[k], k, triangleCount, bbox, axisPlanes[k], axisResults[k] );
+	}
+
+	// Keep best result, in the same axis order as a serial sweep would
+	plane = axisPlanes[0];
+	sahResult = axisResults[0];
+
+	for( unsigned int k = 1; k < 3; ++k )
+	{
+		if( axisResults[k].cost < sahResult.cost )
+		{
+			sahResult = axisResults[k];
+			plane = axisPlanes[k];
 		}
 	}
+}
 
-	// Sort event lists
-	std::sort( _events[0].begin(), _events[0].end(), predicate );
-	std::sort( _events[1].begin(), _events[1].end(), predicate );
-	std::sort( _events[2].begin(), _events[2].end(), predicate );
+void TriangleTreeBuilder::sweep( const std::vector<Event>& events, unsigned int axis, unsigned int triangleCount, const AABB& bbox,
+								 SplitPlane& plane, SahResult& sahResult ) const
+{
+	SplitPlane currentPlane;
+	SahResult currentSahResult;
+
+	unsigned int nL;
+	unsigned int nP;
+	unsigned int nR;
+	unsigned int numStartEvents;
+	unsigned int numPlanarEvents;
+	unsigned int numEndEvents;
 
 	// Reset best classification
 	plane.position = rtu::mathf::MAX_VALUE;
-	plane.axis = 0;
+	plane.axis = axis;
 	sahResult.cost = rtu::mathf::MAX_VALUE;
 	sahResult.side = LEFT;
 
-	// Iterate through all 3 axis computing SAH for each sorted event
-	for( unsigned int k = 0; k < 3; ++k )
-	{
-		// Set current axis and get events
-		currentPlane.axis = k;
-		const std::vector<Event>& currentEvents = _events[k];
-
-		// Start with all triangles on the right
-		nL = 0;
-		nP = 0;
-		nR = triangleCount;
+	// Set current axis
+	currentPlane.axis = axis;
 
-		// Iteratively sweep plane over all split candidates
-		for( unsigned int i = 0, eventCount = currentEvents.size(); i < eventCount; /*empty*/ )
-		{
-			currentPlane.position = currentEvents[i].position;
-			numStartEvents = 0;
-			numPlanarEvents = 0;
-			numEndEvents = 0;
+	// Start with all triangles on the right
+	nL = 0;
+	nP = 0;
+	nR = triangleCount;
 
-			while( ( i < eventCount ) && ( currentPlane.position == currentEvents[i].position ) && 
-				   ( currentEvents[i].type == Event::END ) )
-			{
-				++numEndEvents;
-				++i;
-			}
+	// Iteratively sweep plane over all split candidates
+	for( unsigned int i = 0, eventCount = events.size(); i < eventCount; /*empty*/ )
+	{
+		currentPlane.position = events[i].position;
+		numStartEvents = 0;
+		numPlanarEvents = 0;
+		numEndEvents = 0;
 
-			while( ( i < eventCount ) && ( currentPlane.position == currentEvents[i].position ) && 
-				   ( currentEvents[i].type == Event::PLANAR ) )
-			{
-				++numPlanarEvents;
-				++i;
-			}
+		while( ( i < eventCount ) && ( currentPlane.position == events[i].position ) && 
+			   ( events[i].type == Event::END ) )
+		{
+			++numEndEvents;
+			++i;
+		}
 
-			while( ( i < eventCount ) && ( currentPlane.position == currentEvents[i].position ) && 
-				   ( currentEvents[i].type == Event::START ) )
-			{
-				++numStartEvents;
-				++i;
-			}
+		while( ( i < eventCount ) && ( currentPlane.position == events[i].position ) && 
+			   ( events[i].type == Event::PLANAR ) )
+		{
+			++numPlanarEvents;
+			++i;
+		}
 
-			// Update recurrence
-			nP = numPlanarEvents;
-			nR -= numPlanarEvents;
-			nR -= numEndEvents;
-			
-			// Compute SAH and save best result
-			sah( currentSahResult, currentPlane, bbox, nL, nP, nR );
+		while( ( i < eventCount ) && ( currentPlane.position == events[i].position ) && 
+			   ( events[i].type == Event::START ) )
+		{
+			++numStartEvents;
+			++i;
+		}
 
-			if( currentSahResult.cost < sahResult.cost )
-			{
-				sahResult = currentSahResult;
-				plane = currentPlane;
-			}
+		// Update recurrence
+		nP = numPlanarEvents;
+		nR -= numPlanarEvents;
+		nR -= numEndEvents;
+		
+		// Compute SAH and save best result
+		sah( currentSahResult, currentPlane, bbox, nL, nP, nR );
 
-			// Update recurrence
-			nL += numStartEvents;
-			nL += numPlanarEvents;
+		if( currentSahResult.cost < sahResult.cost )
+		{
+			sahResult = currentSahResult;
+			plane = currentPlane;
 		}
+
+		// Update recurrence
+		nL += numStartEvents;
+		nL += numPlanarEvents;
 	}
 }
 
-void TriangleTreeBuilder::partition( RawKdNode::Elements& left, RawKdNode::Elements& right, const SahResult& sahResult, 
-									 const SplitPlane& plane, const RawKdNode::Elements& triangles )
+void TriangleTreeBuilder::classify( BuildContext& context, const SahResult& sahResult, const SplitPlane& plane, 
+									const std::vector<Event>& bestEvents )
 {
-	const std::vector<Event>& bestEvents = _events[plane.axis];
+	std::vector<Side>& sides = context.sides;
 
 	// Iterate through events of chosen axis and reclassify triangles, if possible
 	for( unsigned int i = 0, size = bestEvents.size(); i < size; ++i )
@@ -316,45 +593,446 @@ void TriangleTreeBuilder::partition( RawKdNode::Elements& left, RawKdNode::Eleme
 		const Event& event = bestEvents[i];
 		if( ( event.type == Event::END ) && ( event.position <= plane.position ) )
 		{
-			_triangleSides[event.triangleId] = LEFT;
+			sides[event.triangle] = LEFT;
 		}
 		else if( ( event.type == Event::START ) && ( event.position >= plane.position ) )
 		{
-			_triangleSides[event.triangleId] = RIGHT;
+			sides[event.triangle] = RIGHT;
 		}
 		else if( event.type == Event::PLANAR )
 		{
 			if( ( event.position < plane.position ) || ( ( event.position == plane.position ) && ( sahResult.side == LEFT ) ) )
 			{
-				_triangleSides[event.triangleId] = LEFT;
+				sides[event.triangle] = LEFT;
 			}
 			if( ( event.position > plane.position ) || ( ( event.position == plane.position ) && ( sahResult.side == RIGHT ) ) )
 			{
-				_triangleSides[event.triangleId] = RIGHT;
+				sides[event.triangle] = RIGHT;
 			}
 		}
 	}
+}
+
+void TriangleTreeBuilder::partition( BuildContext& context, RawKdNode::Elements& left, RawKdNode::Elements& right, const SahResult& sahResult, 
+									 const SplitPlane& plane, const RawKdNode::Elements& triangles )
+{
+	const std::vector<Side>& sides = context.sides;
+
+	// Reclassify triangles, if possible
+	classify( context, sahResult, plane, context.events[plane.axis] );
+
+	// Count triangles on each side to allocate exact child lists
+	const unsigned int size = triangles.size();
+	unsigned int leftCount = 0;
+	unsigned int rightCount = 0;
+	for( unsigned int i = 0; i < size; ++i )
+	{
+		if( ( sides[i] == LEFT ) || ( sides[i] == BOTH ) )
+			++leftCount;
+		if( ( sides[i] == RIGHT ) || ( sides[i] == BOTH ) )
+			++rightCount;
+	}
+
+	left = RawKdNode::Elements( context.scratch.allocate<unsigned int>( leftCount ), 0 );
+	right = RawKdNode::Elements( context.scratch.allocate<unsigned int>( rightCount ), 0 );
 
 	// Iterate through triangle sides and partition triangles
-	for( unsigned int i = 0, size = triangles.size(); i < size; ++i )
+	for( unsigned int i = 0; i < size; ++i )
 	{
 		const unsigned int triangleId = triangles[i];
 
-		if( _triangleSides[triangleId] == LEFT )
+		if( sides[i] == LEFT )
 		{
-			left.push_back( triangleId );
+			left[left.count++] = triangleId;
 		}
-		else if( _triangleSides[triangleId] == RIGHT )
+		else if( sides[i] == RIGHT )
 		{
-			right.push_back( triangleId );
+			right[right.count++] = triangleId;
 		}
-		else if( _triangleSides[triangleId] == BOTH )
+		else if( sides[i] == BOTH )
 		{
-			left.push_back( triangleId );
-			right.push_back( triangleId );
+			left[left.count++] = triangleId;
+			right[right.count++] = triangleId;
 		}
 		// else INVALID, so skip triangle
 	}
 }
 
+void TriangleTreeBuilder::recursiveBuildSorted( BuildContext& context, unsigned int node, const RawKdNode::Elements& triangles, 
+												std::vector<Event> events[3], const AABB& bbox, unsigned int treeDepth )
+{
+	const unsigned int triangleCount = triangles.size();
+
+	// Defer large subtrees to be built in parallel, leaving an empty node in their place
+	if( context.parallel && ( treeDepth == _parallelDepth ) && ( triangleCount >= PARALLEL_MIN_TRIANGLES ) )
+	{
+		BuildJob& job = addJob( context, node, triangles, bbox, treeDepth );
+		job.events[0].swap( events[0] );
+		job.events[1].swap( events[1] );
+		job.events[2].swap( events[2] );
+		return;
+	}
+
+	SplitPlane plane;
+	SahResult sahResult;
+	++context.stats.nodeCount;
+
+	// Events are already sorted, so just sweep them
+	// All triangles are valid (we never keep triangles outside the node)
+	findBestPlane( plane, sahResult, events, triangleCount, bbox, context.parallel && ( triangleCount >= PARALLEL_MIN_TRIANGLES ) );
+
+	// Further subdivision does not pay off if even	the best split is more costly then not splitting at all
+	if( terminate( sahResult, triangleCount ) )
+	{
+		leafNode( context, node, triangles, treeDepth );
+		return;
+	}
+
+	// Split current bounding box according to chosen split plane
+	AABB leftBox;
+	AABB rightBox;
+	bbox.split( leftBox, rightBox, plane );
+
+	// Partition current triangles and their sorted events into both child bounding boxes
+	const Arena::Mark scratchMark = context.scratch.mark();
+	RawKdNode::Elements leftTriangles;
+	RawKdNode::Elements rightTriangles;
+	std::vector<Event> leftEvents[3];
+	std::vector<Event> rightEvents[3];
+	splitEvents( context, leftTriangles, rightTriangles, leftEvents, rightEvents, sahResult, plane, triangles, events, leftBox, rightBox );
+
+	// Parent events are no longer needed
+	for( unsigned int k = 0; k < 3; ++k )
+	{
+		rtu::vectorFreeMemory( events[k] );
+	}
+
+	// Recursive tree build for both children, stored next to each other
+	const unsigned int left = allocateChildren( context );
+	recursiveBuildSorted( context, left, leftTriangles, leftEvents, leftBox, treeDepth + 1 );
+	recursiveBuildSorted( context, left + 1, rightTriangles, rightEvents, rightBox, treeDepth + 1 );
+	context.scratch.rewind( scratchMark );
+
+	context.nodes[node].setInternalNode( plane, &context.nodes[left] );
+}
+
+void TriangleTreeBuilder::splitEvents( BuildContext& context, RawKdNode::Elements& leftTriangles, RawKdNode::Elements& rightTriangles,
+									   std::vector<Event> leftEvents[3], std::vector<Event> rightEvents[3], const SahResult& sahResult, 
+									   const SplitPlane& plane, const RawKdNode::Elements& triangles, const std::vector<Event> events[3],
+									   const AABB& leftBox, const AABB& rightBox )
+{
+	EventOrder predicate;
+	AABB box;
+
+	const std::vector<rtu::float3>& vertices = _geometry->vertices;
+	const unsigned int size = triangles.size();
+
+	std::vector<Side>& sides = context.sides;
+	std::vector<unsigned int>& leftIndices = context.remap[0];
+	std::vector<unsigned int>& rightIndices = context.remap[1];
+	std::vector<Event>* leftStraddling = context.straddling[0];
+	std::vector<Event>* rightStraddling = context.straddling[1];
+
+	// Start with all triangles on both sides and classify them using the sorted events of the chosen axis
+	sides.assign( size, BOTH );
+	classify( context, sahResult, plane, events[plane.axis] );
+
+	// Reset data, but preserve memory allocation
+	leftIndices.resize( size );
+	rightIndices.resize( size );
+	for( unsigned int k = 0; k < 3; ++k )
+	{
+		leftStraddling[k].clear();
+		rightStraddling[k].clear();
+	}
+
+	// Compute new triangle indices in each child.
+	// Triangles straddling the plane are clipped to each child box, and dropped from children they do not overlap.
+	// Their new events still refer to parent indices.
+	unsigned int leftCount = 0;
+	unsigned int rightCount = 0;
+	for( unsigned int t = 0; t < size; ++t )
+	{
+		bool inLeft = ( sides[t] == LEFT );
+		bool inRight = ( sides[t] == RIGHT );
+
+		if( sides[t] == BOTH )
+		{
+			const TriDesc& triDesc = _geometry->triDesc[triangles[t]];
+
+			leftBox.clipTriangle( box, vertices[triDesc.v0], vertices[triDesc.v1], vertices[triDesc.v2] );
+			if( !box.isDegenerate() )
+			{
+				addEvents( leftStraddling, box, t );
+				inLeft = true;
+			}
+
+			rightBox.clipTriangle( box, vertices[triDesc.v0], vertices[triDesc.v1], vertices[triDesc.v2] );
+			if( !box.isDegenerate() )
+			{
+				addEvents( rightStraddling, box, t );
+				inRight = true;
+			}
+		}
+
+		leftIndices[t] = inLeft ? leftCount++ : INVALID_INDEX;
+		rightIndices[t] = inRight ? rightCount++ : INVALID_INDEX;
+	}
+
+	// Partition triangles into exactly sized child lists
+	leftTriangles = RawKdNode::Elements( context.scratch.allocate<unsigned int>( leftCount ), leftCount );
+	rightTriangles = RawKdNode::Elements( context.scratch.allocate<unsigned int>( rightCount ), rightCount );
+	for( unsigned int t = 0; t < size; ++t )
+	{
+		if( leftIndices[t] != INVALID_INDEX )
+			leftTriangles[leftIndices[t]] = triangles[t];
+		if( rightIndices[t] != INVALID_INDEX )
+			rightTriangles[rightIndices[t]] = triangles[t];
+	}
+
+	// Split sorted events of triangles entirely on one side, preserving their order.
+	// Then merge them with the (few) sorted events of straddling triangles.
+	for( unsigned int k = 0; k < 3; ++k )
+	{
+		const std::vector<Event>& currentEvents = events[k];
+
+		for( unsigned int i = 0, eventCount = currentEvents.size(); i < eventCount; ++i )
+		{
+			Event event = currentEvents[i];
+			const Side side = sides[event.triangle];
+
+			if( side == LEFT )
+			{
+				event.triangle = leftIndices[event.triangle];
+				leftEvents[k].push_back( event );
+			}
+			else if( side == RIGHT )
+			{
+				event.triangle = rightIndices[event.triangle];
+				rightEvents[k].push_back( event );
+			}
+		}
+
+		for( unsigned int i = 0, eventCount = leftStraddling[k].size(); i < eventCount; ++i )
+			leftStraddling[k][i].triangle = leftIndices[leftStraddling[k][i].triangle];
+		for( unsigned int i = 0, eventCount = rightStraddling[k].size(); i < eventCount; ++i )
+			rightStraddling[k][i].triangle = rightIndices[rightStraddling[k][i].triangle];
+
+		std::sort( leftStraddling[k].begin(), leftStraddling[k].end(), predicate );
+		std::sort( rightStraddling[k].begin(), rightStraddling[k].end(), predicate );
+
+		const unsigned int leftCount = leftEvents[k].size();
+		leftEvents[k].insert( leftEvents[k].end(), leftStraddling[k].begin(), leftStraddling[k].end() );
+		std::inplace_merge( leftEvents[k].begin(), leftEvents[k].begin() + leftCount, leftEvents[k].end(), predicate );
+
+		const unsigned int rightCount = rightEvents[k].size();
+		rightEvents[k].insert( rightEvents[k].end(), rightStraddling[k].begin(), rightStraddling[k].end() );
+		std::inplace_merge( rightEvents[k].begin(), rightEvents[k].begin() + rightCount, rightEvents[k].end(), predicate );
+	}
+}
+
+void TriangleTreeBuilder::recursiveBuildBinned( BuildContext& context, unsigned int node, const RawKdNode::Elements& triangles, 
+												const AABB& bbox, unsigned int treeDepth )
+{
+	const unsigned int triangleCount = triangles.size();
+
+	// Defer large subtrees to be built in parallel, leaving an empty node in their place
+	if( context.parallel && ( treeDepth == _parallelDepth ) && ( triangleCount >= PARALLEL_MIN_TRIANGLES ) )
+	{
+		addJob( context, node, triangles, bbox, treeDepth );
+		return;
+	}
+
+	SplitPlane plane;
+	SahResult sahResult;
+	++context.stats.nodeCount;
+
+	// Compute approximate cost-optimized split plane
+	findPlaneBinned( context, plane, sahResult, triangles, bbox );
+
+	// Further subdivision does not pay off if even	the best split is more costly then not splitting at all
+	if( terminate( sahResult, triangleCount ) )
+	{
+		leafNode( context, node, triangles, treeDepth );
+		return;
+	}
+
+	// Split current bounding box according to chosen split plane
+	AABB leftBox;
+	AABB rightBox;
+	bbox.split( leftBox, rightBox, plane );
+
+	// Partition current triangles into both child bounding boxes
+	const Arena::Mark scratchMark = context.scratch.mark();
+	RawKdNode::Elements leftTriangles;
+	RawKdNode::Elements rightTriangles;
+	partitionBinned( context, leftTriangles, rightTriangles, plane, triangles, bbox );
+
+	// Recursive tree build for both children, stored next to each other
+	const unsigned int left = allocateChildren( context );
+	recursiveBuildBinned( context, left, leftTriangles, leftBox, treeDepth + 1 );
+	recursiveBuildBinned( context, left + 1, rightTriangles, rightBox, treeDepth + 1 );
+	context.scratch.rewind( scratchMark );
+
+	context.nodes[node].setInternalNode( plane, &context.nodes[left] );
+}
+
+void TriangleTreeBuilder::findPlaneBinned( BuildContext& context, SplitPlane& plane, SahResult& sahResult, 
+										   const RawKdNode::Elements& triangles, const AABB& bbox )
+{
+	SplitPlane currentPlane;
+	SahResult currentSahResult;
+
+	const unsigned int binCount = _binCount;
+	const int size = triangles.size();
+
+	// Reset counters, but preserve memory allocation
+	std::vector<unsigned int>& bins = context.bins;
+	bins.assign( 6 * binCount, 0 );
+
+	if( context.parallel && ( size >= (int)PARALLEL_MIN_TRIANGLES ) )
+	{
+		// Each thread bins a range of triangles into its own counters, which are summed afterwards
+		#pragma omp parallel
+		{
+			std::vector<unsigned int> localBins( 6 * binCount, 0 );
+			const int threadCount = omp_get_num_threads();
+			const int thread = omp_get_thread_num();
+			binTriangles( &localBins[0], triangles, ( size * thread ) / threadCount, ( size * ( thread + 1 ) ) / threadCount, bbox );
+
+			#pragma omp critical
+			{
+				for( unsigned int i = 0; i < 6 * binCount; ++i )
+					bins[i] += localBins[i];
+			}
+		}
+	}
+	else
+	{
+		binTriangles( &bins[0], triangles, 0, size, bbox );
+	}
+
+	// Reset best classification
+	plane.position = rtu::mathf::MAX_VALUE;
+	plane.axis = 0;
+	sahResult.cost = rtu::mathf::MAX_VALUE;
+	sahResult.side = LEFT;
+
+	// Sweep bin borders of all 3 axis
+	for( unsigned int k = 0; k < 3; ++k )
+	{
+		const float extent = bbox.maxv[k] - bbox.minv[k];
+		if( extent <= 0.0f )
+			continue;
+
+		const unsigned int* startBins = &bins[( k * 2 ) * binCount];
+		const unsigned int* endBins = &bins[( k * 2 + 1 ) * binCount];
+
+		currentPlane.axis = k;
+		unsigned int nL = 0;
+		unsigned int nR = size;
+
+		for( unsigned int b = 1; b < binCount; ++b )
+		{
+			// Triangles starting before border are on the left, triangles ending before border are no longer on the right
+			nL += startBins[b-1];
+			nR -= endBins[b-1];
+			currentPlane.position = bbox.minv[k] + extent * b / binCount;
+
+			sah( currentSahResult, currentPlane, bbox, nL, 0, nR );
+
+			if( currentSahResult.cost < sahResult.cost )
+			{
+				sahResult = currentSahResult;
+				plane = currentPlane;
+			}
+		}
+	}
+}
+
+void TriangleTreeBuilder::binTriangles( unsigned int* bins, const RawKdNode::Elements& triangles, int begin, int end, const AABB& bbox ) const
+{
+	const unsigned int binCount = _binCount;
+
+	// Bin coordinates are computed for all 3 axis at once: bin = ( max( min, boxMin ) - boxMin ) * binCount / extent
+	const __m128 boxMin = _mm_set_ps( 0.0f, bbox.minv.z, bbox.minv.y, bbox.minv.x );
+	const __m128 boxMax = _mm_set_ps( 0.0f, bbox.maxv.z, bbox.maxv.y, bbox.maxv.x );
+	const __m128 extent = _mm_sub_ps( boxMax, boxMin );
+	const __m128 scale = _mm_and_ps( _mm_cmpgt_ps( extent, rtu::SSE_ZERO ), 
+		                             _mm_div_ps( _mm_set_ps1( (float)binCount ), extent ) );
+	const __m128 lastBin = _mm_set_ps1( (float)( binCount - 1 ) );
+
+	union { __m128i m; int i[4]; } startBin;
+	union { __m128i m; int i[4]; } endBin;
+
+	unsigned int* startX = bins;
+	unsigned int* endX   = bins + binCount;
+	unsigned int* startY = bins + 2 * binCount;
+	unsigned int* endY   = bins + 3 * binCount;
+	unsigned int* startZ = bins + 4 * binCount;
+	unsigned int* endZ   = bins + 5 * binCount;
+
+	for( int t = begin; t < end; ++t )
+	{
+		const float* bounds = &_triangleBounds[triangles[t] * 8];
+
+		// Clamp triangle box to node box
+		const __m128 triMin = _mm_max_ps( _mm_loadu_ps( bounds ), boxMin );
+		const __m128 triMax = _mm_min_ps( _mm_loadu_ps( bounds + 4 ), boxMax );
+
+		// Compute bins, clamped to valid range
+		startBin.m = _mm_cvttps_epi32( _mm_min_ps( _mm_mul_ps( _mm_sub_ps( triMin, boxMin ), scale ), lastBin ) );
+		endBin.m   = _mm_cvttps_epi32( _mm_min_ps( _mm_mul_ps( _mm_sub_ps( triMax, boxMin ), scale ), lastBin ) );
+
+		++startX[startBin.i[0]];
+		++startY[startBin.i[1]];
+		++startZ[startBin.i[2]];
+		++endX[endBin.i[0]];
+		++endY[endBin.i[1]];
+		++endZ[endBin.i[2]];
+	}
+}
+
+void TriangleTreeBuilder::partitionBinned( BuildContext& context, RawKdNode::Elements& left, RawKdNode::Elements& right, 
+										   const SplitPlane& plane, const RawKdNode::Elements& triangles, const AABB& bbox ) const
+{
+	const unsigned int k = plane.axis;
+	const float boxMin = bbox.minv[k];
+	const float boxMax = bbox.maxv[k];
+	const unsigned int size = triangles.size();
+
+	// Same classification used when binning: triangles starting before the plane go left, 
+	// triangles ending after it go right. Triangles lying on the plane go right.
+	// Child lists are allocated with exact sizes, so triangles are classified twice.
+	unsigned int leftCount = 0;
+	unsigned int rightCount = 0;
+	for( unsigned int i = 0; i < size; ++i )
+	{
+		const float* bounds = &_triangleBounds[triangles[i] * 8];
+		const float triMin = rtu::mathf::max( bounds[k], boxMin );
+		const float triMax = rtu::mathf::min( bounds[k+4], boxMax );
+
+		if( triMin < plane.position )
+			++leftCount;
+		if( ( triMax > plane.position ) || ( triMin >= plane.position ) )
+			++rightCount;
+	}
+
+	left = RawKdNode::Elements( context.scratch.allocate<unsigned int>( leftCount ), 0 );
+	right = RawKdNode::Elements( context.scratch.allocate<unsigned int>( rightCount ), 0 );
+
+	for( unsigned int i = 0; i < size; ++i )
+	{
+		const unsigned int triangleId = triangles[i];
+		const float* bounds = &_triangleBounds[triangleId * 8];
+		const float triMin = rtu::mathf::max( bounds[k], boxMin );
+		const float triMax = rtu::mathf::min( bounds[k+4], boxMax );
+
+		if( triMin < plane.position )
+			left[left.count++] = triangleId;
+		if( ( triMax > plane.position ) || ( triMin >= plane.position ) )
+			right[right.count++] = triangleId;
+	}
+}
+
 } // namespace rtc
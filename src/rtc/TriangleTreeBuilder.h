@@ -4,7 +4,9 @@
 
 #include <rtu/common.h>
 #include <rtc/RawKdTree.h>
+#include <rtc/KdTree.h>
 #include <rtc/Geometry.h>
+#include <rtc/Array.h>
 
 namespace rtc {
 
@@ -13,7 +15,10 @@ class TriangleTreeBuilder
 public:
 	TriangleTreeBuilder();
 
-	RawKdTree* buildTree( Geometry* geometry );
+	// Build mode is one of RT_BUILD_SAH_* (see definitions.h)
+	// Bin count is only used by RT_BUILD_SAH_BINNED
+	// Nodes are written directly in depth-first order, both children of a node stored next to each other
+	void buildTree( KdTree& result, Geometry* geometry, unsigned int buildMode, unsigned int binCount );
 
 private:
 	enum Side
@@ -39,7 +44,8 @@ private:
 			START
 		};
 
-		unsigned int triangleId;
+		// Index into the triangle list of the node being split (not the global triangle id)
+		unsigned int triangle;
 		float position;
 		Type type;
 	};
@@ -49,35 +55,142 @@ private:
 		inline bool operator()( const Event& first, const Event& second ) const;
 	};
 
-	RawKdNode* leafNode( const RawKdNode::Elements& triangles, unsigned int treeDepth );
-	void getTriangleVertices( rtu::float3& v0, rtu::float3& v1, rtu::float3& v2, unsigned int triangleId ) const;
-	bool terminate( const SahResult& bestResult, unsigned int triangleCount ) const;
-	void sah( SahResult& result, const SplitPlane& plane, const AABB& bbox, unsigned int nL, unsigned int nP, unsigned int nR );
+	// Scratch memory and statistics owned by a single build task
+	struct BuildContext
+	{
+		BuildContext();
+
+		void freeMemory();
+
+		// Use OpenMP inside findPlane (only while building the top of the tree)
+		bool parallel;
+
+		std::vector<Event> events[3];
+		std::vector<Side> sides;
+		std::vector<AABB> boxes;
+		RawKdTree::Statistics stats;
+
+		// Presorted mode only: new events of straddling triangles and triangle indices in each child
+		std::vector<Event> straddling[2][3];
+		std::vector<unsigned int> remap[2];
+
+		// Binned mode only: triangle counters, [axis][start/end][bin]
+		std::vector<unsigned int> bins;
+
+		// Triangle lists of nodes being split, released when both children are built (see Arena::rewind)
+		Arena scratch;
+
+		// Output nodes and leaf triangle ids of the tree (or subtree) being built, root first
+		Array<KdNode> nodes;
+		Array<unsigned int> elements;
+	};
+
+	// Subtree deferred by the serial top-level build, to be built in parallel
+	struct BuildJob
+	{
+		unsigned int node; // placeholder in top of the tree, replaced by subtree root
+		RawKdNode::Elements triangles; // allocated in _jobArena
+		std::vector<Event> events[3]; // presorted mode only
+		AABB bbox;
+		unsigned int treeDepth;
+
+		// Subtree output, element starts are relative to subtree elements
+		Array<KdNode> nodes;
+		Array<unsigned int> elements;
+	};
 
-	// O( n log^2 n ) implementation
-	RawKdNode* recursiveBuild( const RawKdNode::Elements& triangles, const AABB& bbox, unsigned int treeDepth );
-	void findPlane( SplitPlane& plane, SahResult& sahResult, unsigned int& triangleCount, 
+	struct BuildJobOrder
+	{
+		inline bool operator()( const BuildJob* first, const BuildJob* second ) const;
+	};
+
+	// Defer subtree of given node with given triangles (copied)
+	BuildJob& addJob( BuildContext& context, unsigned int node, const RawKdNode::Elements& triangles, 
+		              const AABB& bbox, unsigned int treeDepth );
+
+	// Reserve both children of a node being split, returns index of left child
+	inline unsigned int allocateChildren( BuildContext& context ) const;
+	void leafNode( BuildContext& context, unsigned int node, const RawKdNode::Elements& triangles, unsigned int treeDepth );
+	bool terminate( const SahResult& bestResult, unsigned int triangleCount ) const;
+	void sah( SahResult& result, const SplitPlane& plane, const AABB& bbox, unsigned int nL, unsigned int nP, unsigned int nR ) const;
+
+	// Shared by both implementations
+	void addEvents( std::vector<Event> events[3], const AABB& box, unsigned int triangle ) const;
+	void findBestPlane( SplitPlane& plane, SahResult& sahResult, const std::vector<Event> events[3], 
+		                unsigned int triangleCount, const AABB& bbox, bool parallel ) const;
+	void sweep( const std::vector<Event>& events, unsigned int axis, unsigned int triangleCount, const AABB& bbox,
+		        SplitPlane& plane, SahResult& sahResult ) const;
+	void classify( BuildContext& context, const SahResult& sahResult, const SplitPlane& plane, const std::vector<Event>& events );
+
+	// O( n log^2 n ) implementation: events are regenerated and sorted at every node
+	void recursiveBuild( BuildContext& context, unsigned int node, const RawKdNode::Elements& triangles, 
+		                 const AABB& bbox, unsigned int treeDepth );
+	void findPlane( BuildContext& context, SplitPlane& plane, SahResult& sahResult, unsigned int& triangleCount, 
 		            const RawKdNode::Elements& triangles, const AABB& bbox );
-	void partition( RawKdNode::Elements& left, RawKdNode::Elements& right, const SahResult& sahResult, 
+	void partition( BuildContext& context, RawKdNode::Elements& left, RawKdNode::Elements& right, const SahResult& sahResult, 
 		            const SplitPlane& plane, const RawKdNode::Elements& triangles );
 
+	// O( n log n ) implementation: events are sorted once at the root and split among children preserving their order
+	// Only events of triangles straddling the split plane are regenerated (and sorted) at each node
+	void recursiveBuildSorted( BuildContext& context, unsigned int node, const RawKdNode::Elements& triangles, 
+		                       std::vector<Event> events[3], const AABB& bbox, unsigned int treeDepth );
+	void splitEvents( BuildContext& context, RawKdNode::Elements& leftTriangles, RawKdNode::Elements& rightTriangles,
+		              std::vector<Event> leftEvents[3], std::vector<Event> rightEvents[3], const SahResult& sahResult, 
+					  const SplitPlane& plane, const RawKdNode::Elements& triangles, const std::vector<Event> events[3],
+					  const AABB& leftBox, const AABB& rightBox );
+
+	// O( n ) per level implementation: split candidates are restricted to the borders of a fixed number of bins.
+	// Triangle boxes are not clipped, only intersected with node boxes.
+	void recursiveBuildBinned( BuildContext& context, unsigned int node, const RawKdNode::Elements& triangles, 
+		                       const AABB& bbox, unsigned int treeDepth );
+	void findPlaneBinned( BuildContext& context, SplitPlane& plane, SahResult& sahResult, 
+		                  const RawKdNode::Elements& triangles, const AABB& bbox );
+	void binTriangles( unsigned int* bins, const RawKdNode::Elements& triangles, int begin, int end, const AABB& bbox ) const;
+	void partitionBinned( BuildContext& context, RawKdNode::Elements& left, RawKdNode::Elements& right, const SplitPlane& plane, 
+		                  const RawKdNode::Elements& triangles, const AABB& bbox ) const;
+
+	// Build all deferred subtrees in parallel
+	void buildJobs();
+
+	// Hand top of the tree over to result, subtrees are appended to it in job order
+	void storeTree( KdTree& result, BuildContext& context );
+
 	Geometry* _geometry;
-	RawKdTree::Statistics* _stats;
+	unsigned int _buildMode;
+	unsigned int _binCount;
+
+	// Binned mode only: min and max corners of each triangle box (4 floats each, for SIMD loads)
+	std::vector<float> _triangleBounds;
 
-	std::vector< std::vector<Event> > _events;
-	std::vector<Side> _triangleSides;
-	std::vector<AABB> _triangleBoxes;
+	// Nodes at this depth are deferred as parallel jobs (0 means serial build)
+	unsigned int _parallelDepth;
+	std::vector<BuildJob> _jobs;
+	Arena _jobArena;
 
 	float _traversalCost;
 	float _intersectionCost;
 };
 
+inline unsigned int TriangleTreeBuilder::allocateChildren( BuildContext& context ) const
+{
+	const unsigned int left = context.nodes.size();
+	context.nodes.resize( left + 2 );
+	return left;
+}
+
 inline bool TriangleTreeBuilder::EventOrder::operator()( const TriangleTreeBuilder::Event& first, 
 	                                                     const TriangleTreeBuilder::Event& second ) const
 {
 	return ( first.position < second.position ) || ( ( first.position == second.position ) && ( first.type < second.type ) );
 }
 
+inline bool TriangleTreeBuilder::BuildJobOrder::operator()( const TriangleTreeBuilder::BuildJob* first, 
+	                                                        const TriangleTreeBuilder::BuildJob* second ) const
+{
+	// Largest subtrees first, for better load balancing
+	return first->triangles.size() > second->triangles.size();
+}
+
 } // namespace rtc
 
 #endif // _RTC_TRIANGLETREEBUILDER_H_
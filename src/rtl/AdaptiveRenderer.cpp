@@ -1,13 +1,9 @@
 #include <rtl/AdaptiveRenderer.h>
-#include <rtu/random.h>
-
-#include <omp.h>
 
 namespace rtl {
 
 void AdaptiveRenderer::init()
 {
-	rtu::Random::autoSeed();
 	_epsilon = 0.01f;
 	_maxRecursionDepth = 3;
 }
@@ -17,30 +13,36 @@ void AdaptiveRenderer::render()
 	unsigned int width;
 	unsigned int height;
 	rtsViewport( width, height );
-	int w = (int)width;
-	int h = (int)height;
-	float* frameBuffer = rtsFrameBuffer();
-	rtu::float3 resultColor;
-	int x, y;
 
-	int chunk = 16;
+	_width = width;
+	_frameBuffer = rtsFrameBuffer();
+
+	TileScheduler::instance().run( *this, width, height );
+}
+
+void AdaptiveRenderer::renderTile( unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1 )
+{
+	rtu::float3 resultColor;
+	rtu::CounterRandom random;
 
-	#pragma omp parallel for shared( frameBuffer, h, w ) private( y ) schedule( dynamic, chunk )
-	for( y = 0; y < h; ++y )
+	for( unsigned int y = y0; y < y1; ++y )
 	{
-		#pragma omp parallel for shared( frameBuffer, h, w, y ) private( x, resultColor ) schedule( dynamic, chunk )
-		for( x = 0; x < w; ++x )
+		for( unsigned int x = x0; x < x1; ++x )
 		{
-			adaptiveSupersample( x, y, resultColor, 1 );
+			rtsInitPixelRandom( random, x, y );
+			unsigned int sampleCount = 0;
+
+			adaptiveSupersample( (float)x, (float)y, resultColor, 1, random, sampleCount );
 			
-			frameBuffer[(x+y*w)*3]   = resultColor.r;
-			frameBuffer[(x+y*w)*3+1] = resultColor.g;
-			frameBuffer[(x+y*w)*3+2] = resultColor.b;
+			_frameBuffer[(x+y*_width)*3]   = resultColor.r;
+			_frameBuffer[(x+y*_width)*3+1] = resultColor.g;
+			_frameBuffer[(x+y*_width)*3+2] = resultColor.b;
 		}
 	}
 }
 
-void AdaptiveRenderer::adaptiveSupersample( float x, float y, rtu::float3& resultColor, unsigned int recursionDepth )
+void AdaptiveRenderer::adaptiveSupersample( float x, float y, rtu::float3& resultColor, unsigned int recursionDepth,
+										    rtu::CounterRandom& random, unsigned int& sampleCount )
 {
 	const float deltaRatio = 0.5f / (float)recursionDepth;
 	float deltaX;
@@ -51,30 +53,30 @@ void AdaptiveRenderer::adaptiveSupersample( float x, float y, rtu::float3& resul
 	rts::RTstate lowerRightSample;
 
 	// Upper left (A)
-	deltaX = rtu::Random::real( -deltaRatio, 0.0f );
-	deltaY = rtu::Random::real( 0.0f, deltaRatio );
-	rtsInitPrimaryRayState( upperLeftSample, x + deltaX, y + deltaY );
+	deltaX = random.real( -deltaRatio, 0.0f );
+	deltaY = random.real( 0.0f, deltaRatio );
+	rtsInitPrimaryRayState( upperLeftSample, x + deltaX, y + deltaY, sampleCount++ );
 	rtsTraceRay( upperLeftSample );
 	rtu::float3 upperLeftColor = rtsResultColor( upperLeftSample );
 
 	// Upper right (B)
-	deltaX = rtu::Random::real( 0.0f, deltaRatio );
-	deltaY = rtu::Random::real( 0.0f, deltaRatio );
-	rtsInitPrimaryRayState( upperRightSample, x + deltaX, y + deltaY );
+	deltaX = random.real( 0.0f, deltaRatio );
+	deltaY = random.real( 0.0f, deltaRatio );
+	rtsInitPrimaryRayState( upperRightSample, x + deltaX, y + deltaY, sampleCount++ );
 	rtsTraceRay( upperRightSample );
 	rtu::float3 upperRightColor = rtsResultColor( upperRightSample );
 
 	// Lower left (C)
-	deltaX = rtu::Random::real( -deltaRatio, 0.0f );
-	deltaY = rtu::Random::real( -deltaRatio, 0.0f );
-	rtsInitPrimaryRayState( lowerLeftSample, x + deltaX, y + deltaY );
+	deltaX = random.real( -deltaRatio, 0.0f );
+	deltaY = random.real( -deltaRatio, 0.0f );
+	rtsInitPrimaryRayState( lowerLeftSample, x + deltaX, y + deltaY, sampleCount++ );
 	rtsTraceRay( lowerLeftSample );
 	rtu::float3 lowerLeftColor = rtsResultColor( lowerLeftSample );
 
 	// Lower right (D)
-	deltaX = rtu::Random::real( 0.0f, deltaRatio );
-	deltaY = rtu::Random::real( -deltaRatio, 0.0f );
-	rtsInitPrimaryRayState( lowerRightSample, x + deltaX, y + deltaY );
+	deltaX = random.real( 0.0f, deltaRatio );
+	deltaY = random.real( -deltaRatio, 0.0f );
+	rtsInitPrimaryRayState( lowerRightSample, x + deltaX, y + deltaY, sampleCount++ );
 	rtsTraceRay( lowerRightSample );
 	rtu::float3 lowerRightColor = rtsResultColor( lowerRightSample );
 
@@ -114,10 +116,10 @@ void AdaptiveRenderer::adaptiveSupersample( float x, float y, rtu::float3& resul
 			rtu::float3 recLowerLeft;
 			rtu::float3 recLowerRight;
 
-			adaptiveSupersample( x - recDelta, y + recDelta, recUpperLeft, recursionDepth + 1 );
-			adaptiveSupersample( x + recDelta, y + recDelta, recUpperRight, recursionDepth + 1 );
-			adaptiveSupersample( x - recDelta, y - recDelta, recLowerLeft, recursionDepth + 1 );
-			adaptiveSupersample( x + recDelta, y - recDelta, recLowerRight, recursionDepth + 1 );
+			adaptiveSupersample( x - recDelta, y + recDelta, recUpperLeft, recursionDepth + 1, random, sampleCount );
+			adaptiveSupersample( x + recDelta, y + recDelta, recUpperRight, recursionDepth + 1, random, sampleCount );
+			adaptiveSupersample( x - recDelta, y - recDelta, recLowerLeft, recursionDepth + 1, random, sampleCount );
+			adaptiveSupersample( x + recDelta, y - recDelta, recLowerRight, recursionDepth + 1, random, sampleCount );
 
 			// Average results
 			resultColor = ( upperLeftColor * 0.125f ) + ( recUpperLeft * 0.125f ) + 
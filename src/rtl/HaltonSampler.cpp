@@ -0,0 +1,53 @@
+#include <rtl/HaltonSampler.h>
+
+namespace rtl {
+
+static inline float radicalInverse2( unsigned int i )
+{
+	// Reverse bits
+	i = ( i << 16 ) | ( i >> 16 );
+	i = ( ( i & 0x00FF00FF ) << 8 ) | ( ( i & 0xFF00FF00 ) >> 8 );
+	i = ( ( i & 0x0F0F0F0F ) << 4 ) | ( ( i & 0xF0F0F0F0 ) >> 4 );
+	i = ( ( i & 0x33333333 ) << 2 ) | ( ( i & 0xCCCCCCCC ) >> 2 );
+	i = ( ( i & 0x55555555 ) << 1 ) | ( ( i & 0xAAAAAAAA ) >> 1 );
+
+	// Keep 24 bits, exactly representable as float
+	return ( i >> 8 ) * ( 1.0f / 16777216.0f );
+}
+
+static inline float radicalInverse3( unsigned int i )
+{
+	const float invBase = 1.0f / 3.0f;
+	float digitWeight = invBase;
+	float result = 0.0f;
+
+	while( i > 0 )
+	{
+		result += digitWeight * ( i % 3 );
+		i /= 3;
+		digitWeight *= invBase;
+	}
+
+	return result;
+}
+
+// Shift value in [0,1) by offset in [0,1), wrapping around
+static inline float shift( float value, float offset )
+{
+	const float result = value + offset;
+	return ( result < 1.0f ) ? result : result - 1.0f;
+}
+
+void HaltonSampler::sample2D( rtu::CounterRandom& random, unsigned int first, unsigned int count, float* uv )
+{
+	const float offsetU = random.real();
+	const float offsetV = random.real();
+
+	for( unsigned int i = 0; i < count; ++i )
+	{
+		uv[i*2]   = shift( radicalInverse2( first + i ), offsetU );
+		uv[i*2+1] = shift( radicalInverse3( first + i ), offsetV );
+	}
+}
+
+} // namespace rtl
@@ -1,33 +1,9 @@
 #include <rtl/JitteredRenderer.h>
-#include <rtu/random.h>
 
 namespace rtl {
 
-static const float TWO_BY_TWO_GRID[] = { -0.25f, -0.25f, // line 0
-                                     0.25f, -0.25f, 
-								    -0.25f,  0.25f, // line 1
-								     0.25f,  0.25f };
-
-static const float FOUR_BY_FOUR_GRID[] = { -0.375f, -0.375f, // line 0 
-									  -0.125f, -0.375f, 
-									   0.125f, -0.375f, 
-									   0.375f, -0.375f,
-									  -0.375f, -0.125f, // line 1
-									  -0.125f, -0.125f,
-									   0.125f, -0.125f,
-									   0.375f, -0.125f,
-									  -0.375f,  0.125f, // line 2
-									  -0.125f,  0.125f,
-									   0.125f,  0.125f,
-									   0.375f,  0.125f,
-									  -0.375f,  0.375f, // line 3
-									  -0.125f,  0.375f,
-									   0.125f,  0.375f,
-									   0.375f,  0.375f };
-
 void JitteredRenderer::init()
 {
-	rtu::Random::autoSeed();
 	_gridRes = FOUR_BY_FOUR;
 }
 
@@ -36,59 +12,56 @@ void JitteredRenderer::render()
 	unsigned int width;
 	unsigned int height;
 	rtsViewport( width, height );
-	int w = (int)width;
-	int h = (int)height;
-	float* frameBuffer = rtsFrameBuffer();
-	rts::RTstate sample;
-	rtu::float3 resultColor;
-	int x, y;
-
-	const float* grid;
-	unsigned int gridSize;
-	float ratio;
 
 	switch( _gridRes )
 	{
 	case TWO_BY_TWO:
-		grid = TWO_BY_TWO_GRID;
-		gridSize = 8;
-		ratio = 0.25f;
+		_sampleCount = 4;
 		break;
 
 	case FOUR_BY_FOUR:
-		grid = FOUR_BY_FOUR_GRID;
-		gridSize = 32;
-		ratio = 0.0625f;
+		_sampleCount = 16;
 		break;
 
 	default:
 	    return;
 	}
 
-	int chunk = 16;
+	_width = width;
+	_frameBuffer = rtsFrameBuffer();
+
+	TileScheduler::instance().run( *this, width, height );
+}
 
-	#pragma omp parallel for shared( frameBuffer, h, w ) private( y ) schedule( dynamic, chunk )
-	for( y = 0; y < h; ++y )
+void JitteredRenderer::renderTile( unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1 )
+{
+	rts::RTstate sample;
+	rtu::float3 resultColor;
+	float positions[MAX_SAMPLE_COUNT*2];
+
+	const float ratio = 1.0f / (float)_sampleCount;
+
+	for( unsigned int y = y0; y < y1; ++y )
 	{
-		#pragma omp parallel for shared( frameBuffer, h, w, y, grid, gridSize, ratio ) private( x, resultColor, sample ) schedule( dynamic, chunk )
-		for( x = 0; x < w; ++x )
+		for( unsigned int x = x0; x < x1; ++x )
 		{
 			resultColor.set( 0.0f, 0.0f, 0.0f );
 
-			unsigned int i = 0;
-			while( i < gridSize )
+			// Sample positions inside pixel, from current sampler (stratified for low discrepancy sequences)
+			rtsPixelSamples2D( x, y, 0, _sampleCount, positions );
+
+			for( unsigned int i = 0; i < _sampleCount; ++i )
 			{
-				rtsInitPrimaryRayState( sample, (float)x + grid[i++] + rtu::Random::real( -ratio, ratio ), 
-					                            (float)y + grid[i++] + rtu::Random::real( -ratio, ratio ) );
+				rtsInitPrimaryRayState( sample, (float)x + positions[i*2] - 0.5f, (float)y + positions[i*2+1] - 0.5f, i );
 				rtsTraceRay( sample );
 				resultColor += rtsResultColor( sample );
 			}
 			
 			resultColor *= ratio;
 			
-			frameBuffer[(x+y*w)*3]   = resultColor.r;
-			frameBuffer[(x+y*w)*3+1] = resultColor.g;
-			frameBuffer[(x+y*w)*3+2] = resultColor.b;
+			_frameBuffer[(x+y*_width)*3]   = resultColor.r;
+			_frameBuffer[(x+y*_width)*3+1] = resultColor.g;
+			_frameBuffer[(x+y*_width)*3+2] = resultColor.b;
 		}
 	}
 }
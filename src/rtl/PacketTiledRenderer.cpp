@@ -6,69 +6,60 @@ namespace rtl {
 static const float PACKET_GRID[] = { 0, 0,   1, 0,    1, 1,    0, 1,    0, 2,    0, 3,   1, 3,   1, 2,
                                      2, 2,   2, 3,    3, 3,    3, 2,    3, 1,    2, 1,   2, 0,   3, 0 };
 
+static const unsigned int TILE_SIZE = 16;
+
 void PacketTiledRenderer::render()
 {
 	unsigned int width;
 	unsigned int height;
 	rtsViewport( width, height );
-	const int w = (int)width;
-	const int h = (int)height;
-	float* frameBuffer = rtsFrameBuffer();
+
+	_width = width;
+	_frameBuffer = rtsFrameBuffer();
+
+	// Tiles must hold whole packets
+	RTU_STATIC_CHECK( ( TILE_SIZE % RT_PACKET_DIM ) == 0, tile_size_must_be_multiple_of_packet_dim );
+	TileScheduler::instance().run( *this, width, height, TILE_SIZE );
+}
+
+void PacketTiledRenderer::renderTile( unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1 )
+{
 	rts::RTstate sample;
 
-	const int tileSize = 16;
-	const int chunk = 1;
 	const int coordSize = RT_PACKET_SIZE*2;
-
 	float rayXYCoords[coordSize];
 
-	const int numTilesX = rtu::mathf::round( (float)w / (float)tileSize );
-	const int numTilesY = rtu::mathf::round( (float)h / (float)tileSize );
-	const float invNumTilesX = 1.0f / (float)numTilesX;
-	const int limit = numTilesX * numTilesY;
-
-	#pragma omp parallel for shared( frameBuffer, tileSize, coordSize, h, w, numTilesX ) private( sample, rayXYCoords ) schedule( dynamic, chunk )
-	for( int i = 0; i < limit; ++i )
+	for( unsigned int y = y0; y < y1; y+=RT_PACKET_DIM )
 	{
-		const int ty = ( i / numTilesX ) * tileSize;
-		const int tx = ( i % numTilesX ) * tileSize;
-
-		for( int dy = 0; dy < tileSize; dy+=RT_PACKET_DIM )
+		for( unsigned int x = x0; x < x1; x+=RT_PACKET_DIM )
 		{
-			const int y = ty + dy;
-			if( y >= h )
-				continue;
-
-			for( int dx = 0; dx < tileSize; dx+=RT_PACKET_DIM )
+			// Fill packet x, y ray values
+			for( int i = 0; i < coordSize; i+=2 )
 			{
-				const int x = tx + dx;
-				if( x >= w )
-					continue;
+				rayXYCoords[i]   = x + PACKET_GRID[i];
+				rayXYCoords[i+1] = y + PACKET_GRID[i+1];
+			}
 
-				// Fill packet x, y ray values
-				for( int i = 0; i < coordSize; i+=2 )
-				{
-					rayXYCoords[i]   = x + PACKET_GRID[i];
-					rayXYCoords[i+1] = y + PACKET_GRID[i+1];
-				}
+			// Setup ray packet with camera
+			rtsInitPrimaryRayStatePacket( sample, rayXYCoords );
 
-				// Setup ray packet with camera
-				rtsInitPrimaryRayStatePacket( sample, rayXYCoords );
+			// Trace rays
+			rtsTraceRayPacket( sample );
 
-				// Trace rays
-				rtsTraceRayPacket( sample );
+			// Get color results, packets of border tiles may overlap the viewport edges
+			for( int k = 0, r = 0; k < coordSize; k+=2, ++r )
+			{
+				const unsigned int destX = static_cast<unsigned int>( rayXYCoords[k] );
+				const unsigned int destY = static_cast<unsigned int>( rayXYCoords[k+1] );
+				if( ( destX >= x1 ) || ( destY >= y1 ) )
+					continue;
 
-				// Get color results
-				for( int k = 0, r = 0; k < coordSize; k+=2, ++r )
-				{
-					const int destX = rayXYCoords[k];
-					const int destY = rayXYCoords[k+1];
-					const rtu::float3& color = rtsResultColorPacket( sample, r );
+				rtu::float3 color;
+				rtsResultColorPacket( sample, r, color );
 
-					frameBuffer[(destX+destY*w)*3]   = color.r;
-					frameBuffer[(destX+destY*w)*3+1] = color.g;
-					frameBuffer[(destX+destY*w)*3+2] = color.b;
-				}
+				_frameBuffer[(destX+destY*_width)*3]   = color.r;
+				_frameBuffer[(destX+destY*_width)*3+1] = color.g;
+				_frameBuffer[(destX+destY*_width)*3+2] = color.b;
 			}
 		}
 	}
@@ -1,7 +1,11 @@
 #include <rtl/PhongMaterial.h>
+#include <algorithm>
 
 namespace rtl {
 
+// Lights queried at once (see rtsQueryLights)
+static const unsigned int LIGHT_CHUNK_SIZE = 16;
+
 PhongMaterial::PhongMaterial()
 {
 	_ambient.set( 0.1f, 0.1f, 0.1f );
@@ -38,30 +42,41 @@ void PhongMaterial::shade( rts::RTstate& state )
 	rtu::float3 specularVector;
 	rtsComputeSpecularVector( state, specularVector );
 	rtu::float3 objColor;
-	rtsComputeShadingColor( state, objColor );
+	objectColor( state, objColor );
 
-	// Query light sources
-	void** lights;
-	const int lightCount = rtsGlobalLights( lights );
+	// Query light sources that may illuminate hit point, a chunk at a time
+	void* lights[LIGHT_CHUNK_SIZE];
+	float lightWeights[LIGHT_CHUNK_SIZE];
+	unsigned int lightCursor = 0;
+	unsigned int lightCount = 0;
 
 	// Accumulate light contributions
 	rtu::float3 diffuse( 0.0f, 0.0f, 0.0f );
 	rtu::float3 specular( 0.0f, 0.0f, 0.0f );
 
-	for( int i = 0; i < lightCount; ++i )
+	for( unsigned int i = 0; ; ++i )
 	{
+		// Next chunk of lights
+		if( i == lightCount )
+		{
+			lightCount = rtsQueryLights( state, lightCursor, lights, lightWeights, LIGHT_CHUNK_SIZE );
+			if( lightCount == 0 )
+				break;
+			i = 0;
+		}
+
 		// Setup light state
 		rtsInitLightState( state, lightSample );
 
 		// Update lightSample with light radiance and direction
-		bool ok = rtsIlluminate( lightSample, lights[i] );
+		bool ok = rtsIlluminate( lightSample, lights[i], i );
 
 		// Probably light is occluded or points away from hit point
 		if( !ok )
 			continue;
 
-		// Query light sample direction and radiance
-		const rtu::float3& lightIntensity = rtsResultColor( lightSample );
+		// Query light sample direction and weighted radiance
+		const rtu::float3 lightIntensity = rtsResultColor( lightSample ) * lightWeights[i];
 		rtu::float3& L = rtsRayDirection( lightSample );
 		L.normalize();
 
@@ -82,6 +97,160 @@ void PhongMaterial::shade( rts::RTstate& state )
 	returnColor.g = objColor.g * ( _ambient.g + diffuse.g ) + ( _specularColor.g * specular.g );
 	returnColor.b = objColor.b * ( _ambient.b + diffuse.b ) + ( _specularColor.b * specular.b );
 
+	shadeEffects( state );
+}
+
+void PhongMaterial::shadePacket( rts::RTstate& state, const __m128 mask4[RT_PACKET_SIMD_SIZE] )
+{
+	// Create new state for light samples
+	rts::RTstate lightSample;
+
+	// Get data from current state
+	rtsComputeShadingNormalPacket( state, mask4 );
+	rtsComputeHitPositionPacket( state );
+	const __m128* normal4 = rtsShadingNormalPacket( state );
+	__m128 specularVector4[RT_PACKET_SIMD_SIZE*3];
+	rtsComputeSpecularVectorPacket( state, specularVector4 );
+	__m128 objColor4[RT_PACKET_SIMD_SIZE*3];
+	objectColorPacket( state, mask4, objColor4 );
+
+	// Query light sources that may illuminate hit point, a chunk at a time
+	void* lights[LIGHT_CHUNK_SIZE];
+	float lightWeights[LIGHT_CHUNK_SIZE];
+	unsigned int lightCursor = 0;
+	unsigned int lightCount = 0;
+
+	// Accumulate light contributions
+	__m128 diffuse4[RT_PACKET_SIMD_SIZE*3];
+	__m128 specular4[RT_PACKET_SIMD_SIZE*3];
+	std::fill_n( diffuse4, RT_PACKET_SIMD_SIZE*3, rtu::SSE_ZERO );
+	std::fill_n( specular4, RT_PACKET_SIMD_SIZE*3, rtu::SSE_ZERO );
+
+	for( unsigned int i = 0; ; ++i )
+	{
+		// Next chunk of lights
+		if( i == lightCount )
+		{
+			lightCount = rtsQueryLightsPacket( state, mask4, lightCursor, lights, lightWeights, LIGHT_CHUNK_SIZE );
+			if( lightCount == 0 )
+				break;
+			i = 0;
+		}
+
+		// Setup light state
+		rtsInitLightStatePacket( state, lightSample );
+
+		// Update lightSample with light radiance and direction of illuminated rays
+		__m128 litMask4[RT_PACKET_SIMD_SIZE];
+		std::copy( mask4, mask4 + RT_PACKET_SIMD_SIZE, litMask4 );
+		if( !rtsIlluminatePacket( lightSample, lights[i], litMask4, i ) )
+			continue;
+
+		// Query light sample directions and weighted radiances
+		__m128* lightIntensity4 = rtsResultColorPacket( lightSample );
+		const __m128* L4 = rtsRayDirectionPacket( lightSample );
+
+		const __m128 lightWeight = _mm_set_ps1( lightWeights[i] );
+		for( unsigned int k = 0; k < RT_PACKET_SIMD_SIZE*3; ++k )
+		{
+			lightIntensity4[k] = _mm_mul_ps( lightIntensity4[k], lightWeight );
+		}
+
+		for( unsigned int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+		{
+			const unsigned int py = p + RT_PACKET_SIMD_SIZE;
+			const unsigned int pz = p + RT_PACKET_SIMD_SIZE*2;
+
+			// Normalize light directions
+			const __m128 invLength = _mm_div_ps( rtu::SSE_ONE, _mm_sqrt_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( L4[p], L4[p] ), 
+				                                                                                 _mm_mul_ps( L4[py], L4[py] ) ),
+				                                                                     _mm_mul_ps( L4[pz], L4[pz] ) ) ) );
+			const __m128 lx = _mm_mul_ps( L4[p], invLength );
+			const __m128 ly = _mm_mul_ps( L4[py], invLength );
+			const __m128 lz = _mm_mul_ps( L4[pz], invLength );
+
+			// Diffuse shading
+			const __m128 nDotL = _mm_add_ps( _mm_add_ps( _mm_mul_ps( normal4[p], lx ), _mm_mul_ps( normal4[py], ly ) ), 
+				                             _mm_mul_ps( normal4[pz], lz ) );
+			diffuse4[p]  = _mm_add_ps( diffuse4[p],  _mm_and_ps( litMask4[p], _mm_mul_ps( lightIntensity4[p],  nDotL ) ) );
+			diffuse4[py] = _mm_add_ps( diffuse4[py], _mm_and_ps( litMask4[p], _mm_mul_ps( lightIntensity4[py], nDotL ) ) );
+			diffuse4[pz] = _mm_add_ps( diffuse4[pz], _mm_and_ps( litMask4[p], _mm_mul_ps( lightIntensity4[pz], nDotL ) ) );
+
+			// Specular shading
+			const __m128 specDotL = _mm_add_ps( _mm_add_ps( _mm_mul_ps( specularVector4[p], lx ), _mm_mul_ps( specularVector4[py], ly ) ), 
+				                                _mm_mul_ps( specularVector4[pz], lz ) );
+			const __m128 specMask = _mm_and_ps( litMask4[p], _mm_cmpgt_ps( specDotL, rtu::SSE_ZERO ) );
+			const int specBits = _mm_movemask_ps( specMask );
+			if( specBits == 0 )
+				continue;
+
+			// No SSE pow, raise highlights ray by ray
+			union { float highlight[4]; __m128 highlight4; };
+			highlight4 = specDotL;
+			for( int k = 0; k < 4; ++k )
+			{
+				highlight[k] = ( specBits & ( 1 << k ) ) ? pow( highlight[k], _specularExponent ) : 0.0f;
+			}
+
+			specular4[p]  = _mm_add_ps( specular4[p],  _mm_and_ps( specMask, _mm_mul_ps( lightIntensity4[p],  highlight4 ) ) );
+			specular4[py] = _mm_add_ps( specular4[py], _mm_and_ps( specMask, _mm_mul_ps( lightIntensity4[py], highlight4 ) ) );
+			specular4[pz] = _mm_add_ps( specular4[pz], _mm_and_ps( specMask, _mm_mul_ps( lightIntensity4[pz], highlight4 ) ) );
+		}
+	}
+
+	// Gather all lighting contributions, keeping colors of rays out of mask (shaded by other materials)
+	__m128* returnColor4 = rtsResultColorPacket( state );
+	for( unsigned int c = 0; c < 3; ++c )
+	{
+		const __m128 ambient = _mm_set_ps1( _ambient[c] );
+		const __m128 specularColor = _mm_set_ps1( _specularColor[c] );
+
+		for( unsigned int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+		{
+			const unsigned int i = p + c*RT_PACKET_SIMD_SIZE;
+			const __m128 color = _mm_add_ps( _mm_mul_ps( objColor4[i], _mm_add_ps( ambient, diffuse4[i] ) ), 
+				                             _mm_mul_ps( specularColor, specular4[i] ) );
+			returnColor4[i] = _mm_or_ps( _mm_and_ps( mask4[p], color ), _mm_andnot_ps( mask4[p], returnColor4[i] ) );
+		}
+	}
+
+	// Texture is applied ray by ray
+	if( ( _textureId == 0 ) && ( _reflexCoeff <= 0.0f ) && ( _opacity >= 1.0f ) )
+		return;
+
+	// Secondary rays of all rays are traced together, regrouped into coherent packets
+	rts::RTstream& secondaryRays = rtsAcquireRayStream();
+	rtu::float3 colors[RT_PACKET_SIZE];
+
+	rts::RTstate single;
+	for( unsigned int r = 0; r < RT_PACKET_SIZE; ++r )
+	{
+		if( !rtsRayEnabledPacket( mask4, r ) )
+			continue;
+
+		rtsInitRayStateFromPacket( state, r, single );
+		if( _textureId > 0 )
+			rtsApplyTexture( single, _textureId );
+
+		colors[r] = rtsResultColor( single );
+		if( !rtsStopRayRecursion( single ) )
+			enqueueSecondaryRays( single, colors[r], secondaryRays );
+	}
+
+	rtsTraceRayStream( secondaryRays );
+	rtsReleaseRayStream();
+
+	for( unsigned int r = 0; r < RT_PACKET_SIZE; ++r )
+	{
+		if( rtsRayEnabledPacket( mask4, r ) )
+			rtsSetResultColorPacket( state, r, colors[r] );
+	}
+}
+
+void PhongMaterial::shadeEffects( rts::RTstate& state )
+{
+	rtu::float3& returnColor = rtsResultColor( state );
+
 	// Apply texture
 	if( _textureId > 0 )
 		rtsApplyTexture( state, _textureId );
@@ -117,6 +286,43 @@ void PhongMaterial::shade( rts::RTstate& state )
 	}
 }
 
+void PhongMaterial::enqueueSecondaryRays( const rts::RTstate& state, rtu::float3& color, rts::RTstream& stream )
+{
+	// Same contributions as shadeEffects
+	if( _reflexCoeff > 0.0f )
+	{
+		rts::RTstate secondarySample;
+		rtsInitReflectionRayState( state, secondarySample );
+		rtsEnqueueRay( stream, secondarySample, rtu::float3( _reflexCoeff, _reflexCoeff, _reflexCoeff ), color );
+	}
+
+	if( _opacity < 1.0f )
+	{
+		rts::RTstate refractionSample;
+		if( rtsInitRefractionRayState( state, _refractionIndex, refractionSample ) )
+		{
+			const float transparency = 1.0f - _opacity;
+			rtsEnqueueRay( stream, refractionSample, rtu::float3( transparency, transparency, transparency ), color );
+		}
+	}
+}
+
+void PhongMaterial::objectColor( const rts::RTstate& state, rtu::float3& color )
+{
+	rtsComputeShadingColor( state, color );
+}
+
+void PhongMaterial::objectColorPacket( const rts::RTstate& state, const __m128 mask4[RT_PACKET_SIMD_SIZE],
+									   __m128 color4[RT_PACKET_SIMD_SIZE*3] )
+{
+	rtsComputeShadingColorPacket( state, mask4, color4 );
+}
+
+void PhongMaterial::setAmbient( float r, float g, float b )
+{
+	_ambient.set( r, g, b );
+}
+
 void PhongMaterial::setReflexCoeff( float coeff )
 {
 	_reflexCoeff = coeff;
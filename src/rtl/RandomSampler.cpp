@@ -0,0 +1,16 @@
+#include <rtl/RandomSampler.h>
+
+namespace rtl {
+
+void RandomSampler::sample2D( rtu::CounterRandom& random, unsigned int first, unsigned int count, float* uv )
+{
+	// Jump to first sample, so that results don't depend on how samples are split among calls
+	random.seek( first * 2 );
+
+	for( unsigned int i = 0; i < count * 2; ++i )
+	{
+		uv[i] = random.real();
+	}
+}
+
+} // namespace rtl
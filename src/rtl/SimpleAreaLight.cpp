@@ -1,5 +1,5 @@
 #include <rtl/SimpleAreaLight.h>
-#include <rtu/random.h>
+#include <algorithm>
 
 namespace rtl {
 
@@ -8,10 +8,6 @@ SimpleAreaLight::SimpleAreaLight()
 {
 	// empty
 }
-void SimpleAreaLight::init()
-{
-	rtu::Random::autoSeed();
-}
 
 bool SimpleAreaLight::illuminate( rts::RTstate& state )
 {
@@ -28,35 +24,47 @@ bool SimpleAreaLight::illuminate( rts::RTstate& state )
 	// Assume a disk perpendicular to direction using _radius and compute _sampleCount samples randomly inside it
 	rtu::float3 uAxis;
 	rtu::float3 vAxis;
-	rtu::float3 samplePos;
 	rtu::float3 dir = L;
 	dir.normalize();
 	dir.orthonormalBasis( uAxis, vAxis );
+	const rtu::float3& normal = rtsShadingNormal( state );
 	float x;
 	float y;
 	unsigned int successfulSamples = 0;
 
-	for( unsigned int i = 0; i < _sampleCount; ++i )
-	{
-		randomDisk( x, y );
-		x *= _radius;
-		y *= _radius;
-		samplePos = L + ( uAxis * x ) + ( vAxis * y );
-
-		// Setup shadow ray
-		// Since we did not normalize the direction, every parametric t step walks the length of the direction along the ray.
-		// So, when t == 1 we are right at the light position, which is the farthest we want to go.
-		const bool ok = rtsInitShadowRayState( samplePos - hitPos, 1.0f, state );
+	// Stratified over all pixel samples for low discrepancy samplers
+	float samples[MAX_SAMPLE_COUNT*2];
+	rtsSamples2D( state, samples, _sampleCount );
 
-		// Avoid computing light contribution for triangles facing away
-		if( !ok )
-			continue;
+	// All shadow rays start at the hit point towards the same disk: trace them together, a packet at a time
+	rts::RTstate shadow;
 
-		// If light sample is occluded, we avoid computing its contribution
-		if( _castShadows && rtsTraceHit( state ) )
-			continue;
-
-		++successfulSamples;
+	for( unsigned int first = 0; first < _sampleCount; first += RT_PACKET_SIZE )
+	{
+		const unsigned int last = std::min( first + RT_PACKET_SIZE, _sampleCount );
+		unsigned int rayCount = 0;
+		rtsInitShadowRayStatePacket( shadow );
+
+		for( unsigned int i = first; i < last; ++i )
+		{
+			concentricDisk( samples[i*2], samples[i*2+1], x, y );
+			x *= _radius;
+			y *= _radius;
+
+			// Direction towards sample, not normalized: when t == 1 we are right at the sample (see SimplePointLight)
+			const rtu::float3 sampleDir = L + ( uAxis * x ) + ( vAxis * y );
+
+			// Avoid computing light contribution for triangles facing away, same as rtsInitShadowRayState
+			if( normal.dot( sampleDir ) <= 0.0f )
+				continue;
+
+			rtsSetShadowRayPacket( shadow, rayCount++, hitPos, sampleDir, 1.0f );
+		}
+
+		// Occluded samples do not contribute, tracing stops once all of them are occluded
+		successfulSamples += rayCount;
+		if( _castShadows && ( rayCount > 0 ) )
+			successfulSamples -= rtsTraceHitPacket( shadow );
 	}
 
 	// If no samples hit light
@@ -77,10 +85,62 @@ bool SimpleAreaLight::illuminate( rts::RTstate& state )
 	return true;
 }
 
-void SimpleAreaLight::randomDisk( float& x, float& y )
+bool SimpleAreaLight::illuminatePacket( rts::RTstate& state, __m128 mask4[RT_PACKET_SIMD_SIZE] )
+{
+	return rts::ILight::illuminatePacket( state, mask4 );
+}
+
+bool SimpleAreaLight::influence( float cutoff, rtu::float3& center, float& radius )
+{
+	if( !SimplePointLight::influence( cutoff, center, radius ) )
+		return false;
+
+	// Samples are up to _radius away from the center
+	if( radius > 0.0f )
+		radius += _radius;
+	return true;
+}
+
+void SimpleAreaLight::setRadius( float radius )
 {
-	const float r = sqrt( rtu::Random::realInIn() );
-	const float theta = rtu::mathf::TWO_PI*rtu::Random::realInIn();
+	_radius = radius;
+}
+
+void SimpleAreaLight::setSampleCount( unsigned int count )
+{
+	if( count < 1 )
+		count = 1;
+	if( count > MAX_SAMPLE_COUNT )
+		count = MAX_SAMPLE_COUNT;
+
+	_sampleCount = count;
+}
+
+// Shirley-Chiu concentric mapping, keeps the stratification of samples in the unit square
+void SimpleAreaLight::concentricDisk( float u, float v, float& x, float& y )
+{
+	const float a = 2.0f*u - 1.0f;
+	const float b = 2.0f*v - 1.0f;
+
+	if( ( a == 0.0f ) && ( b == 0.0f ) )
+	{
+		x = 0.0f;
+		y = 0.0f;
+		return;
+	}
+
+	float r;
+	float theta;
+	if( a*a > b*b )
+	{
+		r = a;
+		theta = rtu::mathf::PI_4*( b / a );
+	}
+	else
+	{
+		r = b;
+		theta = rtu::mathf::PI_2 - rtu::mathf::PI_4*( a / b );
+	}
 
 	x = r*cos( theta );
 	y = r*sin( theta );
@@ -1,4 +1,5 @@
 #include <rtl/SimplePointLight.h>
+#include <algorithm>
 
 namespace rtl {
 
@@ -36,7 +37,7 @@ bool SimplePointLight::illuminate( rts::RTstate& state )
 
 	// Quadratic distance attenuation
 	const float distance = L.length(); // TODO: if it's slow, we can use only squared distance and attenuation
-	const float attenFactor = 1.0f / ( _constAtten + _linearAtten * distance + _quadAtten * distance * distance );
+	const float attenFactor = attenuation( distance );
 
 	// Compute and return light intensity
 	rtu::float3& I = rtsResultColor( state );
@@ -44,6 +45,102 @@ bool SimplePointLight::illuminate( rts::RTstate& state )
 	return true;
 }
 
+bool SimplePointLight::illuminatePacket( rts::RTstate& state, __m128 mask4[RT_PACKET_SIMD_SIZE] )
+{
+	// Avoid back face lighting
+	rtsFrontFacePacket( state, mask4 );
+
+	// Directions towards light, not normalized (see illuminate)
+	const __m128* hitPos4 = rtsHitPositionPacket( state );
+	__m128 L4[RT_PACKET_SIMD_SIZE*3];
+	for( unsigned int c = 0; c < 3; ++c )
+	{
+		const __m128 position = _mm_set_ps1( _position[c] );
+		for( unsigned int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+		{
+			L4[p+c*RT_PACKET_SIMD_SIZE] = _mm_sub_ps( position, hitPos4[p+c*RT_PACKET_SIMD_SIZE] );
+		}
+	}
+
+	// Setup shadow rays, avoiding triangles facing away
+	if( !rtsInitShadowRayStatePacket( L4, 1.0f, mask4, state ) )
+		return false;
+
+	// Occluded rays get no light contribution
+	if( _castShadows && ( rtsTraceHitPacket( state ) > 0 ) )
+	{
+		const __m128* occluded4 = rtsOccludedPacket( state );
+		for( unsigned int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+		{
+			mask4[p] = _mm_andnot_ps( occluded4[p], mask4[p] );
+		}
+	}
+
+	// Quadratic distance attenuation
+	const __m128 constAtten = _mm_set_ps1( _constAtten );
+	const __m128 linearAtten = _mm_set_ps1( _linearAtten );
+	const __m128 quadAtten = _mm_set_ps1( _quadAtten );
+
+	// Compute and return light intensities
+	__m128* I4 = rtsResultColorPacket( state );
+	int litBits = 0;
+
+	for( unsigned int p = 0; p < RT_PACKET_SIMD_SIZE; ++p )
+	{
+		const unsigned int py = p + RT_PACKET_SIMD_SIZE;
+		const unsigned int pz = p + RT_PACKET_SIMD_SIZE*2;
+
+		const __m128 distance = _mm_sqrt_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( L4[p], L4[p] ), _mm_mul_ps( L4[py], L4[py] ) ), 
+			                                             _mm_mul_ps( L4[pz], L4[pz] ) ) );
+		const __m128 attenFactor = _mm_div_ps( rtu::SSE_ONE, _mm_add_ps( constAtten, _mm_mul_ps( distance, 
+			                                   _mm_add_ps( linearAtten, _mm_mul_ps( quadAtten, distance ) ) ) ) );
+
+		I4[p]  = _mm_mul_ps( _mm_set_ps1( _intensity.r ), attenFactor );
+		I4[py] = _mm_mul_ps( _mm_set_ps1( _intensity.g ), attenFactor );
+		I4[pz] = _mm_mul_ps( _mm_set_ps1( _intensity.b ), attenFactor );
+		litBits |= _mm_movemask_ps( mask4[p] );
+	}
+
+	return ( litBits != 0 );
+}
+
+bool SimplePointLight::influence( float cutoff, rtu::float3& center, float& radius )
+{
+	if( !( cutoff > 0.0f ) )
+		return false;
+
+	// Brightest component falls to cutoff where _quadAtten * d^2 + _linearAtten * d + c = 0
+	const float maxIntensity = std::max( std::max( _intensity.r, _intensity.g ), _intensity.b );
+	const float c = _constAtten - maxIntensity / cutoff;
+
+	if( _quadAtten > 0.0f )
+	{
+		const float discriminant = _linearAtten * _linearAtten - 4.0f * _quadAtten * c;
+		radius = ( discriminant > 0.0f ) ? ( sqrt( discriminant ) - _linearAtten ) / ( 2.0f * _quadAtten ) : 0.0f;
+	}
+	else if( _linearAtten > 0.0f )
+	{
+		radius = -c / _linearAtten;
+	}
+	else
+	{
+		// No distance attenuation, reaches either all points or none
+		if( c < 0.0f )
+			return false;
+		radius = 0.0f;
+	}
+
+	center = _position;
+	radius = std::max( radius, 0.0f );
+	return true;
+}
+
+float SimplePointLight::intensityAt( const rtu::float3& position )
+{
+	const float maxIntensity = std::max( std::max( _intensity.r, _intensity.g ), _intensity.b );
+	return maxIntensity * attenuation( ( _position - position ).length() );
+}
+
 void SimplePointLight::setCastShadows( bool enabled )
 {
 	_castShadows = enabled;
@@ -0,0 +1,35 @@
+#include <rtl/SobolSampler.h>
+
+namespace rtl {
+
+// Generator matrices of first two Sobol dimensions, applied to the bits of i
+static inline unsigned int sobol( unsigned int i, unsigned int dimension, unsigned int scramble )
+{
+	unsigned int result = scramble;
+
+	// Dimension 0 is the van der Corput sequence, dimension 1 uses primitive polynomial x + 1
+	for( unsigned int v = 0x80000000; i != 0; i >>= 1 )
+	{
+		if( i & 1 )
+			result ^= v;
+
+		v = ( dimension == 0 ) ? ( v >> 1 ) : ( v ^ ( v >> 1 ) );
+	}
+
+	return result;
+}
+
+void SobolSampler::sample2D( rtu::CounterRandom& random, unsigned int first, unsigned int count, float* uv )
+{
+	const unsigned int scrambleU = random.integer32();
+	const unsigned int scrambleV = random.integer32();
+
+	for( unsigned int i = 0; i < count; ++i )
+	{
+		// Keep 24 bits, exactly representable as float
+		uv[i*2]   = ( sobol( first + i, 0, scrambleU ) >> 8 ) * ( 1.0f / 16777216.0f );
+		uv[i*2+1] = ( sobol( first + i, 1, scrambleV ) >> 8 ) * ( 1.0f / 16777216.0f );
+	}
+}
+
+} // namespace rtl
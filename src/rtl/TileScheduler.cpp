@@ -0,0 +1,171 @@
+#include <rtl/TileScheduler.h>
+#include <algorithm>
+
+namespace rtl {
+
+// Spreads the lower 16 bits of v to even bit positions
+static inline unsigned int spreadBits( unsigned int v )
+{
+	v &= 0x0000FFFF;
+	v = ( v | ( v << 8 ) ) & 0x00FF00FF;
+	v = ( v | ( v << 4 ) ) & 0x0F0F0F0F;
+	v = ( v | ( v << 2 ) ) & 0x33333333;
+	v = ( v | ( v << 1 ) ) & 0x55555555;
+	return v;
+}
+
+// Inverse of spreadBits
+static inline unsigned int compactBits( unsigned int v )
+{
+	v &= 0x55555555;
+	v = ( v | ( v >> 1 ) ) & 0x33333333;
+	v = ( v | ( v >> 2 ) ) & 0x0F0F0F0F;
+	v = ( v | ( v >> 4 ) ) & 0x00FF00FF;
+	v = ( v | ( v >> 8 ) ) & 0x0000FFFF;
+	return v;
+}
+
+TileScheduler& TileScheduler::instance()
+{
+	static TileScheduler s_instance;
+	return s_instance;
+}
+
+TileScheduler::TileScheduler()
+: _tileCountX( 0 ), _tileCountY( 0 ), _queues( NULL ), _queueCount( 0 )
+{
+}
+
+TileScheduler::~TileScheduler()
+{
+	resizeQueues( 0 );
+}
+
+void TileScheduler::run( ITileJob& job, unsigned int width, unsigned int height, unsigned int tileSize )
+{
+	if( ( width == 0 ) || ( height == 0 ) || ( tileSize == 0 ) )
+		return;
+
+	// Partial tiles at right and bottom borders
+	const unsigned int tileCountX = ( width + tileSize - 1 ) / tileSize;
+	const unsigned int tileCountY = ( height + tileSize - 1 ) / tileSize;
+
+	if( ( tileCountX != _tileCountX ) || ( tileCountY != _tileCountY ) )
+		sortTiles( tileCountX, tileCountY );
+
+	const unsigned int tileCount = _tiles.size();
+	const unsigned int threadCount = std::min<unsigned int>( omp_get_max_threads(), tileCount );
+
+	resizeQueues( threadCount );
+
+	// Give each thread a contiguous range of tiles
+	for( unsigned int t = 0; t < threadCount; ++t )
+	{
+		_queues[t].begin = ( tileCount * t ) / threadCount;
+		_queues[t].end = ( tileCount * ( t + 1 ) ) / threadCount;
+	}
+
+	#pragma omp parallel num_threads( threadCount )
+	{
+		const unsigned int thread = omp_get_thread_num();
+		unsigned int tile;
+
+		// If runtime gives us fewer threads, tiles of missing ones are stolen
+		while( popTile( thread, tile ) || stealTile( thread, tile ) )
+		{
+			const unsigned int x0 = compactBits( tile ) * tileSize;
+			const unsigned int y0 = compactBits( tile >> 1 ) * tileSize;
+			const unsigned int x1 = std::min( x0 + tileSize, width );
+			const unsigned int y1 = std::min( y0 + tileSize, height );
+
+			job.renderTile( x0, y0, x1, y1 );
+		}
+	}
+}
+
+void TileScheduler::sortTiles( unsigned int tileCountX, unsigned int tileCountY )
+{
+	_tileCountX = tileCountX;
+	_tileCountY = tileCountY;
+
+	_tiles.resize( tileCountX * tileCountY );
+
+	unsigned int i = 0;
+	for( unsigned int y = 0; y < tileCountY; ++y )
+	{
+		for( unsigned int x = 0; x < tileCountX; ++x )
+		{
+			_tiles[i++] = spreadBits( x ) | ( spreadBits( y ) << 1 );
+		}
+	}
+
+	std::sort( _tiles.begin(), _tiles.end() );
+}
+
+void TileScheduler::resizeQueues( unsigned int threadCount )
+{
+	if( threadCount == _queueCount )
+		return;
+
+	for( unsigned int t = 0; t < _queueCount; ++t )
+	{
+		omp_destroy_lock( &_queues[t].lock );
+	}
+	delete [] _queues;
+
+	_queues = NULL;
+	_queueCount = threadCount;
+
+	if( threadCount == 0 )
+		return;
+
+	_queues = new WorkQueue[threadCount];
+	for( unsigned int t = 0; t < threadCount; ++t )
+	{
+		omp_init_lock( &_queues[t].lock );
+	}
+}
+
+bool TileScheduler::popTile( unsigned int thread, unsigned int& tile )
+{
+	if( thread >= _queueCount )
+		return false;
+
+	WorkQueue& queue = _queues[thread];
+	bool found = false;
+
+	omp_set_lock( &queue.lock );
+	if( queue.begin < queue.end )
+	{
+		tile = _tiles[queue.begin++];
+		found = true;
+	}
+	omp_unset_lock( &queue.lock );
+
+	return found;
+}
+
+bool TileScheduler::stealTile( unsigned int thread, unsigned int& tile )
+{
+	// Start with next thread, so that thieves don't all pick on the same victim
+	for( unsigned int i = 1; i <= _queueCount; ++i )
+	{
+		WorkQueue& queue = _queues[( thread + i ) % _queueCount];
+		bool found = false;
+
+		omp_set_lock( &queue.lock );
+		if( queue.begin < queue.end )
+		{
+			tile = _tiles[--queue.end];
+			found = true;
+		}
+		omp_unset_lock( &queue.lock );
+
+		if( found )
+			return true;
+	}
+
+	return false;
+}
+
+} // namespace rtl
@@ -2,82 +2,105 @@
 
 namespace rtl {
 
+// Tiles passed to the scheduler, so that each one fits in the sample buffers of sorted shading
+static const unsigned int TILE_SIZE = TileScheduler::DEFAULT_TILE_SIZE;
+static const unsigned int TILE_PIXELS = TILE_SIZE * TILE_SIZE;
+
+TiledRenderer::~TiledRenderer()
+{
+	for( unsigned int i = 0; i < _tileSamples.size(); ++i )
+	{
+		_mm_free( _tileSamples[i] );
+	}
+}
+
+void TiledRenderer::init()
+{
+	_sortShading = false;
+}
+
 void TiledRenderer::render()
 {
 	unsigned int width;
 	unsigned int height;
 	rtsViewport( width, height );
-	const int w = (int)width;
-	const int h = (int)height;
-	float* frameBuffer = rtsFrameBuffer();
-	rts::RTstate sample;
 
-	const int tileSize = 16;
-	const int chunk = 1;
+	_width = width;
+	_frameBuffer = rtsFrameBuffer();
 
-	const int numTilesX = rtu::mathf::round( (float)w / (float)tileSize );
-	const int numTilesY = rtu::mathf::round( (float)h / (float)tileSize );
-	const float invNumTilesX = 1.0f / (float)numTilesX;
-	const int limit = numTilesX * numTilesY;
+	if( _sortShading )
+	{
+		// One sample buffer per thread, kept for next frames
+		const unsigned int threadCount = omp_get_max_threads();
+		while( _tileSamples.size() < threadCount )
+		{
+			_tileSamples.push_back( static_cast<rts::RTstate*>( _mm_malloc( TILE_PIXELS * sizeof( rts::RTstate ), 16 ) ) );
+		}
+	}
+
+	TileScheduler::instance().run( *this, width, height, TILE_SIZE );
+}
 
-	#pragma omp parallel for shared( frameBuffer, tileSize, h, w, numTilesX ) private( sample ) schedule( dynamic, chunk )
-	for( int i = 0; i < limit; ++i )
+void TiledRenderer::renderTile( unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1 )
+{
+	if( _sortShading )
 	{
-		const int ty = ( i / numTilesX ) * tileSize;
-		const int tx = ( i % numTilesX ) * tileSize;
+		renderTileSorted( x0, y0, x1, y1 );
+		return;
+	}
+
+	rts::RTstate sample;
 
-		for( int dy = 0; dy < tileSize; ++dy )
+	for( unsigned int y = y0; y < y1; ++y )
+	{
+		for( unsigned int x = x0; x < x1; ++x )
 		{
-			const int y = ty + dy;
-			if( y >= h )
-				continue;
-
-			for( int dx = 0; dx < tileSize; ++dx )
-			{
-				const int x = tx + dx;
-				if( x >= w )
-					continue;
-
-				rtsInitPrimaryRayState( sample, x, y );
-				rtsTraceRay( sample );
-				const rtu::float3& color = rtsResultColor( sample );
-
-				frameBuffer[(x+y*w)*3]   = color.r;
-				frameBuffer[(x+y*w)*3+1] = color.g;
-				frameBuffer[(x+y*w)*3+2] = color.b;
-			}
+			rtsInitPrimaryRayState( sample, x, y );
+			rtsTraceRay( sample );
+			const rtu::float3& color = rtsResultColor( sample );
+
+			_frameBuffer[(x+y*_width)*3]   = color.r;
+			_frameBuffer[(x+y*_width)*3+1] = color.g;
+			_frameBuffer[(x+y*_width)*3+2] = color.b;
 		}
 	}
+}
+
+void TiledRenderer::setSortShading( bool enabled )
+{
+	_sortShading = enabled;
+}
+
+void TiledRenderer::renderTileSorted( unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1 )
+{
+	rts::RTstate* const samples = _tileSamples[omp_get_thread_num()];
+	rts::RTstate* batch[TILE_PIXELS];
 
-	////#pragma omp parallel for shared( frameBuffer, tileSize, h, w ) private( ty ) schedule( dynamic, chunk )
-	//for( ty = 0; ty < h; ty+=tileSize )
-	//{
-	//	#pragma omp parallel for shared( frameBuffer, tileSize, h, w, ty ) private( tx, dx, dy, x, y, sample ) schedule( dynamic, chunk )
-	//	for( tx = 0; tx < w; tx+=tileSize )
-	//	{
-	//		for( dy = 0; dy < tileSize; ++dy )
-	//		{
-	//			y = ty + dy;
-	//			if( y >= h )
-	//				continue;
-
-	//			for( dx = 0; dx < tileSize; ++dx )
-	//			{
-	//				x = tx + dx;
-	//				if( x >= w )
-	//					continue;
-
-	//				rtsInitPrimaryRayState( x, y, sample );
-	//				rtsTraceSingle( sample );
-	//				const rtu::float3& color = rtsResultColor( sample );
-
-	//				frameBuffer[(x+y*w)*3]   = color.r;
-	//				frameBuffer[(x+y*w)*3+1] = color.g;
-	//				frameBuffer[(x+y*w)*3+2] = color.b;
-	//			}
-	//		}
-	//	}
-	//}
+	unsigned int count = 0;
+	for( unsigned int y = y0; y < y1; ++y )
+	{
+		for( unsigned int x = x0; x < x1; ++x )
+		{
+			rtsInitPrimaryRayState( samples[count], x, y );
+			batch[count] = &samples[count];
+			++count;
+		}
+	}
+
+	rtsTraceRayBatch( batch, count );
+
+	count = 0;
+	for( unsigned int y = y0; y < y1; ++y )
+	{
+		for( unsigned int x = x0; x < x1; ++x )
+		{
+			const rtu::float3& color = rtsResultColor( samples[count++] );
+
+			_frameBuffer[(x+y*_width)*3]   = color.r;
+			_frameBuffer[(x+y*_width)*3+1] = color.g;
+			_frameBuffer[(x+y*_width)*3+2] = color.b;
+		}
+	}
 }
 
 } // namespace rtl
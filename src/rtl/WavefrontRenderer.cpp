@@ -0,0 +1,103 @@
+#include <rtl/WavefrontRenderer.h>
+
+namespace rtl {
+
+// Second iteration of a Hilbert curve, same as PacketTiledRenderer
+static const float PACKET_GRID[] = { 0, 0,   1, 0,    1, 1,    0, 1,    0, 2,    0, 3,   1, 3,   1, 2,
+                                     2, 2,   2, 3,    3, 3,    3, 2,    3, 1,    2, 1,   2, 0,   3, 0 };
+
+// Larger than PacketTiledRenderer's, so that each bounce has enough rays to regroup into coherent packets
+static const unsigned int TILE_SIZE = 32;
+static const unsigned int TILE_PACKETS = ( TILE_SIZE / RT_PACKET_DIM ) * ( TILE_SIZE / RT_PACKET_DIM );
+
+void WavefrontRenderer::render()
+{
+	unsigned int width;
+	unsigned int height;
+	rtsViewport( width, height );
+
+	_width = width;
+	_frameBuffer = rtsFrameBuffer();
+
+	// Tiles must hold whole packets
+	RTU_STATIC_CHECK( ( TILE_SIZE % RT_PACKET_DIM ) == 0, tile_size_must_be_multiple_of_packet_dim );
+	TileScheduler::instance().run( *this, width, height, TILE_SIZE );
+}
+
+void WavefrontRenderer::renderTile( unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1 )
+{
+	// Too large for thread stacks
+	rts::RTstate* packets = static_cast<rts::RTstate*>( _mm_malloc( TILE_PACKETS * sizeof( rts::RTstate ), 16 ) );
+
+	// Tile pixel colors, targets of queued rays
+	rtu::float3 colors[TILE_SIZE*TILE_SIZE];
+
+	const int coordSize = RT_PACKET_SIZE*2;
+	float rayXYCoords[TILE_PACKETS][coordSize];
+
+	rtsBeginRayQueue();
+
+	// Generate primary packets
+	unsigned int packetCount = 0;
+	for( unsigned int y = y0; y < y1; y+=RT_PACKET_DIM )
+	{
+		for( unsigned int x = x0; x < x1; x+=RT_PACKET_DIM )
+		{
+			float* coords = rayXYCoords[packetCount];
+			for( int i = 0; i < coordSize; i+=2 )
+			{
+				coords[i]   = x + PACKET_GRID[i];
+				coords[i+1] = y + PACKET_GRID[i+1];
+			}
+
+			rts::RTstate& packet = packets[packetCount++];
+			rtsInitPrimaryRayStatePacket( packet, coords );
+
+			for( int k = 0, r = 0; k < coordSize; k+=2, ++r )
+			{
+				const unsigned int tileX = static_cast<unsigned int>( coords[k] ) - x0;
+				const unsigned int tileY = static_cast<unsigned int>( coords[k+1] ) - y0;
+				rtsSetPathTargetPacket( packet, r, colors[tileX+tileY*TILE_SIZE] );
+			}
+		}
+	}
+
+	// Trace all of them, then shade all of them
+	for( unsigned int p = 0; p < packetCount; ++p )
+	{
+		rtsIntersectRayPacket( packets[p] );
+	}
+
+	for( unsigned int p = 0; p < packetCount; ++p )
+	{
+		rtsShadeRayPacket( packets[p] );
+
+		const float* coords = rayXYCoords[p];
+		for( int k = 0, r = 0; k < coordSize; k+=2, ++r )
+		{
+			const unsigned int tileX = static_cast<unsigned int>( coords[k] ) - x0;
+			const unsigned int tileY = static_cast<unsigned int>( coords[k+1] ) - y0;
+			rtsResultColorPacket( packets[p], r, colors[tileX+tileY*TILE_SIZE] );
+		}
+	}
+
+	// Secondary rays, one bounce at a time, add their contributions to tile colors
+	while( rtsTraceRayQueue() > 0 )
+		;
+
+	rtsEndRayQueue();
+	_mm_free( packets );
+
+	for( unsigned int y = y0; y < y1; ++y )
+	{
+		for( unsigned int x = x0; x < x1; ++x )
+		{
+			const rtu::float3& color = colors[(x-x0)+(y-y0)*TILE_SIZE];
+			_frameBuffer[(x+y*_width)*3]   = color.r;
+			_frameBuffer[(x+y*_width)*3+1] = color.g;
+			_frameBuffer[(x+y*_width)*3+2] = color.b;
+		}
+	}
+}
+
+} // namespace rtl
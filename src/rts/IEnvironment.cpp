@@ -0,0 +1,20 @@
+#include <rts/IEnvironment.h>
+
+namespace rts {
+
+void IEnvironment::shadePacket( rts::RTstate& state, const __m128 mask4[RT_PACKET_SIMD_SIZE] )
+{
+	rts::RTstate single;
+
+	for( unsigned int r = 0; r < RT_PACKET_SIZE; ++r )
+	{
+		if( !rtsRayEnabledPacket( mask4, r ) )
+			continue;
+
+		rtsInitRayStateFromPacket( state, r, single );
+		shade( single );
+		rtsSetResultColorPacket( state, r, rtsResultColor( single ) );
+	}
+}
+
+} // namespace rts
@@ -2,6 +2,11 @@
 
 namespace rts {
 
+ILight::ILight()
+	: _lightId( 0 )
+{
+}
+
 bool ILight::illuminate( rts::RTstate& state )
 {
 	// avoid warnings
@@ -9,4 +14,43 @@ bool ILight::illuminate( rts::RTstate& state )
 	return false;
 }
 
+bool ILight::illuminatePacket( rts::RTstate& state, __m128 mask4[RT_PACKET_SIMD_SIZE] )
+{
+	rts::RTstate single;
+	bool illuminated = false;
+
+	for( unsigned int r = 0; r < RT_PACKET_SIZE; ++r )
+	{
+		if( !rtsRayEnabledPacket( mask4, r ) )
+			continue;
+
+		rtsInitRayStateFromPacket( state, r, single );
+		if( !illuminate( single ) )
+		{
+			rtsDisableRayPacket( mask4, r );
+			continue;
+		}
+
+		rtsSetResultColorPacket( state, r, rtsResultColor( single ) );
+		rtsSetRayDirectionPacket( state, r, rtsRayDirection( single ) );
+		illuminated = true;
+	}
+
+	return illuminated;
+}
+
+bool ILight::influence( float cutoff, rtu::float3& center, float& radius )
+{
+	// avoid warnings
+	cutoff; center; radius;
+	return false;
+}
+
+float ILight::intensityAt( const rtu::float3& position )
+{
+	// avoid warnings
+	position;
+	return 1.0f;
+}
+
 } // namespace rts
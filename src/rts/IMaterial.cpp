@@ -8,4 +8,27 @@ void IMaterial::shade( rts::RTstate& state )
 	state;
 }
 
+void IMaterial::shadePacket( rts::RTstate& state, const __m128 mask4[RT_PACKET_SIMD_SIZE] )
+{
+	rts::RTstate single;
+
+	for( unsigned int r = 0; r < RT_PACKET_SIZE; ++r )
+	{
+		if( !rtsRayEnabledPacket( mask4, r ) )
+			continue;
+
+		rtsInitRayStateFromPacket( state, r, single );
+		shade( single );
+		rtsSetResultColorPacket( state, r, rtsResultColor( single ) );
+	}
+}
+
+void IMaterial::shadeBatch( rts::RTstate* const states[], unsigned int count )
+{
+	for( unsigned int i = 0; i < count; ++i )
+	{
+		shade( *states[i] );
+	}
+}
+
 } // namespace rts
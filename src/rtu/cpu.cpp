@@ -0,0 +1,97 @@
+#include <rtu/cpu.h>
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+#elif defined(__GNUG__)
+	#include <cpuid.h>
+#endif
+
+namespace rtu {
+
+// cpuid feature bits
+static const uint32 CPUID1_ECX_OSXSAVE = 1 << 27;
+static const uint32 CPUID1_ECX_AVX = 1 << 28;
+static const uint32 CPUID7_EBX_AVX2 = 1 << 5;
+static const uint32 CPUID7_EBX_AVX512F = 1 << 16;
+
+// Register states enabled by the operating system in XCR0
+static const uint64 XCR0_AVX = 0x06;    // xmm, ymm
+static const uint64 XCR0_AVX512 = 0xE6; // xmm, ymm, opmask, zmm
+
+// Returns eax, ebx, ecx and edx of given cpuid leaf
+static void cpuid( uint32 leaf, uint32 subleaf, uint32 regs[4] )
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuidex( info, leaf, subleaf );
+	for( unsigned int i = 0; i < 4; ++i )
+	{
+		regs[i] = static_cast<uint32>( info[i] );
+	}
+#elif defined(__GNUG__)
+	__cpuid_count( leaf, subleaf, regs[0], regs[1], regs[2], regs[3] );
+#endif
+}
+
+// Only valid if CPUID1_ECX_OSXSAVE is set
+static uint64 xcr0()
+{
+#if defined(_MSC_VER) && ( _MSC_VER >= 1600 )
+	return _xgetbv( 0 );
+#elif defined(__GNUG__)
+	uint32 eax;
+	uint32 edx;
+	__asm__ __volatile__( "xgetbv" : "=a"( eax ), "=d"( edx ) : "c"( 0 ) );
+	return ( static_cast<uint64>( edx ) << 32 ) | eax;
+#else
+	// Compiler too old to save AVX registers anyway
+	return 0;
+#endif
+}
+
+// Widest usable SIMD width
+static unsigned int detectSimdWidth()
+{
+	uint32 regs[4];
+	cpuid( 0, 0, regs );
+	const uint32 maxLeaf = regs[0];
+	if( maxLeaf < 7 )
+		return 4;
+
+	cpuid( 1, 0, regs );
+	const uint32 required = CPUID1_ECX_OSXSAVE | CPUID1_ECX_AVX;
+	if( ( regs[2] & required ) != required )
+		return 4;
+
+	const uint64 osState = xcr0();
+	if( ( osState & XCR0_AVX ) != XCR0_AVX )
+		return 4;
+
+	cpuid( 7, 0, regs );
+	if( ( regs[1] & CPUID7_EBX_AVX2 ) == 0 )
+		return 4;
+
+	if( ( ( regs[1] & CPUID7_EBX_AVX512F ) == 0 ) || ( ( osState & XCR0_AVX512 ) != XCR0_AVX512 ) )
+		return 8;
+
+	return 16;
+}
+
+unsigned int Cpu::simdWidth()
+{
+	// Same result from any thread, no need to lock
+	static const unsigned int s_width = detectSimdWidth();
+	return s_width;
+}
+
+bool Cpu::hasAvx2()
+{
+	return simdWidth() >= 8;
+}
+
+bool Cpu::hasAvx512()
+{
+	return simdWidth() >= 16;
+}
+
+} // namespace rtu
@@ -160,4 +160,131 @@ uint32 Random::integer32()
 uint32 Random::mt[N];
 int32 Random::mti( N + 1 );
 
+//////////////////////////////////////////////////////////////////////////
+
+// Philox4x32 round constants
+static const uint32 PHILOX_M0 = 0xD2511F53;
+static const uint32 PHILOX_M1 = 0xCD9E8D57;
+static const uint32 PHILOX_W0 = 0x9E3779B9;
+static const uint32 PHILOX_W1 = 0xBB67AE85;
+
+static inline void mulHiLo( uint32 a, uint32 b, uint32& hi, uint32& lo )
+{
+	const uint64 product = static_cast<uint64>( a ) * b;
+	hi = static_cast<uint32>( product >> 32 );
+	lo = static_cast<uint32>( product );
+}
+
+CounterRandom::CounterRandom()
+{
+	reset( 0, 0, 0 );
+}
+
+CounterRandom::CounterRandom( uint32 seed, uint32 stream, uint32 substream )
+{
+	reset( seed, stream, substream );
+}
+
+void CounterRandom::reset( uint32 seed, uint32 stream, uint32 substream )
+{
+	// Streams go in the counter, where Philox scrambles even consecutive values well. Nearby seeds would give
+	// similar first numbers when used directly as key, so the key is scrambled first.
+	const uint32 seedCounter[4] = { seed, 0, 0, 0 };
+	const uint32 seedKey[2] = { PHILOX_W0, PHILOX_W1 };
+	uint32 key[4];
+	philox( seedCounter, seedKey, key );
+
+	_key[0] = key[0];
+	_key[1] = key[1];
+	_counter[0] = 0;
+	_counter[1] = stream;
+	_counter[2] = substream;
+	_counter[3] = 0;
+	_used = 4;
+}
+
+CounterRandom CounterRandom::branch( uint32 id ) const
+{
+	CounterRandom result( *this );
+	result._counter[0] = 0;
+	result._used = 4;
+
+	// Scramble branch path, so that different paths hardly ever collide
+	uint32 path[4];
+	const uint32 pathCounter[4] = { _counter[3], id, 0, 0 };
+	philox( pathCounter, _key, path );
+	result._counter[3] = path[0];
+
+	return result;
+}
+
+void CounterRandom::seek( uint32 position )
+{
+	_counter[0] = position / 4;
+	nextBlock();
+	_used = position % 4;
+}
+
+__m128 CounterRandom::real4()
+{
+	// Discard numbers left in current block, always use a whole one
+	nextBlock();
+	_used = 4;
+
+	// Keep 24 bits, exactly representable as float
+	const __m128i bits = _mm_srli_epi32( _mm_loadu_si128( reinterpret_cast<const __m128i*>( _block ) ), 8 );
+	return _mm_mul_ps( _mm_cvtepi32_ps( bits ), _mm_set_ps1( 1.0f / 16777216.0f ) );
+}
+
+void CounterRandom::reals( float* result, uint32 count )
+{
+	uint32 i = 0;
+	for( ; i + 4 <= count; i += 4 )
+	{
+		_mm_storeu_ps( result + i, real4() );
+	}
+
+	for( ; i < count; ++i )
+	{
+		result[i] = real();
+	}
+}
+
+void CounterRandom::philox( const uint32 counter[4], const uint32 key[2], uint32 result[4] )
+{
+	uint32 c0 = counter[0];
+	uint32 c1 = counter[1];
+	uint32 c2 = counter[2];
+	uint32 c3 = counter[3];
+	uint32 k0 = key[0];
+	uint32 k1 = key[1];
+
+	for( uint32 round = 0; round < 10; ++round )
+	{
+		uint32 hi0, lo0, hi1, lo1;
+		mulHiLo( PHILOX_M0, c0, hi0, lo0 );
+		mulHiLo( PHILOX_M1, c2, hi1, lo1 );
+
+		c0 = hi1 ^ c1 ^ k0;
+		c1 = lo1;
+		c2 = hi0 ^ c3 ^ k1;
+		c3 = lo0;
+
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+
+	result[0] = c0;
+	result[1] = c1;
+	result[2] = c2;
+	result[3] = c3;
+}
+
+void CounterRandom::nextBlock()
+{
+	philox( _counter, _key, _block );
+	++_counter[0];
+	_used = 0;
+}
+
 }
@@ -7,9 +7,19 @@
 #include <rtut/OsgGeometryLoader.h>
 
 #include <rtl/HeadlightColor.h>
+#include <rtl/TiledRenderer.h>
+#include <rtl/PacketTiledRenderer.h>
+#include <rtl/WavefrontRenderer.h>
+
+#include <rts/IMaterial.h>
+
+#include <rtu/timer.h>
+#include <rtu/random.h>
 
 #include <fstream>
 #include <istream>
+#include <vector>
+#include <algorithm>
 
 void rtutLogo()
 {
@@ -200,6 +210,37 @@ void rtutTeapot()
 
 // Geometry loading
 
+static void expandBounds( const float* vertex, rtu::float3& minv, rtu::float3& maxv )
+{
+	for( unsigned int k = 0; k < 3; ++k )
+	{
+		if( vertex[k] < minv[k] )
+			minv[k] = vertex[k];
+		if( vertex[k] > maxv[k] )
+			maxv[k] = vertex[k];
+	}
+}
+
+// Send all triangles in .ra2 stream to current geometry, computing their bounds
+static void loadRa2Triangles( std::istream& geometry, rtu::float3& minv, rtu::float3& maxv )
+{
+	rtu::float3 vertex;
+	minv.set( rtu::mathf::MAX_VALUE, rtu::mathf::MAX_VALUE, rtu::mathf::MAX_VALUE );
+	maxv.set( -rtu::mathf::MAX_VALUE, -rtu::mathf::MAX_VALUE, -rtu::mathf::MAX_VALUE );
+
+	rtBegin( RT_TRIANGLES );
+	while( !geometry.eof() )
+	{
+		for( unsigned int v = 0; v < 3; ++v )
+		{
+			geometry.read( (char*)vertex.ptr(), 3*sizeof(float) );
+			rtVertex3fv( vertex.ptr() );
+			expandBounds( vertex.ptr(), minv, maxv );
+		}
+	}
+	rtEnd();
+}
+
 // Simple triangle scene for tests
 bool rtutLoadRa2( char* filename, unsigned int& geometryId )
 {
@@ -219,20 +260,10 @@ bool rtutLoadRa2( char* filename, unsigned int& geometryId )
 	rtBindMaterial( matId );
 	rtMaterialClass( new rtl::HeadlightColor );
 
-	rtu::float3 vertex;
-
 	// Load geometry data
-	rtBegin( RT_TRIANGLES );
-	while( !geometry.eof() )
-	{
-		geometry.read( (char*)vertex.ptr(), 3*sizeof(float) );
-		rtVertex3fv( vertex.ptr() );
-		geometry.read( (char*)vertex.ptr(), 3*sizeof(float) );
-		rtVertex3fv( vertex.ptr() );
-		geometry.read( (char*)vertex.ptr(), 3*sizeof(float) );
-		rtVertex3fv( vertex.ptr() );
-	}
-	rtEnd();
+	rtu::float3 minv;
+	rtu::float3 maxv;
+	loadRa2Triangles( geometry, minv, maxv );
 
 	rtEndGeometry();
 	rtBindMaterial( 0 );
@@ -247,3 +278,610 @@ bool rtutLoadOpenSceneGraph( char* filename, unsigned int& geometryId )
 	rtut::OsgGeometryLoader loader;
 	return loader.loadFile( filename, geometryId );
 }
+
+// Benchmarks
+
+// Geometry build modes to be compared
+static const unsigned int BUILD_MODE_COUNT = 3;
+static const unsigned int BUILD_MODES[BUILD_MODE_COUNT] = { RT_BUILD_SAH_SWEEP, RT_BUILD_SAH_PRESORTED, RT_BUILD_SAH_BINNED };
+static const char* BUILD_MODE_NAMES[BUILD_MODE_COUNT] = { "sah sweep", "sah presorted", "sah binned" };
+
+// Instantiate geometry alone, look at it and render a few frames. Returns average frame time.
+static double renderGeometry( unsigned int instanceId, unsigned int geometryId, 
+							  const rtu::float3& minv, const rtu::float3& maxv, unsigned int frameCount )
+{
+	rtPushMatrix();
+	rtLoadIdentity();
+	rtInstantiate( instanceId, geometryId );
+	rtPopMatrix();
+
+	const rtu::float3 center = ( minv + maxv ) * 0.5f;
+	const float radius = ( maxv - minv ).length() * 0.5f;
+	rtLookAt( center.x, center.y, center.z + radius * 2.0f, center.x, center.y, center.z, 0.0f, 1.0f, 0.0f );
+
+	// First frame also rebuilds the instance tree
+	rtRenderFrame();
+
+	rtu::Timer timer;
+	timer.restart();
+	for( unsigned int f = 0; f < frameCount; ++f )
+	{
+		rtRenderFrame();
+	}
+	return timer.elapsed() / ( frameCount > 0 ? frameCount : 1 );
+}
+
+void rtutBenchmarkGeometryBuild( char* ra2Filename, unsigned int frameCount )
+{
+	const unsigned int previousMode = rtGetGeometryBuildMode();
+
+	const unsigned int geometryId = rtGenGeometries( 1 );
+	const unsigned int instanceId = rtGenInstances( 1 );
+
+	unsigned int matId = rtGenMaterials( 1 );
+	rtBindMaterial( matId );
+	rtMaterialClass( new rtl::HeadlightColor );
+
+	rtPushAttributeBindings();
+	rtSetAttributeBinding( RT_NORMAL, RT_BIND_PER_MATERIAL );
+	rtSetAttributeBinding( RT_COLOR, RT_BIND_PER_MATERIAL );
+
+	rtu::Timer timer;
+	rtu::float3 minv;
+	rtu::float3 maxv;
+
+	const unsigned int sceneCount = ( ra2Filename != NULL ) ? 2 : 1;
+	for( unsigned int scene = 0; scene < sceneCount; ++scene )
+	{
+		printf( "rtut: benchmarking geometry build on '%s'\n", ( scene == 0 ) ? "teapot" : ra2Filename );
+
+		for( unsigned int m = 0; m < BUILD_MODE_COUNT; ++m )
+		{
+			rtSetGeometryBuildMode( BUILD_MODES[m] );
+			rtNewGeometry( geometryId );
+
+			if( scene == 0 )
+			{
+				rtutTeapot();
+				minv.set( rtu::mathf::MAX_VALUE, rtu::mathf::MAX_VALUE, rtu::mathf::MAX_VALUE );
+				maxv.set( -rtu::mathf::MAX_VALUE, -rtu::mathf::MAX_VALUE, -rtu::mathf::MAX_VALUE );
+				for( int v = 0; v < rtut::NUM_TEAPOT_VERTICES; ++v )
+					expandBounds( rtut::TEAPOT_VERTICES + v*3, minv, maxv );
+			}
+			else
+			{
+				std::ifstream geometry( ra2Filename, std::ios::binary | std::ios::in );
+				if( !geometry )
+				{
+					printf( "rtut: error! could not open file.\n" );
+					break;
+				}
+				loadRa2Triangles( geometry, minv, maxv );
+			}
+
+			timer.restart();
+			rtEndGeometry();
+			const double buildTime = timer.elapsed();
+
+			const double frameTime = renderGeometry( instanceId, geometryId, minv, maxv, frameCount );
+
+			printf( "  %-16s build: %8.3f s   frame: %8.4f s\n", BUILD_MODE_NAMES[m], buildTime, frameTime );
+		}
+	}
+
+	rtPopAttributeBindings();
+	rtBindMaterial( 0 );
+	rtSetGeometryBuildMode( previousMode );
+}
+
+// Instance build modes to be compared
+static const unsigned int INSTANCE_BUILD_MODE_COUNT = 2;
+static const unsigned int INSTANCE_BUILD_MODES[INSTANCE_BUILD_MODE_COUNT] = { RT_BUILD_CLOSEST_BORDER, RT_BUILD_SAH_BINNED };
+static const char* INSTANCE_BUILD_MODE_NAMES[INSTANCE_BUILD_MODE_COUNT] = { "closest border", "sah binned" };
+
+// Instantiate geometry many times with random rotations and scales, either spread uniformly over a cube
+// or mostly packed into a few dense clusters. Computes scene bounds.
+static void placeInstances( unsigned int firstInstance, unsigned int instanceCount, unsigned int geometryId, float geometryRadius,
+						    bool clustered, rtu::float3& minv, rtu::float3& maxv )
+{
+	static const unsigned int CLUSTER_COUNT = 8;
+
+	// Same layout in every run
+	rtu::Random::seed( 1 );
+
+	// About two geometries per cube side, in the uniform layout
+	const float side = 4.0f * geometryRadius * pow( (float)instanceCount, 1.0f / 3.0f );
+	const float clusterSide = side / 16.0f;
+
+	rtu::float3 clusterCenters[CLUSTER_COUNT];
+	for( unsigned int c = 0; c < CLUSTER_COUNT; ++c )
+	{
+		clusterCenters[c].set( (float)rtu::Random::real( 0.0, side ), (float)rtu::Random::real( 0.0, side ), (float)rtu::Random::real( 0.0, side ) );
+	}
+
+	minv.set( rtu::mathf::MAX_VALUE, rtu::mathf::MAX_VALUE, rtu::mathf::MAX_VALUE );
+	maxv.set( -rtu::mathf::MAX_VALUE, -rtu::mathf::MAX_VALUE, -rtu::mathf::MAX_VALUE );
+
+	for( unsigned int i = 0; i < instanceCount; ++i )
+	{
+		// 90% of clustered instances go to clusters, the others are spread over the whole scene
+		rtu::float3 position;
+		if( clustered && ( rtu::Random::integer32() % 10 != 0 ) )
+		{
+			const rtu::float3& center = clusterCenters[rtu::Random::integer32() % CLUSTER_COUNT];
+			position.set( center.x + (float)rtu::Random::real( -clusterSide, clusterSide ), 
+				          center.y + (float)rtu::Random::real( -clusterSide, clusterSide ), 
+						  center.z + (float)rtu::Random::real( -clusterSide, clusterSide ) );
+		}
+		else
+		{
+			position.set( (float)rtu::Random::real( 0.0, side ), (float)rtu::Random::real( 0.0, side ), (float)rtu::Random::real( 0.0, side ) );
+		}
+
+		const float scale = (float)rtu::Random::real( 0.5, 1.5 );
+
+		rtPushMatrix();
+		rtLoadIdentity();
+		rtTranslatef( position.x, position.y, position.z );
+		rtRotatef( (float)rtu::Random::real( 0.0, 360.0 ), 0.0f, 1.0f, 0.0f );
+		rtScalef( scale, scale, scale );
+		rtInstantiate( firstInstance + i, geometryId );
+		rtPopMatrix();
+
+		const float radius = geometryRadius * scale;
+		const rtu::float3 lower( position.x - radius, position.y - radius, position.z - radius );
+		const rtu::float3 upper( position.x + radius, position.y + radius, position.z + radius );
+		expandBounds( &lower.x, minv, maxv );
+		expandBounds( &upper.x, minv, maxv );
+	}
+}
+
+void rtutBenchmarkInstanceBuild( unsigned int instanceCount, unsigned int width, unsigned int height, unsigned int frameCount )
+{
+	const unsigned int previousMode = rtGetInstanceBuildMode();
+
+	unsigned int matId = rtGenMaterials( 1 );
+	rtBindMaterial( matId );
+	rtMaterialClass( new rtl::HeadlightColor );
+
+	rtPushAttributeBindings();
+	rtSetAttributeBinding( RT_NORMAL, RT_BIND_PER_MATERIAL );
+	rtSetAttributeBinding( RT_COLOR, RT_BIND_PER_MATERIAL );
+
+	// Teapot, centered at origin
+	rtu::float3 minv( rtu::mathf::MAX_VALUE, rtu::mathf::MAX_VALUE, rtu::mathf::MAX_VALUE );
+	rtu::float3 maxv( -rtu::mathf::MAX_VALUE, -rtu::mathf::MAX_VALUE, -rtu::mathf::MAX_VALUE );
+	for( int v = 0; v < rtut::NUM_TEAPOT_VERTICES; ++v )
+		expandBounds( rtut::TEAPOT_VERTICES + v*3, minv, maxv );
+	const rtu::float3 teapotCenter = ( minv + maxv ) * 0.5f;
+	const float teapotRadius = ( maxv - minv ).length() * 0.5f;
+
+	const unsigned int geometryId = rtGenGeometries( 1 );
+	rtNewGeometry( geometryId );
+	rtPushMatrix();
+	rtLoadIdentity();
+	rtTranslatef( -teapotCenter.x, -teapotCenter.y, -teapotCenter.z );
+	rtutTeapot();
+	rtPopMatrix();
+	rtEndGeometry();
+
+	const unsigned int firstInstance = rtGenInstances( instanceCount );
+
+	rtViewport( width, height );
+	const double raysPerFrame = (double)width * height;
+
+	rtu::Timer timer;
+	for( unsigned int layout = 0; layout < 2; ++layout )
+	{
+		printf( "rtut: benchmarking instance build on %u %s instances\n", instanceCount, ( layout == 0 ) ? "uniform" : "clustered" );
+
+		placeInstances( firstInstance, instanceCount, geometryId, teapotRadius, ( layout == 1 ), minv, maxv );
+
+		// Look at the whole scene from one of its corners
+		const rtu::float3 center = ( minv + maxv ) * 0.5f;
+		const float radius = ( maxv - minv ).length() * 0.5f;
+		rtLookAt( center.x + radius, center.y + radius * 0.5f, center.z + radius, center.x, center.y, center.z, 0.0f, 1.0f, 0.0f );
+
+		for( unsigned int m = 0; m < INSTANCE_BUILD_MODE_COUNT; ++m )
+		{
+			// Changing mode rebuilds the instance tree in next frame
+			rtSetInstanceBuildMode( INSTANCE_BUILD_MODES[m] );
+
+			timer.restart();
+			rtRenderFrame();
+			const double firstFrameTime = timer.elapsed();
+
+			timer.restart();
+			for( unsigned int f = 0; f < frameCount; ++f )
+			{
+				rtRenderFrame();
+			}
+			const double frameTime = timer.elapsed() / ( frameCount > 0 ? frameCount : 1 );
+			const double buildTime = ( firstFrameTime > frameTime ) ? firstFrameTime - frameTime : 0.0;
+
+			printf( "  %-16s build: %8.4f s   frame: %8.4f s   %8.3f Mrays/s\n", INSTANCE_BUILD_MODE_NAMES[m], 
+				    buildTime, frameTime, raysPerFrame / frameTime * 1e-6 );
+		}
+	}
+
+	rtPopAttributeBindings();
+	rtBindMaterial( 0 );
+	rtSetInstanceBuildMode( previousMode );
+}
+
+// Packet kernel widths to be compared
+static const unsigned int SIMD_WIDTH_COUNT = 3;
+static const unsigned int SIMD_WIDTHS[SIMD_WIDTH_COUNT] = { 4, 8, 16 };
+static const char* SIMD_WIDTH_NAMES[SIMD_WIDTH_COUNT] = { "sse2 (4)", "avx2 (8)", "avx-512 (16)" };
+
+void rtutBenchmarkSimdWidth( unsigned int width, unsigned int height, unsigned int frameCount )
+{
+	const unsigned int previousWidth = rtGetSimdWidth();
+
+	unsigned int matId = rtGenMaterials( 1 );
+	rtBindMaterial( matId );
+	rtMaterialClass( new rtl::HeadlightColor );
+
+	rtPushAttributeBindings();
+	rtSetAttributeBinding( RT_NORMAL, RT_BIND_PER_MATERIAL );
+	rtSetAttributeBinding( RT_COLOR, RT_BIND_PER_MATERIAL );
+
+	rtu::float3 minv( rtu::mathf::MAX_VALUE, rtu::mathf::MAX_VALUE, rtu::mathf::MAX_VALUE );
+	rtu::float3 maxv( -rtu::mathf::MAX_VALUE, -rtu::mathf::MAX_VALUE, -rtu::mathf::MAX_VALUE );
+	for( int v = 0; v < rtut::NUM_TEAPOT_VERTICES; ++v )
+		expandBounds( rtut::TEAPOT_VERTICES + v*3, minv, maxv );
+
+	const unsigned int geometryId = rtGenGeometries( 1 );
+	rtNewGeometry( geometryId );
+	rtutTeapot();
+	rtEndGeometry();
+
+	const unsigned int instanceId = rtGenInstances( 1 );
+
+	rtViewport( width, height );
+	const double raysPerFrame = (double)width * height;
+
+	printf( "rtut: benchmarking packet kernels on 'teapot'\n" );
+
+	for( unsigned int w = 0; w < SIMD_WIDTH_COUNT; ++w )
+	{
+		rtSetSimdWidth( SIMD_WIDTHS[w] );
+		if( rtGetSimdWidth() != SIMD_WIDTHS[w] )
+		{
+			printf( "  %-16s not supported\n", SIMD_WIDTH_NAMES[w] );
+			continue;
+		}
+
+		const double frameTime = renderGeometry( instanceId, geometryId, minv, maxv, frameCount );
+
+		printf( "  %-16s frame: %8.4f s   %8.3f Mrays/s\n", SIMD_WIDTH_NAMES[w], frameTime, raysPerFrame / frameTime * 1e-6 );
+	}
+
+	rtPopAttributeBindings();
+	rtBindMaterial( 0 );
+	rtSetSimdWidth( previousWidth );
+}
+
+// Tiled renderers to be tested
+static const unsigned int TILED_RENDERER_COUNT = 3;
+static const char* TILED_RENDERER_NAMES[TILED_RENDERER_COUNT] = { "tiled", "packet tiled", "wavefront" };
+
+// Viewport that is not a multiple of packet and tile sizes
+static const unsigned int BORDER_TEST_WIDTH = 37;
+static const unsigned int BORDER_TEST_HEIGHT = 29;
+
+// Never written by renderers, colors are not negative
+static const float GUARD_VALUE = -1.0f;
+
+bool rtutTestTileBorders()
+{
+	unsigned int matId = rtGenMaterials( 1 );
+	rtBindMaterial( matId );
+	rtMaterialClass( new rtl::HeadlightColor );
+
+	// HeadlightColor shades with vertex normals
+	rtPushAttributeBindings();
+	rtSetAttributeBinding( RT_NORMAL, RT_BIND_PER_VERTEX );
+	rtSetAttributeBinding( RT_COLOR, RT_BIND_PER_MATERIAL );
+
+	rtu::float3 minv( rtu::mathf::MAX_VALUE, rtu::mathf::MAX_VALUE, rtu::mathf::MAX_VALUE );
+	rtu::float3 maxv( -rtu::mathf::MAX_VALUE, -rtu::mathf::MAX_VALUE, -rtu::mathf::MAX_VALUE );
+	for( int v = 0; v < rtut::NUM_TEAPOT_VERTICES; ++v )
+		expandBounds( rtut::TEAPOT_VERTICES + v*3, minv, maxv );
+
+	const unsigned int geometryId = rtGenGeometries( 1 );
+	rtNewGeometry( geometryId );
+	rtutTeapot();
+	rtEndGeometry();
+
+	const unsigned int instanceId = rtGenInstances( 1 );
+
+	// Frame buffer followed by as many guard pixels as packets of the last tile row may overlap
+	const unsigned int frameSize = BORDER_TEST_WIDTH * BORDER_TEST_HEIGHT * 3;
+	const unsigned int guardSize = ( BORDER_TEST_WIDTH + RT_PACKET_DIM ) * RT_PACKET_DIM * 3;
+	std::vector<float> buffer( frameSize + guardSize );
+
+	rtViewport( BORDER_TEST_WIDTH, BORDER_TEST_HEIGHT );
+	rtFrameBuffer( &buffer[0] );
+
+	printf( "rtut: testing tile borders on a %ux%u viewport\n", BORDER_TEST_WIDTH, BORDER_TEST_HEIGHT );
+
+	bool passed = true;
+	for( unsigned int r = 0; r < TILED_RENDERER_COUNT; ++r )
+	{
+		switch( r )
+		{
+		case 0: rtRendererClass( new rtl::TiledRenderer ); break;
+		case 1: rtRendererClass( new rtl::PacketTiledRenderer ); break;
+		case 2: rtRendererClass( new rtl::WavefrontRenderer ); break;
+		}
+
+		std::fill( buffer.begin(), buffer.end(), GUARD_VALUE );
+		renderGeometry( instanceId, geometryId, minv, maxv, 0 );
+
+		// Every pixel of the viewport is written, none past its end
+		unsigned int unwritten = 0;
+		unsigned int overflows = 0;
+		for( unsigned int i = 0; i < frameSize; ++i )
+		{
+			if( buffer[i] == GUARD_VALUE )
+				++unwritten;
+		}
+		for( unsigned int i = frameSize; i < buffer.size(); ++i )
+		{
+			if( buffer[i] != GUARD_VALUE )
+				++overflows;
+		}
+
+		const bool rendererPassed = ( unwritten == 0 ) && ( overflows == 0 );
+		printf( "  %-16s %s   unwritten: %u   overflows: %u\n", TILED_RENDERER_NAMES[r], rendererPassed ? "passed" : "FAILED",
+			    unwritten / 3, overflows / 3 );
+		passed = passed && rendererPassed;
+	}
+
+	rtFrameBuffer( NULL );
+
+	rtPopAttributeBindings();
+	rtBindMaterial( 0 );
+
+	return passed;
+}
+
+// Headlight shaded mirror, tracing the reflection rays of a batch as a batch of their own (see rtsTraceRayBatch).
+// Reflections of the mirror on itself are shaded by a nested call to shadeBatch.
+class BatchMirror : public rts::IMaterial
+{
+public:
+	virtual void shade( rts::RTstate& state )
+	{
+		shadeLocal( state );
+		if( rtsStopRayRecursion( state ) )
+			return;
+
+		rts::RTstate reflection;
+		rtsInitReflectionRayState( state, reflection );
+		rtsTraceRay( reflection );
+		rtsResultColor( state ) += rtsResultColor( reflection ) * REFLECTANCE;
+	}
+
+	virtual void shadeBatch( rts::RTstate* const states[], unsigned int count )
+	{
+		// Too large for thread stacks
+		rts::RTstate* reflections = static_cast<rts::RTstate*>( _mm_malloc( count * sizeof( rts::RTstate ), 16 ) );
+		std::vector<rts::RTstate*> traced;
+
+		for( unsigned int i = 0; i < count; ++i )
+		{
+			shadeLocal( *states[i] );
+			if( rtsStopRayRecursion( *states[i] ) )
+				continue;
+
+			rtsInitReflectionRayState( *states[i], reflections[i] );
+			traced.push_back( &reflections[i] );
+		}
+
+		if( !traced.empty() )
+			rtsTraceRayBatch( &traced[0], static_cast<unsigned int>( traced.size() ) );
+
+		for( unsigned int i = 0; i < count; ++i )
+		{
+			if( !rtsStopRayRecursion( *states[i] ) )
+				rtsResultColor( *states[i] ) += rtsResultColor( reflections[i] ) * REFLECTANCE;
+		}
+
+		_mm_free( reflections );
+	}
+
+private:
+	static const float REFLECTANCE;
+
+	void shadeLocal( rts::RTstate& state )
+	{
+		rtsComputeHitPosition( state );
+		const rtu::float3& normal = rtsComputeShadingNormal( state );
+		rtu::float3& rayDir = rtsRayDirection( state );
+		rayDir.normalize();
+
+		const float nDotD = rtu::mathf::abs( normal.dot( rayDir ) );
+		rtsResultColor( state ).set( nDotD, nDotD, nDotD );
+	}
+};
+
+const float BatchMirror::REFLECTANCE = 0.5f;
+
+static const unsigned int RECURSION_TEST_SIZE = 64;
+
+bool rtutTestRecursiveBatchShading()
+{
+	unsigned int matId = rtGenMaterials( 1 );
+	rtBindMaterial( matId );
+	rtMaterialClass( new BatchMirror );
+
+	rtPushAttributeBindings();
+	rtSetAttributeBinding( RT_NORMAL, RT_BIND_PER_VERTEX );
+	rtSetAttributeBinding( RT_COLOR, RT_BIND_PER_MATERIAL );
+
+	rtu::float3 minv( rtu::mathf::MAX_VALUE, rtu::mathf::MAX_VALUE, rtu::mathf::MAX_VALUE );
+	rtu::float3 maxv( -rtu::mathf::MAX_VALUE, -rtu::mathf::MAX_VALUE, -rtu::mathf::MAX_VALUE );
+	for( int v = 0; v < rtut::NUM_TEAPOT_VERTICES; ++v )
+		expandBounds( rtut::TEAPOT_VERTICES + v*3, minv, maxv );
+
+	const unsigned int geometryId = rtGenGeometries( 1 );
+	rtNewGeometry( geometryId );
+	rtutTeapot();
+	rtEndGeometry();
+
+	const unsigned int instanceId = rtGenInstances( 1 );
+
+	const unsigned int frameSize = RECURSION_TEST_SIZE * RECURSION_TEST_SIZE * 3;
+	std::vector<float> expected( frameSize );
+	std::vector<float> sorted( frameSize );
+
+	rtViewport( RECURSION_TEST_SIZE, RECURSION_TEST_SIZE );
+
+	printf( "rtut: testing recursive batch shading on 'teapot'\n" );
+
+	// Same image with each ray traced and shaded on its own
+	rtFrameBuffer( &expected[0] );
+	rtRendererClass( new rtl::TiledRenderer );
+	renderGeometry( instanceId, geometryId, minv, maxv, 0 );
+
+	rtl::TiledRenderer* renderer = new rtl::TiledRenderer;
+	rtRendererClass( renderer );
+	renderer->setSortShading( true );
+	rtFrameBuffer( &sorted[0] );
+	renderGeometry( instanceId, geometryId, minv, maxv, 0 );
+
+	unsigned int mismatches = 0;
+	for( unsigned int i = 0; i < frameSize; i += 3 )
+	{
+		if( ( sorted[i] != expected[i] ) || ( sorted[i+1] != expected[i+1] ) || ( sorted[i+2] != expected[i+2] ) )
+			++mismatches;
+	}
+
+	const bool passed = ( mismatches == 0 );
+	printf( "  %-16s %s   mismatches: %u\n", "sorted shading", passed ? "passed" : "FAILED", mismatches );
+
+	rtFrameBuffer( NULL );
+
+	rtPopAttributeBindings();
+	rtBindMaterial( 0 );
+
+	return passed;
+}
+
+static const unsigned int UPDATE_TEST_INSTANCES = 64;
+static const unsigned int UPDATE_TEST_FRAMES = 16;
+static const unsigned int UPDATE_TEST_SIZE = 64;
+
+bool rtutTestInstanceUpdate()
+{
+	const unsigned int previousMode = rtGetInstanceBuildMode();
+
+	unsigned int matId = rtGenMaterials( 1 );
+	rtBindMaterial( matId );
+	rtMaterialClass( new rtl::HeadlightColor );
+
+	rtPushAttributeBindings();
+	rtSetAttributeBinding( RT_NORMAL, RT_BIND_PER_VERTEX );
+	rtSetAttributeBinding( RT_COLOR, RT_BIND_PER_MATERIAL );
+
+	// Teapot, centered at origin
+	rtu::float3 minv( rtu::mathf::MAX_VALUE, rtu::mathf::MAX_VALUE, rtu::mathf::MAX_VALUE );
+	rtu::float3 maxv( -rtu::mathf::MAX_VALUE, -rtu::mathf::MAX_VALUE, -rtu::mathf::MAX_VALUE );
+	for( int v = 0; v < rtut::NUM_TEAPOT_VERTICES; ++v )
+		expandBounds( rtut::TEAPOT_VERTICES + v*3, minv, maxv );
+	const rtu::float3 teapotCenter = ( minv + maxv ) * 0.5f;
+	const float teapotRadius = ( maxv - minv ).length() * 0.5f;
+
+	const unsigned int geometryId = rtGenGeometries( 1 );
+	rtNewGeometry( geometryId );
+	rtPushMatrix();
+	rtLoadIdentity();
+	rtTranslatef( -teapotCenter.x, -teapotCenter.y, -teapotCenter.z );
+	rtutTeapot();
+	rtPopMatrix();
+	rtEndGeometry();
+
+	const unsigned int firstInstance = rtGenInstances( UPDATE_TEST_INSTANCES );
+	placeInstances( firstInstance, UPDATE_TEST_INSTANCES, geometryId, teapotRadius, true, minv, maxv );
+
+	// Moved instances may leave the initial scene box by about a teapot, look at all of them from outside
+	const rtu::float3 center = ( minv + maxv ) * 0.5f;
+	const float radius = ( maxv - minv ).length() * 0.5f + teapotRadius * 2.0f;
+	rtLookAt( center.x, center.y, center.z + radius * 2.0f, center.x, center.y, center.z, 0.0f, 1.0f, 0.0f );
+
+	const unsigned int frameSize = UPDATE_TEST_SIZE * UPDATE_TEST_SIZE * 3;
+	std::vector<float> updated( frameSize );
+	std::vector<float> rebuilt( frameSize );
+
+	rtViewport( UPDATE_TEST_SIZE, UPDATE_TEST_SIZE );
+	rtRendererClass( new rtl::TiledRenderer );
+
+	printf( "rtut: testing instance tree updates on %u clustered instances\n", UPDATE_TEST_INSTANCES );
+
+	bool passed = true;
+	for( unsigned int m = 0; m < INSTANCE_BUILD_MODE_COUNT; ++m )
+	{
+		// Changing mode rebuilds the instance tree in next frame
+		rtSetInstanceBuildMode( INSTANCE_BUILD_MODES[m] );
+		rtFrameBuffer( &updated[0] );
+		rtRenderFrame();
+
+		// First move every instance anywhere in the scene, then a quarter of them in each frame, either slightly or anywhere
+		rtu::Random::seed( 2 );
+		std::vector<rtu::float3> positions( UPDATE_TEST_INSTANCES );
+		rtu::float4x4 matrix;
+		for( unsigned int f = 0; f < UPDATE_TEST_FRAMES; ++f )
+		{
+			const unsigned int moveCount = ( f == 0 ) ? UPDATE_TEST_INSTANCES : UPDATE_TEST_INSTANCES / 4;
+			for( unsigned int i = 0; i < moveCount; ++i )
+			{
+				const unsigned int index = ( f == 0 ) ? i : rtu::Random::integer32() % UPDATE_TEST_INSTANCES;
+				rtu::float3& position = positions[index];
+
+				if( ( f % 2 == 0 ) && ( f > 0 ) )
+				{
+					position += rtu::float3( (float)rtu::Random::real( -0.1, 0.1 ), (float)rtu::Random::real( -0.1, 0.1 ),
+						                     (float)rtu::Random::real( -0.1, 0.1 ) ) * teapotRadius;
+				}
+				else
+				{
+					position.set( (float)rtu::Random::real( minv.x - teapotRadius, maxv.x + teapotRadius ), 
+						          (float)rtu::Random::real( minv.y - teapotRadius, maxv.y + teapotRadius ), 
+								  (float)rtu::Random::real( minv.z - teapotRadius, maxv.z + teapotRadius ) );
+				}
+
+				const float scale = (float)rtu::Random::real( 0.5, 1.5 );
+				matrix.makeScale( scale, scale, scale );
+				matrix.setTranslation( position );
+				rtUpdateInstanceTransform( firstInstance + index, matrix.ptr() );
+			}
+			rtRenderFrame();
+		}
+
+		// Same instances in a tree built from scratch
+		rtSetInstanceBuildMode( INSTANCE_BUILD_MODES[m] );
+		rtFrameBuffer( &rebuilt[0] );
+		rtRenderFrame();
+
+		unsigned int mismatches = 0;
+		for( unsigned int i = 0; i < frameSize; i += 3 )
+		{
+			if( ( updated[i] != rebuilt[i] ) || ( updated[i+1] != rebuilt[i+1] ) || ( updated[i+2] != rebuilt[i+2] ) )
+				++mismatches;
+		}
+
+		const bool modePassed = ( mismatches == 0 );
+		printf( "  %-16s %s   mismatches: %u\n", INSTANCE_BUILD_MODE_NAMES[m], modePassed ? "passed" : "FAILED", mismatches );
+		passed = passed && modePassed;
+	}
+
+	rtFrameBuffer( NULL );
+
+	rtPopAttributeBindings();
+	rtBindMaterial( 0 );
+	rtSetInstanceBuildMode( previousMode );
+
+	return passed;
+}